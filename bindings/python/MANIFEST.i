@@ -1,5 +1,6 @@
 include sdm.i
 include sdm_wrap.c
 include sdmapi.py
+include shm_reader.py
 recursive-include libsrc *.c
 recursive-include libsrc *.h
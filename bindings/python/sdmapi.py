@@ -41,21 +41,26 @@ def receive_systime(session):
 
 
 def receive_usbl_data(session, nsamples, filename_pattern):
+    """Receive all USBL channels in one usbl_rx_all() pass.
+
+    filename_pattern has "%d" for channel number, every channel goes to its
+    file, optional "<driver>:" prefix. With empty pattern list of channels
+    is returned. See stream_read_planar() to read them back at once."""
     usbl_head_number = 5
-    usbl_channels = [[]] * usbl_head_number
 
-    for ch in range(usbl_head_number):
-        if filename_pattern == '':
-            add_sink_membuf(session);
-        else:
-            add_sink(session, filename_pattern % ch);
+    if filename_pattern == '':
+        add_sink_membuf(session);
+    else:
+        drv, sep, params = filename_pattern.rpartition(':')
+        add_sink(session, "%s/%dch:%s" % (drv, usbl_head_number, params));
 
-        send_usbl_rx(session, ch, nsamples)
-        expect(session, REPLY_STOP);
-        if filename_pattern == '':
-            usbl_channels[ch] = get_membuf(session);
+    usbl_rx_all(session, nsamples)
+    expect(session, REPLY_STOP);
 
-    return usbl_channels
+    if filename_pattern != '':
+        return [[]] * usbl_head_number
+    data = get_membuf(session);
+    return [data[ch * nsamples:(ch + 1) * nsamples] for ch in range(usbl_head_number)]
 
 def wait_data_receive(session):
     expect(session, REPLY_STOP)
@@ -113,7 +113,7 @@ setup(
     name="sdm",
     version="0.0.1",
     description="SDM library for EvoLogics S2C Underwater Acoustic Modems",
-    py_modules=["sdm", "sdmapi"],
+    py_modules=["sdm", "sdmapi", "shm_reader"],
     ext_modules=[sdm_module],
     cmdclass={
         "sdist": CustomSdist,
@@ -0,0 +1,124 @@
+"""Reader of shared memory rings published by the shm: stream driver.
+
+Samples are not copied: every block is a memoryview of int16 values
+pointing into the ring. Block is valid until the next one is requested.
+Sample of sample_size bytes is more than one value, for ex. complex
+samples of ddc:.
+
+    with ShmReader("sdm") as reader:
+        for block in reader:
+            process(block)
+
+The C reader from libstream is used. It is taken from the _sdm module if
+it is installed, otherwise libstream.so is loaded, path can be given in
+LIBSTREAM environment variable.
+"""
+
+import ctypes
+import os
+
+STREAM_ERROR_EOS = -1005
+
+
+def _load_library():
+    try:
+        import _sdm
+        lib = ctypes.CDLL(_sdm.__file__, use_errno=True)
+    except (ImportError, OSError):
+        lib = ctypes.CDLL(os.environ.get("LIBSTREAM", "libstream.so"), use_errno=True)
+
+    lib.stream_shm_reader_open.restype = ctypes.c_void_p
+    lib.stream_shm_reader_open.argtypes = [ctypes.c_char_p]
+    lib.stream_shm_reader_close.argtypes = [ctypes.c_void_p]
+    lib.stream_shm_reader_get_fs.restype = ctypes.c_uint
+    lib.stream_shm_reader_get_fs.argtypes = [ctypes.c_void_p]
+    lib.stream_shm_reader_wait.restype = ctypes.c_long
+    lib.stream_shm_reader_wait.argtypes = [ctypes.c_void_p, ctypes.POINTER(ctypes.c_void_p), ctypes.c_int]
+    lib.stream_shm_reader_release.restype = ctypes.c_long
+    lib.stream_shm_reader_release.argtypes = [ctypes.c_void_p, ctypes.c_ulong]
+    lib.stream_shm_reader_get_sample_size.restype = ctypes.c_uint
+    lib.stream_shm_reader_get_sample_size.argtypes = [ctypes.c_void_p]
+    lib.stream_shm_reader_get_lost.restype = ctypes.c_ulonglong
+    lib.stream_shm_reader_get_lost.argtypes = [ctypes.c_void_p]
+    return lib
+
+
+_lib = None
+
+
+class ShmReader:
+    def __init__(self, name, timeout_ms=-1):
+        global _lib
+        if _lib is None:
+            _lib = _load_library()
+
+        self.timeout_ms = timeout_ms
+        # samples of last returned blocks overwritten while they were used
+        self.overwritten = 0
+        self._pending = 0
+        self._reader = _lib.stream_shm_reader_open(name.encode())
+        if not self._reader:
+            err = ctypes.get_errno()
+            raise OSError(err, "cannot attach shared memory ring", name)
+
+    @property
+    def fs(self):
+        return _lib.stream_shm_reader_get_fs(self._reader)
+
+    @property
+    def sample_size(self):
+        """Bytes per sample."""
+        return _lib.stream_shm_reader_get_sample_size(self._reader)
+
+    @property
+    def lost(self):
+        """Samples skipped because reader was too slow."""
+        return _lib.stream_shm_reader_get_lost(self._reader)
+
+    def read(self, timeout_ms=None):
+        """Return memoryview of next block, None on timeout.
+        EOFError is raised when writer closed the ring."""
+        self.release()
+        ptr = ctypes.c_void_p()
+        n = _lib.stream_shm_reader_wait(self._reader, ctypes.byref(ptr),
+                                        self.timeout_ms if timeout_ms is None else timeout_ms)
+        if n == STREAM_ERROR_EOS:
+            raise EOFError("writer closed the ring")
+        if n <= 0:
+            return None
+        self._pending = n
+        block = (ctypes.c_char * (n * self.sample_size)).from_address(ptr.value)
+        return memoryview(block).cast("B").cast("h")
+
+    def release(self):
+        """Mark last block as read. Return number of its samples which were
+        overwritten by writer before release, results from them must be dropped."""
+        if not self._pending:
+            return 0
+        n = _lib.stream_shm_reader_release(self._reader, self._pending)
+        self._pending = 0
+        self.overwritten += n
+        return n
+
+    def close(self):
+        if self._reader:
+            _lib.stream_shm_reader_close(self._reader)
+            self._reader = None
+
+    def __iter__(self):
+        while True:
+            try:
+                block = self.read()
+            except EOFError:
+                return
+            if block is not None:
+                yield block
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __del__(self):
+        self.close()
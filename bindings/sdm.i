@@ -30,6 +30,7 @@
 %exception sdm_send_rx         EXCEPTION_RET_INT
 %exception sdm_send_config     EXCEPTION_RET_INT
 %exception sdm_send_usbl_rx    EXCEPTION_RET_INT
+%exception sdm_usbl_rx_all     EXCEPTION_RET_INT
 %exception sdm_send_ref        EXCEPTION_RET_INT
 %exception sdm_send_stop       EXCEPTION_RET_INT
 %exception sdm_send_rx_janus   EXCEPTION_RET_INT
@@ -422,6 +423,7 @@ int sdm_add_sink(sdm_session_t *ss, char *sinkname)
         logger(ERR_LOG, "Cannot add sink\n");
         return -1;
     }
+    sdm_set_stream_meta(ss, stream);
 
     if (stream_open(stream)) {
         if (stream_get_errno(stream) == EINTR)
@@ -0,0 +1,113 @@
+//*************************************************************************
+// Example of stream driver plugin: sink which drops samples              *
+//*************************************************************************
+
+/* Build: make plugins
+ * Use:   STREAM_PLUGIN_PATH=. ./sdmsh ... rx 0 null:-
+ *
+ * Plugin libstream-<driver>.so exports stream_impl_<driver>_new() and
+ * description stream_plugin_<driver> made by STREAM_PLUGIN(<driver>).
+ * It is refused if built with other stream.h than libstream which loads
+ * it. Functions of libstream are resolved from the program, so sdmsh is
+ * linked with -rdynamic. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <stream.h>
+
+STREAM_PLUGIN(null);
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    unsigned long long samples;
+    struct timespec start;
+};
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("reading null", ENOTSUP);
+    pdata->samples = 0;
+    clock_gettime(CLOCK_MONOTONIC, &pdata->start);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    (void)stream;
+    return STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    (void)samples;
+    pdata->samples += sample_count;
+    return sample_count;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct timespec now;
+    double sec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sec = (now.tv_sec - pdata->start.tv_sec) + (now.tv_nsec - pdata->start.tv_nsec) * 1e-9;
+    snprintf(buf, len, "dropped %llu samples, %.0f samples/s"
+            , pdata->samples, sec > 0 ? pdata->samples / sec : 0.);
+    return 0;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+int stream_impl_null_new(stream_t *stream)
+{
+    stream->pdata = calloc(1, sizeof(struct private_data_t));
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    strncpy(stream->name, "NULL", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,113 @@
+/* Throughput of stream processing stages.
+ *
+ * Writes synthetic signal to every given output description and reports
+ * samples per second and speed relative to real time at input rate.
+ *
+ *     make stream-bench
+ *     ./stream-bench [-f <fs>] [-s <seconds>] [<description> ...]
+ *
+ * Without descriptions a default set of stages writing to /dev/null
+ * is measured. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include <stream.h>
+
+#define BENCH_CHUNK 16384
+
+static const char *default_descr[] = {
+    "raw:/dev/null",
+    "filter:dc,bp(7k,17k),gain(6):raw:/dev/null",
+    "resample:125/96:raw:/dev/null",
+    "resample:96/125:raw:/dev/null",
+    "resample:625/441:raw:/dev/null",
+    "resample:1/4:raw:/dev/null",
+    "resample:1/16:raw:/dev/null",
+    "ddc:26k,4:raw:/dev/null",
+    "ddc:26k,4,cf32,4:raw:/dev/null",
+    "ddc:12k,16:raw:/dev/null",
+    NULL
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench(const char *descr, const int16_t *signal, unsigned fs, unsigned long nsamples)
+{
+    stream_t *stream = stream_new(STREAM_OUTPUT, (char *)descr);
+    unsigned long done;
+    double t;
+
+    if (!stream) {
+        fprintf(stderr, "%s: cannot create stream\n", descr);
+        return -1;
+    }
+    stream_set_fs(stream, fs);
+    if (stream_open(stream)) {
+        fprintf(stderr, "%s\n", stream_strerror(stream));
+        stream_free(stream);
+        return -1;
+    }
+
+    t = now();
+    for (done = 0; done < nsamples; done += BENCH_CHUNK) {
+        if (stream_write(stream, (int16_t *)signal, BENCH_CHUNK) < 0) {
+            fprintf(stderr, "%s\n", stream_strerror(stream));
+            break;
+        }
+    }
+    stream_close(stream);
+    t = now() - t;
+    stream_free(stream);
+
+    printf("%-48s %8.1f Msamples/s %8.0fx real time\n", descr, done / t / 1e6, done / t / fs);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned fs = 62500;
+    double seconds = 60.;
+    int16_t *signal;
+    int opt, i, rc = 0;
+
+    while ((opt = getopt(argc, argv, "f:s:h")) != -1) {
+        switch (opt) {
+            case 'f': fs = atoi(optarg); break;
+            case 's': seconds = atof(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-f <fs>] [-s <seconds>] [<description> ...]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    /* chirp over the whole band with a bit of DC */
+    signal = malloc(BENCH_CHUNK * sizeof(int16_t));
+    for (i = 0; i < BENCH_CHUNK; i++) {
+        double t = (double)i / fs;
+
+        signal[i] = 500 + 16000 * sin(M_PI * fs / 2 * t * t * fs / BENCH_CHUNK);
+    }
+
+    printf("input fs %u Hz, %.0f s of signal per stage\n", fs, seconds);
+    if (optind < argc) {
+        for (i = optind; i < argc; i++)
+            rc |= bench(argv[i], signal, fs, (unsigned long)(seconds * fs));
+    } else {
+        for (i = 0; default_descr[i]; i++)
+            rc |= bench(default_descr[i], signal, fs, (unsigned long)(seconds * fs));
+    }
+
+    free(signal);
+    return rc ? 1 : 0;
+}
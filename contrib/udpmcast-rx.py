@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Receiver of udpmcast: stream driver datagrams.
+
+Samples of any sender format are written as little endian int16_t to
+the output file (stdout by default), channels interleaved as sent.
+Format and channels are taken from the first datagram, later datagrams
+of other layout are skipped. Lost datagrams are reported to stderr and,
+with --fill, replaced by zeros so that sample positions are kept.
+
+    udpmcast-rx.py 239.255.0.1 5000 -o capture.raw --fill
+"""
+
+import argparse
+import array
+import socket
+import struct
+import sys
+
+HDR = struct.Struct("<4sIQIHHHH")
+MAGIC = b"SDMU"
+MAX_FILL = 1024 * 1024
+# sample format field: s16le, s16be, f32, ulaw
+SAMPLE_SIZE = (2, 2, 4, 1)
+FORMAT_NAME = ("s16le", "s16be", "f32", "ulaw")
+
+
+def ulaw_decode(u):
+    u = ~u & 0xff
+    exp = (u >> 4) & 0x07
+    mag = ((((u & 0x0f) << 3) + 0x84) << exp) - 0x84
+    return -mag if u & 0x80 else mag
+
+
+ULAW = [ulaw_decode(u) for u in range(256)]
+
+
+def to_s16le(fmt, data):
+    if fmt == 0:
+        return data
+    if fmt == 1:
+        a = array.array("h", data)
+    elif fmt == 2:
+        a = array.array("h", (max(-32768, min(32767, round(v * 32768))) for v in array.array("f", data)))
+    else:
+        a = array.array("h", (ULAW[u] for u in data))
+    if (fmt == 1) == (sys.byteorder == "little"):
+        a.byteswap()
+    return a.tobytes()
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("group")
+    ap.add_argument("port", type=int)
+    ap.add_argument("-i", "--interface", default="0.0.0.0", help="address of interface to join group on")
+    ap.add_argument("-o", "--output", help="output file, stdout by default")
+    ap.add_argument("-n", "--samples", type=int, default=0, help="stop after number of samples")
+    ap.add_argument("--fill", action="store_true", help="write zeros in place of lost samples")
+    args = ap.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+    sock.bind((args.group, args.port))
+    mreq = socket.inet_aton(args.group) + socket.inet_aton(args.interface)
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+
+    out = open(args.output, "wb") if args.output else sys.stdout.buffer
+    layout = None
+    expected = None
+    seq_expected = None
+    written = lost_packets = lost_samples = 0
+
+    try:
+        while not args.samples or written < args.samples:
+            pkt = sock.recv(65536)
+            if len(pkt) < HDR.size:
+                continue
+            magic, seq, first, fs, n, fmt, channels, _ = HDR.unpack_from(pkt)
+            if (magic != MAGIC or fmt >= len(SAMPLE_SIZE) or channels == 0
+                    or len(pkt) != HDR.size + SAMPLE_SIZE[fmt] * channels * n):
+                continue
+            if layout is None:
+                layout = (fmt, channels)
+                print("format %s, %u channels, %u Hz" % (FORMAT_NAME[fmt], channels, fs), file=sys.stderr)
+            elif layout != (fmt, channels):
+                continue
+
+            if expected is not None and first + MAX_FILL < expected:
+                print("sender restarted at sample %u" % expected, file=sys.stderr)
+                expected = None
+            if expected is not None and first < expected:
+                continue
+            if expected is not None and first > expected:
+                gap = first - expected
+                lost = (seq - seq_expected) & 0xffffffff
+                lost_packets += lost
+                lost_samples += gap
+                print("gap: %u datagrams, %u samples at sample %u (%.3f s)"
+                      % (lost, gap, expected, expected / fs if fs else 0), file=sys.stderr)
+                if args.fill and gap <= MAX_FILL:
+                    out.write(bytes(2 * channels * gap))
+                    written += gap
+
+            out.write(to_s16le(fmt, pkt[HDR.size:]))
+            written += n
+            expected = first + n
+            seq_expected = (seq + 1) & 0xffffffff
+    except KeyboardInterrupt:
+        pass
+    finally:
+        out.flush()
+        print("samples %u, lost %u datagrams, %u samples" % (written, lost_packets, lost_samples), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
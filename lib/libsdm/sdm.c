@@ -13,6 +13,7 @@
 #include <limits.h>     /* SHORT_MAX  */
 #include <inttypes.h>   /* PRIu32  */
 #include <sys/time.h>   /* struct timeval  */
+#include <math.h>       /* log10() */
 
 #include <sdm.h>
 
@@ -86,10 +87,21 @@ sdm_session_t* sdm_connect(char *host, int port)
     return ss;
 }
 
+static void sdm_usbl_free(sdm_session_t *ss)
+{
+    int c;
+
+    for (c = 0; c < SDM_USBL_CHANNELS; c++) {
+        free(ss->usbl_planes[c]);
+        ss->usbl_planes[c] = NULL;
+    }
+}
+
 void sdm_close(sdm_session_t *ss)
 {
     close(ss->sockfd);
     streams_clean(&ss->streams);
+    sdm_usbl_free(ss);
 
     if (ss->rx_data)
         free(ss->rx_data);
@@ -177,6 +189,10 @@ int sdm_send(sdm_session_t *ss, int cmd_code, ...)
     cmd->magic = SDM_PKG_MAGIC;
     cmd->cmd = cmd_code;
 
+    /* stop cancels usbl_rx of all channels */
+    if (cmd_code == SDM_CMD_STOP)
+        sdm_usbl_free(ss);
+
     va_start (ap, cmd_code);
     switch (cmd_code) {
         case SDM_CMD_STOP:
@@ -189,6 +205,9 @@ int sdm_send(sdm_session_t *ss, int cmd_code, ...)
             cmd->gain_and_srclvl  = va_arg(ap, unsigned) << 7;
             cmd->gain_and_srclvl |= va_arg(ap, unsigned);
             preamp_gain = (va_arg(ap, unsigned) & 0xf) << 12;
+            snprintf(ss->meta_config, sizeof(ss->meta_config), "%u %u %u %u"
+                    , cmd->threshold, cmd->gain_and_srclvl >> 7
+                    , cmd->gain_and_srclvl & 0x7f, preamp_gain >> 12);
             data_len = cmd->data_len = 1;
             cmd_raw = realloc(cmd_raw, SDM_PKT_T_SIZE + cmd->data_len * 2);
             memcpy(&cmd_raw[SDM_PKT_T_OFFSET_DATA], &preamp_gain, 2);
@@ -205,6 +224,8 @@ int sdm_send(sdm_session_t *ss, int cmd_code, ...)
             sample_rate = va_arg(ap, unsigned);
             
             cmd->rx_len = (gain << 4) + (sample_rate << 1);
+            snprintf(ss->meta_usbl_config, sizeof(ss->meta_usbl_config)
+                    , "%"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32"", delay, samples, gain, sample_rate);
 
             data_len = cmd->data_len = 4;
             cmd_raw = realloc(cmd_raw, SDM_PKT_T_SIZE + cmd->data_len * 2);
@@ -249,6 +270,7 @@ int sdm_send(sdm_session_t *ss, int cmd_code, ...)
         case SDM_CMD_RX_JANUS:
         {
             cmd->rx_len = va_arg(ap, unsigned long) & 0xffffff;
+            sdm_reset_levels(ss);
             break;
         }
         case SDM_CMD_USBL_RX:
@@ -260,6 +282,7 @@ int sdm_send(sdm_session_t *ss, int cmd_code, ...)
             samples = va_arg(ap, unsigned);
 
             cmd->rx_len = samples + (channel << 21);
+            sdm_reset_levels(ss);
             break;
         }
         default:
@@ -426,13 +449,14 @@ int sdm_show(sdm_session_t *ss, sdm_pkt_t *cmd)
     return 0;
 }
 
-int sdm_save_samples(sdm_session_t *ss, char *buf, size_t len)
+/* Log and remove sinks which failed in last streams call */
+static int sdm_streams_failed(sdm_session_t *ss)
 {
     int error = 0;
     int i;
 
     for (i = ss->streams.count - 1; i >= 0; i--) {
-        int rc = stream_write(ss->streams.streams[i], (int16_t*)buf, len / 2);
+        int rc = ss->streams.result[i];
 
         if (rc <= 0) {
             error = rc;
@@ -451,6 +475,167 @@ int sdm_save_samples(sdm_session_t *ss, char *buf, size_t len)
     return error;
 }
 
+void sdm_reset_levels(sdm_session_t *ss)
+{
+    memset(&ss->level_total,  0, sizeof(ss->level_total));
+    memset(&ss->level,        0, sizeof(ss->level));
+    memset(&ss->level_window, 0, sizeof(ss->level_window));
+}
+
+/* One pass over chunk, window is published when full */
+static void sdm_update_levels(sdm_session_t *ss, const int16_t *samples, size_t n)
+{
+    dsp_levels_t chunk = {0};
+
+    dsp_levels_s16(samples, n, &chunk);
+    dsp_levels_add(&ss->level_total, &chunk);
+    dsp_levels_add(&ss->level_window, &chunk);
+    if (ss->level_window.count >= SDM_LEVEL_WINDOW) {
+        ss->level = ss->level_window;
+        memset(&ss->level_window, 0, sizeof(ss->level_window));
+    }
+}
+
+/* "peak <dBFS> rms <dBFS> dc <fraction of full scale> clip <samples>" */
+int sdm_levels_str(const dsp_levels_t *lv, char *buf, size_t len)
+{
+    double peak, rms;
+
+    if (lv->count == 0)
+        return snprintf(buf, len, "no samples");
+    peak = -(double)lv->min > lv->max ? -(double)lv->min : lv->max;
+    rms  = sqrt((double)lv->energy / lv->count);
+    return snprintf(buf, len, "peak %.1f rms %.1f dBFS dc %+.4f clip %llu"
+            , peak > 0 ? 20 * log10(peak / 32768.) : -INFINITY
+            , rms  > 0 ? 20 * log10(rms / 32768.)  : -INFINITY
+            , (double)lv->sum / lv->count / 32768., lv->clipped);
+}
+
+int sdm_save_samples(sdm_session_t *ss, char *buf, size_t len)
+{
+    sdm_update_levels(ss, (int16_t*)buf, len / 2);
+
+    if (ss->usbl_planes[0]) {
+        size_t n = len / 2;
+
+        if (n > ss->usbl_nsamples - ss->usbl_received)
+            n = ss->usbl_nsamples - ss->usbl_received;
+        memcpy(ss->usbl_planes[ss->usbl_channel] + ss->usbl_received, buf, n * 2);
+        ss->usbl_received += n;
+        return 0;
+    }
+
+    /* sinks write in background while next chunk is read from socket.
+     * Failures of earlier chunks are reported here too */
+    if (streams_submit(&ss->streams, (int16_t*)buf, len / 2) > 0)
+        return 0;
+
+    return sdm_streams_failed(ss);
+}
+
+int sdm_reap_samples(sdm_session_t *ss)
+{
+    if (streams_reap(&ss->streams) > 0)
+        return 0;
+
+    return sdm_streams_failed(ss);
+}
+
+/* Start usbl_rx of all channels to sinks of 1 channel, which get
+ * channels one after another, or of SDM_USBL_CHANNELS channels */
+int sdm_usbl_rx_all(sdm_session_t *ss, unsigned nsamples)
+{
+    unsigned i;
+    int c;
+
+    SDM_CHECK_ARG_LONG("usbl_rx: number of samples", nsamples, arg >= 1024 && arg <= 51200 && (arg % 1024) == 0);
+    if (ss->streams.count == 0) {
+        logger(ERR_LOG, "No sink\n");
+        return -1;
+    }
+    for (i = 0; i < ss->streams.count; i++) {
+        unsigned nch = stream_get_channels(ss->streams.streams[i]);
+
+        if (nch != 1 && nch != SDM_USBL_CHANNELS) {
+            logger(ERR_LOG, "usbl_rx: sink must have 1 or %d channels\n", SDM_USBL_CHANNELS);
+            return -1;
+        }
+    }
+
+    sdm_usbl_free(ss);
+    for (c = 0; c < SDM_USBL_CHANNELS; c++) {
+        ss->usbl_planes[c] = calloc(nsamples, sizeof(int16_t));
+        if (!ss->usbl_planes[c]) {
+            sdm_usbl_free(ss);
+            logger(ERR_LOG, "usbl_rx: %s\n", strerror(ENOMEM));
+            return -1;
+        }
+    }
+    ss->usbl_channel  = 0;
+    ss->usbl_nsamples = nsamples;
+    ss->usbl_received = 0;
+
+    return sdm_send(ss, SDM_CMD_USBL_RX, 0, nsamples);
+}
+
+/* Channel is received: request next one or write all of them.
+ * Return 1 if next channel is requested */
+static int sdm_usbl_next(sdm_session_t *ss)
+{
+    int i, c;
+
+    if (ss->usbl_channel + 1 < SDM_USBL_CHANNELS) {
+        ss->usbl_channel++;
+        ss->usbl_received = 0;
+        sdm_send(ss, SDM_CMD_USBL_RX, ss->usbl_channel, ss->usbl_nsamples);
+        return 1;
+    }
+
+    for (i = ss->streams.count - 1; i >= 0; i--) {
+        stream_t *stream = ss->streams.streams[i];
+        int rc = 0;
+
+        if (stream_get_channels(stream) == 1) {
+            for (c = 0; c < SDM_USBL_CHANNELS && rc >= 0; c++)
+                rc = stream_write(stream, ss->usbl_planes[c], ss->usbl_nsamples);
+        } else {
+            rc = stream_write_planar(stream, ss->usbl_planes, ss->usbl_nsamples);
+        }
+        if (rc < 0)
+            logger(ERR_LOG, "\nError %s.\n", stream_strerror(stream));
+    }
+    ss->data_len = SDM_USBL_CHANNELS * ss->usbl_nsamples * 2;
+    sdm_usbl_free(ss);
+    return 0;
+}
+
+/* Report sinks which keep statistics, for ex. samples lost by network sinks */
+void sdm_show_streams_status(sdm_session_t *ss)
+{
+    unsigned int i;
+    char status[256];
+
+    for (i = 0; i < ss->streams.count; i++) {
+        stream_t *stream = ss->streams.streams[i];
+
+        if (stream_get_status(stream, status, sizeof(status)) == 0)
+            logger(INFO_LOG, "%s:%s: %s\n", stream_get_name(stream), stream_get_args(stream), status);
+    }
+}
+
+/* Attach session settings to capture stream. Must be called before stream_open() */
+void sdm_set_stream_meta(sdm_session_t *ss, stream_t *stream)
+{
+    if (ss->meta_config[0])
+        stream_set_meta(stream, "config", ss->meta_config);
+    if (ss->meta_usbl_config[0])
+        stream_set_meta(stream, "usbl_config", ss->meta_usbl_config);
+    if (ss->meta_systime[0])
+        stream_set_meta(stream, "systime", ss->meta_systime);
+    if (ss->meta_reference[0])
+        stream_set_meta(stream, "reference", ss->meta_reference);
+}
+
 int sdm_extract_reply(char *buf, size_t len, sdm_pkt_t **cmd)
 {
     unsigned int i;
@@ -586,8 +771,19 @@ int sdm_handle_rx_data(sdm_session_t *ss, char *buf, int len)
 
     switch (ss->cmd->cmd) {
         case SDM_REPLY_STOP:
+            /* intermediate stop of usbl_rx of all channels is not reported */
+            if (ss->usbl_planes[0] && sdm_usbl_next(ss)) {
+                logger(INFO_LOG, "\rusbl_rx: channel %u\n", ss->usbl_channel);
+                free(ss->cmd);
+                ss->cmd = NULL;
+                return handled;
+            }
             if (ss->streams.count) {
+                /* wait for sinks, which are still writing */
+                if (streams_flush(&ss->streams) <= 0)
+                    sdm_streams_failed(ss);
                 logger(INFO_LOG, "\nReceiving %d samples is done.\n", ss->data_len / 2);
+                sdm_show_streams_status(ss);
                 streams_clean(&ss->streams);
                 sdm_set_idle_state(ss);
             }
@@ -610,6 +806,11 @@ int sdm_handle_rx_data(sdm_session_t *ss, char *buf, int len)
             sdm_buf_resize(ss, NULL, -ss->cmd->data_len * 2);
             handled += ss->cmd->data_len * 2;
 
+            snprintf(ss->meta_systime, sizeof(ss->meta_systime)
+                    , "%"PRIu32" %"PRIu32" %"PRIu32" %"PRIu32""
+                    , ss->cmd->current_time, ss->cmd->tx_time, ss->cmd->rx_time
+                    , ss->cmd->data_len == 8 ? ss->cmd->syncin_time : 0);
+
             sdm_set_idle_state(ss);
             ss->state = SDM_STATE_IDLE;
 
@@ -622,6 +823,17 @@ int sdm_handle_rx_data(sdm_session_t *ss, char *buf, int len)
                 return 0;
             }
 
+            {
+                int32_t janus_nshift;
+                float janus_doppler;
+                char value[32];
+
+                memcpy(&janus_nshift, &ss->rx_data[0], 4);
+                memcpy(&janus_doppler, &ss->rx_data[4], 4);
+                snprintf(value, sizeof(value), "%"PRId32" %f", janus_nshift, janus_doppler);
+                streams_mark(&ss->streams, "janus", value);
+            }
+
             sdm_handle_janus_detect(ss);
 
             sdm_buf_resize(ss, NULL, -ss->cmd->data_len * 2);
@@ -632,6 +844,7 @@ int sdm_handle_rx_data(sdm_session_t *ss, char *buf, int len)
         case SDM_REPLY_BUSY:
             return SDM_ERR_BUSY;
         case SDM_REPLY_SYNCIN:
+            streams_mark(&ss->streams, "syncin", NULL);
             if (ss->state == SDM_STATE_WAIT_SYNCIN)
                 ss->state = SDM_STATE_IDLE;
             return handled;
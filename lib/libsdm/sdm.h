@@ -7,6 +7,7 @@
 
 #include <utils.h>
 #include <stream.h>
+#include <stream_dsp.h>
 
 #define SDM_ERR_SYSTEM       -1
 #define SDM_ERR_TIMEOUT      -2
@@ -25,6 +26,11 @@
 
 #define SDM_DEFAULT_TIMEOUT 5000 /* ms */
 
+#define SDM_USBL_CHANNELS 5
+
+/* samples of level shown while receiving */
+#define SDM_LEVEL_WINDOW 16384
+
 enum {
     SDM_CMD_STOP        = 0,
     SDM_CMD_TX          = 1,
@@ -133,9 +139,30 @@ typedef struct {
     char   *sink_membuf;
     size_t  sink_membuf_size;
 
+    /* usbl_rx of all channels: modem sends one channel per command,
+     * samples are kept till the last one and written in one pass */
+    int16_t *usbl_planes[SDM_USBL_CHANNELS];
+    unsigned usbl_channel;
+    unsigned usbl_nsamples;
+    unsigned usbl_received;
+
     sdm_pkt_t *cmd; /* last received command */
 
     long timeout; /* used in expect() */
+
+    /* last settings sent to modem and last systime reply.
+     * Saved as metadata of captures */
+    char meta_config[64];
+    char meta_usbl_config[64];
+    char meta_systime[64];
+    /* source of last ref command, default reference of detect: */
+    char meta_reference[256];
+
+    /* levels of received samples: since start of rx, of last full
+     * window of SDM_LEVEL_WINDOW samples and of window being filled */
+    dsp_levels_t level_total;
+    dsp_levels_t level;
+    dsp_levels_t level_window;
 } sdm_session_t;
 
 sdm_session_t* sdm_connect(char *host, int port);
@@ -154,6 +181,12 @@ void  sdm_set_idle_state(sdm_session_t *ss);
 int   sdm_show(sdm_session_t *ss, sdm_pkt_t *cmd);
 
 int   sdm_save_samples(sdm_session_t *ss, char *buf, size_t len);
+int   sdm_reap_samples(sdm_session_t *ss);
+int   sdm_usbl_rx_all(sdm_session_t *ss, unsigned nsamples);
+void  sdm_set_stream_meta(sdm_session_t *ss, stream_t *stream);
+void  sdm_show_streams_status(sdm_session_t *ss);
+void  sdm_reset_levels(sdm_session_t *ss);
+int   sdm_levels_str(const dsp_levels_t *lv, char *buf, size_t len);
 
 char* sdm_cmd_to_str(uint8_t cmd);
 char* sdm_reply_to_str(uint8_t cmd);
@@ -8,8 +8,17 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <glob.h>
+#include <ctype.h>
+#include <limits.h>
+
+// POSIX headers.
+#include <unistd.h>
+#include <pthread.h>
+#include <dlfcn.h>
 
 #include <stream.h>
+#include <stream_dsp.h>
+#include <stream_async.h>
 // Declare driver initialization functions.
 #define STREAM(a) \
     int stream_impl_ ## a ## _new(stream_t*);
@@ -25,6 +34,18 @@ static const char* s_drivers[] = {
     NULL
 };
 
+#define STREAM_PLUGINS_MAX 16
+
+typedef int (*stream_init_t)(stream_t*);
+
+/* Loaded plugins, they are never unloaded */
+static struct {
+    char name[36];
+    stream_init_t init;
+} s_plugins[STREAM_PLUGINS_MAX];
+static unsigned s_plugins_count;
+static pthread_mutex_t s_plugins_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #define CHECK_SUPPORT(func)     \
     do {                    \
         if (!stream)        \
@@ -38,6 +59,95 @@ const char** stream_get_drivers(void)
     return s_drivers;
 }
 
+static void* stream_plugin_open(const char *driver)
+{
+    const char *path = getenv("STREAM_PLUGIN_PATH");
+    char fname[PATH_MAX];
+    void *dl;
+
+    while (path && *path) {
+        size_t len = strcspn(path, ":");
+
+        snprintf(fname, sizeof(fname), "%.*s/libstream-%s.so", (int)len, path, driver);
+        if (access(fname, F_OK) == 0) {
+            dl = dlopen(fname, RTLD_NOW | RTLD_LOCAL);
+            if (!dl)
+                fprintf(stderr, "libstream: %s\n", dlerror());
+            return dl;
+        }
+        path += len;
+        if (*path == ':')
+            path++;
+    }
+    snprintf(fname, sizeof(fname), "libstream-%s.so", driver);
+    return dlopen(fname, RTLD_NOW | RTLD_LOCAL);
+}
+
+/* Driver initialization function of plugin libstream-<driver>.so */
+static stream_init_t stream_plugin_find(const char *driver)
+{
+    const stream_plugin_t *plugin;
+    stream_init_t init = NULL;
+    char sym[64];
+    const char *c;
+    unsigned i;
+    void *dl;
+
+    /* driver name is a part of file and symbol names */
+    if (!driver[0] || strlen(driver) >= sizeof(s_plugins[0].name))
+        return NULL;
+    for (c = driver; *c; c++)
+        if (!isalnum((unsigned char)*c) && *c != '_')
+            return NULL;
+
+    pthread_mutex_lock(&s_plugins_lock);
+    for (i = 0; i < s_plugins_count; i++)
+        if (!strcmp(s_plugins[i].name, driver)) {
+            init = s_plugins[i].init;
+            goto stream_plugin_find_done;
+        }
+    if (s_plugins_count == STREAM_PLUGINS_MAX)
+        goto stream_plugin_find_done;
+
+    dl = stream_plugin_open(driver);
+    if (!dl)
+        goto stream_plugin_find_done;
+
+    snprintf(sym, sizeof(sym), "stream_plugin_%s", driver);
+    plugin = dlsym(dl, sym);
+    snprintf(sym, sizeof(sym), "stream_impl_%s_new", driver);
+    *(void **)&init = dlsym(dl, sym);
+    if (!plugin || !init) {
+        fprintf(stderr, "libstream: plugin %s: no stream_plugin_%s or %s\n", driver, driver, sym);
+        init = NULL;
+    } else if (plugin->abi_version != STREAM_PLUGIN_ABI_VERSION || plugin->stream_size != sizeof(stream_t)) {
+        fprintf(stderr, "libstream: plugin %s: ABI version %u, stream size %u, expected %u, %u\n"
+                , driver, plugin->abi_version, plugin->stream_size
+                , STREAM_PLUGIN_ABI_VERSION, (unsigned)sizeof(stream_t));
+        init = NULL;
+    }
+    if (!init) {
+        dlclose(dl);
+        goto stream_plugin_find_done;
+    }
+    strcpy(s_plugins[s_plugins_count].name, driver);
+    s_plugins[s_plugins_count].init = init;
+    s_plugins_count++;
+
+stream_plugin_find_done:
+    pthread_mutex_unlock(&s_plugins_lock);
+    return init;
+}
+
+static int stream_plugin_new(stream_t *stream, const char *driver)
+{
+    stream_init_t init = stream_plugin_find(driver);
+
+    if (!init)
+        return STREAM_ERROR;
+    return init(stream);
+}
+
 stream_t *stream_new_v(int direction, const char* driver, const char* args)
 {
     stream_t *stream = (stream_t*)calloc(1, sizeof(stream_t));
@@ -54,6 +164,7 @@ stream_t *stream_new_v(int direction, const char* driver, const char* args)
     globfree (&g);
 
     stream->sample_size = sizeof(int16_t);
+    stream->channels = 1;
     stream->direction = direction;
     stream_set_fs(stream, 62500);
 
@@ -61,7 +172,7 @@ stream_t *stream_new_v(int direction, const char* driver, const char* args)
 #define STREAM(a)                                                      \
     if (strcmp(#a, driver) == 0) {rv = stream_impl_ ## a ## _new(stream);} else
 #include "stream.def"
-    {rv = STREAM_ERROR;}
+    {rv = stream_plugin_new(stream, driver);}
 
     if (rv != STREAM_ERROR_NONE) {
         free(stream);
@@ -74,8 +185,11 @@ void stream_free(stream_t *stream)
 {
     if (!stream || !stream->pdata)
         return;
+    stream_async_free(stream);
     if (stream->free)
         stream->free(stream);
+    free(stream->conv);
+    free(stream->frames);
     free(stream);
     stream = NULL;
 }
@@ -94,6 +208,31 @@ unsigned stream_get_fs(stream_t *stream)
     return stream->fs;
 }
 
+void stream_set_nsamples(stream_t *stream, unsigned long nsamples)
+{
+    if (!stream)
+        return;
+    stream->nsamples = nsamples;
+}
+
+unsigned long stream_get_nsamples(stream_t *stream)
+{
+    if (!stream)
+        return 0;
+    return stream->nsamples;
+}
+
+int stream_set_sample_size(stream_t *stream, unsigned sample_size)
+{
+    if (!stream)
+        return STREAM_ERROR;
+    /* own format or channels would convert samples as int16_t */
+    if (stream->format != STREAM_FORMAT_S16LE || stream->channels != 1)
+        return STREAM_ERROR;
+    stream->sample_size = sample_size;
+    return STREAM_ERROR_NONE;
+}
+
 unsigned stream_get_sample_size(stream_t *stream)
 {
     if (!stream)
@@ -101,6 +240,62 @@ unsigned stream_get_sample_size(stream_t *stream)
     return stream->sample_size;
 }
 
+void stream_set_format(stream_t *stream, int format)
+{
+    if (!stream || stream_format_size(format) == 0)
+        return;
+    stream->format = format;
+    stream->sample_size = stream_format_size(format) * stream->channels;
+}
+
+int stream_get_format(stream_t *stream)
+{
+    if (!stream)
+        return STREAM_FORMAT_S16LE;
+    return stream->format;
+}
+
+void stream_set_channels(stream_t *stream, unsigned channels)
+{
+    if (!stream || channels == 0)
+        return;
+    stream->channels = channels;
+    stream->sample_size = stream_format_size(stream->format) * channels;
+}
+
+unsigned stream_get_channels(stream_t *stream)
+{
+    if (!stream)
+        return 0;
+    return stream->channels;
+}
+
+int stream_get_layout(stream_t *stream)
+{
+    if (!stream)
+        return STREAM_LAYOUT_INTERLEAVED;
+    return stream->layout;
+}
+
+static void* stream_buffer(void **buf, size_t *buf_size, size_t size)
+{
+    if (*buf_size < size) {
+        void *p = realloc(*buf, size);
+
+        if (!p)
+            return NULL;
+        *buf = p;
+        *buf_size = size;
+    }
+    return *buf;
+}
+
+static void* stream_conv_buffer(stream_t *stream, unsigned sample_count)
+{
+    return stream_buffer(&stream->conv, &stream->conv_size
+                         , (size_t)sample_count * stream_format_size(stream->format) * stream->channels);
+}
+
 int stream_open(stream_t *stream)
 {
     CHECK_SUPPORT(open);
@@ -120,24 +315,157 @@ int stream_close(stream_t *stream)
     if (!stream->pdata)
         return 0;
 
+    stream_async_stop(stream);
     return stream->close(stream);
 }
 
 int stream_read(stream_t *stream, int16_t* samples, unsigned sample_count)
 {
+    void *conv;
+    int rc;
+
     CHECK_SUPPORT(read);
-    return stream->read(stream, samples, sample_count);
+    if (stream->format == STREAM_FORMAT_S16LE)
+        return stream->read(stream, samples, sample_count);
+
+    conv = stream_conv_buffer(stream, sample_count);
+    if (!conv)
+        return STREAM_ERROR;
+    rc = stream->read(stream, conv, sample_count);
+    if (rc > 0)
+        stream_format_decode(stream->format, conv, samples, rc * stream->channels);
+    return rc;
+}
+
+int stream_write_now(stream_t *stream, int16_t *samples, unsigned sample_count)
+{
+    void *conv;
+
+    CHECK_SUPPORT(write);
+    if (stream->format == STREAM_FORMAT_S16LE)
+        return stream->write(stream, samples, sample_count);
+
+    conv = stream_conv_buffer(stream, sample_count);
+    if (!conv)
+        return STREAM_ERROR;
+    stream_format_encode(stream->format, samples, conv, sample_count * stream->channels);
+    return stream->write(stream, conv, sample_count);
 }
 
 int stream_write(stream_t *stream, int16_t *samples, unsigned sample_count)
 {
     CHECK_SUPPORT(write);
+    stream_async_sync(stream);
+    return stream_write_now(stream, samples, sample_count);
+}
+
+int stream_read_planar(stream_t *stream, int16_t **planes, unsigned sample_count)
+{
+    int16_t *frames;
+    int rc;
+
+    CHECK_SUPPORT(read);
+    if (stream->read_planar)
+        return stream->read_planar(stream, planes, sample_count);
+    if (stream->channels == 1)
+        return stream_read(stream, planes[0], sample_count);
+
+    frames = stream_buffer(&stream->frames, &stream->frames_size
+                           , (size_t)sample_count * stream->channels * sizeof(int16_t));
+    if (!frames)
+        return STREAM_ERROR;
+    rc = stream_read(stream, frames, sample_count);
+    if (rc > 0)
+        dsp_deinterleave_s16(frames, stream->channels, planes, rc);
+    return rc;
+}
+
+int stream_write_planar(stream_t *stream, int16_t *const *planes, unsigned sample_count)
+{
+    int16_t *frames;
+
+    CHECK_SUPPORT(write);
+    stream_async_sync(stream);
+    if (stream->write_planar)
+        return stream->write_planar(stream, planes, sample_count);
+    if (stream->channels == 1)
+        return stream_write(stream, planes[0], sample_count);
+
+    frames = stream_buffer(&stream->frames, &stream->frames_size
+                           , (size_t)sample_count * stream->channels * sizeof(int16_t));
+    if (!frames)
+        return STREAM_ERROR;
+    dsp_interleave_s16(planes, stream->channels, frames, sample_count);
+    return stream_write(stream, frames, sample_count);
+}
+
+int stream_write_encoded(stream_t *stream, void *samples, unsigned sample_count)
+{
+    CHECK_SUPPORT(write);
+    stream_async_sync(stream);
     return stream->write(stream, samples, sample_count);
 }
 
+int stream_seek(stream_t *stream, unsigned long offset)
+{
+    CHECK_SUPPORT(seek);
+    return stream->seek(stream, offset);
+}
+
+int stream_set_meta(stream_t *stream, const char *key, const char *value)
+{
+    CHECK_SUPPORT(set_meta);
+    return stream->set_meta(stream, key, value);
+}
+
+int stream_mark(stream_t *stream, const char *event, const char *value)
+{
+    CHECK_SUPPORT(mark);
+    stream_async_sync(stream);
+    return stream->mark(stream, event, value);
+}
+
+int stream_get_status(stream_t *stream, char *buf, size_t len)
+{
+    int rc;
+    size_t n;
+
+    CHECK_SUPPORT(status);
+    stream_async_sync(stream);
+    rc = stream->status(stream, buf, len);
+    if (rc != STREAM_ERROR_NONE || !stream->inner || !stream->inner->status)
+        return rc;
+    n = strlen(buf);
+    if (n + 2 < len) {
+        strcpy(buf + n, "; ");
+        stream_get_status(stream->inner, buf + n + 2, len - n - 2);
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_stage_set_meta(stream_t *stream, const char *key, const char *value)
+{
+    return stream->inner ? stream_set_meta(stream->inner, key, value) : STREAM_ERROR_NONE;
+}
+
+static int stream_stage_mark(stream_t *stream, const char *event, const char *value)
+{
+    return stream->inner ? stream_mark(stream->inner, event, value) : STREAM_ERROR_NONE;
+}
+
+void stream_stage_init(stream_t *stream, stream_t *inner)
+{
+    /* inner stream exists from the start, so metadata can be passed on
+     * before open of stage, which is when drivers read it */
+    stream->inner    = inner;
+    stream->set_meta = stream_stage_set_meta;
+    stream->mark     = stream_stage_mark;
+}
+
 ssize_t stream_count(stream_t *stream)
 {
     CHECK_SUPPORT(count);
+    stream_async_sync(stream);
     return stream->count(stream);
 }
 
@@ -185,11 +513,43 @@ const char* stream_get_args(stream_t *stream)
 }
 
 /****************** streams_t ***********************/
+/* driver and sample format by file extension, ascii if unknown */
+static const char* stream_driver_by_ext(const char *filename, int *format)
+{
+    const char *ext = strrchr(filename, '.');
+
+    if (!ext)
+        return "ascii";
+    if (!strcmp(ext, ".dat") || !strcmp(ext, ".txt"))
+        return "ascii";
+    if (!strcmp(ext, ".raw") || !strcmp(ext, ".bin")
+            || !strcmp(ext, ".s16") || !strcmp(ext, ".dmp")
+            || !strcmp(ext, ".fifo"))
+        return "raw";
+    if (!strcmp(ext, ".sdz"))
+        return "lpc";
+    if (!strcmp(ext, ".wav"))
+        return "wav";
+    if (!strcmp(ext, ".sdc"))
+        return "sdc";
+    if (!strcmp(ext, ".f32")) {
+        *format = STREAM_FORMAT_F32;
+        return "raw";
+    }
+    if (!strcmp(ext, ".ul")) {
+        *format = STREAM_FORMAT_ULAW;
+        return "raw";
+    }
+    return "ascii";
+}
+
 stream_t* stream_new(int direction, char *description)
 {
     char *arg = strdup(description);
-    char *default_drv = "ascii";
-    char *drv, *drv_param;
+    const char *drv;
+    char *drv_param, *mods, *mod;
+    int format = STREAM_FORMAT_S16LE;
+    unsigned channels = 1;
     stream_t *stream;
 
     if (strchr(arg, ':')) {
@@ -203,27 +563,62 @@ stream_t* stream_new(int direction, char *description)
             /* logger(ERR_LOG, "Output description undefined\n"); */
             goto stream_new_error;
         }
+        /* <driver>[/<format>][/<N>ch], empty driver name: by extension */
+        mods = strchr(drv, '/');
+        if (mods)
+            *mods++ = 0;
+        while ((mod = strsep(&mods, "/")) != NULL) {
+            char ch[3] = "";
+            unsigned n;
+
+            if (sscanf(mod, "%u%2s", &n, ch) == 2 && !strcmp(ch, "ch") && n > 0) {
+                channels = n;
+                continue;
+            }
+            format = stream_format_parse(mod);
+            if (format < 0)
+                goto stream_new_error;
+        }
+        if (!drv[0]) {
+            int ext_format = format;
+
+            drv = stream_driver_by_ext(drv_param, &ext_format);
+            if (format == STREAM_FORMAT_S16LE)
+                format = ext_format;
+        }
     } else {
-        char *ext = strrchr(arg, '.');
-
-        if (!ext)
-            drv = default_drv;
-        else if (!strcmp(ext, ".dat") || !strcmp(ext, ".txt"))
-            drv = "ascii";
-        else if (!strcmp(ext, ".raw") || !strcmp(ext, ".bin")
-              || !strcmp(ext, ".s16") || !strcmp(ext, ".dmp")
-              || !strcmp(ext, ".fifo"))
-            drv = "raw";
-        else
-            drv = default_drv;
+        drv = stream_driver_by_ext(arg, &format);
         drv_param = arg;
     }
-    
+
+    if (channels > 1 && strstr(drv_param, "%d")) {
+        /* file per channel, format is converted by every one */
+        char planar[sizeof(stream->args)];
+
+        /* truncated pattern would name other files */
+        if (snprintf(planar, sizeof(planar), "%u:%s/%s:%s", channels, drv
+                    , stream_format_name(format), drv_param) >= (int)sizeof(planar)) {
+            errno = ENAMETOOLONG;
+            goto stream_new_error;
+        }
+        stream = stream_new_v(direction, "planar", planar);
+        if (stream == NULL)
+            goto stream_new_error;
+        stream->layout = STREAM_LAYOUT_PLANAR;
+        stream_set_channels(stream, channels);
+        free(arg);
+        return stream;
+    }
+
     stream = stream_new_v(direction, drv, drv_param);
     if (stream == NULL) {
         /* logger(ERR_LOG, "Stream creation error\n"); */
         goto stream_new_error;
     }
+    if (format != STREAM_FORMAT_S16LE)
+        stream_set_format(stream, format);
+    if (channels > 1)
+        stream_set_channels(stream, channels);
 
     free(arg);
     return stream;
@@ -266,6 +661,68 @@ int streams_add(streams_t *streams, stream_t *stream)
     return STREAM_ERROR_NONE;
 }
 
+int streams_write(streams_t *streams, int16_t *samples, unsigned sample_count)
+{
+    unsigned converted = 0;
+    int rc = sample_count;
+    int i;
+
+    if (!streams)
+        return EINVAL;
+
+    for (i = streams->count - 1; i >= 0; i--) {
+        stream_t *stream = streams->streams[i];
+        int format = stream->format;
+        size_t size = (size_t)sample_count * stream_format_size(format);
+        /* multichannel streams take samples as frames */
+        unsigned n = sample_count / stream->channels;
+
+        if (sample_count % stream->channels) {
+            /* part of frame cannot be written */
+            errno = EINVAL;
+            streams->result[i] = STREAM_ERROR;
+        } else if (format == STREAM_FORMAT_S16LE) {
+            streams->result[i] = stream_write(stream, samples, n);
+        } else if (!stream_buffer(&streams->conv[format], &streams->conv_size[format], size)) {
+            /* no memory for shared copy, stream converts itself */
+            streams->result[i] = stream_write(stream, samples, n);
+        } else {
+            if (!(converted & (1u << format))) {
+                stream_format_encode(format, samples, streams->conv[format], sample_count);
+                converted |= 1u << format;
+            }
+            streams->result[i] = stream_write_encoded(stream, streams->conv[format], n);
+        }
+        if (streams->result[i] <= 0 && rc > 0) {
+            rc = streams->result[i];
+            streams->error_index = i;
+        }
+    }
+    return rc;
+}
+
+void streams_set_meta(streams_t *streams, const char *key, const char *value)
+{
+    unsigned int i;
+
+    if (!streams)
+        return;
+
+    for (i = 0; i < streams->count; i++)
+        stream_set_meta(streams->streams[i], key, value);
+}
+
+void streams_mark(streams_t *streams, const char *event, const char *value)
+{
+    unsigned int i;
+
+    if (!streams)
+        return;
+
+    for (i = 0; i < streams->count; i++)
+        stream_mark(streams->streams[i], event, value);
+}
+
 void streams_clean(streams_t *streams)
 {
     int i;
@@ -274,6 +731,11 @@ void streams_clean(streams_t *streams)
 
     for (i = streams->count - 1; i >= 0 ; i--)
         streams_remove(streams, i);
+    for (i = 0; i < STREAM_FORMATS; i++) {
+        free(streams->conv[i]);
+        streams->conv[i] = NULL;
+        streams->conv_size[i] = 0;
+    }
 }
 
 // FIXME: need heavy testing!!!!!!!!!!!!!
@@ -286,10 +748,12 @@ int streams_remove(streams_t *streams, unsigned int index)
         return STREAM_ERROR;
 
     if (streams->streams[index]) {
+        streams_async_drain(streams, index);
         stream_close(streams->streams[index]);
         stream_free (streams->streams[index]);
         if (index != streams->count) {
-            memmove(&streams->streams[index], &streams->streams[index + 1], streams->count - index);
+            memmove(&streams->streams[index], &streams->streams[index + 1]
+                    , (streams->count - index - 1) * sizeof(streams->streams[0]));
             streams->error_index = 0; // ??????????????????????????
         }
         streams->count--;
@@ -307,6 +771,9 @@ void stream_dump(stream_t *stream)
     fprintf(stderr, "Stream Driver: %s\n", stream->name);
     fprintf(stderr, "Stream Driver Arguments: %s\n", stream->args);
     fprintf(stderr, "Stream Bytes Per Sample: %u\n", stream->sample_size);
+    fprintf(stderr, "Stream Sample Format: %s\n", stream_format_name(stream->format));
+    fprintf(stderr, "Stream Channels: %u %s\n", stream->channels
+            , stream->layout == STREAM_LAYOUT_PLANAR ? "planar" : "interleaved");
     fprintf(stderr, "Stream Sampling Frequency (Hz): %u\n", stream->fs);
 }
 
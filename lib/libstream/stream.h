@@ -12,12 +12,45 @@
 
 typedef struct stream_t stream_t;
 
+//! Sample formats, see stream_set_format().
+enum {
+    STREAM_FORMAT_S16LE = 0
+    ,STREAM_FORMAT_S16BE
+    ,STREAM_FORMAT_F32
+    ,STREAM_FORMAT_ULAW
+    ,STREAM_FORMATS
+};
+
+//! Layout of multichannel stream.
+enum {
+    //! Frames of all channels in one stream.
+    STREAM_LAYOUT_INTERLEAVED = 0
+    //! Stream per channel.
+    ,STREAM_LAYOUT_PLANAR
+};
+
+//! Completion of write started by stream_submit_write().
+typedef struct stream_completion_t {
+    //! Tag passed to stream_submit_write().
+    void *tag;
+    //! Result of write as of stream_write().
+    int result;
+} stream_completion_t;
+
 struct stream_t
 {
     //! Sampling frequency (Hz).
     unsigned fs;
     //! Sample size (in bytes).
     unsigned sample_size;
+    //! Sample format of driver side, STREAM_FORMAT_S16LE if not converted.
+    int format;
+    //! Number of channels, sample_size is size of frame of all channels.
+    unsigned channels;
+    //! STREAM_LAYOUT_INTERLEAVED or STREAM_LAYOUT_PLANAR.
+    int layout;
+    //! Expected number of samples, 0 if unknown.
+    unsigned long nsamples;
     
     //! Driver name.
     char name[36];
@@ -36,6 +69,22 @@ struct stream_t
     int (*read)(const stream_t*, int16_t*, unsigned);
     //! Pointer to driver's write function.
     int (*write)(stream_t*, void*, unsigned);
+    //! Pointer to driver's function reading channel per buffer, optional.
+    int (*read_planar)(stream_t*, int16_t**, unsigned);
+    //! Pointer to driver's function writing channel per buffer, optional.
+    int (*write_planar)(stream_t*, int16_t* const*, unsigned);
+    //! Pointer to driver's function starting write, optional. Samples are
+    //! kept till completion is reported by stream_complete().
+    //! STREAM_ERROR_OP_NOT_SUPP passes write to worker thread.
+    int (*submit_write)(stream_t*, void*, unsigned, void*);
+    //! Pointer to driver's seek function, offset in samples.
+    int (*seek)(stream_t*, unsigned long);
+    //! Pointer to driver's function storing metadata, called before open.
+    int (*set_meta)(stream_t*, const char*, const char*);
+    //! Pointer to driver's function marking event at current position.
+    int (*mark)(stream_t*, const char*, const char*);
+    //! Pointer to driver's function describing its state, for ex. lost samples.
+    int (*status)(stream_t*, char*, size_t);
     //! Number of samples in stream, if known.
     int (*count)(stream_t*);
     //! Pointer to driver's error function.
@@ -49,6 +98,16 @@ struct stream_t
     void* pdata;
     //! Error message buffer.
     char bfr_error[512];
+    //! Buffer for samples converted to/from format.
+    void *conv;
+    size_t conv_size;
+    //! Buffer for frames interleaved from/to planes.
+    void *frames;
+    size_t frames_size;
+    //! Submitted writes and their completions, NULL if never submitted.
+    void *async;
+    //! Stream wrapped by stage driver, see stream_stage_init().
+    stream_t *inner;
 
     int direction;
 };
@@ -64,8 +123,30 @@ struct streams_t {
     unsigned int count;
     stream_t *streams[STREAMS_MAX];
     int error_index; /* Last handled stream. For error report */
+    int result[STREAMS_MAX]; /* Results of last streams_write() */
+    /* Samples of last streams_write() in every format */
+    void *conv[STREAM_FORMATS];
+    size_t conv_size[STREAM_FORMATS];
+    /* Chunks of streams_submit() which are not completed by all streams */
+    unsigned chunks;
 };
 
+//! Version of driver interface, changed with layout of stream_t.
+#define STREAM_PLUGIN_ABI_VERSION 2
+
+//! Exported by driver plugin libstream-<driver>.so as stream_plugin_<driver>
+//! next to its stream_impl_<driver>_new(), see STREAM_PLUGIN().
+typedef struct stream_plugin_t {
+    //! STREAM_PLUGIN_ABI_VERSION of plugin build.
+    unsigned abi_version;
+    //! sizeof(stream_t) of plugin build.
+    unsigned stream_size;
+} stream_plugin_t;
+
+//! Define description of driver plugin, for ex. STREAM_PLUGIN(null);
+#define STREAM_PLUGIN(a) \
+    const stream_plugin_t stream_plugin_ ## a = { STREAM_PLUGIN_ABI_VERSION, sizeof(stream_t) }
+
 #define STREAM_SET_ERROR(descr, errno_code) \
     do {                                    \
         pdata->error_op = descr;            \
@@ -79,6 +160,10 @@ struct streams_t {
         return STREAM_ERROR;                   \
     } while (0)
 
+//! Take error of inner stream of stage driver, for ex. after its write failed.
+#define STREAM_SET_INNER_ERROR(descr) \
+    STREAM_SET_ERROR(descr, stream_get_errno(pdata->inner))
+
 #define STREAM_RETURN_FP(descr, stream_error, _fp) \
     do {                                           \
         int ret;                                   \
@@ -100,10 +185,14 @@ const char** stream_get_drivers(void);
 //! Create output stream object.
 //! @param direction STREAM_OUTPUT or STREAM_INPUT
 //! @param description driver's description string
-//! @return output stream object.
+//! @return output stream object, NULL on error. errno is ENAMETOOLONG when
+//! arguments of file per channel stream do not fit.
 stream_t* stream_new(int direction, char *description);
 
 //! Create output stream object.
+//! Driver which is not built in is loaded from libstream-<driver>.so,
+//! searched in directories of STREAM_PLUGIN_PATH (':' separated) and
+//! then by dynamic linker.
 //! @param direction STREAM_OUTPUT or STREAM_INPUT
 //! @param driver driver's name.
 //! @param args driver's arguments.
@@ -124,11 +213,88 @@ void stream_set_fs(stream_t *stream, unsigned fs);
 //! @return sampling frequency (Hz).
 unsigned stream_get_fs(stream_t *stream);
 
+//! Set expected number of samples.
+//! Drivers can use it to preallocate storage before opening.
+//! @param stream output stream object.
+//! @param nsamples number of samples, 0 if unknown.
+void stream_set_nsamples(stream_t *stream, unsigned long nsamples);
+
+//! Retrieve expected number of samples.
+//! @param stream output stream object.
+//! @return number of samples, 0 if unknown.
+unsigned long stream_get_nsamples(stream_t *stream);
+
+//! Set sample size, for ex. 4 for complex int16_t. Must be called before open.
+//! Drivers which only handle int16_t refuse to open other sizes.
+//! @param stream output stream object.
+//! @param sample_size sample size in bytes.
+//! @return STREAM_ERROR if stream has own format or channels.
+int stream_set_sample_size(stream_t *stream, unsigned sample_size);
+
 //! Retrieve sample size.
 //! @param stream output stream object.
 //! @return sample size in bytes.
 unsigned stream_get_sample_size(stream_t *stream);
 
+//! Set sample format of driver side, must be called before open.
+//! Samples are still passed as int16_t, stream_write() and stream_read()
+//! convert them. Set by description "<driver>/<format>:<args>".
+//! @param stream stream object.
+//! @param format STREAM_FORMAT_*, sets sample size too.
+void stream_set_format(stream_t *stream, int format);
+
+//! Retrieve sample format.
+//! @param stream stream object.
+//! @return STREAM_FORMAT_*.
+int stream_get_format(stream_t *stream);
+
+//! Set number of interleaved channels, must be called before open.
+//! Counts of samples in read and write are counts of frames then.
+//! Set by description "<driver>/<N>ch:<args>", planar streams are made
+//! when <args> has "%d" for channel number.
+//! @param stream stream object.
+//! @param channels number of channels.
+void stream_set_channels(stream_t *stream, unsigned channels);
+
+//! Retrieve number of channels.
+//! @param stream stream object.
+//! @return number of channels.
+unsigned stream_get_channels(stream_t *stream);
+
+//! Retrieve layout of channels.
+//! @param stream stream object.
+//! @return STREAM_LAYOUT_INTERLEAVED or STREAM_LAYOUT_PLANAR.
+int stream_get_layout(stream_t *stream);
+
+//! Find sample format by name.
+//! @param name "s16le", "s16be", "f32" or "ulaw".
+//! @return STREAM_FORMAT_* or -1 if unknown.
+int stream_format_parse(const char *name);
+
+//! Retrieve name of sample format.
+//! @param format STREAM_FORMAT_*.
+//! @return format name.
+const char* stream_format_name(int format);
+
+//! Retrieve size of sample in format.
+//! @param format STREAM_FORMAT_*.
+//! @return size in bytes, 0 if unknown.
+unsigned stream_format_size(int format);
+
+//! Convert native int16_t samples to format.
+//! @param format STREAM_FORMAT_*.
+//! @param in native samples.
+//! @param out buffer for n samples of format.
+//! @param n number of samples.
+void stream_format_encode(int format, const int16_t *in, void *out, unsigned n);
+
+//! Convert samples of format to native int16_t, float is saturated.
+//! @param format STREAM_FORMAT_*.
+//! @param in samples of format.
+//! @param out buffer for n native samples.
+//! @param n number of samples.
+void stream_format_decode(int format, const void *in, int16_t *out, unsigned n);
+
 //! Open stream.
 //! @param stream output stream object.
 int stream_open(stream_t *stream);
@@ -154,6 +320,94 @@ int stream_read(stream_t *stream, int16_t* samples, unsigned sample_count);
 //! @param sample_count number of samples.
 int stream_write(stream_t *stream, int16_t *samples, unsigned sample_count);
 
+//! Read frames to buffer per channel.
+//! @param stream input stream object.
+//! @param planes stream_get_channels() buffers.
+//! @param sample_count number of samples in every buffer.
+//! @return number of samples read to every buffer.
+int stream_read_planar(stream_t *stream, int16_t **planes, unsigned sample_count);
+
+//! Write frames from buffer per channel.
+//! @param stream output stream object.
+//! @param planes stream_get_channels() buffers.
+//! @param sample_count number of samples in every buffer.
+int stream_write_planar(stream_t *stream, int16_t *const *planes, unsigned sample_count);
+
+//! Write samples already converted to format of stream.
+//! @param stream output stream object.
+//! @param samples array of samples in stream format.
+//! @param sample_count number of samples.
+int stream_write_encoded(stream_t *stream, void *samples, unsigned sample_count);
+
+//! Start write and return without waiting for it.
+//! Drivers without submit_write are written by worker thread of stream,
+//! other calls of stream wait till submitted samples are written.
+//! @param stream output stream object.
+//! @param samples array of samples, must be kept till completion.
+//! @param sample_count number of samples.
+//! @param tag passed to completion.
+//! @return 0 if submitted, STREAM_ERROR_OVERRUN if too many completions
+//! are not taken yet. Without memory for completions samples are written
+//! at once and number of them is returned, tag gets no completion.
+int stream_submit_write(stream_t *stream, int16_t *samples, unsigned sample_count, void *tag);
+
+//! Take completions of submitted writes, does not block.
+//! @param stream output stream object.
+//! @param completions array for completions.
+//! @param max size of array.
+//! @return number of completions.
+int stream_poll_completion(stream_t *stream, stream_completion_t *completions, unsigned max);
+
+//! Take completions of submitted writes, wait for at least one of them.
+//! @param stream output stream object.
+//! @param completions array for completions.
+//! @param max size of array.
+//! @return number of completions, 0 if nothing is submitted.
+int stream_wait_completion(stream_t *stream, stream_completion_t *completions, unsigned max);
+
+//! Retrieve descriptor which is readable while completions wait for
+//! stream_poll_completion(), for select() or poll().
+//! @param stream output stream object.
+//! @return file descriptor or -1.
+int stream_get_event_fd(stream_t *stream);
+
+//! Report completion of submitted write, for drivers.
+//! @param stream output stream object.
+//! @param tag tag of submitted write.
+//! @param result result of write.
+void stream_complete(stream_t *stream, void *tag, int result);
+
+//! Set read position of stream.
+//! @param stream input stream object.
+//! @param offset position in samples from begin of stream.
+int stream_seek(stream_t *stream, unsigned long offset);
+
+//! Attach metadata to stream. Must be called before stream_open().
+//! @param stream output stream object.
+//! @param key metadata name.
+//! @param value metadata value.
+int stream_set_meta(stream_t *stream, const char *key, const char *value);
+
+//! Mark event at current stream position.
+//! @param stream output stream object.
+//! @param event event name, for ex. "syncin".
+//! @param value optional event value or NULL.
+int stream_mark(stream_t *stream, const char *event, const char *value);
+
+//! Get human readable driver state, for ex. buffered and lost samples.
+//! @param stream stream object.
+//! @param buf buffer for the status line.
+//! @param len size of buffer.
+//! @return 0 if status is stored in buf.
+int stream_get_status(stream_t *stream, char *buf, size_t len);
+
+//! Set inner stream of stage driver (filter:, resample:, ...), called from
+//! its stream_impl_<driver>_new(). Metadata and marks are passed on to inner,
+//! status of inner is appended to status of stage.
+//! @param stream stage stream object.
+//! @param inner stream wrapped by stage, owned by driver, may be NULL.
+void stream_stage_init(stream_t *stream, stream_t *inner);
+
 //! Get stream samples count
 //! @param stream output stream object.
 ssize_t stream_count(stream_t *stream);
@@ -200,6 +454,49 @@ int streams_add(streams_t *streams, stream_t *stream);
 //! @param index which will be removed
 int streams_remove(streams_t *streams, unsigned int index);
 
+//! Write samples to all streams. Samples are converted once per chunk
+//! for every format in use. Result of every stream is kept in result[].
+//! Multichannel streams take samples as frames, the ones sample_count is
+//! not multiple of channels for fail with errno EINVAL.
+//! @param streams output streams object.
+//! @param samples array of native samples.
+//! @param sample_count number of samples.
+//! @return sample_count or result of first failed stream.
+int streams_write(streams_t *streams, int16_t *samples, unsigned sample_count);
+
+//! Submit samples to all streams. Samples are copied and converted once
+//! per chunk for every format in use, several chunks are in flight and
+//! written by streams in background. result[] has failure
+//! of submit or of completions taken meanwhile. Multichannel streams
+//! take samples as frames, as by streams_write().
+//! @param streams output streams object.
+//! @param samples array of native samples.
+//! @param sample_count number of samples.
+//! @return sample_count or first failure.
+int streams_submit(streams_t *streams, int16_t *samples, unsigned sample_count);
+
+//! Take completions of streams_submit(), does not block.
+//! @param streams output streams object.
+//! @return 1 or first failure, failures are kept in result[].
+int streams_reap(streams_t *streams);
+
+//! Wait till all submitted chunks are written.
+//! @param streams output streams object.
+//! @return 1 or first failure, failures are kept in result[].
+int streams_flush(streams_t *streams);
+
+//! Attach metadata to all streams which support it.
+//! @param streams output streams object.
+//! @param key metadata name.
+//! @param value metadata value.
+void streams_set_meta(streams_t *streams, const char *key, const char *value);
+
+//! Mark event in all streams which support it.
+//! @param streams output streams object.
+//! @param event event name.
+//! @param value optional event value or NULL.
+void streams_mark(streams_t *streams, const char *event, const char *value);
+
 //! Clean streams. Close and free memory
 //! @param streams output streams object.
 void streams_clean(streams_t *streams);
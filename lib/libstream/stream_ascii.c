@@ -10,6 +10,7 @@
 #include <limits.h>
 #include <ctype.h>
 #include <math.h>
+#include <endian.h>
 
 #include <stream.h>
 
@@ -86,6 +87,11 @@ static int stream_impl_open(stream_t *stream)
     struct private_data_t *pdata = stream->pdata;
     int rc = 0;
 
+    /* any format can be printed, but only int16_t parsed */
+    if (stream->sample_size != stream_format_size(stream->format)
+            || (stream->direction == STREAM_INPUT && stream->format != STREAM_FORMAT_S16LE))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+
     errno = 0;
     if (stream->direction == STREAM_OUTPUT) {
         pdata->fp = fopen(stream->args, "w");
@@ -241,9 +247,27 @@ static int stream_impl_write(stream_t *stream, void* samples, unsigned int sampl
     if (stream->direction == STREAM_INPUT)
         STREAM_RETURN_ERROR("writing file", ENOTSUP);
 
-    for (i = 0; i < sample_count; i++)
-        if (fprintf (pdata->fp, "%d\n", ((int16_t*)samples)[i]) < 0)
+    for (i = 0; i < sample_count; i++) {
+        int rc;
+
+        /* text has no byte order, s16be prints values */
+        switch (stream->format) {
+            case STREAM_FORMAT_S16BE:
+                rc = fprintf(pdata->fp, "%d\n", (int16_t)be16toh(((uint16_t*)samples)[i]));
+                break;
+            case STREAM_FORMAT_F32:
+                rc = fprintf(pdata->fp, "%.6f\n", ((float*)samples)[i]);
+                break;
+            case STREAM_FORMAT_ULAW:
+                rc = fprintf(pdata->fp, "%u\n", ((uint8_t*)samples)[i]);
+                break;
+            default:
+                rc = fprintf(pdata->fp, "%d\n", ((int16_t*)samples)[i]);
+                break;
+        }
+        if (rc < 0)
             STREAM_RETURN_ERROR("writing file", errno);
+    }
 
     return sample_count;
 }
@@ -0,0 +1,447 @@
+//*************************************************************************
+// Asynchronous writes: submit now, take completion later                 *
+//*************************************************************************
+
+/* Drivers which never block, like tcp in connect mode or shm, implement
+ * submit_write and report completion by stream_complete(). Any other
+ * stream gets a worker thread on first submit, which calls plain write,
+ * so synchronous drivers work unchanged. Completions of both are queued
+ * here and signalled by eventfd. */
+
+// ISO C headers.
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// POSIX headers.
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <stream.h>
+#include <stream_async.h>
+
+/* submitted and not yet reaped writes per stream */
+#define STREAM_ASYNC_DEPTH 16
+/* chunks of streams_submit() in flight */
+#define STREAMS_ASYNC_CHUNKS 8
+
+struct stream_async_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int thread_started;
+    int quit;
+    // Readable while completions wait for stream_poll_completion().
+    int efd;
+
+    // Requests of worker thread.
+    struct {
+        void *samples;
+        unsigned count;
+        void *tag;
+        // Samples are in format of stream already.
+        int encoded;
+    } req[STREAM_ASYNC_DEPTH];
+    unsigned req_head;
+    unsigned req_tail;
+
+    stream_completion_t comp[STREAM_ASYNC_DEPTH];
+    unsigned comp_head;
+    unsigned comp_tail;
+
+    // Submitted and not reaped, bounds both rings.
+    unsigned inflight;
+};
+
+struct streams_chunk_t
+{
+    unsigned refs;
+    // Samples encoded once for all streams of the format, NULL if unused.
+    void *conv[STREAM_FORMATS];
+    int16_t samples[];
+};
+
+static struct stream_async_t* stream_async_get(stream_t *stream)
+{
+    struct stream_async_t *a = stream->async;
+
+    if (a)
+        return a;
+    a = calloc(1, sizeof(*a));
+    if (!a)
+        return NULL;
+    a->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (a->efd < 0) {
+        free(a);
+        return NULL;
+    }
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    stream->async = a;
+    return a;
+}
+
+/* under lock */
+static void stream_async_push(struct stream_async_t *a, void *tag, int result)
+{
+    a->comp[a->comp_head % STREAM_ASYNC_DEPTH].tag = tag;
+    a->comp[a->comp_head % STREAM_ASYNC_DEPTH].result = result;
+    a->comp_head++;
+    eventfd_write(a->efd, 1);
+    pthread_cond_broadcast(&a->cond);
+}
+
+static void* stream_async_worker(void *arg)
+{
+    stream_t *stream = arg;
+    struct stream_async_t *a = stream->async;
+
+    pthread_mutex_lock(&a->lock);
+    for (;;) {
+        unsigned i;
+        int rc;
+
+        while (a->req_tail == a->req_head && !a->quit)
+            pthread_cond_wait(&a->cond, &a->lock);
+        if (a->req_tail == a->req_head)
+            break;
+
+        /* request stays in ring till written, stream_async_sync() waits for it */
+        i = a->req_tail % STREAM_ASYNC_DEPTH;
+        pthread_mutex_unlock(&a->lock);
+        if (a->req[i].encoded)
+            rc = stream->write(stream, a->req[i].samples, a->req[i].count);
+        else
+            rc = stream_write_now(stream, a->req[i].samples, a->req[i].count);
+        pthread_mutex_lock(&a->lock);
+
+        a->req_tail++;
+        stream_async_push(a, a->req[i].tag, rc);
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+void stream_async_sync(stream_t *stream)
+{
+    struct stream_async_t *a = stream->async;
+
+    if (!a || !a->thread_started)
+        return;
+    pthread_mutex_lock(&a->lock);
+    while (a->req_tail != a->req_head)
+        pthread_cond_wait(&a->cond, &a->lock);
+    pthread_mutex_unlock(&a->lock);
+}
+
+void stream_async_stop(stream_t *stream)
+{
+    struct stream_async_t *a = stream->async;
+
+    if (!a || !a->thread_started)
+        return;
+    pthread_mutex_lock(&a->lock);
+    a->quit = 1;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+    pthread_join(a->thread, NULL);
+    a->thread_started = 0;
+    a->quit = 0;
+}
+
+void stream_async_free(stream_t *stream)
+{
+    struct stream_async_t *a = stream->async;
+
+    if (!a)
+        return;
+    stream_async_stop(stream);
+    close(a->efd);
+    pthread_cond_destroy(&a->cond);
+    pthread_mutex_destroy(&a->lock);
+    free(a);
+    stream->async = NULL;
+}
+
+void stream_complete(stream_t *stream, void *tag, int result)
+{
+    struct stream_async_t *a = stream->async;
+
+    pthread_mutex_lock(&a->lock);
+    stream_async_push(a, tag, result);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/* samples are int16_t, or in format of stream if encoded. Returns
+ * number of samples written at once, without completion, when there is
+ * no memory for the queue. */
+static int stream_submit(stream_t *stream, void *samples, unsigned sample_count, void *tag, int encoded)
+{
+    struct stream_async_t *a;
+    int rc = STREAM_ERROR_OP_NOT_SUPP;
+
+    a = stream_async_get(stream);
+    if (!a) {
+        rc = encoded ? stream->write(stream, samples, sample_count)
+                     : stream_write_now(stream, samples, sample_count);
+        return rc == 0 ? STREAM_ERROR : rc;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    if (a->inflight >= STREAM_ASYNC_DEPTH) {
+        pthread_mutex_unlock(&a->lock);
+        return STREAM_ERROR_OVERRUN;
+    }
+    a->inflight++;
+    pthread_mutex_unlock(&a->lock);
+
+    /* conversion of format would need buffer per request, worker does it */
+    if (stream->submit_write && stream->format == STREAM_FORMAT_S16LE && !a->thread_started)
+        rc = stream->submit_write(stream, samples, sample_count, tag);
+    if (rc != STREAM_ERROR_OP_NOT_SUPP) {
+        if (rc < 0) {
+            pthread_mutex_lock(&a->lock);
+            a->inflight--;
+            pthread_mutex_unlock(&a->lock);
+        }
+        return rc;
+    }
+
+    pthread_mutex_lock(&a->lock);
+    if (!a->thread_started) {
+        if (pthread_create(&a->thread, NULL, stream_async_worker, stream)) {
+            /* written at once, completion is queued as for the worker */
+            pthread_mutex_unlock(&a->lock);
+            rc = encoded ? stream->write(stream, samples, sample_count)
+                         : stream_write_now(stream, samples, sample_count);
+            pthread_mutex_lock(&a->lock);
+            stream_async_push(a, tag, rc);
+            pthread_mutex_unlock(&a->lock);
+            return STREAM_ERROR_NONE;
+        }
+        a->thread_started = 1;
+    }
+    a->req[a->req_head % STREAM_ASYNC_DEPTH].samples = samples;
+    a->req[a->req_head % STREAM_ASYNC_DEPTH].count = sample_count;
+    a->req[a->req_head % STREAM_ASYNC_DEPTH].tag = tag;
+    a->req[a->req_head % STREAM_ASYNC_DEPTH].encoded = encoded;
+    a->req_head++;
+    pthread_cond_broadcast(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+
+    return STREAM_ERROR_NONE;
+}
+
+int stream_submit_write(stream_t *stream, int16_t *samples, unsigned sample_count, void *tag)
+{
+    if (!stream)
+        return EINVAL;
+    if (!stream->write)
+        return ENOTSUP;
+    return stream_submit(stream, samples, sample_count, tag, 0);
+}
+
+/* under lock */
+static int stream_async_pop(struct stream_async_t *a, stream_completion_t *completions, unsigned max)
+{
+    eventfd_t cnt;
+    unsigned n = 0;
+
+    eventfd_read(a->efd, &cnt);
+    while (n < max && a->comp_tail != a->comp_head)
+        completions[n++] = a->comp[a->comp_tail++ % STREAM_ASYNC_DEPTH];
+    a->inflight -= n;
+    /* keep fd readable for the rest */
+    if (a->comp_tail != a->comp_head)
+        eventfd_write(a->efd, 1);
+    return n;
+}
+
+int stream_poll_completion(stream_t *stream, stream_completion_t *completions, unsigned max)
+{
+    struct stream_async_t *a;
+    int n;
+
+    if (!stream || !completions)
+        return STREAM_ERROR;
+    a = stream->async;
+    if (!a)
+        return 0;
+    pthread_mutex_lock(&a->lock);
+    n = stream_async_pop(a, completions, max);
+    pthread_mutex_unlock(&a->lock);
+    return n;
+}
+
+int stream_wait_completion(stream_t *stream, stream_completion_t *completions, unsigned max)
+{
+    struct stream_async_t *a;
+    int n;
+
+    if (!stream || !completions)
+        return STREAM_ERROR;
+    a = stream->async;
+    if (!a)
+        return 0;
+    pthread_mutex_lock(&a->lock);
+    while (a->comp_tail == a->comp_head && a->inflight > 0)
+        pthread_cond_wait(&a->cond, &a->lock);
+    n = stream_async_pop(a, completions, max);
+    pthread_mutex_unlock(&a->lock);
+    return n;
+}
+
+int stream_get_event_fd(stream_t *stream)
+{
+    struct stream_async_t *a;
+
+    if (!stream)
+        return -1;
+    a = stream_async_get(stream);
+    return a ? a->efd : -1;
+}
+
+/****************** streams_t ***********************/
+static void streams_chunk_put(streams_t *streams, struct streams_chunk_t *chunk)
+{
+    unsigned i;
+
+    if (--chunk->refs == 0) {
+        for (i = 0; i < STREAM_FORMATS; i++)
+            free(chunk->conv[i]);
+        free(chunk);
+        streams->chunks--;
+    }
+}
+
+/* Take completions of stream i, all of them if wait */
+static void streams_reap_stream(streams_t *streams, unsigned i, int wait)
+{
+    stream_completion_t comp[STREAM_ASYNC_DEPTH];
+    int n, k;
+
+    do {
+        if (wait)
+            n = stream_wait_completion(streams->streams[i], comp, STREAM_ASYNC_DEPTH);
+        else
+            n = stream_poll_completion(streams->streams[i], comp, STREAM_ASYNC_DEPTH);
+        for (k = 0; k < n; k++) {
+            if (comp[k].result <= 0 && streams->result[i] > 0)
+                streams->result[i] = comp[k].result;
+            streams_chunk_put(streams, comp[k].tag);
+        }
+    } while (wait && n > 0);
+}
+
+static int streams_result(streams_t *streams, int ok)
+{
+    unsigned i;
+
+    for (i = 0; i < streams->count; i++)
+        if (streams->result[i] <= 0) {
+            streams->error_index = i;
+            return streams->result[i];
+        }
+    return ok;
+}
+
+int streams_submit(streams_t *streams, int16_t *samples, unsigned sample_count)
+{
+    struct streams_chunk_t *chunk;
+    unsigned i;
+
+    if (!streams)
+        return EINVAL;
+    if (streams->count == 0 || sample_count == 0)
+        return sample_count;
+
+    for (i = 0; i < streams->count; i++)
+        streams->result[i] = sample_count;
+    /* oldest chunk blocks the rest, wait for its slowest stream */
+    for (i = 0; streams->chunks >= STREAMS_ASYNC_CHUNKS && i < streams->count; i++)
+        streams_reap_stream(streams, i, 1);
+
+    chunk = calloc(1, sizeof(*chunk) + (size_t)sample_count * sizeof(int16_t));
+    if (!chunk)
+        return streams_write(streams, samples, sample_count);
+    memcpy(chunk->samples, samples, (size_t)sample_count * sizeof(int16_t));
+    chunk->refs = 1;
+    streams->chunks++;
+
+    for (i = 0; i < streams->count; i++) {
+        stream_t *stream = streams->streams[i];
+        int format = stream->format;
+        void *buf = chunk->samples;
+        int encoded = 0, rc;
+
+        if (!stream->write) {
+            streams->result[i] = STREAM_ERROR;
+            continue;
+        }
+        /* part of frame cannot be written */
+        if (sample_count % stream->channels) {
+            errno = EINVAL;
+            streams->result[i] = STREAM_ERROR;
+            continue;
+        }
+        /* the first stream of format encodes chunk for the rest, without
+         * memory for it stream converts itself */
+        if (format != STREAM_FORMAT_S16LE) {
+            if (!chunk->conv[format]) {
+                chunk->conv[format] = malloc((size_t)sample_count * stream_format_size(format));
+                if (chunk->conv[format])
+                    stream_format_encode(format, chunk->samples, chunk->conv[format], sample_count);
+            }
+            if (chunk->conv[format]) {
+                buf = chunk->conv[format];
+                encoded = 1;
+            }
+        }
+
+        /* multichannel streams take samples as frames. Completions are
+         * taken by this thread only, so reference can follow submit */
+        rc = stream_submit(stream, buf, sample_count / stream->channels, chunk, encoded);
+        if (rc == STREAM_ERROR_NONE)
+            chunk->refs++;
+        else if (rc < 0)
+            streams->result[i] = rc;
+    }
+    streams_chunk_put(streams, chunk);
+
+    for (i = 0; i < streams->count; i++)
+        streams_reap_stream(streams, i, 0);
+    return streams_result(streams, sample_count);
+}
+
+int streams_reap(streams_t *streams)
+{
+    unsigned i;
+
+    if (!streams)
+        return EINVAL;
+    for (i = 0; i < streams->count; i++) {
+        streams->result[i] = 1;
+        streams_reap_stream(streams, i, 0);
+    }
+    return streams_result(streams, 1);
+}
+
+int streams_flush(streams_t *streams)
+{
+    unsigned i;
+
+    if (!streams)
+        return EINVAL;
+    for (i = 0; i < streams->count; i++) {
+        streams->result[i] = 1;
+        streams_reap_stream(streams, i, 1);
+    }
+    return streams_result(streams, 1);
+}
+
+void streams_async_drain(streams_t *streams, unsigned int index)
+{
+    streams_reap_stream(streams, index, 1);
+}
@@ -0,0 +1,20 @@
+//*************************************************************************
+// Asynchronous writes, internal interface of stream.c                    *
+//*************************************************************************
+
+#ifndef STREAM_ASYNC_H_INCLUDED_
+#define STREAM_ASYNC_H_INCLUDED_
+
+#include <stream.h>
+
+/* stream_write() without waiting for submitted writes, used by worker */
+int  stream_write_now(stream_t *stream, int16_t *samples, unsigned sample_count);
+/* wait till worker has written all submitted samples */
+void stream_async_sync(stream_t *stream);
+/* stop worker, submitted samples are written first */
+void stream_async_stop(stream_t *stream);
+void stream_async_free(stream_t *stream);
+/* take all completions of stream before it is removed */
+void streams_async_drain(streams_t *streams, unsigned int index);
+
+#endif
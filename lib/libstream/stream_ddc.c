@@ -0,0 +1,641 @@
+//*************************************************************************
+// Digital down-converter: real samples to complex baseband               *
+//*************************************************************************
+
+/* args: ddc:<center>,<decimation>[,ci16|cf32][,<threads>]:<driver>:<args>
+ *
+ * Output only. Samples are mixed with NCO at <center> Hz (optional 'k'
+ * suffix), decimated by CIC of order 4 by <decimation> / 2 and by FIR
+ * by 2. Inner stream gets interleaved I/Q: ci16 (default, 4 bytes per
+ * sample) or cf32 (8 bytes), at fs / <decimation>. Usable bandwidth is
+ * about 0.78 * fs / <decimation> around center, CIC droop at the edges
+ * is up to 2 dB. Full scale tone at center gives full scale magnitude.
+ *
+ * With <threads> > 1 chunks of input are converted in parallel. Every
+ * chunk starts from zero state preceded by enough input to fill it,
+ * NCO phase comes from absolute sample index and CIC is exact integer
+ * arithmetic, so output is the same as with one thread. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <stream.h>
+#include <stream_dsp.h>
+
+#define DDC_CIC_ORDER     4
+#define DDC_FIR_TAPS      95
+#define DDC_FIR_PAD       96
+// NCO recurrence restarts at multiples of it, so it depends on index only.
+#define DDC_NCO_RESYNC    1024
+// CIC output must fit in 64 bits: 2^30 * (decimation / 2)^4.
+#define DDC_DECIM_MAX     512
+#define DDC_CHUNK         16384
+#define DDC_THREADS_MAX   16
+
+enum {
+    DDC_CI16
+    ,DDC_CF32
+};
+
+enum {
+    BLOCK_FREE
+    ,BLOCK_READY
+    ,BLOCK_BUSY
+    ,BLOCK_DONE
+};
+
+struct ddc_state_t
+{
+    // Absolute index of next input sample.
+    uint64_t index;
+    uint64_t integ[2][DDC_CIC_ORDER];
+    uint64_t comb[2][DDC_CIC_ORDER];
+    // CIC outputs, every value stored twice for contiguous FIR window.
+    float fifo[2][2 * DDC_FIR_PAD];
+    unsigned pos;
+    // NCO phasor at index, if nco_valid.
+    double zr;
+    double zi;
+    int nco_valid;
+};
+
+struct ddc_block_t
+{
+    int state;
+    // Warm up samples followed by samples to convert.
+    int16_t *in;
+    unsigned nwarm;
+    unsigned nin;
+    uint64_t first;
+    // Interleaved I/Q.
+    float *out;
+    unsigned nout;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    stream_t *inner;
+    double center;
+    unsigned decim;
+    unsigned R;
+    int format;
+    unsigned nthreads;
+
+    uint64_t nco_step;
+    float taps[DDC_FIR_PAD];
+
+    // One thread: state kept between writes.
+    struct ddc_state_t st;
+    float *out;
+    int16_t *obuf;
+
+    // Threads: ring of chunks, as in lpc: driver.
+    struct ddc_block_t *blocks;
+    unsigned nqueue;
+    unsigned chunk;
+    unsigned warm;
+    unsigned long long head, tail;
+    int16_t *warmbuf;
+    uint64_t next_first;
+    pthread_t *workers;
+    unsigned nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quit;
+};
+
+static int ddc_parse(struct private_data_t *pdata, const char *args, const char **inner)
+{
+    char *s = strdup(args), *tok, *p, *end;
+    int rc = -1, n = 0;
+
+    pdata->format = DDC_CI16;
+    pdata->nthreads = 1;
+
+    p = strchr(s, ':');
+    if (!p || !p[1])
+        goto ddc_parse_end;
+    *p = 0;
+    *inner = args + (p - s) + 1;
+
+    for (p = s; (tok = strsep(&p, ",")) != NULL; n++) {
+        if (n == 0) {
+            pdata->center = strtod(tok, &end);
+            if (*end == 'k' || *end == 'K') {
+                pdata->center *= 1000.;
+                end++;
+            }
+        } else if (n == 1) {
+            pdata->decim = strtoul(tok, &end, 10);
+        } else if (!strcmp(tok, "ci16")) {
+            pdata->format = DDC_CI16;
+            continue;
+        } else if (!strcmp(tok, "cf32")) {
+            pdata->format = DDC_CF32;
+            continue;
+        } else {
+            pdata->nthreads = strtoul(tok, &end, 10);
+        }
+        if (end == tok || *end)
+            goto ddc_parse_end;
+    }
+    if (n >= 2 && pdata->center >= 0. && pdata->decim >= 2 && pdata->decim <= DDC_DECIM_MAX
+            && pdata->decim % 2 == 0 && pdata->nthreads >= 1 && pdata->nthreads <= DDC_THREADS_MAX)
+        rc = 0;
+
+ddc_parse_end:
+    free(s);
+    return rc;
+}
+
+static void ddc_state_reset(struct ddc_state_t *st, uint64_t index)
+{
+    memset(st, 0, sizeof(*st));
+    st->index = index;
+}
+
+/* convert n samples, return number of complex outputs stored to out */
+static unsigned ddc_run(struct private_data_t *pdata, struct ddc_state_t *st, const int16_t *x, unsigned n, float *out)
+{
+    const unsigned R = pdata->R;
+    unsigned i = 0, nout = 0;
+
+    const double dth = (double)pdata->nco_step * (2 * M_PI / 18446744073709551616.0);
+    const double wr = cos(dth), wi = -sin(dth);
+
+    while (i < n) {
+        /* NCO: exact cos/sin at resync points, recurrence between them.
+         * Phasor depends on index only, so output does not depend on
+         * splitting to calls or threads */
+        unsigned len = DDC_NCO_RESYNC - st->index % DDC_NCO_RESYNC;
+        double zr = st->zr, zi = st->zi;
+        unsigned end;
+
+        if (len == DDC_NCO_RESYNC || !st->nco_valid) {
+            uint64_t base = st->index - st->index % DDC_NCO_RESYNC;
+            double th = (double)(base * pdata->nco_step) * (2 * M_PI / 18446744073709551616.0);
+            unsigned k;
+
+            zr = cos(th);
+            zi = -sin(th);
+            for (k = 0; k < DDC_NCO_RESYNC - len; k++) {
+                double t = zr * wr - zi * wi;
+
+                zi = zr * wi + zi * wr;
+                zr = t;
+            }
+        }
+
+        if (len > n - i)
+            len = n - i;
+        end = i + len;
+
+        for (; i < end; i++) {
+            double t;
+            unsigned s, c;
+
+            /* 2^15 * 2^15 full scale, CIC adds log2(R^4) bits */
+            st->integ[0][0] += (uint64_t)llrint(x[i] * zr * 32768.);
+            st->integ[1][0] += (uint64_t)llrint(x[i] * zi * 32768.);
+            for (s = 1; s < DDC_CIC_ORDER; s++) {
+                st->integ[0][s] += st->integ[0][s - 1];
+                st->integ[1][s] += st->integ[1][s - 1];
+            }
+
+            t  = zr * wr - zi * wi;
+            zi = zr * wi + zi * wr;
+            zr = t;
+
+            if (++st->index % R)
+                continue;
+
+            /* CIC output, FIR works on every second one */
+            for (c = 0; c < 2; c++) {
+                uint64_t v = st->integ[c][DDC_CIC_ORDER - 1];
+
+                for (s = 0; s < DDC_CIC_ORDER; s++) {
+                    uint64_t d = v - st->comb[c][s];
+
+                    st->comb[c][s] = v;
+                    v = d;
+                }
+                st->fifo[c][st->pos] = st->fifo[c][st->pos + DDC_FIR_PAD] = (float)(int64_t)v;
+            }
+            st->pos = (st->pos + 1) % DDC_FIR_PAD;
+
+            if ((st->index / R) % 2)
+                continue;
+            for (c = 0; c < 2; c++) {
+                const float *w = st->fifo[c] + st->pos;
+                float acc = 0.f;
+                unsigned k;
+
+                for (k = 0; k < DDC_FIR_PAD; k++)
+                    acc += w[k] * pdata->taps[k];
+                out[2 * nout + c] = acc;
+            }
+            nout++;
+        }
+        st->zr = zr;
+        st->zi = zi;
+        st->nco_valid = 1;
+    }
+    return nout;
+}
+
+static void *ddc_worker(void *arg)
+{
+    struct private_data_t *pdata = arg;
+    struct ddc_state_t *st = malloc(sizeof(*st));
+
+    pthread_mutex_lock(&pdata->lock);
+    for (;;) {
+        struct ddc_block_t *blk = NULL;
+        unsigned long long seq;
+
+        for (seq = pdata->tail; seq < pdata->head; seq++)
+            if (pdata->blocks[seq % pdata->nqueue].state == BLOCK_READY) {
+                blk = &pdata->blocks[seq % pdata->nqueue];
+                break;
+            }
+
+        if (!blk) {
+            if (pdata->quit)
+                break;
+            pthread_cond_wait(&pdata->cond, &pdata->lock);
+            continue;
+        }
+
+        blk->state = BLOCK_BUSY;
+        pthread_mutex_unlock(&pdata->lock);
+
+        /* outputs of warm up are dropped */
+        ddc_state_reset(st, blk->first - blk->nwarm);
+        ddc_run(pdata, st, blk->in, blk->nwarm, blk->out);
+        blk->nout = ddc_run(pdata, st, blk->in + blk->nwarm, blk->nin, blk->out);
+
+        pthread_mutex_lock(&pdata->lock);
+        blk->state = BLOCK_DONE;
+        pthread_cond_broadcast(&pdata->cond);
+    }
+    pthread_mutex_unlock(&pdata->lock);
+    free(st);
+
+    return NULL;
+}
+
+static int ddc_write_inner(stream_t *stream, float *out, unsigned nout)
+{
+    struct private_data_t *pdata = stream->pdata;
+    void *data = out;
+    int rc;
+
+    if (nout == 0)
+        return STREAM_ERROR_NONE;
+    if (pdata->format == DDC_CI16) {
+        dsp_float_to_s16(out, pdata->obuf, 2 * nout);
+        data = pdata->obuf;
+    }
+    rc = stream_write(pdata->inner, data, nout);
+    if (rc < 0) {
+        STREAM_SET_INNER_ERROR("writing inner stream");
+        return rc;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+/* write converted chunks in order. If wait_all, wait for all submitted
+ * chunks, otherwise only till there is a free one for filling */
+static int ddc_drain(stream_t *stream, int wait_all)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    pthread_mutex_lock(&pdata->lock);
+    while (pdata->tail < pdata->head) {
+        struct ddc_block_t *blk = &pdata->blocks[pdata->tail % pdata->nqueue];
+        int rc;
+
+        if (blk->state != BLOCK_DONE) {
+            if (!wait_all && pdata->blocks[pdata->head % pdata->nqueue].state == BLOCK_FREE)
+                break;
+            pthread_cond_wait(&pdata->cond, &pdata->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pdata->lock);
+
+        rc = ddc_write_inner(stream, blk->out, blk->nout);
+
+        pthread_mutex_lock(&pdata->lock);
+        blk->state = BLOCK_FREE;
+        blk->nin = 0;
+        pdata->tail++;
+        if (rc < 0) {
+            pthread_mutex_unlock(&pdata->lock);
+            return rc;
+        }
+    }
+    pthread_mutex_unlock(&pdata->lock);
+    return STREAM_ERROR_NONE;
+}
+
+static void ddc_submit(struct private_data_t *pdata)
+{
+    struct ddc_block_t *blk = &pdata->blocks[pdata->head % pdata->nqueue];
+    unsigned k = blk->nwarm + blk->nin < pdata->warm ? blk->nwarm + blk->nin : pdata->warm;
+
+    /* next chunk warms up on the end of this one */
+    memcpy(pdata->warmbuf + pdata->warm - k, blk->in + blk->nwarm + blk->nin - k, k * sizeof(int16_t));
+    pdata->next_first = blk->first + blk->nin;
+
+    pthread_mutex_lock(&pdata->lock);
+    blk->state = BLOCK_READY;
+    pdata->head++;
+    pthread_cond_broadcast(&pdata->cond);
+    pthread_mutex_unlock(&pdata->lock);
+}
+
+static int ddc_threads_start(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned i;
+
+    /* besides chunks for workers, one is filled and one written meanwhile */
+    pdata->nqueue = pdata->nthreads + 2;
+    pdata->blocks = calloc(pdata->nqueue, sizeof(struct ddc_block_t));
+    pdata->workers = calloc(pdata->nthreads, sizeof(pthread_t));
+    pdata->warmbuf = malloc(pdata->warm * sizeof(int16_t));
+    if (!pdata->blocks || !pdata->workers || !pdata->warmbuf)
+        STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+    for (i = 0; i < pdata->nqueue; i++) {
+        pdata->blocks[i].in  = malloc((pdata->warm + pdata->chunk) * sizeof(int16_t));
+        pdata->blocks[i].out = malloc((pdata->chunk / pdata->decim + 1) * 2 * sizeof(float));
+        if (!pdata->blocks[i].in || !pdata->blocks[i].out)
+            STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+    }
+    pdata->head = pdata->tail = 0;
+    pdata->next_first = 0;
+    pdata->quit = 0;
+
+    pthread_mutex_init(&pdata->lock, NULL);
+    pthread_cond_init(&pdata->cond, NULL);
+    for (i = 0; i < pdata->nthreads; i++)
+        if (pthread_create(&pdata->workers[i], NULL, ddc_worker, pdata) != 0)
+            break;
+    pdata->nworkers = i;
+    if (pdata->nworkers == 0)
+        STREAM_RETURN_ERROR("starting threads", EAGAIN);
+
+    return STREAM_ERROR_NONE;
+}
+
+static void ddc_threads_stop(struct private_data_t *pdata)
+{
+    unsigned i;
+
+    if (pdata->nworkers) {
+        pthread_mutex_lock(&pdata->lock);
+        pdata->quit = 1;
+        pthread_cond_broadcast(&pdata->cond);
+        pthread_mutex_unlock(&pdata->lock);
+        for (i = 0; i < pdata->nworkers; i++)
+            pthread_join(pdata->workers[i], NULL);
+        pthread_mutex_destroy(&pdata->lock);
+        pthread_cond_destroy(&pdata->cond);
+        pdata->nworkers = 0;
+    }
+    if (pdata->blocks) {
+        for (i = 0; i < pdata->nqueue; i++) {
+            free(pdata->blocks[i].in);
+            free(pdata->blocks[i].out);
+        }
+    }
+    free(pdata->blocks);
+    free(pdata->workers);
+    free(pdata->warmbuf);
+    pdata->blocks = NULL;
+    pdata->workers = NULL;
+    pdata->warmbuf = NULL;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    float taps[DDC_FIR_TAPS];
+    double gain, cic_gain;
+    unsigned i, max_out;
+    char value[32];
+
+    if (stream->direction != STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("opening stream", ENOTSUP);
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+    if (pdata->center >= stream->fs / 2.)
+        STREAM_RETURN_ERROR("center frequency", EINVAL);
+
+    pdata->R = pdata->decim / 2;
+    pdata->nco_step = (uint64_t)llrint(pdata->center / stream->fs * 18446744073709551616.0 / 2) * 2;
+
+    /* decimate by 2, CIC and mixer gain go into taps */
+    dsp_fir_design(taps, DDC_FIR_TAPS, 0., 0.225, 1.);
+    cic_gain = pow(pdata->R, DDC_CIC_ORDER);
+    gain = 2. / (cic_gain * 32768. * 32768.);
+    memset(pdata->taps, 0, sizeof(pdata->taps));
+    for (i = 0; i < DDC_FIR_TAPS; i++)
+        pdata->taps[DDC_FIR_PAD - 1 - i] = taps[i] * gain;
+
+    stream_set_fs(pdata->inner, (stream->fs + pdata->decim / 2) / pdata->decim);
+    if (stream_set_sample_size(pdata->inner, pdata->format == DDC_CI16 ? 2 * sizeof(int16_t) : 2 * sizeof(float)) < 0)
+        STREAM_RETURN_ERROR("sample format of inner stream", EINVAL);
+    stream_set_nsamples(pdata->inner, stream->nsamples / pdata->decim);
+    /* containers keep how to read the samples, others ignore it */
+    stream_set_meta(pdata->inner, "format", pdata->format == DDC_CI16 ? "ci16" : "cf32");
+    snprintf(value, sizeof(value), "%.3f", pdata->center);
+    stream_set_meta(pdata->inner, "ddc_center", value);
+    snprintf(value, sizeof(value), "%u", pdata->decim);
+    stream_set_meta(pdata->inner, "ddc_decimation", value);
+
+    if (stream_open(pdata->inner)) {
+        STREAM_SET_INNER_ERROR("opening inner stream");
+        return STREAM_ERROR;
+    }
+
+    /* warm up fills CIC, combs and FIR, chunks are whole output samples */
+    pdata->warm  = pdata->R * (2 * DDC_CIC_ORDER + DDC_FIR_PAD) + pdata->decim;
+    pdata->warm  = (pdata->warm + pdata->decim - 1) / pdata->decim * pdata->decim;
+    pdata->chunk = DDC_CHUNK > pdata->warm ? DDC_CHUNK : pdata->warm;
+    pdata->chunk = (pdata->chunk + pdata->decim - 1) / pdata->decim * pdata->decim;
+
+    ddc_state_reset(&pdata->st, 0);
+    max_out = (pdata->nthreads > 1 ? pdata->chunk : DSP_BLOCK) / pdata->decim + 1;
+    pdata->out  = malloc(max_out * 2 * sizeof(float));
+    pdata->obuf = malloc(max_out * 2 * sizeof(int16_t));
+    if (!pdata->out || !pdata->obuf) {
+        stream_close(pdata->inner);
+        STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+    }
+
+    if (pdata->nthreads > 1 && ddc_threads_start(stream) < 0) {
+        ddc_threads_stop(pdata);
+        stream_close(pdata->inner);
+        return STREAM_ERROR;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+
+    if (!pdata->out)
+        return STREAM_ERROR;
+
+    if (pdata->blocks) {
+        struct ddc_block_t *blk = &pdata->blocks[pdata->head % pdata->nqueue];
+
+        if (blk->state == BLOCK_FREE && blk->nin)
+            ddc_submit(pdata);
+        rc = ddc_drain(stream, 1);
+        ddc_threads_stop(pdata);
+    }
+    free(pdata->out);
+    free(pdata->obuf);
+    pdata->out = NULL;
+    pdata->obuf = NULL;
+
+    if (stream_close(pdata->inner) < 0 && rc == STREAM_ERROR_NONE) {
+        STREAM_SET_INNER_ERROR("closing inner stream");
+        rc = STREAM_ERROR;
+    }
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    ddc_threads_stop(pdata);
+    free(pdata->out);
+    free(pdata->obuf);
+    stream_free(pdata->inner);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    const int16_t *src = samples;
+    unsigned i, n;
+    int rc;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing to stream", ENOTSUP);
+
+    if (!pdata->blocks) {
+        for (i = 0; i < sample_count; i += n) {
+            n = sample_count - i < DSP_BLOCK ? sample_count - i : DSP_BLOCK;
+            rc = ddc_write_inner(stream, pdata->out, ddc_run(pdata, &pdata->st, src + i, n, pdata->out));
+            if (rc < 0)
+                return rc;
+        }
+        return sample_count;
+    }
+
+    for (i = 0; i < sample_count; i += n) {
+        struct ddc_block_t *blk = &pdata->blocks[pdata->head % pdata->nqueue];
+
+        if (blk->state != BLOCK_FREE) {
+            rc = ddc_drain(stream, 0);
+            if (rc < 0)
+                return rc;
+        }
+        if (blk->nin == 0) {
+            blk->first = pdata->next_first;
+            blk->nwarm = blk->first < pdata->warm ? blk->first : pdata->warm;
+            memcpy(blk->in, pdata->warmbuf + pdata->warm - blk->nwarm, blk->nwarm * sizeof(int16_t));
+        }
+        n = pdata->chunk - blk->nin;
+        if (n > sample_count - i)
+            n = sample_count - i;
+        memcpy(blk->in + blk->nwarm + blk->nin, src + i, n * sizeof(int16_t));
+        blk->nin += n;
+
+        if (blk->nin == pdata->chunk) {
+            ddc_submit(pdata);
+            rc = ddc_drain(stream, 0);
+            if (rc < 0)
+                return rc;
+        }
+    }
+    return sample_count;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+    snprintf(buf, len, "center %.0f Hz, decimation %u, %s", pdata->center, pdata->decim
+                     , pdata->format == DDC_CI16 ? "ci16" : "cf32");
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    STREAM_RETURN_ERROR("stream count", ENOTSUP);
+}
+
+int stream_impl_ddc_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+    const char *inner;
+
+    if (ddc_parse(pdata, stream->args, &inner) < 0
+            || (pdata->inner = stream_new(stream->direction, (char *)inner)) == NULL) {
+        free(pdata);
+        return STREAM_ERROR;
+    }
+
+    stream->pdata = pdata;
+    stream_stage_init(stream, pdata->inner);
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "DDC", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
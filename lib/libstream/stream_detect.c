@@ -0,0 +1,702 @@
+//*************************************************************************
+// Matched filter detector in front of any other stream                   *
+//*************************************************************************
+
+/* args: detect:[<reference>][,<threshold>[,<events>[,<doppler>[,<hypotheses>[,<threads>]]]]][:<driver>:<args>]
+ *
+ * Samples are passed to inner stream unchanged, if there is one, and
+ * correlated with reference by FFT overlap-save. Reference file is read
+ * like the ref command does, first 1024 samples; without file name or
+ * with "-" it is taken from metadata "reference", which sdmsh sets to
+ * the last ref.
+ *
+ * Correlation is normalised by energy of reference and of signal under
+ * it, detection is the peak of correlation coefficient above threshold
+ * (default 0.5) within reference length. Every detection is reported as
+ * "<sample index> <peak> <SNR dB>", where sample index is position of
+ * reference start from the first sample of stream and SNR is peak power
+ * of correlation over its mean power in preceding blocks:
+ *     event "detect" marked in inner stream,
+ *     line in <events> file or on stderr without it (or if empty).
+ *
+ * With <doppler> in m/s there is a bank of references time scaled for
+ * radial speeds evenly spread in -<doppler>..<doppler>, positive is
+ * approaching. Default number of <hypotheses> keeps drift between
+ * neighbours over the reference below half a sample. Their spectra are
+ * made on open, every block is transformed once and correlated with all
+ * of them by <threads> (default 1, the writing one included). Detection
+ * is taken from the best hypothesis and its speed is added to report:
+ * "<sample index> <peak> <SNR dB> <doppler>". */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <stream.h>
+#include <stream_dsp.h>
+#include <stream_fft.h>
+
+#define DETECT_REF_MAX        1024
+#define DETECT_FFT_MIN        4096
+#define DETECT_THRESHOLD      0.5
+#define DETECT_SOUND_SPEED    1500.
+// Scaled reference fits in 2 * DETECT_REF_MAX.
+#define DETECT_DOPPLER_MAX    50.
+#define DETECT_HYP_MAX        65
+#define DETECT_THREADS_MAX    16
+// Half length of windowed sinc for time scaling.
+#define DETECT_INTERP_HALF    8
+
+// Doppler hypothesis: time scaled reference.
+struct detect_hyp_t
+{
+    // Radial speed, m/s.
+    double doppler;
+    unsigned len;
+    double energy;
+    // Conjugated spectrum of reference.
+    dsp_complex_t *ref_spec;
+    dsp_complex_t *spec;
+    // Correlation and its coefficient in block.
+    float *corr;
+    float *rho;
+    // Mean power of correlation in block and in preceding blocks.
+    double power;
+    double floor;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    stream_t *inner;
+    char ref_name[256];
+    char events_name[256];
+    FILE *events;
+    double threshold;
+    double doppler;
+    unsigned nthreads;
+
+    float ref[DETECT_REF_MAX];
+    unsigned ref_len;
+    struct detect_hyp_t hyp[DETECT_HYP_MAX];
+    unsigned nhyp;
+    // Longest reference of bank.
+    unsigned len_max;
+
+    dsp_fft_t *fft;
+    unsigned n;
+    // Spectrum of input block.
+    dsp_complex_t *spec;
+    // Input block and its cumulative energy.
+    float *seg;
+    double *cum;
+    unsigned fill;
+    // Start positions of block to check.
+    unsigned nvalid;
+    // Stream index of seg[0].
+    unsigned long long base;
+
+    // Hypotheses of block are taken by writer and workers from next.
+    pthread_t workers[DETECT_THREADS_MAX];
+    unsigned nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned next;
+    unsigned done;
+    int quit;
+
+    // Peak of detection in progress.
+    int active;
+    unsigned long long peak_index;
+    double peak_rho;
+    double peak_power;
+    double peak_floor;
+    double peak_doppler;
+    // No new detection before this index.
+    unsigned long long holdoff;
+
+    unsigned long detections;
+    unsigned long long last_index;
+    double last_rho;
+    double last_snr;
+    double last_doppler;
+};
+
+static int detect_parse(struct private_data_t *pdata, char *args, char **inner)
+{
+    char *colon = strchr(args, ':');
+    char *p = args, *tok, *end;
+    int n;
+
+    *inner = NULL;
+    if (colon) {
+        *colon = 0;
+        *inner = colon + 1;
+        if (!**inner)
+            return -1;
+    }
+    pdata->threshold = DETECT_THRESHOLD;
+    pdata->nthreads = 1;
+
+    for (n = 0; (tok = strsep(&p, ",")) != NULL; n++) {
+        if (n == 0) {
+            /* "-" is reference of session too */
+            if (strcmp(tok, "-"))
+                snprintf(pdata->ref_name, sizeof(pdata->ref_name), "%s", tok);
+            continue;
+        } else if (n == 2) {
+            snprintf(pdata->events_name, sizeof(pdata->events_name), "%s", tok);
+            continue;
+        } else if (!*tok) {
+            /* empty is default */
+            continue;
+        } else if (n == 1) {
+            pdata->threshold = strtod(tok, &end);
+        } else if (n == 3) {
+            pdata->doppler = strtod(tok, &end);
+        } else if (n == 4) {
+            pdata->nhyp = strtoul(tok, &end, 10);
+        } else if (n == 5) {
+            pdata->nthreads = strtoul(tok, &end, 10);
+        } else {
+            return -1;
+        }
+        if (end == tok || *end)
+            return -1;
+    }
+    if (pdata->threshold <= 0 || pdata->threshold >= 1
+            || pdata->doppler < 0 || pdata->doppler > DETECT_DOPPLER_MAX
+            || pdata->nhyp > DETECT_HYP_MAX
+            || pdata->nthreads < 1 || pdata->nthreads > DETECT_THREADS_MAX)
+        return -1;
+    return 0;
+}
+
+static int detect_load_reference(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int16_t ref[DETECT_REF_MAX];
+    stream_t *src;
+    int rc;
+
+    if (!pdata->ref_name[0])
+        STREAM_RETURN_ERROR("no reference, ref command or file name is needed", EINVAL);
+    src = stream_new(STREAM_INPUT, pdata->ref_name);
+    if (!src)
+        STREAM_RETURN_ERROR("creating reference stream", EINVAL);
+    if (stream_open(src)) {
+        pdata->error = stream_get_errno(src);
+        stream_free(src);
+        STREAM_RETURN_ERROR("opening reference", pdata->error);
+    }
+    rc = stream_read(src, ref, DETECT_REF_MAX);
+    stream_close(src);
+    stream_free(src);
+    if (rc <= 0)
+        STREAM_RETURN_ERROR("reading reference", EINVAL);
+
+    /* leading and trailing zeros of padded reference shift index only */
+    pdata->ref_len = rc;
+    while (pdata->ref_len > 0 && ref[pdata->ref_len - 1] == 0)
+        pdata->ref_len--;
+    if (pdata->ref_len == 0)
+        STREAM_RETURN_ERROR("reference is silent", EINVAL);
+    dsp_s16_to_float(ref, pdata->ref, pdata->ref_len);
+    return STREAM_ERROR_NONE;
+}
+
+/* Reference of hypothesis h, received from source moving with speed v is
+ * r(t * (1 + v / c)), made by Hann windowed sinc. Returns its length */
+static unsigned detect_hyp_ref(struct private_data_t *pdata, unsigned h, float *out)
+{
+    double a = 1. + pdata->hyp[h].doppler / DETECT_SOUND_SPEED;
+    unsigned n, k;
+    int j;
+
+    if (pdata->hyp[h].doppler == 0) {
+        memcpy(out, pdata->ref, pdata->ref_len * sizeof(float));
+        return pdata->ref_len;
+    }
+    n = (unsigned)((pdata->ref_len - 1) / a) + 1;
+    for (k = 0; k < n; k++) {
+        double t = k * a;
+        int i0 = (int)floor(t);
+        double frac = t - i0, sum = 0;
+
+        for (j = 1 - DETECT_INTERP_HALF; j <= DETECT_INTERP_HALF; j++) {
+            double x = j - frac;
+
+            if (i0 + j < 0 || i0 + j >= (int)pdata->ref_len)
+                continue;
+            sum += pdata->ref[i0 + j] * (0.5 + 0.5 * cos(M_PI * x / DETECT_INTERP_HALF))
+                * (fabs(x) < 1e-9 ? 1. : sin(M_PI * x) / (M_PI * x));
+        }
+        out[k] = sum;
+    }
+    return n;
+}
+
+/* Speeds, lengths and energies of bank */
+static int detect_bank_setup(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    float ref[2 * DETECT_REF_MAX];
+    unsigned h, i;
+
+    if (pdata->doppler == 0) {
+        pdata->nhyp = 1;
+    } else if (pdata->nhyp == 0) {
+        double step = DETECT_SOUND_SPEED * 0.5 / pdata->ref_len;
+
+        pdata->nhyp = 2 * (unsigned)ceil(pdata->doppler / step) + 1;
+        if (pdata->nhyp > DETECT_HYP_MAX)
+            pdata->nhyp = DETECT_HYP_MAX;
+    }
+
+    pdata->len_max = 0;
+    for (h = 0; h < pdata->nhyp; h++) {
+        struct detect_hyp_t *hyp = &pdata->hyp[h];
+
+        hyp->doppler = pdata->nhyp > 1 ? pdata->doppler * (2. * h / (pdata->nhyp - 1) - 1.) : 0;
+        hyp->len = detect_hyp_ref(pdata, h, ref);
+        hyp->energy = 0;
+        for (i = 0; i < hyp->len; i++)
+            hyp->energy += (double)ref[i] * ref[i];
+        if (hyp->energy == 0)
+            STREAM_RETURN_ERROR("reference is silent", EINVAL);
+        if (hyp->len > pdata->len_max)
+            pdata->len_max = hyp->len;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static void detect_report(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char value[96];
+    int n;
+
+    pdata->detections++;
+    pdata->last_index = pdata->peak_index;
+    pdata->last_rho = pdata->peak_rho;
+    pdata->last_snr = pdata->peak_floor > 0 ? 10 * log10(pdata->peak_power / pdata->peak_floor) : 0;
+    pdata->last_doppler = pdata->peak_doppler;
+
+    n = snprintf(value, sizeof(value), "%llu %.3f %.1f", pdata->last_index, pdata->last_rho, pdata->last_snr);
+    if (pdata->nhyp > 1)
+        snprintf(value + n, sizeof(value) - n, " %.2f", pdata->last_doppler);
+    if (pdata->inner)
+        stream_mark(pdata->inner, "detect", value);
+    if (pdata->events) {
+        fprintf(pdata->events, "%s\n", value);
+        fflush(pdata->events);
+    } else if (pdata->nhyp > 1) {
+        fprintf(stderr, "\ndetect: sample %llu peak %.3f SNR %.1f dB Doppler %.2f m/s\n"
+                , pdata->last_index, pdata->last_rho, pdata->last_snr, pdata->last_doppler);
+    } else {
+        fprintf(stderr, "\ndetect: sample %llu peak %.3f SNR %.1f dB\n"
+                , pdata->last_index, pdata->last_rho, pdata->last_snr);
+    }
+}
+
+/* Correlation coefficient of hypothesis h for start positions of block */
+static void detect_hyp_run(struct private_data_t *pdata, unsigned h)
+{
+    struct detect_hyp_t *hyp = &pdata->hyp[h];
+    unsigned L = hyp->len, i;
+    float scale = 1.f / pdata->n;
+    double power = 0;
+
+    dsp_fft_multiply(pdata->spec, hyp->ref_spec, hyp->spec, pdata->n / 2 + 1);
+    dsp_fft_inverse(pdata->fft, hyp->spec, hyp->corr);
+
+    /* nvalid <= n - len_max + 1 and L <= len_max: cum[i + L] is at most cum[n] */
+    for (i = 0; i < pdata->nvalid; i++) {
+        double c = hyp->corr[i] * scale;
+        double energy = pdata->cum[i + L] - pdata->cum[i];
+
+        hyp->corr[i] = c;
+        power += c * c;
+        /* below 1 LSB rms signal is silence */
+        hyp->rho[i] = energy > L * 1e-10 ? c / sqrt(hyp->energy * energy) : 0;
+    }
+    hyp->power = pdata->nvalid ? power / pdata->nvalid : 0;
+}
+
+static void *detect_worker(void *arg)
+{
+    struct private_data_t *pdata = arg;
+
+    pthread_mutex_lock(&pdata->lock);
+    for (;;) {
+        unsigned h;
+
+        while (pdata->next >= pdata->nhyp && !pdata->quit)
+            pthread_cond_wait(&pdata->cond, &pdata->lock);
+        if (pdata->quit)
+            break;
+        h = pdata->next++;
+        pthread_mutex_unlock(&pdata->lock);
+
+        detect_hyp_run(pdata, h);
+
+        pthread_mutex_lock(&pdata->lock);
+        if (++pdata->done == pdata->nhyp)
+            pthread_cond_broadcast(&pdata->cond);
+    }
+    pthread_mutex_unlock(&pdata->lock);
+    return NULL;
+}
+
+/* All hypotheses of block, writer takes them too */
+static void detect_bank_run(struct private_data_t *pdata)
+{
+    unsigned h;
+
+    if (!pdata->nworkers) {
+        for (h = 0; h < pdata->nhyp; h++)
+            detect_hyp_run(pdata, h);
+        return;
+    }
+    pthread_mutex_lock(&pdata->lock);
+    pdata->next = pdata->done = 0;
+    pthread_cond_broadcast(&pdata->cond);
+    while (pdata->next < pdata->nhyp) {
+        h = pdata->next++;
+        pthread_mutex_unlock(&pdata->lock);
+        detect_hyp_run(pdata, h);
+        pthread_mutex_lock(&pdata->lock);
+        pdata->done++;
+    }
+    while (pdata->done < pdata->nhyp)
+        pthread_cond_wait(&pdata->cond, &pdata->lock);
+    pthread_mutex_unlock(&pdata->lock);
+}
+
+/* Correlate block seg[0..fill), report peaks of first nvalid start positions */
+static void detect_block(stream_t *stream, unsigned nvalid)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned L = pdata->len_max, i, h;
+
+    if (pdata->fill < pdata->n)
+        memset(pdata->seg + pdata->fill, 0, (pdata->n - pdata->fill) * sizeof(float));
+    pdata->cum[0] = 0;
+    for (i = 0; i < pdata->n; i++)
+        pdata->cum[i + 1] = pdata->cum[i] + (double)pdata->seg[i] * pdata->seg[i];
+    dsp_fft_forward(pdata->fft, pdata->seg, pdata->spec);
+    pdata->nvalid = nvalid;
+    detect_bank_run(pdata);
+
+    /* the first block is its own noise floor */
+    for (h = 0; h < pdata->nhyp; h++)
+        if (pdata->hyp[h].floor == 0)
+            pdata->hyp[h].floor = pdata->hyp[h].power;
+
+    for (i = 0; i < nvalid; i++) {
+        unsigned long long index = pdata->base + i;
+        struct detect_hyp_t *best = &pdata->hyp[0];
+        double rho;
+
+        for (h = 1; h < pdata->nhyp; h++)
+            if (pdata->hyp[h].rho[i] > best->rho[i])
+                best = &pdata->hyp[h];
+        rho = best->rho[i];
+
+        if (pdata->active && index >= pdata->peak_index + L) {
+            detect_report(stream);
+            pdata->active = 0;
+            pdata->holdoff = pdata->peak_index + L;
+        }
+        if (rho >= pdata->threshold && index >= pdata->holdoff
+                && (!pdata->active || rho > pdata->peak_rho)) {
+            pdata->active = 1;
+            pdata->peak_index = index;
+            pdata->peak_rho = rho;
+            pdata->peak_power = (double)best->corr[i] * best->corr[i];
+            pdata->peak_floor = best->floor;
+            pdata->peak_doppler = best->doppler;
+        }
+    }
+    if (nvalid)
+        for (h = 0; h < pdata->nhyp; h++)
+            pdata->hyp[h].floor = 0.75 * pdata->hyp[h].floor + 0.25 * pdata->hyp[h].power;
+}
+
+static int detect_threads_start(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned i, n = pdata->nthreads - 1;
+
+    if (n > pdata->nhyp - 1)
+        n = pdata->nhyp - 1;
+    if (n == 0)
+        return STREAM_ERROR_NONE;
+    pthread_mutex_init(&pdata->lock, NULL);
+    pthread_cond_init(&pdata->cond, NULL);
+    /* nothing to take till the first block */
+    pdata->next = pdata->done = pdata->nhyp;
+    pdata->quit = 0;
+    for (i = 0; i < n; i++)
+        if (pthread_create(&pdata->workers[i], NULL, detect_worker, pdata) != 0)
+            break;
+    pdata->nworkers = i;
+    if (pdata->nworkers == 0) {
+        pthread_mutex_destroy(&pdata->lock);
+        pthread_cond_destroy(&pdata->cond);
+        STREAM_RETURN_ERROR("starting threads", EAGAIN);
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static void detect_threads_stop(struct private_data_t *pdata)
+{
+    unsigned i;
+
+    if (!pdata->nworkers)
+        return;
+    pthread_mutex_lock(&pdata->lock);
+    pdata->quit = 1;
+    pthread_cond_broadcast(&pdata->cond);
+    pthread_mutex_unlock(&pdata->lock);
+    for (i = 0; i < pdata->nworkers; i++)
+        pthread_join(pdata->workers[i], NULL);
+    pthread_mutex_destroy(&pdata->lock);
+    pthread_cond_destroy(&pdata->cond);
+    pdata->nworkers = 0;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned h;
+
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
+    if (detect_load_reference(stream) < 0 || detect_bank_setup(stream) < 0)
+        return STREAM_ERROR;
+
+    /* hop n - L + 1 is at least 3/4 of FFT */
+    pdata->n = DETECT_FFT_MIN;
+    while (pdata->n < 4 * pdata->len_max)
+        pdata->n *= 2;
+    pdata->fft = dsp_fft_get(pdata->n);
+    pdata->spec = malloc((pdata->n / 2 + 1) * sizeof(dsp_complex_t));
+    pdata->seg = calloc(pdata->n, sizeof(float));
+    pdata->cum = malloc((pdata->n + 1) * sizeof(double));
+    if (!pdata->fft || !pdata->spec || !pdata->seg || !pdata->cum)
+        STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+
+    for (h = 0; h < pdata->nhyp; h++) {
+        struct detect_hyp_t *hyp = &pdata->hyp[h];
+
+        hyp->ref_spec = malloc((pdata->n / 2 + 1) * sizeof(dsp_complex_t));
+        hyp->spec = malloc((pdata->n / 2 + 1) * sizeof(dsp_complex_t));
+        hyp->corr = malloc(pdata->n * sizeof(float));
+        hyp->rho = malloc(pdata->n * sizeof(float));
+        if (!hyp->ref_spec || !hyp->spec || !hyp->corr || !hyp->rho)
+            STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+
+        detect_hyp_ref(pdata, h, pdata->seg);
+        dsp_fft_reference(pdata->fft, pdata->seg, hyp->len, hyp->ref_spec);
+        hyp->floor = 0;
+    }
+    memset(pdata->seg, 0, pdata->n * sizeof(float));
+    pdata->fill = 0;
+    pdata->base = 0;
+    pdata->active = 0;
+    pdata->holdoff = 0;
+    pdata->detections = 0;
+
+    if (detect_threads_start(stream) < 0)
+        return STREAM_ERROR;
+
+    if (pdata->events_name[0]) {
+        pdata->events = fopen(pdata->events_name, "a");
+        if (!pdata->events)
+            STREAM_RETURN_ERROR("opening events file", errno);
+        fprintf(pdata->events, "# sample peak snr_db%s, reference %s, %u samples, fs %u\n"
+                , pdata->nhyp > 1 ? " doppler_m/s" : "", pdata->ref_name, pdata->ref_len, stream->fs);
+        if (pdata->nhyp > 1)
+            fprintf(pdata->events, "# %u hypotheses of Doppler -%g..%g m/s\n"
+                    , pdata->nhyp, pdata->doppler, pdata->doppler);
+    }
+
+    if (pdata->inner) {
+        stream_set_fs(pdata->inner, stream->fs);
+        stream_set_nsamples(pdata->inner, stream->nsamples);
+        if (stream_open(pdata->inner)) {
+            STREAM_SET_INNER_ERROR("opening inner stream");
+            return STREAM_ERROR;
+        }
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static void detect_release(struct private_data_t *pdata)
+{
+    unsigned h;
+
+    detect_threads_stop(pdata);
+    for (h = 0; h < DETECT_HYP_MAX; h++) {
+        free(pdata->hyp[h].ref_spec);
+        free(pdata->hyp[h].spec);
+        free(pdata->hyp[h].corr);
+        free(pdata->hyp[h].rho);
+        pdata->hyp[h].ref_spec = pdata->hyp[h].spec = NULL;
+        pdata->hyp[h].corr = pdata->hyp[h].rho = NULL;
+    }
+    dsp_fft_free(pdata->fft);
+    free(pdata->spec);
+    free(pdata->seg);
+    free(pdata->cum);
+    pdata->fft = NULL;
+    pdata->spec = NULL;
+    pdata->seg = NULL;
+    pdata->cum = NULL;
+    if (pdata->events)
+        fclose(pdata->events);
+    pdata->events = NULL;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    /* tail: start positions with the whole reference in stream */
+    if (pdata->seg && pdata->fill >= pdata->len_max)
+        detect_block(stream, pdata->fill - pdata->len_max + 1);
+    if (pdata->seg && pdata->active)
+        detect_report(stream);
+    pdata->active = 0;
+    detect_release(pdata);
+    return pdata->inner ? stream_close(pdata->inner) : STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    detect_release(pdata);
+    stream_free(pdata->inner);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    const int16_t *src = samples;
+    unsigned hop = pdata->n - pdata->len_max + 1;
+    unsigned i = 0;
+
+    while (i < sample_count) {
+        unsigned n = pdata->n - pdata->fill;
+
+        if (n > sample_count - i)
+            n = sample_count - i;
+        dsp_s16_to_float(src + i, pdata->seg + pdata->fill, n);
+        pdata->fill += n;
+        i += n;
+        if (pdata->fill == pdata->n) {
+            detect_block(stream, hop);
+            /* overlap-save: last L - 1 samples start next block */
+            memmove(pdata->seg, pdata->seg + hop, (pdata->n - hop) * sizeof(float));
+            pdata->fill = pdata->n - hop;
+            pdata->base += hop;
+        }
+    }
+
+    if (pdata->inner) {
+        int rc = stream_write(pdata->inner, samples, sample_count);
+
+        if (rc < 0) {
+            STREAM_SET_INNER_ERROR("writing inner stream");
+            return rc;
+        }
+    }
+    return sample_count;
+}
+
+static int stream_impl_set_meta(stream_t *stream, const char *key, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    /* reference of session is the default one */
+    if (!strcmp(key, "reference") && !pdata->ref_name[0])
+        snprintf(pdata->ref_name, sizeof(pdata->ref_name), "%s", value);
+    return pdata->inner ? stream_set_meta(pdata->inner, key, value) : STREAM_ERROR_NONE;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (pdata->detections && pdata->nhyp > 1)
+        snprintf(buf, len, "%lu detections, last at sample %llu peak %.3f SNR %.1f dB Doppler %.2f m/s"
+                , pdata->detections, pdata->last_index, pdata->last_rho, pdata->last_snr, pdata->last_doppler);
+    else if (pdata->detections)
+        snprintf(buf, len, "%lu detections, last at sample %llu peak %.3f SNR %.1f dB"
+                , pdata->detections, pdata->last_index, pdata->last_rho, pdata->last_snr);
+    else
+        snprintf(buf, len, "no detections");
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+int stream_impl_detect_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+    char *args = strdup(stream->args);
+    char *inner;
+
+    if (detect_parse(pdata, args, &inner) < 0
+            || (inner && (pdata->inner = stream_new(stream->direction, inner)) == NULL)) {
+        free(args);
+        free(pdata);
+        return STREAM_ERROR;
+    }
+    free(args);
+
+    stream->pdata = pdata;
+    stream_stage_init(stream, pdata->inner);
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->set_meta     = stream_impl_set_meta;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    strncpy(stream->name, "DETECT", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
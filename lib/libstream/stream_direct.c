@@ -0,0 +1,330 @@
+//*************************************************************************
+// Preallocated O_DIRECT capture file driver                              *
+//*************************************************************************
+
+// ISO C headers.
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stream.h>
+
+/* O_DIRECT requires buffer address, file offset and length to be aligned
+ * to the logical block size of the device. 4096 covers all common cases */
+#define DIRECT_ALIGN    4096
+#define DIRECT_BFR_SIZE (1024 * 1024)
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    int fd;
+    // O_DIRECT was accepted by filesystem.
+    int direct;
+
+    // Double buffer: one is filled by stream_write(), other is written by writer thread.
+    char *bfr[2];
+    int cur;
+    size_t fill;
+
+    // File offset of next buffer handed to writer.
+    off_t offset;
+    // Real stream length in bytes.
+    off_t length;
+
+    pthread_t writer;
+    int writer_started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Buffer index waiting for writer or -1.
+    int pending;
+    size_t pending_len;
+    off_t pending_offset;
+    // errno of last failed write in writer thread.
+    int writer_error;
+    int quit;
+};
+
+static int direct_pwrite(struct private_data_t *pdata, const char *buf, size_t len, off_t offset)
+{
+    ssize_t rc;
+
+    while (len > 0) {
+        rc = pwrite(pdata->fd, buf, len, offset);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buf    += rc;
+        len    -= rc;
+        offset += rc;
+    }
+
+    /* without O_DIRECT at least do not let page cache grow */
+    if (!pdata->direct)
+        posix_fadvise(pdata->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    return 0;
+}
+
+static void* direct_writer(void *arg)
+{
+    struct private_data_t *pdata = arg;
+
+    pthread_mutex_lock(&pdata->lock);
+    for (;;) {
+        int idx, rc;
+
+        while (pdata->pending < 0 && !pdata->quit)
+            pthread_cond_wait(&pdata->cond, &pdata->lock);
+
+        if (pdata->pending < 0)
+            break;
+
+        idx = pdata->pending;
+        pthread_mutex_unlock(&pdata->lock);
+
+        rc = direct_pwrite(pdata, pdata->bfr[idx], pdata->pending_len, pdata->pending_offset);
+
+        pthread_mutex_lock(&pdata->lock);
+        if (rc)
+            pdata->writer_error = rc;
+        pdata->pending = -1;
+        pthread_cond_broadcast(&pdata->cond);
+    }
+    pthread_mutex_unlock(&pdata->lock);
+
+    return NULL;
+}
+
+/* wait till writer thread is done with pending buffer. Return errno of writer */
+static int direct_wait_writer(struct private_data_t *pdata)
+{
+    int rc;
+
+    pthread_mutex_lock(&pdata->lock);
+    while (pdata->pending >= 0)
+        pthread_cond_wait(&pdata->cond, &pdata->lock);
+    rc = pdata->writer_error;
+    pthread_mutex_unlock(&pdata->lock);
+
+    return rc;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int i, rc;
+
+    if (stream->direction != STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("opening file", ENOTSUP);
+
+    pdata->direct = 1;
+    pdata->fd = open(stream->args, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    if (pdata->fd < 0 && errno == EINVAL) {
+        /* tmpfs and some others do not support O_DIRECT */
+        pdata->direct = 0;
+        pdata->fd = open(stream->args, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (pdata->fd < 0)
+        STREAM_RETURN_ERROR("opening file", errno);
+
+    if (stream->nsamples) {
+        off_t size = ALIGN_UP((off_t)stream->nsamples * stream->sample_size, DIRECT_ALIGN);
+
+        if (fallocate(pdata->fd, 0, 0, size) < 0 && errno != EOPNOTSUPP) {
+            STREAM_SET_ERROR("preallocating file", errno);
+            goto stream_impl_open_error;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (posix_memalign((void **)&pdata->bfr[i], DIRECT_ALIGN, DIRECT_BFR_SIZE) != 0) {
+            STREAM_SET_ERROR("allocating buffer", ENOMEM);
+            goto stream_impl_open_error;
+        }
+    }
+
+    pdata->cur = 0;
+    pdata->fill = 0;
+    pdata->offset = 0;
+    pdata->length = 0;
+    pdata->pending = -1;
+    pdata->writer_error = 0;
+    pdata->quit = 0;
+
+    pthread_mutex_init(&pdata->lock, NULL);
+    pthread_cond_init(&pdata->cond, NULL);
+    /* pthread_create() returns error code, errno is not set */
+    rc = pthread_create(&pdata->writer, NULL, direct_writer, pdata);
+    if (rc != 0) {
+        STREAM_SET_ERROR("starting writer thread", rc);
+        pthread_mutex_destroy(&pdata->lock);
+        pthread_cond_destroy(&pdata->cond);
+        goto stream_impl_open_error;
+    }
+    pdata->writer_started = 1;
+
+    return STREAM_ERROR_NONE;
+
+stream_impl_open_error:
+    for (i = 0; i < 2; i++) {
+        free(pdata->bfr[i]);
+        pdata->bfr[i] = NULL;
+    }
+    close(pdata->fd);
+    pdata->fd = -1;
+    return STREAM_ERROR;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = 0, i;
+
+    if (pdata->fd < 0)
+        return STREAM_ERROR_NONE;
+
+    if (pdata->writer_started) {
+        rc = direct_wait_writer(pdata);
+
+        pthread_mutex_lock(&pdata->lock);
+        pdata->quit = 1;
+        pthread_cond_broadcast(&pdata->cond);
+        pthread_mutex_unlock(&pdata->lock);
+        pthread_join(pdata->writer, NULL);
+        pdata->writer_started = 0;
+
+        pthread_mutex_destroy(&pdata->lock);
+        pthread_cond_destroy(&pdata->cond);
+    }
+
+    /* tail is padded up to alignment, ftruncate() will cut it */
+    if (rc == 0 && pdata->fill) {
+        size_t len = ALIGN_UP(pdata->fill, DIRECT_ALIGN);
+
+        memset(pdata->bfr[pdata->cur] + pdata->fill, 0, len - pdata->fill);
+        rc = direct_pwrite(pdata, pdata->bfr[pdata->cur], len, pdata->offset);
+    }
+
+    /* also after write error: padding of written blocks must not stay */
+    if (ftruncate(pdata->fd, pdata->length) < 0 && rc == 0)
+        rc = errno;
+
+    close(pdata->fd);
+    pdata->fd = -1;
+
+    for (i = 0; i < 2; i++) {
+        free(pdata->bfr[i]);
+        pdata->bfr[i] = NULL;
+    }
+
+    if (rc)
+        STREAM_RETURN_ERROR("closing file", rc);
+
+    return STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t len = (size_t)sample_count * stream->sample_size;
+    char *src = samples;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing file", ENOTSUP);
+
+    while (len > 0) {
+        size_t n = DIRECT_BFR_SIZE - pdata->fill;
+        int rc;
+
+        if (n > len)
+            n = len;
+        memcpy(pdata->bfr[pdata->cur] + pdata->fill, src, n);
+        pdata->fill   += n;
+        pdata->length += n;
+        src += n;
+        len -= n;
+
+        if (pdata->fill < DIRECT_BFR_SIZE)
+            break;
+
+        /* buffer is full: hand it to writer and switch to other one */
+        rc = direct_wait_writer(pdata);
+        if (rc)
+            STREAM_RETURN_ERROR("writing file", rc);
+
+        pthread_mutex_lock(&pdata->lock);
+        pdata->pending = pdata->cur;
+        pdata->pending_len = DIRECT_BFR_SIZE;
+        pdata->pending_offset = pdata->offset;
+        pthread_cond_broadcast(&pdata->cond);
+        pthread_mutex_unlock(&pdata->lock);
+
+        pdata->offset += DIRECT_BFR_SIZE;
+        pdata->cur ^= 1;
+        pdata->fill = 0;
+    }
+
+    return sample_count;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    STREAM_RETURN_ERROR("counting samples in file", ENOTSUP);
+}
+
+int stream_impl_direct_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+
+    pdata->fd = -1;
+    stream->pdata = pdata;
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "DIRECT", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,547 @@
+//*************************************************************************
+// Block based DSP kernels used by processing stream stages               *
+//*************************************************************************
+
+// ISO C headers.
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <stream_dsp.h>
+
+struct dsp_resampler_t
+{
+    unsigned L;
+    unsigned M;
+    // Taps per phase and its padding to multiple of 4.
+    unsigned ntaps;
+    unsigned ntaps_pad;
+    // L phases of ntaps_pad reversed coefficients.
+    float *taps;
+    // History of ntaps_pad - 1 samples followed by current block.
+    float *work;
+    // Delay of prototype filter at L * fs.
+    unsigned delay;
+    // Next output: newest input sample in block and its phase.
+    unsigned long next;
+    unsigned phase;
+};
+
+struct dsp_fir_t
+{
+    // Reversed coefficients, padded with zeros to multiple of 4.
+    float *taps;
+    unsigned ntaps;
+    unsigned ntaps_pad;
+    // History of ntaps_pad - 1 samples followed by current block.
+    float *work;
+};
+
+/* n is multiple of 4 */
+static inline float dsp_dot(const float *a, const float *b, unsigned n)
+{
+    unsigned k;
+#if defined(__SSE2__)
+    __m128 s = _mm_setzero_ps();
+
+    for (k = 0; k < n; k += 4)
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k)));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+#else
+    float acc = 0.f;
+
+    for (k = 0; k < n; k++)
+        acc += a[k] * b[k];
+    return acc;
+#endif
+}
+
+void dsp_s16_to_float(const int16_t *in, float *out, unsigned n)
+{
+    const float k = 1.0f / 32768.0f;
+    unsigned i = 0;
+
+#if defined(__SSE2__)
+    const __m128 vk = _mm_set1_ps(k);
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v  = _mm_loadu_si128((const __m128i *)(in + i));
+        /* sign extension: put 16 bits to high half, shift back */
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+        _mm_storeu_ps(out + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), vk));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), vk));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = in[i] * k;
+}
+
+void dsp_float_to_s16(const float *in, int16_t *out, unsigned n)
+{
+    unsigned i = 0;
+
+#if defined(__SSE2__)
+    const __m128 vk = _mm_set1_ps(32768.0f);
+
+    for (; i + 8 <= n; i += 8) {
+        /* cvtps rounds to nearest, packs saturates */
+        __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i), vk));
+        __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(in + i + 4), vk));
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        float v = rintf(in[i] * 32768.0f);
+
+        out[i] = v > 32767.0f ? 32767 : v < -32768.0f ? -32768 : (int16_t)v;
+    }
+}
+
+#if defined(__SSE2__)
+/* rows of 8x8 matrix of int16_t become its columns */
+static inline void dsp_transpose8_epi16(__m128i r[8])
+{
+    __m128i b[8], c[8];
+    unsigned k;
+
+    for (k = 0; k < 8; k += 2) {
+        b[k]     = _mm_unpacklo_epi16(r[k], r[k + 1]);
+        b[k + 1] = _mm_unpackhi_epi16(r[k], r[k + 1]);
+    }
+    for (k = 0; k < 8; k += 4) {
+        c[k]     = _mm_unpacklo_epi32(b[k],     b[k + 2]);
+        c[k + 1] = _mm_unpackhi_epi32(b[k],     b[k + 2]);
+        c[k + 2] = _mm_unpacklo_epi32(b[k + 1], b[k + 3]);
+        c[k + 3] = _mm_unpackhi_epi32(b[k + 1], b[k + 3]);
+    }
+    for (k = 0; k < 4; k++) {
+        r[2 * k]     = _mm_unpacklo_epi64(c[k], c[k + 4]);
+        r[2 * k + 1] = _mm_unpackhi_epi64(c[k], c[k + 4]);
+    }
+}
+#endif
+
+void dsp_interleave_s16(int16_t *const *planes, unsigned nch, int16_t *out, unsigned n)
+{
+    unsigned i = 0, c;
+
+#if defined(__SSE2__)
+    if (nch == 2) {
+        for (; i + 8 <= n; i += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+
+            _mm_storeu_si128((__m128i *)(out + 2 * i),     _mm_unpacklo_epi16(a, b));
+            _mm_storeu_si128((__m128i *)(out + 2 * i + 8), _mm_unpackhi_epi16(a, b));
+        }
+    } else if (nch > 2 && nch <= 8) {
+        /* 8 frames at a time: channels are rows, frames columns. Frame is
+         * stored as 8 samples, the spare ones are overwritten by the next
+         * frame, so the last store must stay inside out. */
+        for (; (size_t)(i + 7) * nch + 8 <= (size_t)n * nch; i += 8) {
+            __m128i r[8];
+
+            for (c = 0; c < 8; c++)
+                r[c] = c < nch ? _mm_loadu_si128((const __m128i *)(planes[c] + i)) : _mm_setzero_si128();
+            dsp_transpose8_epi16(r);
+            for (c = 0; c < 8; c++)
+                _mm_storeu_si128((__m128i *)(out + (size_t)(i + c) * nch), r[c]);
+        }
+    }
+#endif
+    /* channel outer: every plane is read sequentially */
+    for (c = 0; c < nch; c++) {
+        const int16_t *p = planes[c];
+        int16_t *o = out + c;
+        unsigned k;
+
+        for (k = i; k < n; k++)
+            o[k * nch] = p[k];
+    }
+}
+
+void dsp_deinterleave_s16(const int16_t *in, unsigned nch, int16_t **planes, unsigned n)
+{
+    unsigned i = 0, c;
+
+#if defined(__SSE2__)
+    if (nch == 2) {
+        for (; i + 8 <= n; i += 8) {
+            __m128i lo = _mm_loadu_si128((const __m128i *)(in + 2 * i));
+            __m128i hi = _mm_loadu_si128((const __m128i *)(in + 2 * i + 8));
+            /* even samples sign extended from low half of 32 bit, odd from high */
+            __m128i e = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16)
+                                      , _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+            __m128i o = _mm_packs_epi32(_mm_srai_epi32(lo, 16), _mm_srai_epi32(hi, 16));
+
+            _mm_storeu_si128((__m128i *)(planes[0] + i), e);
+            _mm_storeu_si128((__m128i *)(planes[1] + i), o);
+        }
+    } else if (nch > 2 && nch <= 8) {
+        /* 8 frames at a time, every one loaded as 8 samples with the head
+         * of the next frame; after transposition rows are channels */
+        for (; (size_t)(i + 7) * nch + 8 <= (size_t)n * nch; i += 8) {
+            __m128i r[8];
+
+            for (c = 0; c < 8; c++)
+                r[c] = _mm_loadu_si128((const __m128i *)(in + (size_t)(i + c) * nch));
+            dsp_transpose8_epi16(r);
+            for (c = 0; c < nch; c++)
+                _mm_storeu_si128((__m128i *)(planes[c] + i), r[c]);
+        }
+    }
+#endif
+    for (c = 0; c < nch; c++) {
+        const int16_t *p = in + c;
+        int16_t *o = planes[c];
+        unsigned k;
+
+        for (k = i; k < n; k++)
+            o[k] = p[k * nch];
+    }
+}
+
+uint64_t dsp_energy_s16(const int16_t *in, unsigned n)
+{
+    uint64_t sum = 0;
+    unsigned i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    uint64_t lanes[2];
+
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        /* pair of squares is up to 2^31, exact as unsigned 32 bits */
+        __m128i sq = _mm_madd_epi16(v, v);
+
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for (; i < n; i++)
+        sum += (int32_t)in[i] * in[i];
+    return sum;
+}
+
+void dsp_levels_s16(const int16_t *in, unsigned n, dsp_levels_t *lv)
+{
+    int mn = lv->count ? lv->min : INT16_MAX;
+    int mx = lv->count ? lv->max : INT16_MIN;
+    unsigned i = 0;
+
+#if defined(__SSE2__)
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i full = _mm_set1_epi16(INT16_MAX);
+    const __m128i low = _mm_set1_epi16(INT16_MIN);
+    __m128i vmin = _mm_set1_epi16(mn);
+    __m128i vmax = _mm_set1_epi16(mx);
+    int32_t lanes[4];
+    int16_t ext[8];
+    unsigned k;
+
+    while (i + 8 <= n) {
+        /* pair sums are up to 2^16, run of 2^14 fits int32 lanes */
+        unsigned end = n - i > 8 * 16384 ? i + 8 * 16384 : n;
+        __m128i sum = _mm_setzero_si128();
+        __m128i clip = _mm_setzero_si128();
+
+        for (; i + 8 <= end; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+            __m128i at_full = _mm_or_si128(_mm_cmpeq_epi16(v, full), _mm_cmpeq_epi16(v, low));
+
+            vmin = _mm_min_epi16(vmin, v);
+            vmax = _mm_max_epi16(vmax, v);
+            sum  = _mm_add_epi32(sum, _mm_madd_epi16(v, ones));
+            /* lanes of mask are -1 */
+            clip = _mm_sub_epi32(clip, _mm_madd_epi16(at_full, ones));
+        }
+        _mm_storeu_si128((__m128i *)lanes, sum);
+        lv->sum += (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        _mm_storeu_si128((__m128i *)lanes, clip);
+        lv->clipped += (unsigned)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    _mm_storeu_si128((__m128i *)ext, vmin);
+    for (k = 0; k < 8; k++)
+        mn = ext[k] < mn ? ext[k] : mn;
+    _mm_storeu_si128((__m128i *)ext, vmax);
+    for (k = 0; k < 8; k++)
+        mx = ext[k] > mx ? ext[k] : mx;
+#endif
+    for (; i < n; i++) {
+        mn = in[i] < mn ? in[i] : mn;
+        mx = in[i] > mx ? in[i] : mx;
+        lv->sum += in[i];
+        lv->clipped += in[i] == INT16_MAX || in[i] == INT16_MIN;
+    }
+    lv->energy += dsp_energy_s16(in, n);
+    if (n) {
+        lv->min = mn;
+        lv->max = mx;
+    }
+    lv->count += n;
+}
+
+void dsp_levels_add(dsp_levels_t *to, const dsp_levels_t *from)
+{
+    if (!from->count)
+        return;
+    if (!to->count || from->min < to->min)
+        to->min = from->min;
+    if (!to->count || from->max > to->max)
+        to->max = from->max;
+    to->count   += from->count;
+    to->sum     += from->sum;
+    to->energy  += from->energy;
+    to->clipped += from->clipped;
+}
+
+void dsp_scale(float *x, unsigned n, float gain)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++)
+        x[i] *= gain;
+}
+
+static double sinc(double x)
+{
+    return x == 0. ? 1. : sin(M_PI * x) / (M_PI * x);
+}
+
+void dsp_fir_design(float *taps, unsigned ntaps, double f1, double f2, double fs)
+{
+    double c = (ntaps - 1) / 2.;
+    double lo = f1 / fs, hi = f2 >= fs / 2 ? 0.5 : f2 / fs;
+    double fc, re = 0., im = 0., g;
+    unsigned i;
+
+    for (i = 0; i < ntaps; i++) {
+        double t = i - c;
+        /* Blackman window */
+        double w = ntaps == 1 ? 1. : 0.42 - 0.5 * cos(2 * M_PI * i / (ntaps - 1))
+                                          + 0.08 * cos(4 * M_PI * i / (ntaps - 1));
+
+        taps[i] = (2 * hi * sinc(2 * hi * t) - 2 * lo * sinc(2 * lo * t)) * w;
+    }
+
+    /* unity gain in the middle of passband */
+    fc = lo == 0. ? 0. : hi == 0.5 ? 0.5 : (lo + hi) / 2;
+    for (i = 0; i < ntaps; i++) {
+        re += taps[i] * cos(2 * M_PI * fc * i);
+        im -= taps[i] * sin(2 * M_PI * fc * i);
+    }
+    g = sqrt(re * re + im * im);
+    if (g > 0.)
+        for (i = 0; i < ntaps; i++)
+            taps[i] /= g;
+}
+
+dsp_fir_t *dsp_fir_new(const float *taps, unsigned ntaps)
+{
+    dsp_fir_t *fir = calloc(1, sizeof(*fir));
+    unsigned i;
+
+    if (!fir)
+        return NULL;
+    fir->ntaps = ntaps;
+    fir->ntaps_pad = (ntaps + 3) & ~3u;
+    fir->taps = calloc(fir->ntaps_pad, sizeof(float));
+    fir->work = calloc(fir->ntaps_pad - 1 + DSP_BLOCK, sizeof(float));
+    if (!fir->taps || !fir->work) {
+        dsp_fir_free(fir);
+        return NULL;
+    }
+    /* zero padding goes first, it meets the oldest history samples */
+    for (i = 0; i < ntaps; i++)
+        fir->taps[fir->ntaps_pad - 1 - i] = taps[i];
+
+    return fir;
+}
+
+void dsp_fir_free(dsp_fir_t *fir)
+{
+    if (!fir)
+        return;
+    free(fir->taps);
+    free(fir->work);
+    free(fir);
+}
+
+void dsp_fir_reset(dsp_fir_t *fir)
+{
+    memset(fir->work, 0, (fir->ntaps_pad - 1) * sizeof(float));
+}
+
+void dsp_fir_process(dsp_fir_t *fir, float *x, unsigned n)
+{
+    unsigned hist = fir->ntaps_pad - 1;
+    float *w = fir->work;
+    unsigned i;
+
+    memcpy(w + hist, x, n * sizeof(float));
+
+    /* y[i] = sum(taps_rev[k] * w[i + k]) */
+    for (i = 0; i < n; i++)
+        x[i] = dsp_dot(w + i, fir->taps, fir->ntaps_pad);
+
+    memmove(w, w + n, hist * sizeof(float));
+}
+
+void dsp_dc_init(dsp_dc_t *dc, double fc, double fs)
+{
+    dc->a  = exp(-2 * M_PI * fc / fs);
+    dc->x1 = 0.f;
+    dc->y1 = 0.f;
+}
+
+void dsp_dc_process(dsp_dc_t *dc, float *x, unsigned n)
+{
+    float a = dc->a, x1 = dc->x1, y1 = dc->y1;
+    unsigned i;
+
+    /* recursive, so kept scalar */
+    for (i = 0; i < n; i++) {
+        float v = x[i];
+
+        y1 = v - x1 + a * y1;
+        x1 = v;
+        x[i] = y1;
+    }
+    dc->x1 = x1;
+    dc->y1 = y1;
+}
+
+void dsp_biquad_notch(dsp_biquad_t *bq, double f, double q, double fs)
+{
+    double w0 = 2 * M_PI * f / fs;
+    double alpha = sin(w0) / (2 * q);
+    double a0 = 1 + alpha;
+
+    bq->b0 = 1 / a0;
+    bq->b1 = -2 * cos(w0) / a0;
+    bq->b2 = 1 / a0;
+    bq->a1 = -2 * cos(w0) / a0;
+    bq->a2 = (1 - alpha) / a0;
+    bq->z1 = bq->z2 = 0.f;
+}
+
+void dsp_biquad_process(dsp_biquad_t *bq, float *x, unsigned n)
+{
+    float z1 = bq->z1, z2 = bq->z2;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        float v = x[i];
+        float y = bq->b0 * v + z1;
+
+        z1 = bq->b1 * v - bq->a1 * y + z2;
+        z2 = bq->b2 * v - bq->a2 * y;
+        x[i] = y;
+    }
+    bq->z1 = z1;
+    bq->z2 = z2;
+}
+
+dsp_resampler_t *dsp_resampler_new(unsigned L, unsigned M, unsigned ntaps)
+{
+    dsp_resampler_t *rs = calloc(1, sizeof(*rs));
+    unsigned n, p, k;
+    double cutoff;
+    float *proto;
+
+    if (!rs)
+        return NULL;
+    /* decimation: filter spans the same time at output rate */
+    if (M > L)
+        ntaps = ntaps * ((M + L - 1) / L);
+    /* zeros flushing the filter fit in one block */
+    if (ntaps > DSP_BLOCK / 2)
+        ntaps = DSP_BLOCK / 2;
+
+    rs->L = L;
+    rs->M = M;
+    rs->ntaps = ntaps;
+    rs->ntaps_pad = (ntaps + 3) & ~3u;
+    n = ntaps * L;
+    rs->delay = (n - 1) / 2;
+    rs->taps = calloc((size_t)L * rs->ntaps_pad, sizeof(float));
+    rs->work = calloc(rs->ntaps_pad - 1 + DSP_BLOCK, sizeof(float));
+    proto = malloc(n * sizeof(float));
+    if (!rs->taps || !rs->work || !proto) {
+        free(proto);
+        dsp_resampler_free(rs);
+        return NULL;
+    }
+
+    /* prototype at rate L, input rate is 1. Cutoff is below the lower
+     * Nyquist frequency by half of Blackman transition band, 5.5 / ntaps */
+    cutoff = 0.5 * (L < M ? (double)L / M : 1.) - 2.75 / ntaps;
+    dsp_fir_design(proto, n, 0., cutoff, L);
+    for (p = 0; p < L; p++)
+        for (k = 0; k < ntaps; k++)
+            rs->taps[(size_t)p * rs->ntaps_pad + rs->ntaps_pad - 1 - k] = proto[p + k * L] * L;
+    free(proto);
+
+    dsp_resampler_reset(rs);
+    return rs;
+}
+
+void dsp_resampler_free(dsp_resampler_t *rs)
+{
+    if (!rs)
+        return;
+    free(rs->taps);
+    free(rs->work);
+    free(rs);
+}
+
+void dsp_resampler_reset(dsp_resampler_t *rs)
+{
+    memset(rs->work, 0, (rs->ntaps_pad - 1) * sizeof(float));
+    /* start at filter delay: output sample m is input at time m * M / L */
+    rs->next  = rs->delay / rs->L;
+    rs->phase = rs->delay % rs->L;
+}
+
+unsigned dsp_resampler_max_out(const dsp_resampler_t *rs, unsigned n)
+{
+    return (unsigned)(((unsigned long long)n * rs->L + rs->M - 1) / rs->M) + 1;
+}
+
+unsigned dsp_resampler_latency(const dsp_resampler_t *rs)
+{
+    return (rs->delay + rs->L - 1) / rs->L + 1;
+}
+
+unsigned dsp_resampler_process(dsp_resampler_t *rs, const float *in, unsigned n, float *out)
+{
+    unsigned hist = rs->ntaps_pad - 1;
+    float *w = rs->work;
+    unsigned nout = 0;
+
+    memcpy(w + hist, in, n * sizeof(float));
+
+    while (rs->next < n) {
+        out[nout++] = dsp_dot(w + rs->next, rs->taps + (size_t)rs->phase * rs->ntaps_pad, rs->ntaps_pad);
+        rs->phase += rs->M;
+        rs->next  += rs->phase / rs->L;
+        rs->phase %= rs->L;
+    }
+    rs->next -= n;
+
+    memmove(w, w + n, hist * sizeof(float));
+    return nout;
+}
@@ -0,0 +1,158 @@
+//*************************************************************************
+// Block based DSP kernels used by processing stream stages               *
+//*************************************************************************
+
+#ifndef STREAM_DSP_H_INCLUDED_
+#define STREAM_DSP_H_INCLUDED_
+
+#include <stdint.h>
+
+//! Number of samples stages process at once.
+#define DSP_BLOCK 4096
+
+typedef struct dsp_fir_t dsp_fir_t;
+typedef struct dsp_resampler_t dsp_resampler_t;
+
+//! One-pole DC blocker state.
+typedef struct dsp_dc_t
+{
+    float a;
+    float x1;
+    float y1;
+} dsp_dc_t;
+
+//! Levels of int16_t samples, accumulated over blocks.
+//! Zeroed structure is empty.
+typedef struct dsp_levels_t
+{
+    unsigned long long count;
+    int min;
+    int max;
+    int64_t sum;
+    uint64_t energy;
+    //! Samples at full scale, -32768 or 32767.
+    unsigned long long clipped;
+} dsp_levels_t;
+
+//! Biquad section state, transposed direct form II.
+typedef struct dsp_biquad_t
+{
+    float b0, b1, b2, a1, a2;
+    float z1, z2;
+} dsp_biquad_t;
+
+//! Convert int16_t samples to float, 1.0 is full scale.
+//! @param in input samples.
+//! @param out output samples.
+//! @param n number of samples.
+void dsp_s16_to_float(const int16_t *in, float *out, unsigned n);
+
+//! Convert float samples to int16_t with rounding and saturation.
+//! @param in input samples, 1.0 is full scale.
+//! @param out output samples.
+//! @param n number of samples.
+void dsp_float_to_s16(const float *in, int16_t *out, unsigned n);
+
+//! Interleave buffers per channel to frames.
+//! @param planes nch buffers of n samples.
+//! @param nch number of channels.
+//! @param out n frames of nch samples.
+//! @param n number of frames.
+void dsp_interleave_s16(int16_t *const *planes, unsigned nch, int16_t *out, unsigned n);
+
+//! Split frames to buffers per channel.
+//! @param in n frames of nch samples.
+//! @param nch number of channels.
+//! @param planes nch buffers for n samples.
+//! @param n number of frames.
+void dsp_deinterleave_s16(const int16_t *in, unsigned nch, int16_t **planes, unsigned n);
+
+//! Sum of squares of int16_t samples, exact.
+//! @param in samples.
+//! @param n number of samples.
+uint64_t dsp_energy_s16(const int16_t *in, unsigned n);
+
+//! Add block to levels: minimum, maximum, sum, energy and clipped samples.
+//! @param in samples.
+//! @param n number of samples.
+//! @param lv levels to update.
+void dsp_levels_s16(const int16_t *in, unsigned n, dsp_levels_t *lv);
+
+//! Add levels of other blocks.
+void dsp_levels_add(dsp_levels_t *to, const dsp_levels_t *from);
+
+//! Multiply samples by constant in place.
+void dsp_scale(float *x, unsigned n, float gain);
+
+//! Design windowed sinc FIR filter.
+//! @param taps output coefficients, ntaps values.
+//! @param ntaps number of taps, must be odd for highpass.
+//! @param f1 lower edge (Hz), 0 for lowpass.
+//! @param f2 upper edge (Hz), fs / 2 or more for highpass.
+//! @param fs sampling frequency (Hz).
+void dsp_fir_design(float *taps, unsigned ntaps, double f1, double f2, double fs);
+
+//! Create FIR filter.
+//! @param taps coefficients, copied.
+//! @param ntaps number of coefficients.
+//! @return filter or NULL if there is no memory.
+dsp_fir_t *dsp_fir_new(const float *taps, unsigned ntaps);
+
+//! Free FIR filter.
+void dsp_fir_free(dsp_fir_t *fir);
+
+//! Clear filter history.
+void dsp_fir_reset(dsp_fir_t *fir);
+
+//! Filter block of samples in place, history is kept between calls.
+//! @param fir filter.
+//! @param x samples.
+//! @param n number of samples, up to DSP_BLOCK.
+void dsp_fir_process(dsp_fir_t *fir, float *x, unsigned n);
+
+//! Initialise DC blocker.
+//! @param fc cutoff frequency (Hz).
+//! @param fs sampling frequency (Hz).
+void dsp_dc_init(dsp_dc_t *dc, double fc, double fs);
+
+//! Remove DC in place.
+void dsp_dc_process(dsp_dc_t *dc, float *x, unsigned n);
+
+//! Initialise biquad as notch filter.
+//! @param f notch frequency (Hz).
+//! @param q quality factor.
+//! @param fs sampling frequency (Hz).
+void dsp_biquad_notch(dsp_biquad_t *bq, double f, double q, double fs);
+
+//! Filter block of samples in place by biquad section.
+void dsp_biquad_process(dsp_biquad_t *bq, float *x, unsigned n);
+
+//! Create polyphase resampler changing rate by L / M.
+//! Output sample m is input at time m * M / L, filter delay is compensated.
+//! @param L interpolation factor.
+//! @param M decimation factor.
+//! @param ntaps taps per phase, multiplied by M / L when decimating.
+//! @return resampler or NULL if there is no memory.
+dsp_resampler_t *dsp_resampler_new(unsigned L, unsigned M, unsigned ntaps);
+
+//! Free resampler.
+void dsp_resampler_free(dsp_resampler_t *rs);
+
+//! Clear history, next input is the first one.
+void dsp_resampler_reset(dsp_resampler_t *rs);
+
+//! Maximum number of output samples for n input samples.
+unsigned dsp_resampler_max_out(const dsp_resampler_t *rs, unsigned n);
+
+//! Number of zero input samples flushing delayed tail of signal.
+unsigned dsp_resampler_latency(const dsp_resampler_t *rs);
+
+//! Resample block.
+//! @param rs resampler.
+//! @param in input samples.
+//! @param n number of input samples, up to DSP_BLOCK.
+//! @param out output, room for dsp_resampler_max_out(n) samples.
+//! @return number of output samples.
+unsigned dsp_resampler_process(dsp_resampler_t *rs, const float *in, unsigned n, float *out);
+
+#endif
@@ -0,0 +1,306 @@
+//*************************************************************************
+// Run program without shell, samples through its stdin or stdout        *
+//*************************************************************************
+
+/* args: exec:<program> [<arg> ...]
+ *
+ * Arguments are split on blanks, '...' and "..." quote and '\' escapes
+ * next character; no other shell processing is done. Program is found
+ * in PATH and started by posix_spawnp(), which is much cheaper than
+ * /bin/sh started by popen().
+ *
+ * Pipe is enlarged up to EXEC_PIPE_SIZE. Output samples are copied once
+ * into page aligned pool and the pool pages are moved into the pipe by
+ * vmsplice(). Pipe holds references to the pool pages, not copies, so
+ * a page is reused only after a pipe size of data written after it:
+ * by then the reader has consumed it. Reader which splices the pipe
+ * further, instead of reading it, may see later data. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <stream.h>
+
+extern char **environ;
+
+#define EXEC_PIPE_SIZE   (1024 * 1024)
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    int fd;
+    pid_t pid;
+    size_t pipe_size;
+
+    // Output pool, twice the pipe size.
+    char *pool;
+    size_t pool_size;
+    size_t pool_pos;
+};
+
+/* split args in place to NULL terminated argv. Return number of arguments */
+static int exec_split_args(char *s, char **argv, int max)
+{
+    int argc = 0;
+    char *d = s;
+
+    for (;;) {
+        char quote = 0;
+
+        while (*s == ' ' || *s == '\t' || *s == '\n')
+            s++;
+        if (*s == 0 || argc == max - 1)
+            break;
+
+        argv[argc++] = d;
+        for (; *s; s++) {
+            if (quote) {
+                if (*s == quote)
+                    quote = 0;
+                else if (*s == '\\' && quote == '"' && s[1])
+                    *d++ = *++s;
+                else
+                    *d++ = *s;
+            } else if (*s == '\'' || *s == '"') {
+                quote = *s;
+            } else if (*s == '\\' && s[1]) {
+                *d++ = *++s;
+            } else if (*s == ' ' || *s == '\t' || *s == '\n') {
+                s++;
+                break;
+            } else
+                *d++ = *s;
+        }
+        *d++ = 0;
+    }
+    argv[argc] = NULL;
+    return argc;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    posix_spawn_file_actions_t fa;
+    char *args, *argv[sizeof(stream->args) / 2 + 1];
+    int fds[2], child_fd, rc;
+    int size;
+
+    args = strdup(stream->args);
+    if (exec_split_args(args, argv, sizeof(argv) / sizeof(argv[0])) == 0) {
+        free(args);
+        STREAM_RETURN_ERROR("arguments parsing", EINVAL);
+    }
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        free(args);
+        STREAM_RETURN_ERROR("pipe creation", errno);
+    }
+    if (stream->direction == STREAM_OUTPUT) {
+        pdata->fd = fds[1];
+        child_fd  = fds[0];
+    } else {
+        pdata->fd = fds[0];
+        child_fd  = fds[1];
+    }
+
+    /* unprivileged process is limited by /proc/sys/fs/pipe-max-size */
+    for (size = EXEC_PIPE_SIZE; size > 65536; size /= 2)
+        if (fcntl(pdata->fd, F_SETPIPE_SZ, size) >= 0)
+            break;
+    size = fcntl(pdata->fd, F_GETPIPE_SZ);
+    pdata->pipe_size = size > 0 ? size : 65536;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, child_fd
+                                     , stream->direction == STREAM_OUTPUT ? STDIN_FILENO : STDOUT_FILENO);
+    rc = posix_spawnp(&pdata->pid, argv[0], &fa, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&fa);
+    free(args);
+    close(child_fd);
+
+    if (rc != 0) {
+        close(pdata->fd);
+        pdata->fd = -1;
+        STREAM_RETURN_ERROR("spawning process", rc);
+    }
+
+    if (stream->direction == STREAM_OUTPUT) {
+        long page = sysconf(_SC_PAGESIZE);
+
+        pdata->pool_size = 2 * pdata->pipe_size;
+        pdata->pool_pos  = 0;
+        if (posix_memalign((void **)&pdata->pool, page, pdata->pool_size)) {
+            STREAM_SET_ERROR("pool allocation", ENOMEM);
+            close(pdata->fd);
+            pdata->fd = -1;
+            waitpid(pdata->pid, NULL, 0);
+            return STREAM_ERROR;
+        }
+    }
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int status;
+
+    if (pdata->fd < 0)
+        return STREAM_ERROR;
+
+    close(pdata->fd);
+    pdata->fd = -1;
+    free(pdata->pool);
+    pdata->pool = NULL;
+
+    while (waitpid(pdata->pid, &status, 0) < 0)
+        if (errno != EINTR)
+            STREAM_RETURN_ERROR("waiting process", errno);
+
+    return STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t requested_length = (size_t)sample_count * stream->sample_size;
+    size_t offset = 0;
+    ssize_t rv;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading to write only process", ENOTSUP);
+
+    do {
+        rv = read(pdata->fd, &((char*)samples)[offset], requested_length - offset);
+        if (rv > 0) {
+            offset += rv;
+        } else if (rv == 0) {
+            break;
+        } else {
+            if (errno == EINTR)
+                continue;
+            STREAM_RETURN_ERROR("reading from stream", errno);
+        }
+    } while (offset < requested_length);
+
+    if (offset == 0)
+        return STREAM_ERROR_EOS;
+    return offset / stream->sample_size;
+}
+
+/* move pool[pos .. pos + len) into pipe */
+static int exec_vmsplice(struct private_data_t *pdata, size_t pos, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = pdata->pool + pos;
+    iov.iov_len  = len;
+    while (iov.iov_len > 0) {
+        ssize_t rc = vmsplice(pdata->fd, &iov, 1, 0);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        iov.iov_base = (char *)iov.iov_base + rc;
+        iov.iov_len -= rc;
+    }
+    return 0;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned int sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t length = (size_t)sample_count * stream->sample_size;
+    const char *src = samples;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing to read only process", ENOTSUP);
+
+    /* chunks not larger than pipe keep pool reuse safe, see above */
+    while (length > 0) {
+        size_t n = length < pdata->pipe_size ? length : pdata->pipe_size;
+
+        if (n > pdata->pool_size - pdata->pool_pos)
+            n = pdata->pool_size - pdata->pool_pos;
+        memcpy(pdata->pool + pdata->pool_pos, src, n);
+
+        if (exec_vmsplice(pdata, pdata->pool_pos, n) < 0) {
+            if (errno == EPIPE) {
+                errno = 0;
+                return STREAM_ERROR_EOS;
+            }
+            STREAM_RETURN_ERROR("writing to stream", errno);
+        }
+        pdata->pool_pos = (pdata->pool_pos + n) % pdata->pool_size;
+        src    += n;
+        length -= n;
+    }
+
+    return sample_count;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    STREAM_RETURN_ERROR("stream count", ENOTSUP);
+}
+
+int stream_impl_exec_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+
+    pdata->fd = -1;
+    stream->pdata = pdata;
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "EXEC", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,394 @@
+//*************************************************************************
+// FFT of real signals used by processing stream stages                   *
+//*************************************************************************
+
+/* Real transform of size n is complex transform of size n / 2 over
+ * pairs of samples, split to bins of even and odd samples afterwards.
+ *
+ * Complex transform is iterative in place after bit reversal: the first
+ * pass is radix-2 or radix-4 without multiplications, the others are
+ * radix-4, made of two radix-2 stages, so data is passed half as often.
+ * Butterflies take two columns at once with SSE2. Twiddles are laid out
+ * per pass in order of access, real and imaginary parts duplicated for
+ * both complex values of a vector.
+ *
+ * Plans are tables only, shared ones are kept in process wide cache. */
+
+// ISO C headers.
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <stream_fft.h>
+
+struct dsp_fft_t
+{
+    unsigned n;
+    // Size of complex transform, n / 2.
+    unsigned m;
+    // Bit reversed index, m values.
+    unsigned *rev;
+    // Twiddles of radix-4 passes with quarter q from 2 up: per pair of
+    // columns j, j + 1 re and im of W_2q^j, then of W_4q^j, 16 floats.
+    float *tw;
+    // exp(-2 pi i k / n), m / 2 + 1 values, for split of real transform.
+    dsp_complex_t *split;
+    // Plan of cache, never freed.
+    int shared;
+    dsp_fft_t *next;
+};
+
+static pthread_mutex_t fft_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static dsp_fft_t *fft_cache;
+
+/* Quarter of the first radix-4 pass with twiddles: blocks done by the
+ * first pass, 2 for odd power of 2 */
+static unsigned fft_first_q(unsigned m)
+{
+    return (m & 0xaaaaaaaau) ? 2 : 4;
+}
+
+dsp_fft_t *dsp_fft_new(unsigned n)
+{
+    dsp_fft_t *fft;
+    unsigned i, q, bits = 0, ntw = 0;
+    float *t;
+
+    if (n < 4 || (n & (n - 1)))
+        return NULL;
+    fft = calloc(1, sizeof(*fft));
+    if (!fft)
+        return NULL;
+    fft->n = n;
+    fft->m = n / 2;
+    for (q = fft_first_q(fft->m); q < fft->m; q *= 4)
+        ntw += 8 * q;
+    fft->rev = malloc(fft->m * sizeof(unsigned));
+    fft->tw = malloc((ntw ? ntw : 1) * sizeof(float));
+    fft->split = malloc((fft->m / 2 + 1) * sizeof(dsp_complex_t));
+    if (!fft->rev || !fft->tw || !fft->split) {
+        dsp_fft_free(fft);
+        return NULL;
+    }
+
+    while ((1u << bits) < fft->m)
+        bits++;
+    for (i = 0; i < fft->m; i++) {
+        unsigned r = 0, b;
+
+        for (b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        fft->rev[i] = r;
+    }
+    t = fft->tw;
+    for (q = fft_first_q(fft->m); q < fft->m; q *= 4) {
+        for (i = 0; i < q; i++) {
+            float *p = t + 16 * (i / 2) + 2 * (i % 2);
+
+            p[0]  = p[1]  = cos(M_PI * i / q);
+            p[4]  = p[5]  = -sin(M_PI * i / q);
+            p[8]  = p[9]  = cos(M_PI * i / (2 * q));
+            p[12] = p[13] = -sin(M_PI * i / (2 * q));
+        }
+        t += 8 * q;
+    }
+    for (i = 0; i <= fft->m / 2; i++) {
+        fft->split[i].re = cos(2 * M_PI * i / n);
+        fft->split[i].im = -sin(2 * M_PI * i / n);
+    }
+    return fft;
+}
+
+dsp_fft_t *dsp_fft_get(unsigned n)
+{
+    dsp_fft_t *fft;
+
+    pthread_mutex_lock(&fft_cache_lock);
+    for (fft = fft_cache; fft; fft = fft->next)
+        if (fft->n == n)
+            break;
+    if (!fft && (fft = dsp_fft_new(n)) != NULL) {
+        fft->shared = 1;
+        fft->next = fft_cache;
+        fft_cache = fft;
+    }
+    pthread_mutex_unlock(&fft_cache_lock);
+    return fft;
+}
+
+void dsp_fft_free(dsp_fft_t *fft)
+{
+    if (!fft || fft->shared)
+        return;
+    free(fft->rev);
+    free(fft->tw);
+    free(fft->split);
+    free(fft);
+}
+
+unsigned dsp_fft_size(const dsp_fft_t *fft)
+{
+    return fft->n;
+}
+
+#if !defined(__SSE2__)
+/* Radix-4 pass over blocks of 4q, made of radix-2 stages
+ * of size 2q (twiddle w1 = W_2q^j) and 4q (w2 = W_4q^j, W_4q^(j+q) is
+ * -i w2), conjugated twiddles for inverse */
+static void fft_pass4_scalar(dsp_complex_t *x, unsigned m, unsigned q, const float *tw, int inverse)
+{
+    float sign = inverse ? -1.f : 1.f;
+    unsigned i, j;
+
+    for (i = 0; i < m; i += 4 * q) {
+        for (j = 0; j < q; j++) {
+            const float *p = tw + 16 * (j / 2) + 2 * (j % 2);
+            float w1r = p[0], w1i = p[4] * sign, w2r = p[8], w2i = p[12] * sign;
+            dsp_complex_t *a = &x[i + j], *b = a + q, *c = b + q, *d = c + q;
+            float br = b->re * w1r - b->im * w1i, bi = b->re * w1i + b->im * w1r;
+            float dr = d->re * w1r - d->im * w1i, di = d->re * w1i + d->im * w1r;
+            float a1r = a->re + br, a1i = a->im + bi, b1r = a->re - br, b1i = a->im - bi;
+            float c1r = c->re + dr, c1i = c->im + di, d1r = c->re - dr, d1i = c->im - di;
+            float c2r = c1r * w2r - c1i * w2i, c2i = c1r * w2i + c1i * w2r;
+            float d2r = d1r * w2r - d1i * w2i, d2i = d1r * w2i + d1i * w2r;
+            /* times -i, +i for inverse */
+            float tr = d2i * sign, ti = -d2r * sign;
+
+            a->re = a1r + c2r;
+            a->im = a1i + c2i;
+            c->re = a1r - c2r;
+            c->im = a1i - c2i;
+            b->re = b1r + tr;
+            b->im = b1i + ti;
+            d->re = b1r - tr;
+            d->im = b1i - ti;
+        }
+    }
+}
+#endif
+
+#if defined(__SSE2__)
+/* (re, im) pairs times twiddle of duplicated parts, conj_mask negates
+ * products of im of twiddle: re for forward, im for inverse */
+static inline __m128 fft_cmul(__m128 v, __m128 wr, __m128 wi, __m128 conj_mask)
+{
+    __m128 swap = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+
+    return _mm_add_ps(_mm_mul_ps(v, wr), _mm_xor_ps(_mm_mul_ps(swap, wi), conj_mask));
+}
+
+static void fft_pass4_sse2(dsp_complex_t *x, unsigned m, unsigned q, const float *tw, int inverse)
+{
+    const __m128 neg_re = _mm_castsi128_ps(_mm_set_epi32(0, INT32_MIN, 0, INT32_MIN));
+    const __m128 neg_im = _mm_castsi128_ps(_mm_set_epi32(INT32_MIN, 0, INT32_MIN, 0));
+    const __m128 conj_mask = inverse ? neg_im : neg_re;
+    /* -i z = (im, -re), i z = (-im, re) */
+    const __m128 rot_mask = inverse ? neg_re : neg_im;
+    unsigned i, j;
+
+    for (i = 0; i < m; i += 4 * q) {
+        float *base = &x[i].re;
+
+        for (j = 0; j < q; j += 2) {
+            const float *p = tw + 8 * j;
+            float *pa = base + 2 * j, *pb = pa + 2 * q, *pc = pb + 2 * q, *pd = pc + 2 * q;
+            __m128 w1r = _mm_loadu_ps(p), w1i = _mm_loadu_ps(p + 4);
+            __m128 w2r = _mm_loadu_ps(p + 8), w2i = _mm_loadu_ps(p + 12);
+            __m128 a = _mm_loadu_ps(pa);
+            __m128 b = fft_cmul(_mm_loadu_ps(pb), w1r, w1i, conj_mask);
+            __m128 c = _mm_loadu_ps(pc);
+            __m128 d = fft_cmul(_mm_loadu_ps(pd), w1r, w1i, conj_mask);
+            __m128 a1 = _mm_add_ps(a, b), b1 = _mm_sub_ps(a, b);
+            __m128 c1 = _mm_add_ps(c, d), d1 = _mm_sub_ps(c, d);
+            __m128 c2 = fft_cmul(c1, w2r, w2i, conj_mask);
+            __m128 d2 = fft_cmul(d1, w2r, w2i, conj_mask);
+            __m128 t = _mm_xor_ps(_mm_shuffle_ps(d2, d2, _MM_SHUFFLE(2, 3, 0, 1)), rot_mask);
+
+            _mm_storeu_ps(pa, _mm_add_ps(a1, c2));
+            _mm_storeu_ps(pc, _mm_sub_ps(a1, c2));
+            _mm_storeu_ps(pb, _mm_add_ps(b1, t));
+            _mm_storeu_ps(pd, _mm_sub_ps(b1, t));
+        }
+    }
+}
+#endif
+
+/* in place, conjugated twiddles for inverse */
+static void fft_complex(const dsp_fft_t *fft, dsp_complex_t *x, int inverse)
+{
+    unsigned m = fft->m, q, i;
+    float sign = inverse ? -1.f : 1.f;
+    const float *tw = fft->tw;
+
+    for (i = 0; i < m; i++) {
+        unsigned r = fft->rev[i];
+
+        if (r > i) {
+            dsp_complex_t t = x[i];
+
+            x[i] = x[r];
+            x[r] = t;
+        }
+    }
+
+    /* first pass has twiddles 1 and -i only */
+    if (fft_first_q(m) == 2) {
+        for (i = 0; i < m; i += 2) {
+            dsp_complex_t a = x[i], b = x[i + 1];
+
+            x[i].re = a.re + b.re;
+            x[i].im = a.im + b.im;
+            x[i + 1].re = a.re - b.re;
+            x[i + 1].im = a.im - b.im;
+        }
+    } else {
+        for (i = 0; i < m; i += 4) {
+            dsp_complex_t a = x[i], b = x[i + 1], c = x[i + 2], d = x[i + 3];
+            float a1r = a.re + b.re, a1i = a.im + b.im, b1r = a.re - b.re, b1i = a.im - b.im;
+            float c1r = c.re + d.re, c1i = c.im + d.im, d1r = c.re - d.re, d1i = c.im - d.im;
+            float tr = d1i * sign, ti = -d1r * sign;
+
+            x[i].re = a1r + c1r;
+            x[i].im = a1i + c1i;
+            x[i + 2].re = a1r - c1r;
+            x[i + 2].im = a1i - c1i;
+            x[i + 1].re = b1r + tr;
+            x[i + 1].im = b1i + ti;
+            x[i + 3].re = b1r - tr;
+            x[i + 3].im = b1i - ti;
+        }
+    }
+
+    for (q = fft_first_q(m); q < m; q *= 4) {
+#if defined(__SSE2__)
+        fft_pass4_sse2(x, m, q, tw, inverse);
+#else
+        fft_pass4_scalar(x, m, q, tw, inverse);
+#endif
+        tw += 8 * q;
+    }
+}
+
+void dsp_fft_complex(const dsp_fft_t *fft, dsp_complex_t *x, int inverse)
+{
+    fft_complex(fft, x, inverse);
+}
+
+/* Real transform of samples already in out */
+static void fft_forward_inplace(const dsp_fft_t *fft, dsp_complex_t *out)
+{
+    unsigned m = fft->m, k;
+    dsp_complex_t z0;
+
+    fft_complex(fft, out, 0);
+
+    /* X[k] = E + W^k O, X[m - k] = conj(E - W^k O), where
+     * E = (Z[k] + conj(Z[m - k])) / 2, O = -i (Z[k] - conj(Z[m - k])) / 2 */
+    z0 = out[0];
+    out[0].re = z0.re + z0.im;
+    out[0].im = 0;
+    out[m].re = z0.re - z0.im;
+    out[m].im = 0;
+    for (k = 1; k <= m / 2; k++) {
+        dsp_complex_t a = out[k], b = out[m - k], w = fft->split[k];
+        float er = (a.re + b.re) * .5f, ei = (a.im - b.im) * .5f;
+        float or_ = (a.im + b.im) * .5f, oi = (b.re - a.re) * .5f;
+        float wr = w.re * or_ - w.im * oi, wi = w.re * oi + w.im * or_;
+
+        out[k].re = er + wr;
+        out[k].im = ei + wi;
+        out[m - k].re = er - wr;
+        out[m - k].im = wi - ei;
+    }
+}
+
+void dsp_fft_forward(const dsp_fft_t *fft, const float *in, dsp_complex_t *out)
+{
+    memcpy(out, in, fft->n * sizeof(float));
+    fft_forward_inplace(fft, out);
+}
+
+void dsp_fft_inverse(const dsp_fft_t *fft, const dsp_complex_t *in, float *out)
+{
+    dsp_complex_t *z = (dsp_complex_t *)out;
+    unsigned m = fft->m, k;
+
+    /* Z[k] = E + i O, Z[m - k] = conj(E) + i conj(O), where
+     * E = X[k] + conj(X[m - k]), O = (X[k] - conj(X[m - k])) conj(W^k) */
+    for (k = 0; k <= m / 2; k++) {
+        dsp_complex_t a = in[k], b = in[m - k], w = fft->split[k];
+        float er = a.re + b.re, ei = a.im - b.im;
+        float dr = a.re - b.re, di = a.im + b.im;
+        float or_ = dr * w.re + di * w.im, oi = di * w.re - dr * w.im;
+
+        z[k].re = er - oi;
+        z[k].im = ei + or_;
+        if (k != 0 && k != m - k) {
+            z[m - k].re = er + oi;
+            z[m - k].im = or_ - ei;
+        }
+    }
+    fft_complex(fft, z, 1);
+}
+
+void dsp_fft_reference(const dsp_fft_t *fft, const float *ref, unsigned len, dsp_complex_t *out)
+{
+    float *buf = (float *)out;
+    unsigned k;
+
+    if (len > fft->n)
+        len = fft->n;
+    memcpy(buf, ref, len * sizeof(float));
+    memset(buf + len, 0, (fft->n - len) * sizeof(float));
+    fft_forward_inplace(fft, out);
+    for (k = 0; k <= fft->m; k++)
+        out[k].im = -out[k].im;
+}
+
+void dsp_fft_multiply(const dsp_complex_t *in, const dsp_complex_t *ref, dsp_complex_t *out, unsigned n)
+{
+    unsigned k = 0;
+
+#if defined(__SSE2__)
+    const __m128 neg_re = _mm_castsi128_ps(_mm_set_epi32(0, INT32_MIN, 0, INT32_MIN));
+
+    for (; k + 2 <= n; k += 2) {
+        __m128 r = _mm_loadu_ps(&ref[k].re);
+        __m128 wr = _mm_shuffle_ps(r, r, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128 wi = _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 3, 1, 1));
+
+        _mm_storeu_ps(&out[k].re, fft_cmul(_mm_loadu_ps(&in[k].re), wr, wi, neg_re));
+    }
+#endif
+    for (; k < n; k++) {
+        dsp_complex_t x = in[k], r = ref[k];
+
+        out[k].re = x.re * r.re - x.im * r.im;
+        out[k].im = x.re * r.im + x.im * r.re;
+    }
+}
+
+void dsp_fft_power_add(const dsp_complex_t *in, float *acc, unsigned n)
+{
+    unsigned k = 0;
+
+#if defined(__SSE2__)
+    for (; k + 4 <= n; k += 4) {
+        __m128 a = _mm_loadu_ps(&in[k].re);
+        __m128 b = _mm_loadu_ps(&in[k + 2].re);
+
+        a = _mm_mul_ps(a, a);
+        b = _mm_mul_ps(b, b);
+        /* re^2 of 4 bins plus im^2 of 4 bins */
+        a = _mm_add_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        _mm_storeu_ps(acc + k, _mm_add_ps(_mm_loadu_ps(acc + k), a));
+    }
+#endif
+    for (; k < n; k++)
+        acc[k] += in[k].re * in[k].re + in[k].im * in[k].im;
+}
@@ -0,0 +1,74 @@
+//*************************************************************************
+// FFT of real signals used by processing stream stages                   *
+//*************************************************************************
+
+#ifndef STREAM_FFT_H_INCLUDED_
+#define STREAM_FFT_H_INCLUDED_
+
+typedef struct dsp_fft_t dsp_fft_t;
+
+//! Complex value, layout of float[2].
+typedef struct dsp_complex_t
+{
+    float re;
+    float im;
+} dsp_complex_t;
+
+//! Create FFT of real signal, tables only: one plan serves any
+//! number of threads.
+//! @param n size, power of 2 from 4.
+//! @return plan or NULL if size is wrong or there is no memory.
+dsp_fft_t *dsp_fft_new(unsigned n);
+
+//! Retrieve shared FFT plan from process wide cache, created on first
+//! use. Thread safe, plan lives till exit.
+//! @param n size, power of 2 from 4.
+//! @return plan or NULL if size is wrong or there is no memory.
+dsp_fft_t *dsp_fft_get(unsigned n);
+
+//! Free FFT plan, shared plan is kept.
+void dsp_fft_free(dsp_fft_t *fft);
+
+//! Retrieve FFT size.
+unsigned dsp_fft_size(const dsp_fft_t *fft);
+
+//! Forward transform, not scaled.
+//! @param fft plan.
+//! @param in n real samples.
+//! @param out n / 2 + 1 bins, DC to fs / 2.
+void dsp_fft_forward(const dsp_fft_t *fft, const float *in, dsp_complex_t *out);
+
+//! Inverse transform, result is scaled by n.
+//! @param fft plan.
+//! @param in n / 2 + 1 bins.
+//! @param out n real samples.
+void dsp_fft_inverse(const dsp_fft_t *fft, const dsp_complex_t *in, float *out);
+
+//! Complex transform in place, of n / 2 values for plan of size n.
+//! @param fft plan.
+//! @param x n / 2 values.
+//! @param inverse nonzero for inverse transform, scaled by n / 2.
+void dsp_fft_complex(const dsp_fft_t *fft, dsp_complex_t *x, int inverse);
+
+//! Conjugated spectrum of reference for correlation by multiplication
+//! with spectra of signal, reference is padded by zeros.
+//! @param fft plan.
+//! @param ref reference samples.
+//! @param len number of samples, up to n.
+//! @param out n / 2 + 1 bins.
+void dsp_fft_reference(const dsp_fft_t *fft, const float *ref, unsigned len, dsp_complex_t *out);
+
+//! Multiply bins: out[k] = in[k] * ref[k], out may be in.
+//! @param in bins.
+//! @param ref bins, for ex. of dsp_fft_reference().
+//! @param out n bins.
+//! @param n number of bins.
+void dsp_fft_multiply(const dsp_complex_t *in, const dsp_complex_t *ref, dsp_complex_t *out, unsigned n);
+
+//! Add power of bins to accumulator: acc[k] += |in[k]|^2.
+//! @param in bins.
+//! @param acc n accumulated powers.
+//! @param n number of bins.
+void dsp_fft_power_add(const dsp_complex_t *in, float *acc, unsigned n);
+
+#endif
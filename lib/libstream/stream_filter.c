@@ -0,0 +1,426 @@
+//*************************************************************************
+// In-line filter chain in front of any other stream                      *
+//*************************************************************************
+
+/* args: filter:<stage>[,<stage>...]:<driver>:<args>
+ *
+ * Stages, frequencies in Hz with optional 'k' suffix:
+ *     dc[(<cutoff>)]           DC removal, default cutoff 10 Hz
+ *     gain(<dB>)               gain, result is saturated
+ *     lp(<f>[,<taps>])         lowpass FIR, default 127 taps
+ *     hp(<f>[,<taps>])         highpass FIR
+ *     bp(<f1>,<f2>[,<taps>])   bandpass FIR
+ *     notch(<f>[,<Q>])         IIR notch, default Q 30
+ *
+ * Output: samples are converted once to float blocks owned by the stage,
+ * all stages run in place on the block, result goes to inner stream.
+ * Caller buffer, which may be shared with other sinks, is not modified.
+ * Input: samples read from inner stream are filtered in caller buffer.
+ * FIR stages delay signal by (taps - 1) / 2 samples. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <stream.h>
+#include <stream_dsp.h>
+
+#define FILTER_TAPS_DEFAULT  127
+#define FILTER_TAPS_MAX      4095
+#define FILTER_STAGES_MAX    16
+
+enum {
+    STAGE_DC
+    ,STAGE_GAIN
+    ,STAGE_FIR
+    ,STAGE_NOTCH
+};
+
+struct stage_t
+{
+    int type;
+    double f1;
+    double f2;
+    double value;
+    unsigned ntaps;
+
+    float gain;
+    dsp_dc_t dc;
+    dsp_biquad_t bq;
+    dsp_fir_t *fir;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    stream_t *inner;
+    struct stage_t stages[FILTER_STAGES_MAX];
+    unsigned nstages;
+    // Sum of FIR delays in samples.
+    unsigned delay;
+
+    float fbuf[DSP_BLOCK];
+    int16_t obuf[DSP_BLOCK];
+};
+
+/* "7k" -> 7000 */
+static int filter_parse_freq(const char *s, double *f)
+{
+    char *end;
+
+    *f = strtod(s, &end);
+    if (end == s)
+        return -1;
+    if (*end == 'k' || *end == 'K') {
+        *f *= 1000.;
+        end++;
+    }
+    return *end == 0 && *f >= 0. ? 0 : -1;
+}
+
+/* parse "name(a,b,c)" to stage, args of stage are split in place */
+static int filter_parse_stage(struct stage_t *st, char *s)
+{
+    char *name = s, *argv[3] = {NULL, NULL, NULL};
+    char *p = strchr(s, '(');
+    int argc = 0;
+
+    if (p) {
+        char *end = strrchr(p, ')');
+
+        if (!end || end[1])
+            return -1;
+        *p++ = 0;
+        *end = 0;
+        while (argc < 3 && (argv[argc] = strsep(&p, ",")) != NULL)
+            argc++;
+        if (p)
+            return -1;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->ntaps = FILTER_TAPS_DEFAULT;
+
+    if (!strcmp(name, "dc")) {
+        st->type = STAGE_DC;
+        st->f1 = 10.;
+        if (argc > 1 || (argc == 1 && filter_parse_freq(argv[0], &st->f1) < 0))
+            return -1;
+    } else if (!strcmp(name, "gain")) {
+        char *end;
+
+        st->type = STAGE_GAIN;
+        if (argc != 1)
+            return -1;
+        st->value = strtod(argv[0], &end);
+        if (end == argv[0] || *end)
+            return -1;
+    } else if (!strcmp(name, "lp") || !strcmp(name, "hp")) {
+        double f;
+
+        st->type = STAGE_FIR;
+        if (argc < 1 || argc > 2 || filter_parse_freq(argv[0], &f) < 0)
+            return -1;
+        if (argc == 2)
+            st->ntaps = atoi(argv[1]);
+        if (name[0] == 'l') {
+            st->f1 = 0.;
+            st->f2 = f;
+        } else {
+            st->f1 = f;
+            st->f2 = INFINITY;
+        }
+    } else if (!strcmp(name, "bp")) {
+        st->type = STAGE_FIR;
+        if (argc < 2 || filter_parse_freq(argv[0], &st->f1) < 0
+                || filter_parse_freq(argv[1], &st->f2) < 0 || st->f1 >= st->f2)
+            return -1;
+        if (argc == 3)
+            st->ntaps = atoi(argv[2]);
+    } else if (!strcmp(name, "notch")) {
+        char *end;
+
+        st->type = STAGE_NOTCH;
+        st->value = 30.;
+        if (argc < 1 || argc > 2 || filter_parse_freq(argv[0], &st->f1) < 0)
+            return -1;
+        if (argc == 2) {
+            st->value = strtod(argv[1], &end);
+            if (end == argv[1] || *end || st->value <= 0.)
+                return -1;
+        }
+    } else
+        return -1;
+
+    if (st->type == STAGE_FIR) {
+        if (st->ntaps < 3 || st->ntaps > FILTER_TAPS_MAX)
+            return -1;
+        /* odd length: linear phase with integer delay, highpass possible */
+        st->ntaps |= 1;
+    }
+    return 0;
+}
+
+/* split "dc,bp(7k,17k),gain(6):raw:out.raw" to stages and inner description */
+static int filter_parse(struct private_data_t *pdata, char *args, char **inner)
+{
+    char *p, *start = args;
+    int depth = 0;
+
+    pdata->nstages = 0;
+    for (p = args; ; p++) {
+        if (*p == '(')
+            depth++;
+        else if (*p == ')')
+            depth--;
+        else if ((*p == ',' || *p == ':' || *p == 0) && depth == 0) {
+            char c = *p;
+
+            *p = 0;
+            if (pdata->nstages == FILTER_STAGES_MAX
+                    || filter_parse_stage(&pdata->stages[pdata->nstages++], start) < 0)
+                return -1;
+            start = p + 1;
+            if (c == ':') {
+                *inner = start;
+                return **inner ? 0 : -1;
+            }
+            if (c == 0)
+                return -1;
+        }
+    }
+}
+
+static int filter_stages_init(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned i;
+
+    pdata->delay = 0;
+    for (i = 0; i < pdata->nstages; i++) {
+        struct stage_t *st = &pdata->stages[i];
+
+        switch (st->type) {
+            case STAGE_DC:
+                dsp_dc_init(&st->dc, st->f1, stream->fs);
+                break;
+            case STAGE_GAIN:
+                st->gain = pow(10., st->value / 20.);
+                break;
+            case STAGE_NOTCH:
+                if (st->f1 <= 0. || st->f1 >= stream->fs / 2.)
+                    STREAM_RETURN_ERROR("notch frequency", EINVAL);
+                dsp_biquad_notch(&st->bq, st->f1, st->value, stream->fs);
+                break;
+            case STAGE_FIR: {
+                float taps[FILTER_TAPS_MAX];
+
+                if (st->f1 >= stream->fs / 2. || (st->f1 == 0. && st->f2 <= 0.))
+                    STREAM_RETURN_ERROR("filter frequency", EINVAL);
+                dsp_fir_design(taps, st->ntaps, st->f1, st->f2, stream->fs);
+                dsp_fir_free(st->fir);
+                st->fir = dsp_fir_new(taps, st->ntaps);
+                if (!st->fir)
+                    STREAM_RETURN_ERROR("filter creation", ENOMEM);
+                pdata->delay += (st->ntaps - 1) / 2;
+                break;
+            }
+        }
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static void filter_process(struct private_data_t *pdata, float *x, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < pdata->nstages; i++) {
+        struct stage_t *st = &pdata->stages[i];
+
+        switch (st->type) {
+            case STAGE_DC:    dsp_dc_process(&st->dc, x, n); break;
+            case STAGE_GAIN:  dsp_scale(x, n, st->gain); break;
+            case STAGE_NOTCH: dsp_biquad_process(&st->bq, x, n); break;
+            case STAGE_FIR:   dsp_fir_process(st->fir, x, n); break;
+        }
+    }
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+
+    stream_set_fs(pdata->inner, stream->fs);
+    stream_set_nsamples(pdata->inner, stream->nsamples);
+    if (stream_open(pdata->inner)) {
+        STREAM_SET_INNER_ERROR("opening inner stream");
+        return STREAM_ERROR;
+    }
+    /* input file knows its rate only after open */
+    if (stream->direction == STREAM_INPUT)
+        stream->fs = stream_get_fs(pdata->inner);
+
+    if (filter_stages_init(stream) < 0) {
+        stream_close(pdata->inner);
+        return STREAM_ERROR;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned i;
+
+    for (i = 0; i < pdata->nstages; i++) {
+        dsp_fir_free(pdata->stages[i].fir);
+        pdata->stages[i].fir = NULL;
+    }
+    return stream_close(pdata->inner);
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned i;
+
+    for (i = 0; i < pdata->nstages; i++)
+        dsp_fir_free(pdata->stages[i].fir);
+    stream_free(pdata->inner);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc, i;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
+
+    rc = stream_read(pdata->inner, samples, sample_count);
+    if (rc < 0) {
+        STREAM_SET_INNER_ERROR("reading inner stream");
+        return rc;
+    }
+    for (i = 0; i < rc; i += DSP_BLOCK) {
+        unsigned n = rc - i < DSP_BLOCK ? rc - i : DSP_BLOCK;
+
+        dsp_s16_to_float(samples + i, pdata->fbuf, n);
+        filter_process(pdata, pdata->fbuf, n);
+        dsp_float_to_s16(pdata->fbuf, samples + i, n);
+    }
+    return rc;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    const int16_t *src = samples;
+    unsigned i;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing to stream", ENOTSUP);
+
+    for (i = 0; i < sample_count; i += DSP_BLOCK) {
+        unsigned n = sample_count - i < DSP_BLOCK ? sample_count - i : DSP_BLOCK;
+        int rc;
+
+        dsp_s16_to_float(src + i, pdata->fbuf, n);
+        filter_process(pdata, pdata->fbuf, n);
+        dsp_float_to_s16(pdata->fbuf, pdata->obuf, n);
+
+        rc = stream_write(pdata->inner, pdata->obuf, n);
+        if (rc < 0) {
+            STREAM_SET_INNER_ERROR("writing inner stream");
+            return rc;
+        }
+    }
+    return sample_count;
+}
+
+static int stream_impl_seek(stream_t *stream, unsigned long offset)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream_seek(pdata->inner, offset) != STREAM_ERROR_NONE) {
+        STREAM_SET_INNER_ERROR("seeking inner stream");
+        return STREAM_ERROR;
+    }
+    /* filters restart from silence at new position */
+    return filter_stages_init(stream);
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+    snprintf(buf, len, "%u stages, delay %u samples", pdata->nstages, pdata->delay);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return stream_count(pdata->inner);
+}
+
+int stream_impl_filter_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+    char *args = strdup(stream->args);
+    char *inner;
+
+    if (filter_parse(pdata, args, &inner) < 0
+            || (pdata->inner = stream_new(stream->direction, inner)) == NULL) {
+        free(args);
+        free(pdata);
+        return STREAM_ERROR;
+    }
+    free(args);
+
+    stream->pdata = pdata;
+    stream_stage_init(stream, pdata->inner);
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->seek         = stream_impl_seek;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "FILTER", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,140 @@
+//*************************************************************************
+// Sample formats of streams and conversion from/to native int16_t        *
+//*************************************************************************
+
+// ISO C headers.
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <endian.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <stream.h>
+#include <stream_dsp.h>
+
+static const struct {
+    const char *name;
+    unsigned size;
+} s_formats[STREAM_FORMATS] = {
+    [STREAM_FORMAT_S16LE] = { "s16le", 2 },
+    [STREAM_FORMAT_S16BE] = { "s16be", 2 },
+    [STREAM_FORMAT_F32]   = { "f32",   4 },
+    [STREAM_FORMAT_ULAW]  = { "ulaw",  1 },
+};
+
+int stream_format_parse(const char *name)
+{
+    int i;
+
+    for (i = 0; i < STREAM_FORMATS; i++)
+        if (!strcasecmp(name, s_formats[i].name))
+            return i;
+    return -1;
+}
+
+const char* stream_format_name(int format)
+{
+    if (format < 0 || format >= STREAM_FORMATS)
+        return "unknown";
+    return s_formats[format].name;
+}
+
+unsigned stream_format_size(int format)
+{
+    if (format < 0 || format >= STREAM_FORMATS)
+        return 0;
+    return s_formats[format].size;
+}
+
+/* byte order of int16_t differs from host: swap, otherwise copy */
+static void swap16(const int16_t *in, int16_t *out, unsigned n, int swap)
+{
+    unsigned i = 0;
+
+    if (!swap) {
+        if (in != out)
+            memcpy(out, in, n * sizeof(int16_t));
+        return;
+    }
+#if defined(__SSE2__)
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+
+        _mm_storeu_si128((__m128i *)(out + i), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = (int16_t)__builtin_bswap16((uint16_t)in[i]);
+}
+
+/* G.711 mu-law */
+static inline uint8_t ulaw_encode(int16_t s)
+{
+    int sign = s < 0 ? 0x80 : 0;
+    int mag = s < 0 ? -(int)s : s;
+    int exp;
+
+    if (mag > 32635)
+        mag = 32635;
+    mag += 0x84;
+    /* highest set bit is 7..14 */
+    exp = 31 - __builtin_clz(mag) - 7;
+
+    return ~(sign | exp << 4 | ((mag >> (exp + 3)) & 0x0f));
+}
+
+static inline int16_t ulaw_decode(uint8_t u)
+{
+    int exp, mag;
+
+    u = ~u;
+    exp = (u >> 4) & 0x07;
+    mag = ((((u & 0x0f) << 3) + 0x84) << exp) - 0x84;
+
+    return u & 0x80 ? -mag : mag;
+}
+
+void stream_format_encode(int format, const int16_t *in, void *out, unsigned n)
+{
+    unsigned i;
+
+    switch (format) {
+        case STREAM_FORMAT_S16LE:
+            swap16(in, out, n, __BYTE_ORDER != __LITTLE_ENDIAN);
+            break;
+        case STREAM_FORMAT_S16BE:
+            swap16(in, out, n, __BYTE_ORDER != __BIG_ENDIAN);
+            break;
+        case STREAM_FORMAT_F32:
+            dsp_s16_to_float(in, out, n);
+            break;
+        case STREAM_FORMAT_ULAW:
+            for (i = 0; i < n; i++)
+                ((uint8_t *)out)[i] = ulaw_encode(in[i]);
+            break;
+    }
+}
+
+void stream_format_decode(int format, const void *in, int16_t *out, unsigned n)
+{
+    unsigned i;
+
+    switch (format) {
+        case STREAM_FORMAT_S16LE:
+            swap16(in, out, n, __BYTE_ORDER != __LITTLE_ENDIAN);
+            break;
+        case STREAM_FORMAT_S16BE:
+            swap16(in, out, n, __BYTE_ORDER != __BIG_ENDIAN);
+            break;
+        case STREAM_FORMAT_F32:
+            dsp_float_to_s16(in, out, n);
+            break;
+        case STREAM_FORMAT_ULAW:
+            for (i = 0; i < n; i++)
+                out[i] = ulaw_decode(((const uint8_t *)in)[i]);
+            break;
+    }
+}
@@ -0,0 +1,514 @@
+//*************************************************************************
+// History of last samples, written out on events                         *
+//*************************************************************************
+
+/* args: history:<length>[,<events>]:<driver>:<args>
+ *
+ * Output only. Last <length> samples, or seconds with 's' suffix, are
+ * kept in memory. When event from <events> is marked, for ex. by sdmsh
+ * on SYNCIN or JANUS detection, history before it is written to new
+ * stream <driver>:<args> with -0000, -0001, ... before extension of file
+ * name. <events> are names separated by '+', default "syncin+janus",
+ * '*' is any event. Metadata is copied to every snapshot, and snapshot,
+ * its first sample, length, host time and event are listed in
+ * <file name>.manifest like rotate: does.
+ *
+ * Ring and copies for 4 snapshots are allocated on open. Writer never
+ * waits: it reserves space, copies samples and publishes head, as shm:
+ * does. On event history is copied out of the ring to free copy, which
+ * is quick, and background thread writes copies to sinks one after
+ * another, so reception is not delayed by slow sink. Events which come
+ * while all copies are waiting are dropped. If event is marked by other
+ * thread than writer, samples overwritten meanwhile are zeros in
+ * snapshot and counted as lost in status. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <stream.h>
+
+#define HISTORY_EVENTS        "syncin+janus"
+#define HISTORY_QUEUE         4
+#define HISTORY_PIECE         16384
+#define HISTORY_LEN_MAX       (600 * 1000000.)
+
+struct history_request_t
+{
+    unsigned long long first;
+    unsigned long long end;
+    char event[32];
+    struct timeval tv;
+    // Copy of history.
+    int16_t *samples;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    double length;
+    int seconds;
+    char events[128];
+    // Snapshot format, for ex. "raw:pre-%04u.raw".
+    char *pattern;
+    char *manifest_name;
+    FILE *manifest;
+
+    // Metadata copied to every snapshot: key, value, key, value, ...
+    char **meta;
+    unsigned nmeta;
+
+    unsigned len;
+    int16_t *ring;
+    uint64_t mask;
+    // Samples written and samples being written.
+    uint64_t head;
+    uint64_t reserve;
+
+    // Snapshots waiting for background thread, with copies of history.
+    int16_t *copies;
+    pthread_t thread;
+    int thread_started;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct history_request_t queue[HISTORY_QUEUE];
+    unsigned q_head;
+    unsigned q_tail;
+    int quit;
+
+    // Counters, under lock.
+    unsigned snapshots;
+    unsigned dropped;
+    unsigned long long lost;
+    int job_error;
+    const char *job_error_op;
+};
+
+static int history_parse(struct private_data_t *pdata, const char *args)
+{
+    char *s = strdup(args), *p, *events, *end, *fn, *ext;
+    int rc = -1;
+
+    p = strchr(s, ':');
+    if (!p || !p[1] || strchr(p + 1, '%'))
+        goto history_parse_end;
+    *p++ = 0;
+
+    snprintf(pdata->events, sizeof(pdata->events), "%s", HISTORY_EVENTS);
+    events = strchr(s, ',');
+    if (events) {
+        *events++ = 0;
+        if (!*events)
+            goto history_parse_end;
+        snprintf(pdata->events, sizeof(pdata->events), "%s", events);
+    }
+    pdata->length = strtod(s, &end);
+    pdata->seconds = *end == 's';
+    if (pdata->seconds)
+        end++;
+    if (end == s || *end || pdata->length <= 0 || pdata->length > HISTORY_LEN_MAX)
+        goto history_parse_end;
+
+    /* "raw:pre.raw" -> "raw:pre-%04u.raw" and "pre.manifest" */
+    fn = strchr(p, ':');
+    fn = fn ? fn + 1 : p;
+    ext = strrchr(fn, '.');
+    if (!ext || strchr(ext, '/'))
+        ext = fn + strlen(fn);
+    if (asprintf(&pdata->pattern, "%.*s-%%04u%s", (int)(ext - p), p, ext) < 0) {
+        pdata->pattern = NULL;
+        goto history_parse_end;
+    }
+    if (asprintf(&pdata->manifest_name, "%.*s.manifest", (int)(ext - fn), fn) < 0) {
+        pdata->manifest_name = NULL;
+        goto history_parse_end;
+    }
+    rc = 0;
+
+history_parse_end:
+    free(s);
+    return rc;
+}
+
+static int history_event_match(struct private_data_t *pdata, const char *event)
+{
+    size_t len = strlen(event);
+    const char *p = pdata->events;
+
+    if (!strcmp(p, "*"))
+        return 1;
+    while ((p = strstr(p, event)) != NULL) {
+        if ((p == pdata->events || p[-1] == '+') && (p[len] == 0 || p[len] == '+'))
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+/* Copy history of request from ring, returns number of lost samples */
+static unsigned long long history_capture(struct private_data_t *pdata, struct history_request_t *req)
+{
+    uint64_t capacity = pdata->mask + 1;
+    uint64_t idx = req->first & pdata->mask, reserve;
+    unsigned long long n = req->end - req->first, first = n, lost = 0;
+
+    if (first > capacity - idx)
+        first = capacity - idx;
+    memcpy(req->samples, pdata->ring + idx, first * sizeof(int16_t));
+    if (first < n)
+        memcpy(req->samples + first, pdata->ring, (n - first) * sizeof(int16_t));
+
+    /* samples were read before reserve is checked, older than
+     * reserve - capacity could be overwritten meanwhile */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    reserve = __atomic_load_n(&pdata->reserve, __ATOMIC_ACQUIRE);
+    if (reserve - req->first > capacity) {
+        lost = reserve - capacity - req->first;
+        if (lost > n)
+            lost = n;
+        memset(req->samples, 0, lost * sizeof(int16_t));
+    }
+    return lost;
+}
+
+/* Write copy of history to new stream, in background thread */
+static void history_snapshot(stream_t *stream, struct history_request_t *req, unsigned index)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned long long n = req->end - req->first, pos = 0;
+    char descr[sizeof(((stream_t *)0)->args)];
+    const char *error_op = NULL, *fn;
+    stream_t *snap;
+    unsigned i;
+    int error = 0;
+
+    snprintf(descr, sizeof(descr), pdata->pattern, index);
+    snap = stream_new(STREAM_OUTPUT, descr);
+    if (!snap) {
+        error = EINVAL;
+        error_op = "creating snapshot";
+        goto history_snapshot_end;
+    }
+    stream_set_fs(snap, stream->fs);
+    stream_set_nsamples(snap, n);
+    for (i = 0; i < pdata->nmeta; i += 2)
+        stream_set_meta(snap, pdata->meta[i], pdata->meta[i + 1]);
+    if (stream_open(snap)) {
+        error = stream_get_errno(snap);
+        error_op = "opening snapshot";
+        stream_free(snap);
+        goto history_snapshot_end;
+    }
+
+    while (pos < n) {
+        unsigned piece = n - pos < HISTORY_PIECE ? n - pos : HISTORY_PIECE;
+
+        if (stream_write(snap, req->samples + pos, piece) < 0) {
+            error = stream_get_errno(snap);
+            error_op = "writing snapshot";
+            break;
+        }
+        pos += piece;
+    }
+    if (stream_close(snap) < 0 && !error) {
+        error = stream_get_errno(snap);
+        error_op = "closing snapshot";
+    }
+    stream_free(snap);
+
+    fn = strchr(descr, ':');
+    fn = fn ? fn + 1 : descr;
+    if (pdata->manifest) {
+        fprintf(pdata->manifest, "%u %llu %llu %ld.%06ld %s %s\n", index, req->first, n
+                , (long)req->tv.tv_sec, (long)req->tv.tv_usec, req->event, fn);
+        fflush(pdata->manifest);
+    }
+
+history_snapshot_end:
+    if (error) {
+        pthread_mutex_lock(&pdata->lock);
+        pdata->job_error = error;
+        pdata->job_error_op = error_op;
+        pthread_mutex_unlock(&pdata->lock);
+    }
+}
+
+static void *history_thread(void *arg)
+{
+    stream_t *stream = arg;
+    struct private_data_t *pdata = stream->pdata;
+
+    pthread_mutex_lock(&pdata->lock);
+    for (;;) {
+        struct history_request_t *req;
+        unsigned index;
+
+        while (pdata->q_tail == pdata->q_head && !pdata->quit)
+            pthread_cond_wait(&pdata->cond, &pdata->lock);
+        /* requests before close are written */
+        if (pdata->q_tail == pdata->q_head)
+            break;
+        /* request keeps its copy till written */
+        req = &pdata->queue[pdata->q_tail % HISTORY_QUEUE];
+        index = pdata->snapshots;
+        pthread_mutex_unlock(&pdata->lock);
+
+        history_snapshot(stream, req, index);
+
+        pthread_mutex_lock(&pdata->lock);
+        pdata->snapshots++;
+        pdata->q_tail++;
+    }
+    pthread_mutex_unlock(&pdata->lock);
+    return NULL;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    uint64_t capacity = 1;
+    unsigned i;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+
+    pdata->len = (unsigned)(pdata->seconds ? pdata->length * stream->fs + 0.5 : pdata->length);
+    if (pdata->len == 0)
+        STREAM_RETURN_ERROR("history length", EINVAL);
+    while (capacity < pdata->len)
+        capacity *= 2;
+    pdata->mask = capacity - 1;
+    pdata->ring = malloc(capacity * sizeof(int16_t));
+    pdata->copies = malloc((size_t)HISTORY_QUEUE * pdata->len * sizeof(int16_t));
+    if (!pdata->ring || !pdata->copies)
+        STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+    for (i = 0; i < HISTORY_QUEUE; i++)
+        pdata->queue[i].samples = pdata->copies + (size_t)i * pdata->len;
+    pdata->head = pdata->reserve = 0;
+    pdata->q_head = pdata->q_tail = 0;
+    pdata->snapshots = pdata->dropped = 0;
+    pdata->lost = 0;
+    pdata->job_error = 0;
+    pdata->quit = 0;
+
+    pdata->manifest = fopen(pdata->manifest_name, "w");
+    if (!pdata->manifest)
+        STREAM_RETURN_ERROR("opening manifest", errno);
+    fprintf(pdata->manifest, "# snapshot first_sample samples host_time event file\n");
+
+    pthread_mutex_init(&pdata->lock, NULL);
+    pthread_cond_init(&pdata->cond, NULL);
+    if (pthread_create(&pdata->thread, NULL, history_thread, stream) != 0) {
+        pthread_mutex_destroy(&pdata->lock);
+        pthread_cond_destroy(&pdata->cond);
+        STREAM_RETURN_ERROR("starting thread", EAGAIN);
+    }
+    pdata->thread_started = 1;
+    return STREAM_ERROR_NONE;
+}
+
+static void history_release(struct private_data_t *pdata)
+{
+    if (pdata->thread_started) {
+        pthread_mutex_lock(&pdata->lock);
+        pdata->quit = 1;
+        pthread_cond_broadcast(&pdata->cond);
+        pthread_mutex_unlock(&pdata->lock);
+        pthread_join(pdata->thread, NULL);
+        pthread_mutex_destroy(&pdata->lock);
+        pthread_cond_destroy(&pdata->cond);
+        pdata->thread_started = 0;
+    }
+    free(pdata->ring);
+    free(pdata->copies);
+    pdata->ring = NULL;
+    pdata->copies = NULL;
+    if (pdata->manifest)
+        fclose(pdata->manifest);
+    pdata->manifest = NULL;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    /* waits for queued snapshots */
+    history_release(pdata);
+    return STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned i;
+
+    history_release(pdata);
+    for (i = 0; i < pdata->nmeta; i++)
+        free(pdata->meta[i]);
+    free(pdata->meta);
+    free(pdata->pattern);
+    free(pdata->manifest_name);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    uint64_t capacity = pdata->mask + 1;
+    int16_t *src = samples;
+    unsigned left = sample_count;
+
+    /* pieces of at most half of the ring, snapshot has time to follow */
+    while (left > 0) {
+        uint64_t head = pdata->head;
+        uint64_t idx = head & pdata->mask;
+        unsigned n = left, first;
+
+        if (n > capacity / 2)
+            n = capacity / 2;
+        first = n;
+        if (first > capacity - idx)
+            first = capacity - idx;
+
+        __atomic_store_n(&pdata->reserve, head + n, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        memcpy(pdata->ring + idx, src, (size_t)first * sizeof(int16_t));
+        if (first < n)
+            memcpy(pdata->ring, src + first, (size_t)(n - first) * sizeof(int16_t));
+
+        __atomic_store_n(&pdata->head, head + n, __ATOMIC_RELEASE);
+        src  += n;
+        left -= n;
+    }
+    return sample_count;
+}
+
+static int stream_impl_set_meta(stream_t *stream, const char *key, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char **meta;
+
+    meta = realloc(pdata->meta, (pdata->nmeta + 2) * sizeof(char *));
+    if (!meta)
+        STREAM_RETURN_ERROR("setting metadata", ENOMEM);
+    pdata->meta = meta;
+    pdata->meta[pdata->nmeta++] = strdup(key);
+    pdata->meta[pdata->nmeta++] = strdup(value);
+    return STREAM_ERROR_NONE;
+}
+
+/* Called by writer of samples, copies history and queues it */
+static int stream_impl_mark(stream_t *stream, const char *event, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct history_request_t *req;
+    uint64_t head = __atomic_load_n(&pdata->head, __ATOMIC_ACQUIRE);
+    unsigned long long lost;
+
+    (void)value;
+    if (!pdata->ring || !history_event_match(pdata, event))
+        return STREAM_ERROR_NONE;
+
+    pthread_mutex_lock(&pdata->lock);
+    if (pdata->q_head - pdata->q_tail >= HISTORY_QUEUE) {
+        pdata->dropped++;
+        pthread_mutex_unlock(&pdata->lock);
+        STREAM_RETURN_ERROR("queueing snapshot", EBUSY);
+    }
+    req = &pdata->queue[pdata->q_head % HISTORY_QUEUE];
+    pthread_mutex_unlock(&pdata->lock);
+
+    /* free copy is used by this thread only */
+    req->end = head;
+    req->first = head > pdata->len ? head - pdata->len : 0;
+    snprintf(req->event, sizeof(req->event), "%s", event);
+    gettimeofday(&req->tv, NULL);
+    lost = history_capture(pdata, req);
+
+    pthread_mutex_lock(&pdata->lock);
+    pdata->lost += lost;
+    pdata->q_head++;
+    pthread_cond_broadcast(&pdata->cond);
+    pthread_mutex_unlock(&pdata->lock);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int n;
+
+    if (!pdata->thread_started) {
+        snprintf(buf, len, "%u samples of history", pdata->len);
+        return STREAM_ERROR_NONE;
+    }
+    pthread_mutex_lock(&pdata->lock);
+    n = snprintf(buf, len, "%u samples of history, %u snapshots", pdata->len, pdata->snapshots);
+    if (pdata->q_head != pdata->q_tail && n > 0 && (size_t)n < len)
+        n += snprintf(buf + n, len - n, ", %u waiting", pdata->q_head - pdata->q_tail);
+    if (pdata->dropped && n > 0 && (size_t)n < len)
+        n += snprintf(buf + n, len - n, ", %u dropped", pdata->dropped);
+    if (pdata->lost && n > 0 && (size_t)n < len)
+        n += snprintf(buf + n, len - n, ", %llu samples lost", pdata->lost);
+    if (pdata->job_error && n > 0 && (size_t)n < len)
+        snprintf(buf + n, len - n, ", %s: %s", pdata->job_error_op, strerror(pdata->job_error));
+    pthread_mutex_unlock(&pdata->lock);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+int stream_impl_history_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+
+    if (history_parse(pdata, stream->args) < 0) {
+        free(pdata->pattern);
+        free(pdata->manifest_name);
+        free(pdata);
+        return STREAM_ERROR;
+    }
+
+    stream->pdata = pdata;
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->set_meta     = stream_impl_set_meta;
+    stream->mark         = stream_impl_mark;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    strncpy(stream->name, "HISTORY", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,903 @@
+//*************************************************************************
+// Lossless compressed samples driver: fixed prediction + Rice coding     *
+//*************************************************************************
+
+/*
+ * File layout, all values little endian:
+ *
+ *   header  "SDZ1" u32:version u32:fs u32:block_size u8:reserved[16]
+ *   block   u32:payload_len u16:nsamples u8:order u8:k payload
+ *   ...
+ *   index   { u64:offset u32:nsamples u32:payload_len } per block
+ *   footer  u64:index_offset u64:total_samples u32:nblocks "SDZI"
+ *
+ * order is 0..4 for fixed polynomial predictor or LPC_VERBATIM for plain
+ * int16 payload. Predictor payload is order warmup samples as int16 and
+ * Rice coded zigzag residuals with parameter k. If footer is missing (capture
+ * was not closed properly) the index is rebuilt by scanning block headers.
+ */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <endian.h>
+
+#include <stream.h>
+
+#define LPC_MAGIC          "SDZ1"
+#define LPC_INDEX_MAGIC    "SDZI"
+#define LPC_VERSION        1
+#define LPC_HEADER_SIZE    32
+#define LPC_BLOCK_HDR_SIZE 8
+#define LPC_FOOTER_SIZE    24
+#define LPC_INDEX_ENTRY    16
+#define LPC_BLOCK_SIZE     4096
+#define LPC_MAX_ORDER      4
+#define LPC_VERBATIM       0xff
+#define LPC_MAX_THREADS    8
+/* unary part longer then this is escaped with raw value */
+#define LPC_RICE_ESCAPE    24
+#define LPC_RICE_RAW_BITS  21
+
+enum {
+    BLOCK_FREE = 0,
+    BLOCK_READY,
+    BLOCK_BUSY,
+    BLOCK_DONE
+};
+
+struct lpc_block_t
+{
+    int16_t *samples;
+    unsigned nsamples;
+    unsigned long long seq;
+    int state;
+    // Encoded block with header.
+    uint8_t *out;
+    size_t out_len;
+    // Scratch of encoder, LPC_MAX_ORDER + block size values. Allocated
+    // with the block, so worker threads cannot fail.
+    int32_t *work;
+};
+
+struct lpc_index_t
+{
+    uint64_t offset;
+    uint32_t nsamples;
+    uint32_t payload_len;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    FILE *fp;
+    unsigned block_size;
+
+    struct lpc_index_t *index;
+    unsigned nblocks;
+    unsigned long long total;
+
+    // Writer: ring of blocks compressed by worker threads.
+    struct lpc_block_t *blocks;
+    unsigned nqueue;
+    unsigned long long head, tail;
+    pthread_t *workers;
+    unsigned nworkers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quit;
+    uint64_t offset;
+
+    // Reader: current decoded block.
+    int16_t *dec;
+    unsigned dec_len;
+    unsigned dec_pos;
+    unsigned cur_block;
+    uint8_t *payload;
+    size_t payload_size;
+};
+
+/**************************** codec ****************************/
+struct bitwriter_t
+{
+    uint8_t *p;
+    uint64_t acc;
+    unsigned bits;
+};
+
+static inline void bw_put(struct bitwriter_t *bw, uint32_t val, unsigned n)
+{
+    bw->acc = (bw->acc << n) | (val & ((1ULL << n) - 1));
+    bw->bits += n;
+    while (bw->bits >= 8) {
+        bw->bits -= 8;
+        *bw->p++ = bw->acc >> bw->bits;
+    }
+}
+
+static inline void bw_put_ones(struct bitwriter_t *bw, unsigned n)
+{
+    while (n >= 16) {
+        bw_put(bw, 0xffff, 16);
+        n -= 16;
+    }
+    bw_put(bw, (1u << n) - 1, n);
+}
+
+static inline void bw_flush(struct bitwriter_t *bw)
+{
+    if (bw->bits)
+        *bw->p++ = bw->acc << (8 - bw->bits);
+    bw->bits = 0;
+}
+
+struct bitreader_t
+{
+    const uint8_t *p, *end;
+    uint64_t acc;
+    unsigned bits;
+};
+
+static inline int br_fill(struct bitreader_t *br)
+{
+    while (br->bits <= 56 && br->p < br->end) {
+        br->acc |= (uint64_t)*br->p++ << (56 - br->bits);
+        br->bits += 8;
+    }
+    return br->bits;
+}
+
+static inline int br_get(struct bitreader_t *br, unsigned n, uint32_t *val)
+{
+    if (br->bits < n && br_fill(br) < (int)n)
+        return -1;
+    *val = n ? br->acc >> (64 - n) : 0;
+    br->acc <<= n;
+    br->bits -= n;
+    return 0;
+}
+
+static inline int br_get_unary(struct bitreader_t *br, unsigned *q)
+{
+    *q = 0;
+    for (;;) {
+        unsigned ones;
+
+        if (br->bits == 0 && br_fill(br) == 0)
+            return -1;
+        ones = ~br->acc ? __builtin_clzll(~br->acc) : 64;
+        if (ones > br->bits)
+            ones = br->bits;
+        if (*q + ones >= LPC_RICE_ESCAPE) {
+            ones = LPC_RICE_ESCAPE - *q;
+            *q = LPC_RICE_ESCAPE;
+            br->acc <<= ones;
+            br->bits -= ones;
+            return 0;
+        }
+        *q += ones;
+        br->acc <<= ones;
+        br->bits -= ones;
+        if (br->bits) {
+            /* terminating zero */
+            br->acc <<= 1;
+            br->bits--;
+            return 0;
+        }
+    }
+}
+
+static inline int32_t lpc_predict(const int32_t *x, int order)
+{
+    switch (order) {
+        case 0:  return 0;
+        case 1:  return x[-1];
+        case 2:  return 2 * x[-1] - x[-2];
+        case 3:  return 3 * x[-1] - 3 * x[-2] + x[-3];
+        default: return 4 * x[-1] - 6 * x[-2] + 4 * x[-3] - x[-4];
+    }
+}
+
+/* Worst case of encoded block size */
+static size_t lpc_block_max_size(unsigned nsamples)
+{
+    return LPC_BLOCK_HDR_SIZE + nsamples * 2 + 16;
+}
+
+/* Encode block into out. Returns encoded size with block header */
+static size_t lpc_encode_block(const int16_t *samples, unsigned n, uint8_t *out, int32_t *x)
+{
+    uint64_t sum[LPC_MAX_ORDER + 1] = {0};
+    struct bitwriter_t bw;
+    uint32_t payload_len;
+    uint16_t nsamples = htole16(n);
+    unsigned i;
+    int order, best = 0, k = 0;
+
+    /* x[] have LPC_MAX_ORDER zeros before samples to simplify prediction */
+    for (i = 0; i < n; i++)
+        x[i] = samples[i];
+
+    /* total absolute residual of every order in one pass, as FLAC does */
+    for (i = LPC_MAX_ORDER; i < n; i++) {
+        int32_t e0 = x[i];
+        int32_t e1 = e0 - x[i - 1];
+        int32_t e2 = e1 - (x[i - 1] - x[i - 2]);
+        int32_t e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+        int32_t e4 = e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]);
+
+        sum[0] += abs(e0);
+        sum[1] += abs(e1);
+        sum[2] += abs(e2);
+        sum[3] += abs(e3);
+        sum[4] += abs(e4);
+    }
+    for (order = 1; order <= LPC_MAX_ORDER; order++)
+        if (sum[order] < sum[best])
+            best = order;
+
+    if (n > (unsigned)best)
+        while (k < 16 && ((uint64_t)(n - best) << (k + 1)) < sum[best])
+            k++;
+
+    bw.p = out + LPC_BLOCK_HDR_SIZE;
+    bw.acc = 0;
+    bw.bits = 0;
+
+    if (n < LPC_MAX_ORDER * 2)
+        goto verbatim;
+
+    for (i = 0; i < (unsigned)best; i++) {
+        int16_t w = htole16(samples[i]);
+        memcpy(bw.p, &w, 2);
+        bw.p += 2;
+    }
+
+    for (i = best; i < n; i++) {
+        int32_t r = x[i] - lpc_predict(&x[i], best);
+        uint32_t u = ((uint32_t)r << 1) ^ (uint32_t)(r >> 31);
+        uint32_t q = u >> k;
+
+        if (q >= LPC_RICE_ESCAPE) {
+            bw_put_ones(&bw, LPC_RICE_ESCAPE);
+            bw_put(&bw, u, LPC_RICE_RAW_BITS);
+        } else {
+            bw_put_ones(&bw, q);
+            bw_put(&bw, 0, 1);
+            bw_put(&bw, u, k);
+        }
+        /* compressed block would be bigger then verbatim */
+        if ((size_t)(bw.p - out) > LPC_BLOCK_HDR_SIZE + n * 2)
+            goto verbatim;
+    }
+    bw_flush(&bw);
+
+    payload_len = htole32(bw.p - out - LPC_BLOCK_HDR_SIZE);
+    memcpy(out, &payload_len, 4);
+    memcpy(out + 4, &nsamples, 2);
+    out[6] = best;
+    out[7] = k;
+    return bw.p - out;
+
+verbatim:
+    for (i = 0; i < n; i++) {
+        int16_t w = htole16(samples[i]);
+        memcpy(out + LPC_BLOCK_HDR_SIZE + i * 2, &w, 2);
+    }
+    payload_len = htole32(n * 2);
+    memcpy(out, &payload_len, 4);
+    memcpy(out + 4, &nsamples, 2);
+    out[6] = LPC_VERBATIM;
+    out[7] = 0;
+    return LPC_BLOCK_HDR_SIZE + n * 2;
+}
+
+static int lpc_decode_block(const uint8_t *payload, size_t len, int order, unsigned k
+                            , int16_t *samples, unsigned n)
+{
+    struct bitreader_t br = { .p = payload, .end = payload + len };
+    int32_t x[LPC_MAX_ORDER] = {0};
+    unsigned i;
+
+    if (order == LPC_VERBATIM) {
+        if (len < n * 2)
+            return -1;
+        for (i = 0; i < n; i++) {
+            int16_t w;
+            memcpy(&w, payload + i * 2, 2);
+            samples[i] = le16toh(w);
+        }
+        return 0;
+    }
+
+    if (order > LPC_MAX_ORDER || k > 16 || len < (unsigned)order * 2)
+        return -1;
+
+    for (i = 0; i < (unsigned)order; i++) {
+        int16_t w;
+        memcpy(&w, payload + i * 2, 2);
+        samples[i] = le16toh(w);
+        x[LPC_MAX_ORDER - order + i] = samples[i];
+    }
+    br.p += order * 2;
+
+    for (; i < n; i++) {
+        uint32_t u, low;
+        unsigned q;
+        int32_t r, s;
+
+        if (br_get_unary(&br, &q) < 0)
+            return -1;
+        if (q == LPC_RICE_ESCAPE) {
+            if (br_get(&br, LPC_RICE_RAW_BITS, &u) < 0)
+                return -1;
+        } else {
+            if (br_get(&br, k, &low) < 0)
+                return -1;
+            u = (q << k) | low;
+        }
+        r = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+        s = r + lpc_predict(&x[LPC_MAX_ORDER], order);
+
+        memmove(x, x + 1, (LPC_MAX_ORDER - 1) * sizeof(x[0]));
+        x[LPC_MAX_ORDER - 1] = s;
+        samples[i] = s;
+    }
+    return 0;
+}
+
+/**************************** writer ****************************/
+static void* lpc_worker(void *arg)
+{
+    struct private_data_t *pdata = arg;
+
+    pthread_mutex_lock(&pdata->lock);
+    for (;;) {
+        struct lpc_block_t *blk = NULL;
+        unsigned long long seq;
+
+        for (seq = pdata->tail; seq < pdata->head; seq++)
+            if (pdata->blocks[seq % pdata->nqueue].state == BLOCK_READY) {
+                blk = &pdata->blocks[seq % pdata->nqueue];
+                break;
+            }
+
+        if (!blk) {
+            if (pdata->quit)
+                break;
+            pthread_cond_wait(&pdata->cond, &pdata->lock);
+            continue;
+        }
+
+        blk->state = BLOCK_BUSY;
+        pthread_mutex_unlock(&pdata->lock);
+
+        blk->out_len = lpc_encode_block(blk->samples, blk->nsamples, blk->out, blk->work + LPC_MAX_ORDER);
+
+        pthread_mutex_lock(&pdata->lock);
+        blk->state = BLOCK_DONE;
+        pthread_cond_broadcast(&pdata->cond);
+    }
+    pthread_mutex_unlock(&pdata->lock);
+
+    return NULL;
+}
+
+static int lpc_write_header(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    uint8_t hdr[LPC_HEADER_SIZE] = {0};
+    uint32_t v;
+
+    memcpy(hdr, LPC_MAGIC, 4);
+    v = htole32(LPC_VERSION);       memcpy(hdr + 4,  &v, 4);
+    v = htole32(stream->fs);        memcpy(hdr + 8,  &v, 4);
+    v = htole32(pdata->block_size); memcpy(hdr + 12, &v, 4);
+
+    if (fwrite(hdr, sizeof(hdr), 1, pdata->fp) != 1)
+        return -1;
+    pdata->offset = sizeof(hdr);
+    return 0;
+}
+
+static int lpc_index_add(struct private_data_t *pdata, uint64_t offset, unsigned nsamples, unsigned payload_len)
+{
+    if ((pdata->nblocks & 1023) == 0) {
+        struct lpc_index_t *idx = realloc(pdata->index, (pdata->nblocks + 1024) * sizeof(*idx));
+        if (!idx)
+            return -1;
+        pdata->index = idx;
+    }
+    pdata->index[pdata->nblocks].offset = offset;
+    pdata->index[pdata->nblocks].nsamples = nsamples;
+    pdata->index[pdata->nblocks].payload_len = payload_len;
+    pdata->nblocks++;
+    pdata->total += nsamples;
+    return 0;
+}
+
+/* Write compressed blocks in order. If wait, wait for all submitted blocks
+ * otherwise only till there is a free block for filling */
+static int lpc_drain(stream_t *stream, int wait_all)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    pthread_mutex_lock(&pdata->lock);
+    while (pdata->tail < pdata->head) {
+        struct lpc_block_t *blk = &pdata->blocks[pdata->tail % pdata->nqueue];
+
+        if (blk->state != BLOCK_DONE) {
+            if (!wait_all && pdata->blocks[pdata->head % pdata->nqueue].state == BLOCK_FREE)
+                break;
+            pthread_cond_wait(&pdata->cond, &pdata->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pdata->lock);
+
+        if (fwrite(blk->out, blk->out_len, 1, pdata->fp) != 1
+                || lpc_index_add(pdata, pdata->offset, blk->nsamples, blk->out_len - LPC_BLOCK_HDR_SIZE) < 0) {
+            STREAM_SET_ERROR("writing file", errno ? errno : EIO);
+            return STREAM_ERROR;
+        }
+        pdata->offset += blk->out_len;
+
+        pthread_mutex_lock(&pdata->lock);
+        blk->state = BLOCK_FREE;
+        blk->nsamples = 0;
+        pdata->tail++;
+    }
+    pthread_mutex_unlock(&pdata->lock);
+    return STREAM_ERROR_NONE;
+}
+
+static void lpc_submit(struct private_data_t *pdata)
+{
+    pthread_mutex_lock(&pdata->lock);
+    pdata->blocks[pdata->head % pdata->nqueue].state = BLOCK_READY;
+    pdata->blocks[pdata->head % pdata->nqueue].seq = pdata->head;
+    pdata->head++;
+    pthread_cond_broadcast(&pdata->cond);
+    pthread_mutex_unlock(&pdata->lock);
+}
+
+static int lpc_open_writer(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned i, nworkers;
+    int rc = 0;
+
+    /* close after failure: lock is valid, only started threads are joined */
+    pthread_mutex_init(&pdata->lock, NULL);
+    pthread_cond_init(&pdata->cond, NULL);
+    pdata->nworkers = 0;
+
+    nworkers = ncpu < 1 ? 1 : ncpu > LPC_MAX_THREADS ? LPC_MAX_THREADS : ncpu;
+    pdata->nqueue = nworkers * 2;
+    pdata->blocks = calloc(pdata->nqueue, sizeof(struct lpc_block_t));
+    pdata->workers = calloc(nworkers, sizeof(pthread_t));
+    if (!pdata->blocks || !pdata->workers)
+        STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+
+    for (i = 0; i < pdata->nqueue; i++) {
+        pdata->blocks[i].samples = malloc(pdata->block_size * sizeof(int16_t));
+        pdata->blocks[i].out = malloc(lpc_block_max_size(pdata->block_size));
+        pdata->blocks[i].work = calloc(pdata->block_size + LPC_MAX_ORDER, sizeof(int32_t));
+        if (!pdata->blocks[i].samples || !pdata->blocks[i].out || !pdata->blocks[i].work)
+            STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+    }
+
+    if (lpc_write_header(stream) < 0)
+        STREAM_RETURN_ERROR("writing file", errno);
+
+    for (i = 0; i < nworkers; i++) {
+        rc = pthread_create(&pdata->workers[i], NULL, lpc_worker, pdata);
+        if (rc != 0)
+            break;
+        pdata->nworkers++;
+    }
+    if (pdata->nworkers == 0)
+        STREAM_RETURN_ERROR("starting worker threads", rc);
+
+    return STREAM_ERROR_NONE;
+}
+
+static int lpc_close_writer(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct lpc_block_t *blk;
+    int rc = STREAM_ERROR_NONE;
+    unsigned i;
+
+    /* writer was not opened */
+    if (!pdata->workers && !pdata->blocks)
+        return STREAM_ERROR_NONE;
+
+    if (pdata->nworkers) {
+        blk = &pdata->blocks[pdata->head % pdata->nqueue];
+        if (blk->state == BLOCK_FREE && blk->nsamples)
+            lpc_submit(pdata);
+        rc = lpc_drain(stream, 1);
+
+        pthread_mutex_lock(&pdata->lock);
+        pdata->quit = 1;
+        pthread_cond_broadcast(&pdata->cond);
+        pthread_mutex_unlock(&pdata->lock);
+        for (i = 0; i < pdata->nworkers; i++)
+            pthread_join(pdata->workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pdata->lock);
+    pthread_cond_destroy(&pdata->cond);
+
+    /* no index after failed open */
+    if (rc == STREAM_ERROR_NONE && pdata->nworkers) {
+        uint8_t footer[LPC_FOOTER_SIZE];
+        uint64_t v64;
+        uint32_t v32;
+
+        for (i = 0; i < pdata->nblocks; i++) {
+            uint8_t e[LPC_INDEX_ENTRY];
+
+            v64 = htole64(pdata->index[i].offset);      memcpy(e,      &v64, 8);
+            v32 = htole32(pdata->index[i].nsamples);    memcpy(e + 8,  &v32, 4);
+            v32 = htole32(pdata->index[i].payload_len); memcpy(e + 12, &v32, 4);
+            if (fwrite(e, sizeof(e), 1, pdata->fp) != 1)
+                break;
+        }
+
+        v64 = htole64(pdata->offset);  memcpy(footer,      &v64, 8);
+        v64 = htole64(pdata->total);   memcpy(footer + 8,  &v64, 8);
+        v32 = htole32(pdata->nblocks); memcpy(footer + 16, &v32, 4);
+        memcpy(footer + 20, LPC_INDEX_MAGIC, 4);
+
+        if (i != pdata->nblocks || fwrite(footer, sizeof(footer), 1, pdata->fp) != 1) {
+            STREAM_SET_ERROR("writing index", errno);
+            rc = STREAM_ERROR;
+        }
+    }
+
+    for (i = 0; pdata->blocks && i < pdata->nqueue; i++) {
+        free(pdata->blocks[i].samples);
+        free(pdata->blocks[i].out);
+        free(pdata->blocks[i].work);
+    }
+    free(pdata->blocks);
+    free(pdata->workers);
+    pdata->blocks = NULL;
+    pdata->workers = NULL;
+    pdata->nworkers = 0;
+
+    return rc;
+}
+
+/**************************** reader ****************************/
+static int lpc_read_index(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    uint8_t hdr[LPC_HEADER_SIZE], footer[LPC_FOOTER_SIZE];
+    uint64_t index_offset, total, v64;
+    uint32_t v32, nblocks, i;
+    off_t size;
+
+    if (fread(hdr, sizeof(hdr), 1, pdata->fp) != 1 || memcmp(hdr, LPC_MAGIC, 4))
+        STREAM_RETURN_ERROR("wrong file format", EINVAL);
+
+    memcpy(&v32, hdr + 8, 4);  stream->fs = le32toh(v32);
+    memcpy(&v32, hdr + 12, 4); pdata->block_size = le32toh(v32);
+    if (pdata->block_size == 0 || pdata->block_size > 0xffff)
+        STREAM_RETURN_ERROR("wrong file format", EINVAL);
+
+    if (fseeko(pdata->fp, 0, SEEK_END) < 0 || (size = ftello(pdata->fp)) < 0)
+        STREAM_RETURN_ERROR("reading file", errno);
+
+    /* fast path: index at the end of file, entries are checked as block
+     * headers of slow path, so corrupted index cannot overflow buffers */
+    if (fseeko(pdata->fp, -LPC_FOOTER_SIZE, SEEK_END) == 0
+            && fread(footer, sizeof(footer), 1, pdata->fp) == 1
+            && !memcmp(footer + 20, LPC_INDEX_MAGIC, 4)) {
+        memcpy(&v64, footer, 8);      index_offset = le64toh(v64);
+        memcpy(&v64, footer + 8, 8);  total = le64toh(v64);
+        memcpy(&v32, footer + 16, 4); nblocks = le32toh(v32);
+
+        if (fseeko(pdata->fp, index_offset, SEEK_SET) == 0) {
+            for (i = 0; i < nblocks; i++) {
+                uint8_t e[LPC_INDEX_ENTRY];
+                uint32_t n, len;
+
+                if (fread(e, sizeof(e), 1, pdata->fp) != 1)
+                    break;
+                memcpy(&v64, e, 8);      v64 = le64toh(v64);
+                memcpy(&n, e + 8, 4);    n = le32toh(n);
+                memcpy(&len, e + 12, 4); len = le32toh(len);
+                if (n == 0 || n > pdata->block_size || v64 > (uint64_t)size
+                        || (uint64_t)size - v64 < LPC_BLOCK_HDR_SIZE + (uint64_t)len)
+                    break;
+                if (lpc_index_add(pdata, v64, n, len) < 0)
+                    STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+            }
+            if (i == nblocks && pdata->total == total)
+                return STREAM_ERROR_NONE;
+        }
+        free(pdata->index);
+        pdata->index = NULL;
+        pdata->nblocks = 0;
+        pdata->total = 0;
+    }
+
+    /* slow path: scan block headers, skip last block if it was not written completely */
+    v64 = LPC_HEADER_SIZE;
+    while (fseeko(pdata->fp, v64, SEEK_SET) == 0) {
+        uint8_t bh[LPC_BLOCK_HDR_SIZE];
+        uint32_t len;
+        uint16_t n;
+
+        if (fread(bh, sizeof(bh), 1, pdata->fp) != 1)
+            break;
+        memcpy(&len, bh, 4); len = le32toh(len);
+        memcpy(&n, bh + 4, 2); n = le16toh(n);
+        if (n == 0 || n > pdata->block_size || v64 + LPC_BLOCK_HDR_SIZE + len > (uint64_t)size)
+            break;
+        if (lpc_index_add(pdata, v64, n, len) < 0)
+            STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+        v64 += LPC_BLOCK_HDR_SIZE + len;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static int lpc_load_block(stream_t *stream, unsigned block)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct lpc_index_t *idx = &pdata->index[block];
+    uint8_t bh[LPC_BLOCK_HDR_SIZE];
+
+    if (idx->nsamples == 0 || idx->nsamples > pdata->block_size)
+        STREAM_RETURN_ERROR("decoding block", EILSEQ);
+    if (idx->payload_len > pdata->payload_size) {
+        uint8_t *p = realloc(pdata->payload, idx->payload_len);
+        if (!p)
+            STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+        pdata->payload = p;
+        pdata->payload_size = idx->payload_len;
+    }
+
+    if (fseeko(pdata->fp, idx->offset, SEEK_SET) < 0
+            || fread(bh, sizeof(bh), 1, pdata->fp) != 1
+            || fread(pdata->payload, idx->payload_len, 1, pdata->fp) != 1)
+        STREAM_RETURN_FP("reading file", STREAM_ERROR_IO, pdata->fp);
+
+    if (lpc_decode_block(pdata->payload, idx->payload_len, bh[6], bh[7], pdata->dec, idx->nsamples) < 0)
+        STREAM_RETURN_ERROR("decoding block", EILSEQ);
+
+    pdata->cur_block = block;
+    pdata->dec_len = idx->nsamples;
+    pdata->dec_pos = 0;
+    return STREAM_ERROR_NONE;
+}
+
+/**************************** stream_t ****************************/
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+
+    pdata->block_size = LPC_BLOCK_SIZE;
+    pdata->fp = fopen(stream->args, stream->direction == STREAM_OUTPUT ? "w" : "r");
+    if (!pdata->fp)
+        STREAM_RETURN_ERROR("opening file", errno);
+
+    if (stream->direction == STREAM_OUTPUT)
+        return lpc_open_writer(stream);
+
+    if (lpc_read_index(stream) < 0)
+        return STREAM_ERROR;
+
+    pdata->dec = malloc(pdata->block_size * sizeof(int16_t));
+    if (!pdata->dec)
+        STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+    pdata->cur_block = 0;
+    pdata->dec_len = pdata->dec_pos = 0;
+
+    if (pdata->nblocks)
+        return lpc_load_block(stream, 0);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+
+    if (!pdata->fp)
+        return STREAM_ERROR_NONE;
+
+    if (stream->direction == STREAM_OUTPUT)
+        rc = lpc_close_writer(stream);
+
+    if (fclose(pdata->fp) != 0 && rc == STREAM_ERROR_NONE) {
+        STREAM_SET_ERROR("closing file", errno);
+        rc = STREAM_ERROR;
+    }
+    pdata->fp = NULL;
+
+    free(pdata->index);
+    free(pdata->dec);
+    free(pdata->payload);
+    pdata->index = NULL;
+    pdata->dec = NULL;
+    pdata->payload = NULL;
+    pdata->payload_size = 0;
+    pdata->nblocks = 0;
+    pdata->total = 0;
+
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned n = 0;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading file", ENOTSUP);
+
+    while (n < sample_count) {
+        unsigned len;
+
+        if (pdata->dec_pos == pdata->dec_len) {
+            if (pdata->cur_block + 1 >= pdata->nblocks)
+                break;
+            if (lpc_load_block((stream_t *)stream, pdata->cur_block + 1) < 0)
+                return STREAM_ERROR;
+        }
+
+        len = pdata->dec_len - pdata->dec_pos;
+        if (len > sample_count - n)
+            len = sample_count - n;
+        memcpy(samples + n, pdata->dec + pdata->dec_pos, len * sizeof(int16_t));
+        pdata->dec_pos += len;
+        n += len;
+    }
+
+    if (n == 0 && sample_count)
+        return STREAM_ERROR_EOS;
+    return n;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int16_t *src = samples;
+    unsigned left = sample_count;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing file", ENOTSUP);
+
+    while (left > 0) {
+        struct lpc_block_t *blk = &pdata->blocks[pdata->head % pdata->nqueue];
+        unsigned n = pdata->block_size - blk->nsamples;
+
+        if (n > left)
+            n = left;
+        memcpy(blk->samples + blk->nsamples, src, n * sizeof(int16_t));
+        blk->nsamples += n;
+        src  += n;
+        left -= n;
+
+        if (blk->nsamples < pdata->block_size)
+            break;
+
+        lpc_submit(pdata);
+        if (lpc_drain(stream, 0) < 0)
+            return STREAM_ERROR;
+    }
+
+    return sample_count;
+}
+
+static int stream_impl_seek(stream_t *stream, unsigned long offset)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned block;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("seeking file", ENOTSUP);
+
+    if (offset > pdata->total)
+        STREAM_RETURN_ERROR("seeking file", EINVAL);
+
+    /* all blocks except last one are block_size long */
+    block = offset / pdata->block_size;
+    if (block >= pdata->nblocks) {
+        pdata->cur_block = pdata->nblocks ? pdata->nblocks - 1 : 0;
+        pdata->dec_pos = pdata->dec_len;
+        return STREAM_ERROR_NONE;
+    }
+
+    if (lpc_load_block(stream, block) < 0)
+        return STREAM_ERROR;
+    pdata->dec_pos = offset - (unsigned long)block * pdata->block_size;
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("counting samples in file", ENOTSUP);
+
+    /* stream_count() can be called before stream_open() */
+    if (!pdata->fp) {
+        int rc;
+
+        pdata->fp = fopen(stream->args, "r");
+        if (!pdata->fp)
+            STREAM_RETURN_ERROR("opening file", errno);
+        rc = lpc_read_index(stream);
+        fclose(pdata->fp);
+        pdata->fp = NULL;
+        free(pdata->index);
+        pdata->index = NULL;
+        pdata->nblocks = 0;
+        if (rc < 0)
+            return rc;
+        rc = pdata->total;
+        pdata->total = 0;
+        return rc;
+    }
+
+    return pdata->total;
+}
+
+int stream_impl_lpc_new(stream_t *stream)
+{
+    stream->pdata = calloc(1, sizeof(struct private_data_t));
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->seek         = stream_impl_seek;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "LPC", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,299 @@
+//*************************************************************************
+// Multichannel stream as set of streams, one per channel                 *
+//*************************************************************************
+
+/* args: planar:<channels>:<driver>:<args with %d>
+ *
+ * Usually made by stream_new() from "<driver>/<N>ch:<args>" when <args>
+ * has "%d", which is replaced by channel number 0..N-1 for every stream.
+ * Planes are passed to channel streams as is, interleaved frames are
+ * split first. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stream.h>
+#include <stream_dsp.h>
+
+#define PLANAR_CHANNELS_MAX 64
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    unsigned nch;
+    stream_t *ch[PLANAR_CHANNELS_MAX];
+    // Buffers for split frames.
+    int16_t *planes[PLANAR_CHANNELS_MAX];
+    unsigned planes_size;
+};
+
+static int planar_error(stream_t *stream, stream_t *ch, const char *op)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    pdata->error = stream_get_errno(ch);
+    pdata->error_op = op;
+    return STREAM_ERROR;
+}
+
+static int planar_buffers(stream_t *stream, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned c;
+
+    if (pdata->planes_size >= sample_count)
+        return STREAM_ERROR_NONE;
+    for (c = 0; c < pdata->nch; c++) {
+        int16_t *p = realloc(pdata->planes[c], sample_count * sizeof(int16_t));
+
+        if (!p)
+            STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+        pdata->planes[c] = p;
+    }
+    pdata->planes_size = sample_count;
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned c;
+
+    for (c = 0; c < pdata->nch; c++) {
+        stream_set_fs(pdata->ch[c], stream->fs);
+        stream_set_nsamples(pdata->ch[c], stream->nsamples);
+        if (stream_open(pdata->ch[c])) {
+            planar_error(stream, pdata->ch[c], "opening channel stream");
+            while (c--)
+                stream_close(pdata->ch[c]);
+            return STREAM_ERROR;
+        }
+    }
+    /* input: rate of files */
+    stream->fs = stream_get_fs(pdata->ch[0]);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+    unsigned c;
+
+    for (c = 0; c < pdata->nch; c++)
+        if (stream_close(pdata->ch[c]) < 0 && rc == STREAM_ERROR_NONE)
+            rc = planar_error(stream, pdata->ch[c], "closing channel stream");
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned c;
+
+    for (c = 0; c < pdata->nch; c++) {
+        stream_free(pdata->ch[c]);
+        free(pdata->planes[c]);
+    }
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_read_planar(stream_t *stream, int16_t **planes, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned n, got, c;
+    int rc;
+
+    /* the first channel sets the block, other ones must have the same
+     * number of samples: their short reads are completed */
+    rc = stream_read(pdata->ch[0], planes[0], sample_count);
+    if (rc < 0 && rc != STREAM_ERROR_EOS)
+        return planar_error(stream, pdata->ch[0], "reading channel stream");
+    if (rc == 0)
+        return 0;
+    n = rc > 0 ? rc : 0;
+
+    for (c = 1; c < pdata->nch; c++) {
+        for (got = 0; got < n; got += rc) {
+            rc = stream_read(pdata->ch[c], planes[c] + got, n - got);
+            if (rc == STREAM_ERROR_EOS || rc == 0)
+                break;
+            if (rc < 0)
+                return planar_error(stream, pdata->ch[c], "reading channel stream");
+        }
+        /* the first channel ended: so must every other one */
+        if (n == 0) {
+            rc = stream_read(pdata->ch[c], planes[c], 1);
+            if (rc < 0 && rc != STREAM_ERROR_EOS)
+                return planar_error(stream, pdata->ch[c], "reading channel stream");
+            got = rc > 0;
+        }
+        if (got != n)
+            STREAM_RETURN_ERROR("channel streams of different length", EINVAL);
+    }
+    return n ? (int)n : STREAM_ERROR_EOS;
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc;
+
+    if (planar_buffers((stream_t *)stream, sample_count) < 0)
+        return STREAM_ERROR;
+    rc = stream_impl_read_planar((stream_t *)stream, pdata->planes, sample_count);
+    if (rc > 0)
+        dsp_interleave_s16(pdata->planes, pdata->nch, samples, rc);
+    return rc;
+}
+
+static int stream_impl_write_planar(stream_t *stream, int16_t *const *planes, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned c;
+
+    for (c = 0; c < pdata->nch; c++) {
+        int rc = stream_write(pdata->ch[c], planes[c], sample_count);
+
+        if (rc < 0) {
+            planar_error(stream, pdata->ch[c], "writing channel stream");
+            return rc;
+        }
+    }
+    return sample_count;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (planar_buffers(stream, sample_count) < 0)
+        return STREAM_ERROR;
+    dsp_deinterleave_s16(samples, pdata->nch, pdata->planes, sample_count);
+    return stream_impl_write_planar(stream, pdata->planes, sample_count);
+}
+
+static int stream_impl_seek(stream_t *stream, unsigned long offset)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned c;
+
+    for (c = 0; c < pdata->nch; c++)
+        if (stream_seek(pdata->ch[c], offset) < 0)
+            return planar_error(stream, pdata->ch[c], "seeking channel stream");
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_set_meta(stream_t *stream, const char *key, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned c;
+
+    for (c = 0; c < pdata->nch; c++)
+        stream_set_meta(pdata->ch[c], key, value);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_mark(stream_t *stream, const char *event, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned c;
+
+    for (c = 0; c < pdata->nch; c++)
+        stream_mark(pdata->ch[c], event, value);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    ssize_t n = -1;
+    unsigned c;
+
+    for (c = 0; c < pdata->nch; c++) {
+        ssize_t rc = stream_count(pdata->ch[c]);
+
+        if (rc < 0)
+            return planar_error(stream, pdata->ch[c], "counting samples");
+        if (n < 0 || rc < n)
+            n = rc;
+    }
+    return n;
+}
+
+int stream_impl_planar_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+    char descr[sizeof(stream->args) + 16];
+    const char *pattern, *d;
+    char *end;
+    unsigned c;
+
+    if (!pdata)
+        return STREAM_ERROR;
+    pdata->nch = strtoul(stream->args, &end, 10);
+    /* no ':' after count, for ex. bare "planar:": end is terminator */
+    d = *end == ':' ? strstr(end + 1, "%d") : NULL;
+    if (pdata->nch == 0 || pdata->nch > PLANAR_CHANNELS_MAX || !d) {
+        free(pdata);
+        return STREAM_ERROR;
+    }
+    pattern = end + 1;
+
+    /* only "%d" is replaced, pattern is not a printf format */
+    for (c = 0; c < pdata->nch; c++) {
+        snprintf(descr, sizeof(descr), "%.*s%u%s", (int)(d - pattern), pattern, c, d + 2);
+        pdata->ch[c] = stream_new(stream->direction, descr);
+        if (!pdata->ch[c]) {
+            while (c--)
+                stream_free(pdata->ch[c]);
+            free(pdata);
+            return STREAM_ERROR;
+        }
+    }
+
+    stream->pdata = pdata;
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->read_planar  = stream_impl_read_planar;
+    stream->write_planar = stream_impl_write_planar;
+    stream->seek         = stream_impl_seek;
+    stream->set_meta     = stream_impl_set_meta;
+    stream->mark         = stream_impl_mark;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "PLANAR", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
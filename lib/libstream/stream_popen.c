@@ -61,7 +61,7 @@ static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned s
         STREAM_RETURN_ERROR("reading to write only process", ENOTSUP);
 
     do {
-        rc = fread(samples + offset, 2, samples_count - offset, pdata->fp);
+        rc = fread((char *)samples + offset * stream->sample_size, stream->sample_size, samples_count - offset, pdata->fp);
         if (rc != samples_count - offset) {
             STREAM_RETURN_FP("reading from stream", STREAM_ERROR_IO, pdata->fp);
         }
@@ -84,7 +84,7 @@ static int stream_impl_write(stream_t *stream, void* samples, unsigned int sampl
         STREAM_RETURN_ERROR("writing to read only process", ENOTSUP);
 
     do {
-        rc = fwrite(samples + offset, 2, samples_count - offset, pdata->fp);
+        rc = fwrite((char *)samples + offset * stream->sample_size, stream->sample_size, samples_count - offset, pdata->fp);
         if (rc != samples_count - offset) {
             if (ferror(pdata->fp)) {
                 if (errno == EPIPE) {
@@ -101,6 +101,16 @@ static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_co
     return rc;
 }
 
+static int stream_impl_seek(stream_t *stream, unsigned long offset)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (fseeko(pdata->fp, (off_t)offset * stream->sample_size, SEEK_SET) < 0)
+        STREAM_RETURN_ERROR("seeking file", errno);
+
+    return STREAM_ERROR_NONE;
+}
+
 static int stream_impl_get_errno(stream_t *stream)
 {
     struct private_data_t *pdata = stream->pdata;
@@ -144,6 +154,7 @@ int stream_impl_raw_new(stream_t *stream)
     stream->free         = stream_impl_free;
     stream->read         = stream_impl_read;
     stream->write        = stream_impl_write;
+    stream->seek         = stream_impl_seek;
     stream->get_errno    = stream_impl_get_errno;
     stream->strerror     = stream_impl_strerror;
     stream->get_error_op = stream_impl_get_error_op;
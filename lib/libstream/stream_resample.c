@@ -0,0 +1,392 @@
+//*************************************************************************
+// Polyphase resampling stage in front of any other stream                *
+//*************************************************************************
+
+/* args: resample:<L>/<M>[,<taps>]:<driver>:<args>
+ *       resample:<fs>[,<taps>]:<driver>:<args>
+ *
+ * Rate is changed by L / M or to given sampling frequency, ratio is
+ * reduced by greatest common divisor. taps: taps per phase, default 64.
+ *
+ * Output: stream fs is rate of written samples, inner stream gets
+ * resampled ones, for ex. decimated capture for preview.
+ * Input: inner stream is read at its own rate, for ex. 48 kHz WAV for tx:
+ *     tx resample:62500:wav:signal.wav
+ *
+ * Filter delay is compensated: output has ceil(n * L / M) samples for
+ * n input samples, aligned to them. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <stream.h>
+#include <stream_dsp.h>
+
+#define RESAMPLE_TAPS_DEFAULT  64
+#define RESAMPLE_FACTOR_MAX    1024
+// Ratio is limited so output of one block fits in buffer.
+#define RESAMPLE_RATIO_MAX     64
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    stream_t *inner;
+    // Either L/M or target fs is given.
+    unsigned L;
+    unsigned M;
+    unsigned fs_target;
+    unsigned ntaps;
+
+    dsp_resampler_t *rs;
+    // Input and output samples since open, for exact output length.
+    unsigned long long nin;
+    unsigned long long nout;
+    int flushed;
+
+    float fbuf[DSP_BLOCK];
+    int16_t ibuf[DSP_BLOCK];
+    // Resampled block and read position in it.
+    float *fout;
+    int16_t *obuf;
+    unsigned out_len;
+    unsigned out_pos;
+};
+
+static unsigned long gcd(unsigned long a, unsigned long b)
+{
+    while (b) {
+        unsigned long t = a % b;
+
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* "125/96,64:wav:x.wav" or "62500:wav:x.wav" */
+static int resample_parse(struct private_data_t *pdata, const char *args, const char **inner)
+{
+    char *end;
+
+    pdata->L = pdata->M = pdata->fs_target = 0;
+    pdata->ntaps = RESAMPLE_TAPS_DEFAULT;
+
+    errno = 0;
+    pdata->L = strtoul(args, &end, 10);
+    if (errno || end == args || pdata->L == 0)
+        return -1;
+    if (*end == '/') {
+        args = end + 1;
+        pdata->M = strtoul(args, &end, 10);
+        if (errno || end == args || pdata->M == 0)
+            return -1;
+    } else {
+        pdata->fs_target = pdata->L;
+        pdata->L = 0;
+    }
+    if (*end == ',') {
+        args = end + 1;
+        pdata->ntaps = strtoul(args, &end, 10);
+        if (errno || end == args || pdata->ntaps < 4 || pdata->ntaps > 1024)
+            return -1;
+    }
+    if (*end != ':' || !end[1])
+        return -1;
+    *inner = end + 1;
+    return 0;
+}
+
+/* set L/M from rate of samples before resampling */
+static int resample_ratio(stream_t *stream, unsigned fs_in)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned long L = pdata->L, M = pdata->M, d;
+
+    if (pdata->fs_target) {
+        L = pdata->fs_target;
+        M = fs_in;
+    }
+    if (M == 0)
+        STREAM_RETURN_ERROR("sampling frequency", EINVAL);
+    d = gcd(L, M);
+    L /= d;
+    M /= d;
+    if (L > RESAMPLE_FACTOR_MAX || M > RESAMPLE_FACTOR_MAX
+            || L > M * RESAMPLE_RATIO_MAX || M > L * RESAMPLE_RATIO_MAX)
+        STREAM_RETURN_ERROR("resampling ratio", ERANGE);
+    pdata->L = L;
+    pdata->M = M;
+    pdata->fs_target = 0;
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned max_out;
+
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+
+    if (stream->direction == STREAM_OUTPUT) {
+        if (resample_ratio(stream, stream->fs) < 0)
+            return STREAM_ERROR;
+        stream_set_fs(pdata->inner, (unsigned)(((unsigned long long)stream->fs * pdata->L + pdata->M / 2) / pdata->M));
+        stream_set_nsamples(pdata->inner, (unsigned long)(((unsigned long long)stream->nsamples * pdata->L + pdata->M - 1) / pdata->M));
+    }
+
+    if (stream_open(pdata->inner)) {
+        STREAM_SET_INNER_ERROR("opening inner stream");
+        return STREAM_ERROR;
+    }
+
+    if (stream->direction == STREAM_INPUT) {
+        unsigned fs_in = stream_get_fs(pdata->inner);
+
+        if (resample_ratio(stream, fs_in) < 0) {
+            stream_close(pdata->inner);
+            return STREAM_ERROR;
+        }
+        stream->fs = (unsigned)(((unsigned long long)fs_in * pdata->L + pdata->M / 2) / pdata->M);
+    }
+
+    dsp_resampler_free(pdata->rs);
+    free(pdata->fout);
+    free(pdata->obuf);
+    pdata->rs = dsp_resampler_new(pdata->L, pdata->M, pdata->ntaps);
+    max_out = pdata->rs ? dsp_resampler_max_out(pdata->rs, DSP_BLOCK) : 0;
+    pdata->fout = malloc(max_out * sizeof(float));
+    pdata->obuf = malloc(max_out * sizeof(int16_t));
+    if (!pdata->rs || !pdata->fout || !pdata->obuf) {
+        stream_close(pdata->inner);
+        STREAM_RETURN_ERROR("resampler creation", ENOMEM);
+    }
+
+    pdata->nin = pdata->nout = 0;
+    pdata->out_len = pdata->out_pos = 0;
+    pdata->flushed = 0;
+    return STREAM_ERROR_NONE;
+}
+
+/* resample block, output length is limited to ceil(nin * L / M) */
+static unsigned resample_block(struct private_data_t *pdata, const float *in, unsigned n, int last)
+{
+    unsigned nout = dsp_resampler_process(pdata->rs, in, n, pdata->fout);
+
+    if (last) {
+        unsigned long long total = (pdata->nin * pdata->L + pdata->M - 1) / pdata->M;
+
+        if (pdata->nout + nout > total)
+            nout = total - pdata->nout;
+    }
+    pdata->nout += nout;
+    return nout;
+}
+
+/* push zeros through filter to get the tail of signal */
+static unsigned resample_flush(struct private_data_t *pdata)
+{
+    unsigned n = dsp_resampler_latency(pdata->rs);
+
+    memset(pdata->fbuf, 0, n * sizeof(float));
+    pdata->flushed = 1;
+    return resample_block(pdata, pdata->fbuf, n, 1);
+}
+
+static int resample_write_inner(stream_t *stream, unsigned n)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc;
+
+    if (n == 0)
+        return STREAM_ERROR_NONE;
+    dsp_float_to_s16(pdata->fout, pdata->obuf, n);
+    rc = stream_write(pdata->inner, pdata->obuf, n);
+    if (rc < 0) {
+        STREAM_SET_INNER_ERROR("writing inner stream");
+        return rc;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+
+    if (!pdata->rs)
+        return STREAM_ERROR;
+
+    if (stream->direction == STREAM_OUTPUT && !pdata->flushed)
+        rc = resample_write_inner(stream, resample_flush(pdata));
+
+    dsp_resampler_free(pdata->rs);
+    pdata->rs = NULL;
+    free(pdata->fout);
+    free(pdata->obuf);
+    pdata->fout = NULL;
+    pdata->obuf = NULL;
+
+    if (stream_close(pdata->inner) < 0 && rc == STREAM_ERROR_NONE) {
+        STREAM_SET_INNER_ERROR("closing inner stream");
+        rc = STREAM_ERROR;
+    }
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    dsp_resampler_free(pdata->rs);
+    free(pdata->fout);
+    free(pdata->obuf);
+    stream_free(pdata->inner);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned done = 0;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
+
+    while (done < sample_count) {
+        int rc;
+
+        if (pdata->out_pos < pdata->out_len) {
+            unsigned n = pdata->out_len - pdata->out_pos;
+
+            if (n > sample_count - done)
+                n = sample_count - done;
+            dsp_float_to_s16(pdata->fout + pdata->out_pos, samples + done, n);
+            pdata->out_pos += n;
+            done += n;
+            continue;
+        }
+        if (pdata->flushed)
+            break;
+
+        rc = stream_read(pdata->inner, pdata->ibuf, DSP_BLOCK);
+        if (rc == STREAM_ERROR_EOS || rc == 0) {
+            pdata->out_len = resample_flush(pdata);
+        } else if (rc < 0) {
+            STREAM_SET_INNER_ERROR("reading inner stream");
+            return rc;
+        } else {
+            dsp_s16_to_float(pdata->ibuf, pdata->fbuf, rc);
+            pdata->nin += rc;
+            pdata->out_len = resample_block(pdata, pdata->fbuf, rc, 0);
+        }
+        pdata->out_pos = 0;
+    }
+
+    if (done == 0)
+        return STREAM_ERROR_EOS;
+    return done;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    const int16_t *src = samples;
+    unsigned i;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing to stream", ENOTSUP);
+
+    for (i = 0; i < sample_count; i += DSP_BLOCK) {
+        unsigned n = sample_count - i < DSP_BLOCK ? sample_count - i : DSP_BLOCK;
+        int rc;
+
+        dsp_s16_to_float(src + i, pdata->fbuf, n);
+        pdata->nin += n;
+        rc = resample_write_inner(stream, resample_block(pdata, pdata->fbuf, n, 0));
+        if (rc < 0)
+            return rc;
+    }
+    return sample_count;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+    snprintf(buf, len, "ratio %u/%u", pdata->L, pdata->M);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("stream count", ENOTSUP);
+
+    /* can be called before open: inner file reports its rate with count */
+    rc = stream_count(pdata->inner);
+    if (rc < 0) {
+        STREAM_SET_INNER_ERROR("counting inner stream");
+        return rc;
+    }
+    if (pdata->fs_target && resample_ratio(stream, stream_get_fs(pdata->inner)) < 0)
+        return STREAM_ERROR;
+
+    return (int)(((unsigned long long)rc * pdata->L + pdata->M - 1) / pdata->M);
+}
+
+int stream_impl_resample_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+    const char *inner;
+
+    if (resample_parse(pdata, stream->args, &inner) < 0
+            || (pdata->inner = stream_new(stream->direction, (char *)inner)) == NULL) {
+        free(pdata);
+        return STREAM_ERROR;
+    }
+
+    stream->pdata = pdata;
+    stream_stage_init(stream, pdata->inner);
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "RESAMPLE", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,463 @@
+//*************************************************************************
+// Segmented file driver rotating output every N samples or seconds       *
+//*************************************************************************
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include <stream.h>
+
+struct segment_t
+{
+    stream_t *stream;
+    unsigned index;
+    char description[sizeof(((stream_t *)0)->args)];
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    // Segment length in samples.
+    unsigned long limit;
+    // Segment description format, for ex. "raw:capture-%04u.raw".
+    char *pattern;
+    FILE *manifest;
+
+    struct segment_t cur;
+    // Samples written to current segment.
+    unsigned long cur_len;
+    // Samples written to all segments.
+    unsigned long long total;
+
+    // Background job: open next segment and close previous one.
+    pthread_t job;
+    int job_running;
+    struct segment_t next;
+    struct segment_t prev;
+    int job_error;
+    const char *job_error_op;
+
+    // Metadata copied to every segment: key, value, key, value, ...
+    char **meta;
+    unsigned nmeta;
+};
+
+/* Check that format have exactly one %u or %d conversion, optionally with width */
+static int rotate_check_pattern(const char *fmt)
+{
+    int conv = 0;
+
+    for (; *fmt; fmt++) {
+        if (*fmt != '%')
+            continue;
+        if (*++fmt == '%')
+            continue;
+        while (*fmt == '0' || *fmt == '-')
+            fmt++;
+        while (isdigit(*fmt))
+            fmt++;
+        if (*fmt != 'u' && *fmt != 'd')
+            return -1;
+        conv++;
+    }
+    return conv == 1 ? 0 : -1;
+}
+
+/* Build segment format and manifest file name from user description.
+ * "raw:cap.raw" -> "raw:cap-%04u.raw" and "cap.manifest".
+ * Returns 0, EINVAL or ENOMEM. */
+static int rotate_parse_pattern(struct private_data_t *pdata, const char *descr, char **manifest)
+{
+    const char *fn = strchr(descr, ':');
+    const char *ext, *conv;
+    size_t len = strlen(descr);
+
+    fn = fn ? fn + 1 : descr;
+    ext = strrchr(fn, '.');
+    if (!ext || strchr(ext, '/'))
+        ext = fn + strlen(fn);
+
+    if (!strchr(fn, '%')) {
+        pdata->pattern = malloc(len + sizeof("-%04u"));
+        if (!pdata->pattern)
+            return ENOMEM;
+        sprintf(pdata->pattern, "%.*s-%%04u%s", (int)(ext - descr), descr, ext);
+        if (asprintf(manifest, "%.*s.manifest", (int)(ext - fn), fn) < 0)
+            return ENOMEM;
+        return 0;
+    }
+
+    if (rotate_check_pattern(descr) < 0)
+        return EINVAL;
+    pdata->pattern = strdup(descr);
+    if (!pdata->pattern)
+        return ENOMEM;
+
+    /* manifest: file name without conversion and extension */
+    conv = strchr(fn, '%');
+    while (conv > fn && strchr("-_.", conv[-1]))
+        conv--;
+    if (asprintf(manifest, "%.*s.manifest", (int)(conv - fn), fn) < 0)
+        return ENOMEM;
+    return 0;
+}
+
+static int rotate_segment_open(stream_t *stream, struct segment_t *seg, unsigned index, const char **error_op)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned i;
+
+    seg->index = index;
+    snprintf(seg->description, sizeof(seg->description), pdata->pattern, index);
+
+    seg->stream = stream_new(STREAM_OUTPUT, seg->description);
+    if (!seg->stream) {
+        *error_op = "creating segment";
+        return EINVAL;
+    }
+    stream_set_fs(seg->stream, stream->fs);
+    /* samples other than int16_t, for ex. of ddc:, are passed as they are,
+     * segment with own format encodes int16_t itself */
+    if (stream->sample_size != sizeof(int16_t)
+            && stream_set_sample_size(seg->stream, stream->sample_size) < 0) {
+        *error_op = "sample format of segment";
+        stream_free(seg->stream);
+        seg->stream = NULL;
+        return EINVAL;
+    }
+    stream_set_nsamples(seg->stream, pdata->limit);
+    for (i = 0; i < pdata->nmeta; i += 2)
+        stream_set_meta(seg->stream, pdata->meta[i], pdata->meta[i + 1]);
+
+    if (stream_open(seg->stream)) {
+        int rc = stream_get_errno(seg->stream);
+
+        *error_op = "opening segment";
+        stream_free(seg->stream);
+        seg->stream = NULL;
+        return rc ? rc : EIO;
+    }
+    return 0;
+}
+
+static void rotate_segment_close(struct segment_t *seg)
+{
+    if (!seg->stream)
+        return;
+    stream_close(seg->stream);
+    stream_free(seg->stream);
+    seg->stream = NULL;
+}
+
+static void* rotate_job(void *arg)
+{
+    stream_t *stream = arg;
+    struct private_data_t *pdata = stream->pdata;
+
+    rotate_segment_close(&pdata->prev);
+    pdata->job_error = rotate_segment_open(stream, &pdata->next, pdata->cur.index + 1
+                                           , &pdata->job_error_op);
+    return NULL;
+}
+
+static int rotate_job_start(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    int rc;
+
+    pdata->job_error = 0;
+    /* pthread_create() returns error code, errno is not set */
+    rc = pthread_create(&pdata->job, NULL, rotate_job, stream);
+    if (rc != 0)
+        return rc;
+    pdata->job_running = 1;
+    return 0;
+}
+
+static int rotate_job_wait(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (!pdata->job_running)
+        return 0;
+    pthread_join(pdata->job, NULL);
+    pdata->job_running = 0;
+    return pdata->job_error;
+}
+
+static void rotate_manifest_add(struct private_data_t *pdata)
+{
+    struct timeval tv;
+    const char *fn;
+
+    if (!pdata->manifest)
+        return;
+
+    gettimeofday(&tv, NULL);
+    fn = strchr(pdata->cur.description, ':');
+    fn = fn ? fn + 1 : pdata->cur.description;
+    fprintf(pdata->manifest, "%u %llu %ld.%06ld %s\n", pdata->cur.index, pdata->total
+            , (long)tv.tv_sec, (long)tv.tv_usec, fn);
+    fflush(pdata->manifest);
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char *args, *limit_s, *descr, *endptr;
+    char *manifest = NULL;
+    const char *error_op;
+    int rc;
+
+    /* args: rotate:<samples>[s]:[<driver>:]<filename> */
+    if (stream->direction != STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("opening stream", ENOTSUP);
+
+    args = strdup(stream->args);
+    limit_s = strtok(args, ":");
+    descr = strtok(NULL, "");
+    if (!limit_s || !descr) {
+        free(args);
+        STREAM_RETURN_ERROR("arguments parsing", EINVAL);
+    }
+
+    errno = 0;
+    pdata->limit = strtoul(limit_s, &endptr, 10);
+    if (*endptr == 's')
+        pdata->limit *= stream->fs, endptr++;
+    if (errno || *endptr || pdata->limit == 0) {
+        free(args);
+        STREAM_RETURN_ERROR("segment length", EINVAL);
+    }
+
+    rc = rotate_parse_pattern(pdata, descr, &manifest);
+    free(args);
+    if (rc) {
+        STREAM_SET_ERROR(rc == ENOMEM ? "allocating memory" : "segment file name format", rc);
+        goto stream_impl_open_error;
+    }
+
+    pdata->manifest = fopen(manifest, "w");
+    if (!pdata->manifest) {
+        STREAM_SET_ERROR("opening manifest", errno);
+        goto stream_impl_open_error;
+    }
+    fprintf(pdata->manifest, "# segment first_sample host_time file\n");
+
+    pdata->total = 0;
+    pdata->cur_len = 0;
+    rc = rotate_segment_open(stream, &pdata->cur, 0, &error_op);
+    if (rc) {
+        STREAM_SET_ERROR(error_op, rc);
+        goto stream_impl_open_error;
+    }
+    rotate_manifest_add(pdata);
+
+    rc = rotate_job_start(stream);
+    if (rc) {
+        STREAM_SET_ERROR("starting background job", rc);
+        goto stream_impl_open_error;
+    }
+
+    free(manifest);
+    return STREAM_ERROR_NONE;
+
+stream_impl_open_error:
+    rotate_segment_close(&pdata->cur);
+    if (pdata->manifest) {
+        fclose(pdata->manifest);
+        pdata->manifest = NULL;
+    }
+    free(pdata->pattern);
+    pdata->pattern = NULL;
+    free(manifest);
+    return STREAM_ERROR;
+}
+
+static int rotate_switch(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc;
+
+    /* normally next segment is already open for a long time */
+    rc = rotate_job_wait(stream);
+    if (rc)
+        STREAM_RETURN_ERROR(pdata->job_error_op, rc);
+
+    pdata->prev = pdata->cur;
+    pdata->cur  = pdata->next;
+    pdata->next.stream = NULL;
+    pdata->cur_len = 0;
+    rotate_manifest_add(pdata);
+
+    rc = rotate_job_start(stream);
+    if (rc)
+        STREAM_RETURN_ERROR("starting background job", rc);
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char *src = samples;
+    unsigned left = sample_count;
+
+    while (left > 0) {
+        unsigned n = left;
+        int rc;
+
+        if (pdata->cur_len == pdata->limit && rotate_switch(stream) < 0)
+            return STREAM_ERROR;
+
+        if (n > pdata->limit - pdata->cur_len)
+            n = pdata->limit - pdata->cur_len;
+
+        rc = stream_write(pdata->cur.stream, (int16_t *)src, n);
+        if (rc < 0) {
+            pdata->error = stream_get_errno(pdata->cur.stream);
+            pdata->error_op = "writing segment";
+            return rc;
+        }
+
+        src  += (size_t)n * stream->sample_size;
+        left -= n;
+        pdata->cur_len += n;
+        pdata->total   += n;
+    }
+
+    return sample_count;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct stat st;
+
+    rotate_job_wait(stream);
+    rotate_segment_close(&pdata->prev);
+    rotate_segment_close(&pdata->cur);
+
+    /* remove segment opened in advance, nothing was written there.
+     * Container formats leave only a header, so size is not checked */
+    if (pdata->next.stream) {
+        const char *fn = stream_get_args(pdata->next.stream);
+        char *path = strdup(fn);
+
+        rotate_segment_close(&pdata->next);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            unlink(path);
+        free(path);
+    }
+
+    if (pdata->manifest) {
+        fclose(pdata->manifest);
+        pdata->manifest = NULL;
+    }
+    free(pdata->pattern);
+    pdata->pattern = NULL;
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_set_meta(stream_t *stream, const char *key, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char **meta;
+
+    meta = realloc(pdata->meta, (pdata->nmeta + 2) * sizeof(char *));
+    if (!meta)
+        STREAM_RETURN_ERROR("setting metadata", ENOMEM);
+    pdata->meta = meta;
+    pdata->meta[pdata->nmeta++] = strdup(key);
+    pdata->meta[pdata->nmeta++] = strdup(value);
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_mark(stream_t *stream, const char *event, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    /* event at segment boundary goes to beginning of next segment */
+    if (pdata->cur_len == pdata->limit && rotate_switch(stream) < 0)
+        return STREAM_ERROR;
+
+    if (!pdata->cur.stream)
+        STREAM_RETURN_ERROR("marking event", ENOTSUP);
+
+    if (stream_mark(pdata->cur.stream, event, value) < 0) {
+        pdata->error = stream_get_errno(pdata->cur.stream);
+        pdata->error_op = "marking event";
+        return STREAM_ERROR;
+    }
+
+    return STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned i;
+
+    for (i = 0; i < pdata->nmeta; i++)
+        free(pdata->meta[i]);
+    free(pdata->meta);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    STREAM_RETURN_ERROR("stream count", ENOTSUP);
+}
+
+int stream_impl_rotate_new(stream_t *stream)
+{
+    stream->pdata = calloc(1, sizeof(struct private_data_t));
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->set_meta     = stream_impl_set_meta;
+    stream->mark         = stream_impl_mark;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "ROTATE", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,526 @@
+//*************************************************************************
+// Indexed capture container with session metadata                        *
+//*************************************************************************
+
+/* File layout, all numbers are little endian:
+ *
+ * header, SDC_HEADER_SIZE bytes:
+ *     0  "SDC1"
+ *     4  u32 version
+ *     8  u32 sample rate
+ *    12  u32 sample size in bytes
+ *    16  u32 chunk size in samples
+ *    20  u32 metadata length
+ *    24  u64 host time of capture start, usec since epoch
+ *    32  u64 offset of first sample
+ *    64  metadata text, "key=value\n" lines
+ *
+ * data: samples starting at data offset, aligned to SDC_ALIGN. int16 and
+ *       float samples are little endian, except for s16be format.
+ *       Chunk N starts at sample N * chunk size, so any sample position
+ *       is found without reading the file.
+ *
+ * trailer, written on close:
+ *     chunk index: per chunk u64 first sample, u64 file offset,
+ *                  u64 host time when chunk was received
+ *     event index: per event u64 sample, u64 host time,
+ *                  char name[16], char value[40]
+ *     footer, SDC_FOOTER_SIZE bytes: u64 index offset, u64 samples count,
+ *                  u32 chunks count, u32 events count, u32 reserved, "SDCI"
+ *
+ * If capture was not closed properly, footer is absent and all data
+ * till end of file is taken as samples. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stream.h>
+
+#define SDC_VERSION        1
+#define SDC_HEADER_SIZE    64
+#define SDC_FOOTER_SIZE    32
+#define SDC_ALIGN          4096
+#define SDC_META_MAX       (1024 * 1024)
+#define SDC_CHUNK_SAMPLES  65536
+#define SDC_CHUNK_ENTRY    24
+#define SDC_EVENT_NAME     16
+#define SDC_EVENT_VALUE    40
+#define SDC_EVENT_ENTRY    (16 + SDC_EVENT_NAME + SDC_EVENT_VALUE)
+
+struct sdc_chunk_t
+{
+    uint64_t first;
+    uint64_t offset;
+    uint64_t usec;
+};
+
+struct sdc_event_t
+{
+    uint64_t sample;
+    uint64_t usec;
+    char name[SDC_EVENT_NAME];
+    char value[SDC_EVENT_VALUE];
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    FILE *fp;
+    // "key=value\n" lines.
+    char *meta;
+    size_t meta_len;
+    uint64_t data_offset;
+    // Samples written or available for reading.
+    uint64_t total;
+    // Input position in samples.
+    uint64_t pos;
+
+    struct sdc_chunk_t *chunks;
+    unsigned nchunks;
+    struct sdc_event_t *events;
+    unsigned nevents;
+};
+
+static uint64_t sdc_usec(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static inline void wr32(uint8_t *p, uint32_t v) { v = htole32(v); memcpy(p, &v, 4); }
+static inline void wr64(uint8_t *p, uint64_t v) { v = htole64(v); memcpy(p, &v, 8); }
+static inline uint32_t rd32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return le32toh(v); }
+static inline uint64_t rd64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return le64toh(v); }
+
+static int sdc_write_header(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    uint8_t *h;
+    int rc;
+
+    pdata->data_offset = (SDC_HEADER_SIZE + pdata->meta_len + SDC_ALIGN - 1) / SDC_ALIGN * SDC_ALIGN;
+    h = calloc(1, pdata->data_offset);
+    if (!h)
+        return -1;
+
+    memcpy(h, "SDC1", 4);
+    wr32(h + 4,  SDC_VERSION);
+    wr32(h + 8,  stream->fs);
+    wr32(h + 12, stream->sample_size);
+    wr32(h + 16, SDC_CHUNK_SAMPLES);
+    wr32(h + 20, pdata->meta_len);
+    wr64(h + 24, sdc_usec());
+    wr64(h + 32, pdata->data_offset);
+    if (pdata->meta_len)
+        memcpy(h + SDC_HEADER_SIZE, pdata->meta, pdata->meta_len);
+
+    rc = fwrite(h, pdata->data_offset, 1, pdata->fp) == 1 ? 0 : -1;
+    free(h);
+    return rc;
+}
+
+static int sdc_write_trailer(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    uint64_t index_offset = pdata->data_offset + pdata->total * stream->sample_size;
+    uint8_t e[SDC_EVENT_ENTRY];
+    unsigned i;
+
+    for (i = 0; i < pdata->nchunks; i++) {
+        wr64(e,      pdata->chunks[i].first);
+        wr64(e + 8,  pdata->chunks[i].offset);
+        wr64(e + 16, pdata->chunks[i].usec);
+        if (fwrite(e, SDC_CHUNK_ENTRY, 1, pdata->fp) != 1)
+            return -1;
+    }
+
+    for (i = 0; i < pdata->nevents; i++) {
+        wr64(e,     pdata->events[i].sample);
+        wr64(e + 8, pdata->events[i].usec);
+        memcpy(e + 16, pdata->events[i].name, SDC_EVENT_NAME);
+        memcpy(e + 16 + SDC_EVENT_NAME, pdata->events[i].value, SDC_EVENT_VALUE);
+        if (fwrite(e, SDC_EVENT_ENTRY, 1, pdata->fp) != 1)
+            return -1;
+    }
+
+    memset(e, 0, SDC_FOOTER_SIZE);
+    wr64(e,      index_offset);
+    wr64(e + 8,  pdata->total);
+    wr32(e + 16, pdata->nchunks);
+    wr32(e + 20, pdata->nevents);
+    memcpy(e + 28, "SDCI", 4);
+    if (fwrite(e, SDC_FOOTER_SIZE, 1, pdata->fp) != 1)
+        return -1;
+
+    return 0;
+}
+
+/* Read header and footer of existing capture */
+static int sdc_read_header(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    uint8_t h[SDC_HEADER_SIZE];
+    struct stat st;
+    uint64_t data_end;
+
+    if (fread(h, sizeof(h), 1, pdata->fp) != 1 || memcmp(h, "SDC1", 4))
+        STREAM_RETURN_ERROR("not a capture container", EINVAL);
+    if (rd32(h + 4) != SDC_VERSION || rd32(h + 12) != stream->sample_size)
+        STREAM_RETURN_ERROR("unsupported container version", ENOTSUP);
+
+    stream->fs = rd32(h + 8);
+    pdata->meta_len = rd32(h + 20);
+    pdata->data_offset = rd64(h + 32);
+    if (pdata->meta_len > SDC_META_MAX || pdata->data_offset < SDC_HEADER_SIZE + pdata->meta_len)
+        STREAM_RETURN_ERROR("wrong container header", EINVAL);
+
+    pdata->meta = malloc(pdata->meta_len + 1);
+    if (!pdata->meta)
+        STREAM_RETURN_ERROR("reading metadata", ENOMEM);
+    if (pdata->meta_len && fread(pdata->meta, pdata->meta_len, 1, pdata->fp) != 1)
+        STREAM_RETURN_ERROR("reading file", errno ? errno : EINVAL);
+    pdata->meta[pdata->meta_len] = 0;
+
+    if (fstat(fileno(pdata->fp), &st) < 0)
+        STREAM_RETURN_ERROR("reading file", errno);
+    data_end = st.st_size;
+
+    if (st.st_size >= (off_t)(pdata->data_offset + SDC_FOOTER_SIZE)) {
+        uint8_t f[SDC_FOOTER_SIZE];
+
+        if (fseeko(pdata->fp, st.st_size - SDC_FOOTER_SIZE, SEEK_SET) == 0
+                && fread(f, sizeof(f), 1, pdata->fp) == 1
+                && !memcmp(f + 28, "SDCI", 4)
+                && rd64(f) >= pdata->data_offset && rd64(f) <= (uint64_t)st.st_size)
+            data_end = rd64(f);
+    }
+    if (data_end < pdata->data_offset)
+        data_end = pdata->data_offset;
+
+    pdata->total = (data_end - pdata->data_offset) / stream->sample_size;
+    pdata->pos = 0;
+
+    if (fseeko(pdata->fp, pdata->data_offset, SEEK_SET) < 0)
+        STREAM_RETURN_ERROR("seeking file", errno);
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    pdata->fp = fopen(stream->args, stream->direction == STREAM_OUTPUT ? "w" : "r");
+    if (!pdata->fp)
+        STREAM_RETURN_ERROR("opening file", errno);
+
+    if (stream->direction == STREAM_INPUT) {
+        free(pdata->meta);
+        pdata->meta = NULL;
+        if (sdc_read_header(stream) < 0) {
+            fclose(pdata->fp);
+            pdata->fp = NULL;
+            return STREAM_ERROR;
+        }
+        return STREAM_ERROR_NONE;
+    }
+
+    pdata->total = 0;
+    pdata->nchunks = 0;
+    pdata->nevents = 0;
+    if (sdc_write_header(stream) < 0) {
+        STREAM_SET_ERROR("writing file", errno);
+        fclose(pdata->fp);
+        pdata->fp = NULL;
+        return STREAM_ERROR;
+    }
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+
+    if (!pdata->fp)
+        return STREAM_ERROR_NONE;
+
+    if (stream->direction == STREAM_OUTPUT && sdc_write_trailer(stream) < 0) {
+        STREAM_SET_ERROR("writing index", errno);
+        rc = STREAM_ERROR;
+    }
+    if (fclose(pdata->fp) != 0 && rc == STREAM_ERROR_NONE) {
+        STREAM_SET_ERROR("closing file", errno);
+        rc = STREAM_ERROR;
+    }
+    pdata->fp = NULL;
+
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    free(pdata->meta);
+    free(pdata->chunks);
+    free(pdata->events);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+/* s16le and f32 samples are passed in host order and stored little endian,
+ * s16be and ulaw ones are already in byte order of their format */
+static int sdc_host_order(const stream_t *stream)
+{
+    return stream->format == STREAM_FORMAT_S16LE || stream->format == STREAM_FORMAT_F32;
+}
+
+static void sdc_swap(uint8_t *p, unsigned size)
+{
+    unsigned i;
+
+    for (i = 0; i < size / 2; i++) {
+        uint8_t t = p[i];
+        p[i] = p[size - 1 - i];
+        p[size - 1 - i] = t;
+    }
+}
+#endif
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t rc;
+    uint64_t n;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading file", ENOTSUP);
+
+    if (pdata->pos >= pdata->total)
+        return STREAM_ERROR_EOS;
+
+    n = pdata->total - pdata->pos;
+    if (n > sample_count)
+        n = sample_count;
+
+    rc = fread(samples, stream->sample_size, n, pdata->fp);
+    if (rc == 0) {
+        if (ferror(pdata->fp))
+            STREAM_RETURN_ERROR("reading file", errno);
+        return STREAM_ERROR_EOS;
+    }
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    if (sdc_host_order(stream)) {
+        unsigned size = stream_format_size(stream->format);
+
+        for (n = 0; n < rc * stream->sample_size; n += size)
+            sdc_swap((uint8_t *)samples + n, size);
+    }
+#endif
+
+    pdata->pos += rc;
+    return rc;
+}
+
+static int sdc_add_chunks(stream_t *stream, uint64_t total)
+{
+    struct private_data_t *pdata = stream->pdata;
+    uint64_t usec = 0;
+
+    /* one index entry per chunk started by this write */
+    while ((uint64_t)pdata->nchunks * SDC_CHUNK_SAMPLES < total) {
+        struct sdc_chunk_t *c;
+
+        if ((pdata->nchunks & 63) == 0) {
+            c = realloc(pdata->chunks, (pdata->nchunks + 64) * sizeof(*c));
+            if (!c)
+                return -1;
+            pdata->chunks = c;
+        }
+        if (!usec)
+            usec = sdc_usec();
+        c = &pdata->chunks[pdata->nchunks];
+        c->first  = (uint64_t)pdata->nchunks * SDC_CHUNK_SAMPLES;
+        c->offset = pdata->data_offset + c->first * stream->sample_size;
+        c->usec   = usec;
+        pdata->nchunks++;
+    }
+    return 0;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned rc;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing file", ENOTSUP);
+
+    if (sdc_add_chunks(stream, pdata->total + sample_count) < 0)
+        STREAM_RETURN_ERROR("updating index", ENOMEM);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    rc = fwrite(samples, stream->sample_size, sample_count, pdata->fp);
+#else
+    {
+        /* caller buffer may be shared with other sinks, swap a copy */
+        unsigned size = stream_format_size(stream->format);
+        size_t i, n = (size_t)sample_count * stream->sample_size;
+        uint8_t v[4];
+
+        for (i = 0; i < n; i += size) {
+            memcpy(v, (uint8_t *)samples + i, size);
+            if (sdc_host_order(stream))
+                sdc_swap(v, size);
+            if (fwrite(v, size, 1, pdata->fp) != 1)
+                break;
+        }
+        rc = i / stream->sample_size;
+    }
+#endif
+    pdata->total += rc;
+    if (rc != sample_count)
+        STREAM_RETURN_ERROR("writing file", errno);
+
+    return rc;
+}
+
+static int stream_impl_seek(stream_t *stream, unsigned long offset)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("seeking file", ENOTSUP);
+
+    if (offset > pdata->total)
+        STREAM_RETURN_ERROR("seeking file", EINVAL);
+
+    if (fseeko(pdata->fp, pdata->data_offset + (off_t)offset * stream->sample_size, SEEK_SET) < 0)
+        STREAM_RETURN_ERROR("seeking file", errno);
+
+    pdata->pos = offset;
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_set_meta(stream_t *stream, const char *key, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t len = strlen(key) + strlen(value) + 2;
+    char *meta;
+
+    if (stream->direction == STREAM_INPUT || pdata->fp)
+        STREAM_RETURN_ERROR("setting metadata", ENOTSUP);
+
+    if (!*key || strpbrk(key, "=\n") || strchr(value, '\n'))
+        STREAM_RETURN_ERROR("setting metadata", EINVAL);
+
+    meta = realloc(pdata->meta, pdata->meta_len + len + 1);
+    if (!meta)
+        STREAM_RETURN_ERROR("setting metadata", ENOMEM);
+    sprintf(meta + pdata->meta_len, "%s=%s\n", key, value);
+    pdata->meta = meta;
+    pdata->meta_len += len;
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_mark(stream_t *stream, const char *event, const char *value)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct sdc_event_t *e;
+
+    if (stream->direction == STREAM_INPUT || !pdata->fp)
+        STREAM_RETURN_ERROR("marking event", ENOTSUP);
+
+    if ((pdata->nevents & 63) == 0) {
+        e = realloc(pdata->events, (pdata->nevents + 64) * sizeof(*e));
+        if (!e)
+            STREAM_RETURN_ERROR("marking event", ENOMEM);
+        pdata->events = e;
+    }
+
+    e = &pdata->events[pdata->nevents++];
+    memset(e, 0, sizeof(*e));
+    e->sample = pdata->total;
+    e->usec   = sdc_usec();
+    strncpy(e->name, event, sizeof(e->name) - 1);
+    if (value)
+        strncpy(e->value, value, sizeof(e->value) - 1);
+
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("counting samples in file", ENOTSUP);
+
+    if (pdata->fp)
+        return pdata->total;
+
+    /* samples count from footer, without reading data */
+    rc = stream_impl_open(stream);
+    if (rc == STREAM_ERROR_NONE) {
+        rc = pdata->total;
+        stream_impl_close(stream);
+    }
+
+    return rc;
+}
+
+int stream_impl_sdc_new(stream_t *stream)
+{
+    stream->pdata = calloc(1, sizeof(struct private_data_t));
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->seek         = stream_impl_seek;
+    stream->set_meta     = stream_impl_set_meta;
+    stream->mark         = stream_impl_mark;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "SDC", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,499 @@
+//*************************************************************************
+// POSIX shared memory ring driver for local zero copy consumers          *
+//*************************************************************************
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <stream.h>
+#include <stream_shm.h>
+
+#define SHM_DEFAULT_CAPACITY (1024 * 1024)
+
+/* layout is described in stream_shm.h */
+struct shm_header_t
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t fs;
+    uint32_t sample_size;
+    uint64_t capacity;
+    uint64_t head;
+    uint32_t seq;
+    uint32_t waiters;
+    uint32_t closed;
+    uint32_t reserved;
+    uint64_t reserve;
+};
+
+struct stream_shm_reader_t
+{
+    struct shm_header_t *hdr;
+    // Sample N at N & mask times sample_size bytes.
+    char *ring;
+    unsigned sample_size;
+    size_t map_size;
+    uint64_t mask;
+    // Next sample to read.
+    uint64_t pos;
+    unsigned long long lost;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    // Output.
+    char *name;
+    struct shm_header_t *hdr;
+    char *ring;
+    size_t map_size;
+    uint64_t capacity;
+
+    // Input.
+    stream_shm_reader_t *reader;
+};
+
+static int shm_futex(uint32_t *addr, int op, uint32_t val, const struct timespec *ts)
+{
+    return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+/* "name" and "/name" are the same segment */
+static char* shm_path(const char *name)
+{
+    char *path;
+
+    if (asprintf(&path, "%s%s", name[0] == '/' ? "" : "/", name) < 0)
+        return NULL;
+    return path;
+}
+
+stream_shm_reader_t* stream_shm_reader_open(const char *name)
+{
+    stream_shm_reader_t *reader;
+    struct shm_header_t hdr;
+    char *path = shm_path(name);
+    int fd;
+
+    if (!path) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    /* writable mapping is needed for waiters counter */
+    fd = shm_open(path, O_RDWR, 0);
+    free(path);
+    if (fd < 0)
+        return NULL;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)
+            || memcmp(hdr.magic, STREAM_SHM_MAGIC, 4) || hdr.version != STREAM_SHM_VERSION
+            || hdr.capacity == 0 || (hdr.capacity & (hdr.capacity - 1))
+            || hdr.sample_size == 0 || hdr.capacity > (SIZE_MAX - STREAM_SHM_DATA_OFFSET) / hdr.sample_size) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    reader = calloc(1, sizeof(*reader));
+    reader->map_size = STREAM_SHM_DATA_OFFSET + hdr.capacity * hdr.sample_size;
+    reader->hdr = mmap(NULL, reader->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (reader->hdr == MAP_FAILED) {
+        free(reader);
+        return NULL;
+    }
+
+    reader->ring = (char *)reader->hdr + STREAM_SHM_DATA_OFFSET;
+    reader->sample_size = hdr.sample_size;
+    reader->mask = hdr.capacity - 1;
+    reader->pos  = __atomic_load_n(&reader->hdr->head, __ATOMIC_ACQUIRE);
+
+    return reader;
+}
+
+void stream_shm_reader_close(stream_shm_reader_t *reader)
+{
+    if (!reader)
+        return;
+    munmap(reader->hdr, reader->map_size);
+    free(reader);
+}
+
+unsigned stream_shm_reader_get_fs(stream_shm_reader_t *reader)
+{
+    return reader->hdr->fs;
+}
+
+unsigned stream_shm_reader_get_sample_size(stream_shm_reader_t *reader)
+{
+    return reader->sample_size;
+}
+
+unsigned long long stream_shm_reader_get_lost(stream_shm_reader_t *reader)
+{
+    return reader->lost;
+}
+
+long stream_shm_reader_wait(stream_shm_reader_t *reader, const int16_t **samples, int timeout_ms)
+{
+    struct shm_header_t *hdr = reader->hdr;
+    uint64_t capacity = reader->mask + 1;
+    struct timespec deadline, now, ts;
+
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec  += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+            deadline.tv_sec++, deadline.tv_nsec -= 1000000000L;
+    }
+
+    for (;;) {
+        uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        uint64_t reserve = __atomic_load_n(&hdr->reserve, __ATOMIC_ACQUIRE);
+        uint32_t seq;
+
+        /* reader is too slow: skip samples writer is overwriting */
+        if (reserve - reader->pos > capacity) {
+            reader->lost += reserve - capacity - reader->pos;
+            reader->pos   = reserve - capacity;
+        }
+
+        if (head > reader->pos) {
+            uint64_t idx = reader->pos & reader->mask;
+            uint64_t n = head - reader->pos;
+
+            if (n > capacity - idx)
+                n = capacity - idx;
+            *samples = (const int16_t *)(reader->ring + idx * reader->sample_size);
+            return n;
+        }
+
+        if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+            return STREAM_ERROR_EOS;
+        if (timeout_ms == 0)
+            return 0;
+
+        __atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+        seq = __atomic_load_n(&hdr->seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) != head
+                || __atomic_load_n(&hdr->closed, __ATOMIC_SEQ_CST)) {
+            __atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (timeout_ms > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ts.tv_sec  = deadline.tv_sec - now.tv_sec;
+            ts.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+            if (ts.tv_nsec < 0)
+                ts.tv_sec--, ts.tv_nsec += 1000000000L;
+            if (ts.tv_sec < 0) {
+                __atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+                return 0;
+            }
+        }
+        /* segment is shared between processes: no FUTEX_PRIVATE_FLAG */
+        shm_futex(&hdr->seq, FUTEX_WAIT, seq, timeout_ms > 0 ? &ts : NULL);
+        __atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+long stream_shm_reader_release(stream_shm_reader_t *reader, unsigned long count)
+{
+    uint64_t capacity = reader->mask + 1;
+    uint64_t first = reader->pos;
+    uint64_t reserve;
+
+    /* samples were read before reserve is checked */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    reserve = __atomic_load_n(&reader->hdr->reserve, __ATOMIC_ACQUIRE);
+    reader->pos += count;
+
+    if (reserve - first <= capacity)
+        return 0;
+    if (reserve - capacity - first > count)
+        return count;
+    return reserve - capacity - first;
+}
+
+/* Segment of finished capture is replaced, the one of live writer is not
+ * taken over. Segment of crashed writer stays closed = 0 and has to be
+ * removed from /dev/shm by hand. */
+static int shm_remove_closed(const char *name)
+{
+    struct shm_header_t *hdr;
+    struct stat st;
+    int fd, closed = 0;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*hdr)) {
+        hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0);
+        if (hdr != MAP_FAILED) {
+            closed = !memcmp(hdr->magic, STREAM_SHM_MAGIC, 4)
+                && __atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE);
+            munmap(hdr, sizeof(*hdr));
+        }
+    }
+    close(fd);
+
+    if (!closed) {
+        errno = EEXIST;
+        return -1;
+    }
+    /* readers of previous capture keep old segment until they detach */
+    if (shm_unlink(name) < 0 && errno != ENOENT)
+        return -1;
+    return 0;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char *args, *name, *cap_s, *endptr;
+    int fd;
+
+    /* args: shm:<name>[:<samples>] */
+    args = strdup(stream->args);
+    name = strtok(args, ":");
+    cap_s = strtok(NULL, ":");
+    if (!name) {
+        free(args);
+        STREAM_RETURN_ERROR("arguments parsing", EINVAL);
+    }
+
+    if (stream->direction == STREAM_INPUT) {
+        pdata->reader = stream_shm_reader_open(name);
+        free(args);
+        if (!pdata->reader)
+            STREAM_RETURN_ERROR("attaching shared memory", errno);
+        stream->fs = stream_shm_reader_get_fs(pdata->reader);
+        if (stream_shm_reader_get_sample_size(pdata->reader) != stream->sample_size) {
+            stream_shm_reader_close(pdata->reader);
+            pdata->reader = NULL;
+            STREAM_RETURN_ERROR("sample size of ring", EINVAL);
+        }
+        return STREAM_ERROR_NONE;
+    }
+
+    pdata->capacity = SHM_DEFAULT_CAPACITY;
+    if (cap_s) {
+        unsigned long cap;
+
+        errno = 0;
+        cap = strtoul(cap_s, &endptr, 10);
+        if (errno || *endptr || cap < 1024) {
+            free(args);
+            STREAM_RETURN_ERROR("ring size", EINVAL);
+        }
+        for (pdata->capacity = 1024; pdata->capacity < cap; pdata->capacity <<= 1)
+            ;
+    }
+
+    pdata->name = shm_path(name);
+    free(args);
+    if (!pdata->name)
+        STREAM_RETURN_ERROR("arguments parsing", ENOMEM);
+
+    if (shm_remove_closed(pdata->name) < 0)
+        STREAM_RETURN_ERROR("replacing shared memory", errno);
+    fd = shm_open(pdata->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        STREAM_RETURN_ERROR("creating shared memory", errno);
+
+    pdata->map_size = STREAM_SHM_DATA_OFFSET + pdata->capacity * stream->sample_size;
+    if (ftruncate(fd, pdata->map_size) < 0) {
+        STREAM_SET_ERROR("creating shared memory", errno);
+        close(fd);
+        return STREAM_ERROR;
+    }
+
+    pdata->hdr = mmap(NULL, pdata->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pdata->hdr == MAP_FAILED) {
+        pdata->hdr = NULL;
+        STREAM_RETURN_ERROR("mapping shared memory", errno);
+    }
+    pdata->ring = (char *)pdata->hdr + STREAM_SHM_DATA_OFFSET;
+
+    pdata->hdr->version     = STREAM_SHM_VERSION;
+    pdata->hdr->fs          = stream->fs;
+    pdata->hdr->sample_size = stream->sample_size;
+    pdata->hdr->capacity    = pdata->capacity;
+    /* magic last: readers check it before anything else */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(pdata->hdr->magic, STREAM_SHM_MAGIC, 4);
+
+    return STREAM_ERROR_NONE;
+}
+
+static void shm_publish(struct private_data_t *pdata)
+{
+    __atomic_add_fetch(&pdata->hdr->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pdata->hdr->waiters, __ATOMIC_SEQ_CST))
+        shm_futex(&pdata->hdr->seq, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (pdata->reader) {
+        stream_shm_reader_close(pdata->reader);
+        pdata->reader = NULL;
+    }
+
+    /* segment stays, so late readers can take the tail of capture.
+     * It is replaced by next capture with the same name */
+    if (pdata->hdr) {
+        __atomic_store_n(&pdata->hdr->closed, 1, __ATOMIC_SEQ_CST);
+        shm_publish(pdata);
+        munmap(pdata->hdr, pdata->map_size);
+        pdata->hdr = NULL;
+    }
+    free(pdata->name);
+    pdata->name = NULL;
+
+    return STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    const int16_t *src;
+    long n, torn;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading shared memory", ENOTSUP);
+
+    do {
+        n = stream_shm_reader_wait(pdata->reader, &src, -1);
+        if (n < 0)
+            return n;
+        if (n > sample_count)
+            n = sample_count;
+
+        memcpy(samples, src, n * stream->sample_size);
+        /* writer lapped reader while copying: leading samples are torn */
+        torn = stream_shm_reader_release(pdata->reader, n);
+        if (torn > 0) {
+            n -= torn;
+            memmove(samples, (char *)samples + torn * stream->sample_size, n * stream->sample_size);
+            pdata->reader->lost += torn;
+        }
+    } while (n == 0);
+
+    return n;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct shm_header_t *hdr = pdata->hdr;
+    uint64_t mask = pdata->capacity - 1;
+    const char *src = samples;
+    size_t size = stream->sample_size;
+    unsigned left = sample_count;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing shared memory", ENOTSUP);
+
+    /* pieces of at most half of the ring, readers have time to follow */
+    while (left > 0) {
+        uint64_t head = hdr->head;
+        uint64_t idx = head & mask;
+        unsigned n = left, first;
+
+        if (n > pdata->capacity / 2)
+            n = pdata->capacity / 2;
+        first = n;
+        if (first > pdata->capacity - idx)
+            first = pdata->capacity - idx;
+
+        __atomic_store_n(&hdr->reserve, head + n, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        memcpy(pdata->ring + idx * size, src, first * size);
+        if (first < n)
+            memcpy(pdata->ring, src + first * size, (n - first) * size);
+
+        __atomic_store_n(&hdr->head, head + n, __ATOMIC_RELEASE);
+        src  += n * size;
+        left -= n;
+    }
+    shm_publish(pdata);
+
+    return sample_count;
+}
+
+static int stream_impl_submit_write(stream_t *stream, void* samples, unsigned sample_count, void *tag)
+{
+    /* samples are copied to ring, so write is complete */
+    stream_complete(stream, tag, stream_impl_write(stream, samples, sample_count));
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    STREAM_RETURN_ERROR("stream count", ENOTSUP);
+}
+
+int stream_impl_shm_new(stream_t *stream)
+{
+    stream->pdata = calloc(1, sizeof(struct private_data_t));
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->submit_write = stream_impl_submit_write;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "SHM", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,76 @@
+//*************************************************************************
+// Shared memory ring reader API                                          *
+//*************************************************************************
+
+#ifndef STREAM_SHM_H_INCLUDED_
+#define STREAM_SHM_H_INCLUDED_
+
+#include <stdint.h>
+
+#include <stream_error.h>
+
+/* Segment /<name> layout, native byte order:
+ *     0  "SDMR"
+ *     4  u32 version
+ *     8  u32 sample rate
+ *    12  u32 sample size in bytes
+ *    16  u64 ring capacity in samples, power of two
+ *    24  u64 head: samples published since capture start
+ *    32  u32 sequence, incremented on every publish, futex word
+ *    36  u32 number of readers sleeping on sequence
+ *    40  u32 writer closed flag
+ *    48  u64 reserve: head plus samples being copied now
+ *  4096  ring of samples of sample size, sample N is at index N & (capacity - 1)
+ *
+ * Writer stores reserve, copies samples to the ring, then publishes them
+ * by storing head and incrementing sequence. Readers never block writer:
+ * sample N is valid while reserve - N <= capacity, reader which is behind
+ * more than that loses oldest samples. */
+
+#define STREAM_SHM_MAGIC        "SDMR"
+#define STREAM_SHM_VERSION      1
+#define STREAM_SHM_DATA_OFFSET  4096
+
+typedef struct stream_shm_reader_t stream_shm_reader_t;
+
+//! Attach to shared memory ring published by shm: output stream.
+//! Reading starts from the newest sample.
+//! @param name ring name as given to shm: driver.
+//! @return reader object or NULL, errno is set.
+stream_shm_reader_t* stream_shm_reader_open(const char *name);
+
+//! Detach from ring and free reader.
+//! @param reader reader object.
+void stream_shm_reader_close(stream_shm_reader_t *reader);
+
+//! Get sampling frequency of published stream.
+//! @param reader reader object.
+unsigned stream_shm_reader_get_fs(stream_shm_reader_t *reader);
+
+//! Get size of sample in bytes: 2 for int16_t, more for complex samples
+//! of ddc: or for frames of channels.
+//! @param reader reader object.
+unsigned stream_shm_reader_get_sample_size(stream_shm_reader_t *reader);
+
+//! Wait for unread samples. Samples are not copied: pointer to the ring
+//! is returned, valid until stream_shm_reader_release(). Samples are of
+//! stream_shm_reader_get_sample_size() bytes.
+//! @param reader reader object.
+//! @param samples pointer to first unread sample is stored here.
+//! @param timeout_ms time to wait, -1 to wait forever.
+//! @return number of contiguous samples, 0 on timeout, STREAM_ERROR_EOS if
+//! writer closed the ring and all samples are read.
+long stream_shm_reader_wait(stream_shm_reader_t *reader, const int16_t **samples, int timeout_ms);
+
+//! Mark samples returned by stream_shm_reader_wait() as read.
+//! @param reader reader object.
+//! @param count number of samples.
+//! @return 0 or number of these samples overwritten by writer while
+//! they were processed. In that case results must be dropped.
+long stream_shm_reader_release(stream_shm_reader_t *reader, unsigned long count);
+
+//! Get number of samples lost by this reader because it was too slow.
+//! @param reader reader object.
+unsigned long long stream_shm_reader_get_lost(stream_shm_reader_t *reader);
+
+#endif
@@ -0,0 +1,362 @@
+//*************************************************************************
+// Spectrum: averaged power spectra of signal written to other stream     *
+//*************************************************************************
+
+/* args: spectrum:[<fft>][,<interval>[,<bins>]]:<driver>:<args>
+ *
+ * Output only. Signal is cut to segments of <fft> (default 1024) samples
+ * with half overlap, Hann window, power spectra of segments ending in
+ * every <interval> (default 1 s, 's' suffix for seconds) are averaged
+ * (Welch method). Frame of <bins> (default <fft> / 2) int16_t values is
+ * written to inner stream per interval: level of bins from DC up in
+ * 0.01 dBFS, full scale sine in one bin is 0. Adjacent FFT bins are
+ * averaged when <bins> is less than <fft> / 2.
+ *
+ * Inner stream gets metadata "spectrum": "<fft> <bins> <interval> <fs>",
+ * so frames can be told apart by consumer, for ex. over tcp: or udp. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include <stream.h>
+#include <stream_dsp.h>
+#include <stream_fft.h>
+
+#define SPECTRUM_FFT          1024
+#define SPECTRUM_FFT_MAX      65536
+#define SPECTRUM_INTERVAL     1.
+#define SPECTRUM_INTERVAL_MAX (3600 * 1000000.)
+// Level of zero power, 0.01 dBFS.
+#define SPECTRUM_LEVEL_MIN    INT16_MIN
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    stream_t *inner;
+    unsigned fft_len;
+    double interval_value;
+    int interval_seconds;
+    unsigned bins;
+
+    dsp_fft_t *fft;
+    unsigned interval;
+    float *window;
+    // Segment being filled, fft_len samples.
+    float *segment;
+    unsigned fill;
+    float *windowed;
+    dsp_complex_t *spec;
+    // Sum of power spectra of interval, fft_len / 2 bins.
+    float *power;
+    unsigned nsegments;
+    int16_t *frame;
+    // Level of full scale sine in bin, power.
+    double full_scale;
+
+    // Samples taken and end of current interval.
+    unsigned long long total;
+    unsigned long long frame_end;
+    unsigned long long frames;
+    // Loudest bin of last frame.
+    unsigned peak_bin;
+    int peak_level;
+};
+
+static int spectrum_parse(struct private_data_t *pdata, char *args, char **inner)
+{
+    char *colon = strchr(args, ':');
+    char *p = args, *tok, *end;
+    unsigned long v;
+    int n, rc = 0;
+
+    if (!colon || !colon[1])
+        return -1;
+    *colon = 0;
+    *inner = colon + 1;
+
+    pdata->fft_len = SPECTRUM_FFT;
+    pdata->interval_value = SPECTRUM_INTERVAL;
+    pdata->interval_seconds = 1;
+    pdata->bins = 0;
+
+    for (n = 0; rc == 0 && (tok = strsep(&p, ",")) != NULL; n++) {
+        /* empty is default */
+        if (!*tok)
+            continue;
+        if (n == 0) {
+            v = strtoul(tok, &end, 0);
+            if (end == tok || *end || v < 16 || v > SPECTRUM_FFT_MAX || (v & (v - 1)))
+                rc = -1;
+            pdata->fft_len = v;
+        } else if (n == 1) {
+            pdata->interval_value = strtod(tok, &end);
+            pdata->interval_seconds = *end == 's';
+            if (pdata->interval_seconds)
+                end++;
+            if (end == tok || *end || pdata->interval_value <= 0
+                    || pdata->interval_value > SPECTRUM_INTERVAL_MAX)
+                rc = -1;
+        } else if (n == 2) {
+            v = strtoul(tok, &end, 0);
+            if (end == tok || *end || v == 0 || v > SPECTRUM_FFT_MAX / 2)
+                rc = -1;
+            pdata->bins = v;
+        } else {
+            rc = -1;
+        }
+    }
+    if (rc == 0 && pdata->bins == 0)
+        pdata->bins = pdata->fft_len / 2;
+    /* bins are made of equal number of FFT bins */
+    if (rc == 0 && (pdata->bins > pdata->fft_len / 2 || (pdata->fft_len / 2) % pdata->bins))
+        rc = -1;
+    return rc;
+}
+
+static void spectrum_release(struct private_data_t *pdata)
+{
+    dsp_fft_free(pdata->fft);
+    pdata->fft = NULL;
+    free(pdata->window);
+    free(pdata->segment);
+    free(pdata->windowed);
+    free(pdata->spec);
+    free(pdata->power);
+    free(pdata->frame);
+    pdata->window = pdata->segment = pdata->windowed = pdata->power = NULL;
+    pdata->spec = NULL;
+    pdata->frame = NULL;
+}
+
+/* Write averaged spectrum of interval as frame of levels */
+static int spectrum_frame(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned group = pdata->fft_len / 2 / pdata->bins;
+    unsigned b, k;
+    int rc;
+
+    pdata->peak_level = SPECTRUM_LEVEL_MIN;
+    pdata->peak_bin = 0;
+    for (b = 0; b < pdata->bins; b++) {
+        double p = 0, level;
+
+        for (k = 0; k < group; k++)
+            p += pdata->power[b * group + k];
+        p /= (double)group * pdata->nsegments * pdata->full_scale;
+        level = p > 0 ? 1000. * log10(p) : SPECTRUM_LEVEL_MIN;
+        if (level < SPECTRUM_LEVEL_MIN)
+            level = SPECTRUM_LEVEL_MIN;
+        if (level > INT16_MAX)
+            level = INT16_MAX;
+        pdata->frame[b] = (int16_t)lrint(level);
+        if (pdata->frame[b] > pdata->peak_level) {
+            pdata->peak_level = pdata->frame[b];
+            pdata->peak_bin = b;
+        }
+    }
+    memset(pdata->power, 0, pdata->fft_len / 2 * sizeof(float));
+    pdata->nsegments = 0;
+    pdata->frames++;
+
+    rc = stream_write(pdata->inner, pdata->frame, pdata->bins);
+    if (rc < 0) {
+        STREAM_SET_INNER_ERROR("writing inner stream");
+        return STREAM_ERROR;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+/* Segment is full: add its spectrum, keep second half as start of next one */
+static int spectrum_segment(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned n = pdata->fft_len, i;
+
+    for (i = 0; i < n; i++)
+        pdata->windowed[i] = pdata->segment[i] * pdata->window[i];
+    dsp_fft_forward(pdata->fft, pdata->windowed, pdata->spec);
+    dsp_fft_power_add(pdata->spec, pdata->power, n / 2);
+    pdata->nsegments++;
+    memmove(pdata->segment, pdata->segment + n / 2, n / 2 * sizeof(float));
+    pdata->fill = n / 2;
+
+    if (pdata->total < pdata->frame_end)
+        return STREAM_ERROR_NONE;
+    while (pdata->frame_end <= pdata->total)
+        pdata->frame_end += pdata->interval;
+    return spectrum_frame(stream);
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned n = pdata->fft_len, i;
+    double interval, frames_fs;
+    char value[96];
+
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
+
+    interval = pdata->interval_seconds ? pdata->interval_value * stream->fs : pdata->interval_value;
+    /* every frame gets at least one segment */
+    if (interval < n / 2 || interval > UINT32_MAX)
+        STREAM_RETURN_ERROR("interval shorter than half of FFT", EINVAL);
+    pdata->interval = (unsigned)(interval + 0.5);
+
+    pdata->fft = dsp_fft_get(n);
+    pdata->window = malloc(n * sizeof(float));
+    pdata->segment = malloc(n * sizeof(float));
+    pdata->windowed = malloc(n * sizeof(float));
+    pdata->spec = malloc((n / 2 + 1) * sizeof(dsp_complex_t));
+    pdata->power = calloc(n / 2, sizeof(float));
+    pdata->frame = malloc(pdata->bins * sizeof(int16_t));
+    if (!pdata->fft || !pdata->window || !pdata->segment || !pdata->windowed
+            || !pdata->spec || !pdata->power || !pdata->frame) {
+        spectrum_release(pdata);
+        STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+    }
+    /* periodic Hann: sum is n / 2, full scale sine in bin has |X| = n / 4 */
+    for (i = 0; i < n; i++)
+        pdata->window[i] = (float)(0.5 - 0.5 * cos(2 * M_PI * i / n));
+    pdata->full_scale = (n / 4.) * (n / 4.);
+    pdata->fill = 0;
+    pdata->nsegments = 0;
+    pdata->total = 0;
+    pdata->frame_end = pdata->interval;
+    pdata->frames = 0;
+    pdata->peak_bin = 0;
+    pdata->peak_level = SPECTRUM_LEVEL_MIN;
+
+    snprintf(value, sizeof(value), "%u %u %u %u", n, pdata->bins, pdata->interval, stream->fs);
+    stream_set_meta(pdata->inner, "spectrum", value);
+    /* rate of levels, not of signal */
+    frames_fs = (double)pdata->bins * stream->fs / pdata->interval;
+    stream_set_fs(pdata->inner, frames_fs >= 1. ? (unsigned)(frames_fs + 0.5) : 1);
+    stream_set_nsamples(pdata->inner, stream->nsamples / pdata->interval * pdata->bins);
+    if (stream_open(pdata->inner)) {
+        spectrum_release(pdata);
+        STREAM_SET_INNER_ERROR("opening inner stream");
+        return STREAM_ERROR;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+
+    /* last interval is partial */
+    if (pdata->fft && pdata->nsegments)
+        rc = spectrum_frame(stream);
+    spectrum_release(pdata);
+    if (stream_close(pdata->inner) < 0 && rc == STREAM_ERROR_NONE) {
+        STREAM_SET_INNER_ERROR("closing inner stream");
+        rc = STREAM_ERROR;
+    }
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    spectrum_release(pdata);
+    stream_free(pdata->inner);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    const int16_t *src = samples;
+    unsigned i = 0;
+
+    while (i < sample_count) {
+        unsigned n = pdata->fft_len - pdata->fill;
+
+        if (n > sample_count - i)
+            n = sample_count - i;
+        dsp_s16_to_float(src + i, pdata->segment + pdata->fill, n);
+        pdata->fill += n;
+        pdata->total += n;
+        i += n;
+        if (pdata->fill == pdata->fft_len && spectrum_segment(stream) < 0)
+            return STREAM_ERROR;
+    }
+    return sample_count;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned group = pdata->fft_len / 2 / pdata->bins;
+
+    if (pdata->frames)
+        snprintf(buf, len, "%llu spectra of %u bins, peak %.0f Hz %.1f dBFS"
+                , pdata->frames, pdata->bins
+                , (pdata->peak_bin * group + (group - 1) / 2.) * stream->fs / pdata->fft_len
+                , pdata->peak_level / 100.);
+    else
+        snprintf(buf, len, "no spectra yet, %llu samples", pdata->total);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+int stream_impl_spectrum_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+    char *args = strdup(stream->args);
+    char *inner;
+
+    if (spectrum_parse(pdata, args, &inner) < 0
+            || (pdata->inner = stream_new(stream->direction, inner)) == NULL) {
+        free(args);
+        free(pdata);
+        return STREAM_ERROR;
+    }
+    free(args);
+
+    stream->pdata = pdata;
+    stream_stage_init(stream, pdata->inner);
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    strncpy(stream->name, "SPECTRUM", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -9,6 +9,9 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
@@ -18,6 +21,20 @@
 
 #include <stream.h>
 
+/* connect mode output: samples go through bounded ring, so peer restart
+ * does not stop capture */
+#define TCP_RING_SIZE       (8 * 1024 * 1024)
+#define TCP_BACKOFF_MIN_MS  100
+#define TCP_BACKOFF_MAX_MS  10000
+// Time to send buffered data on close.
+#define TCP_DRAIN_MS        1000
+
+enum {
+    TCP_DISCONNECTED,
+    TCP_CONNECTING,
+    TCP_CONNECTED
+};
+
 struct private_data_t
 {
     // Code of last error.
@@ -29,6 +46,24 @@ struct private_data_t
     int fd;
     // socket parameters
     struct sockaddr_in saun;
+
+    // Ring of not yet sent data, NULL if not in buffered mode.
+    char *ring;
+    size_t ring_size;
+    size_t ring_head;
+    size_t ring_len;
+    // Bytes taken from ring since open, sent or dropped.
+    unsigned long long consumed;
+
+    int state;
+    long backoff_ms;
+    struct timespec next_try;
+
+    unsigned long disconnects;
+    // Samples written while peer was not connected.
+    unsigned long long buffered;
+    // Samples dropped because ring was full.
+    unsigned long long lost;
 };
 
 static int stream_impl_open_connect(stream_t *stream)
@@ -93,14 +128,212 @@ stream_impl_listen_error:
 
 }
 
+static int tcp_ring_init(stream_t *stream, const char *size_s)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    pdata->ring_size = TCP_RING_SIZE;
+    if (size_s) {
+        char *endptr;
+
+        errno = 0;
+        pdata->ring_size = strtoul(size_s, &endptr, 10) * 1024;
+        if (errno || *endptr || pdata->ring_size == 0) {
+            errno = EINVAL;
+            STREAM_RETURN_ERROR("buffer size", EINVAL);
+        }
+    }
+    pdata->ring_size -= pdata->ring_size % stream->sample_size;
+
+    pdata->ring = malloc(pdata->ring_size);
+    if (!pdata->ring) {
+        errno = ENOMEM;
+        STREAM_RETURN_ERROR("allocating buffer", ENOMEM);
+    }
+    pdata->ring_head = pdata->ring_len = 0;
+    pdata->consumed = 0;
+    pdata->state = TCP_CONNECTED;
+    pdata->backoff_ms = TCP_BACKOFF_MIN_MS;
+    pdata->disconnects = 0;
+    pdata->buffered = pdata->lost = 0;
+
+    fcntl(pdata->fd, F_SETFL, fcntl(pdata->fd, F_GETFL) | O_NONBLOCK);
+    return STREAM_ERROR_NONE;
+}
+
+/* unsent rest of a partially sent sample at ring head, kept while connected */
+static size_t tcp_ring_partial(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned ss = stream->sample_size;
+    size_t rest;
+
+    if (pdata->state == TCP_DISCONNECTED || pdata->consumed % ss == 0)
+        return 0;
+    rest = ss - pdata->consumed % ss;
+    return rest < pdata->ring_len ? rest : pdata->ring_len;
+}
+
+/* remove whole samples from ring head. Rest of partially sent sample stays
+ * at head while connected, so peer keeps sample alignment; without
+ * connection it is dropped together with the samples. */
+static void tcp_ring_drop(stream_t *stream, size_t len, int count_lost)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned ss = stream->sample_size;
+    size_t keep = tcp_ring_partial(stream);
+    unsigned long long end;
+    size_t i;
+
+    if (keep) {
+        len = (len + ss - 1) / ss * ss;
+        if (len > pdata->ring_len - keep)
+            len = (pdata->ring_len - keep) / ss * ss;
+        if (count_lost)
+            pdata->lost += len / ss;
+        /* move the rest over dropped samples */
+        for (i = keep; i-- > 0; )
+            pdata->ring[(pdata->ring_head + len + i) % pdata->ring_size] =
+                pdata->ring[(pdata->ring_head + i) % pdata->ring_size];
+    } else {
+        end = (pdata->consumed + len + ss - 1) / ss * ss;
+        len = end - pdata->consumed;
+        if (len > pdata->ring_len)
+            len = pdata->ring_len;
+        if (count_lost)
+            pdata->lost += (pdata->consumed + len + ss - 1) / ss - (pdata->consumed + ss - 1) / ss;
+    }
+
+    pdata->ring_head = (pdata->ring_head + len) % pdata->ring_size;
+    pdata->ring_len -= len;
+    pdata->consumed += len;
+}
+
+static void tcp_ring_push(stream_t *stream, const char *data, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned ss = stream->sample_size;
+    size_t room = pdata->ring_size - tcp_ring_partial(stream);
+    size_t tail, n;
+
+    /* ring is full: oldest samples are lost */
+    if (len > room) {
+        n = (len - room + ss - 1) / ss * ss;
+        pdata->lost += n / ss;
+        data += n;
+        len -= n;
+    }
+    if (pdata->ring_len + len > pdata->ring_size)
+        tcp_ring_drop(stream, pdata->ring_len + len - pdata->ring_size, 1);
+
+    tail = (pdata->ring_head + pdata->ring_len) % pdata->ring_size;
+    n = pdata->ring_size - tail;
+    if (n > len)
+        n = len;
+    memcpy(pdata->ring + tail, data, n);
+    memcpy(pdata->ring, data + n, len - n);
+    pdata->ring_len += len;
+}
+
+static void tcp_disconnect(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (pdata->fd >= 0)
+        close(pdata->fd);
+    pdata->fd = -1;
+    if (pdata->state == TCP_CONNECTED)
+        pdata->disconnects++;
+    pdata->state = TCP_DISCONNECTED;
+
+    /* new connection must start from the whole sample */
+    tcp_ring_drop(stream, 0, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &pdata->next_try);
+    pdata->next_try.tv_sec  += pdata->backoff_ms / 1000;
+    pdata->next_try.tv_nsec += (pdata->backoff_ms % 1000) * 1000000L;
+    if (pdata->next_try.tv_nsec >= 1000000000L)
+        pdata->next_try.tv_sec++, pdata->next_try.tv_nsec -= 1000000000L;
+    pdata->backoff_ms *= 2;
+    if (pdata->backoff_ms > TCP_BACKOFF_MAX_MS)
+        pdata->backoff_ms = TCP_BACKOFF_MAX_MS;
+}
+
+/* non-blocking connection attempt, when backoff time is over */
+static void tcp_reconnect(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct timespec now;
+
+    if (pdata->state == TCP_DISCONNECTED) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec < pdata->next_try.tv_sec
+                || (now.tv_sec == pdata->next_try.tv_sec && now.tv_nsec < pdata->next_try.tv_nsec))
+            return;
+
+        pdata->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (pdata->fd < 0) {
+            tcp_disconnect(stream);
+            return;
+        }
+        if (connect(pdata->fd, (struct sockaddr *)&pdata->saun, sizeof(pdata->saun)) == 0) {
+            pdata->state = TCP_CONNECTED;
+        } else if (errno == EINPROGRESS) {
+            pdata->state = TCP_CONNECTING;
+        } else {
+            tcp_disconnect(stream);
+            return;
+        }
+    }
+
+    if (pdata->state == TCP_CONNECTING) {
+        struct pollfd pfd = { pdata->fd, POLLOUT, 0 };
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (poll(&pfd, 1, 0) <= 0)
+            return;
+        if (getsockopt(pdata->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            tcp_disconnect(stream);
+            return;
+        }
+        pdata->state = TCP_CONNECTED;
+    }
+    pdata->backoff_ms = TCP_BACKOFF_MIN_MS;
+}
+
+static void tcp_ring_send(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    while (pdata->ring_len > 0) {
+        size_t n = pdata->ring_size - pdata->ring_head;
+        ssize_t rc;
+
+        if (n > pdata->ring_len)
+            n = pdata->ring_len;
+        rc = send(pdata->fd, pdata->ring + pdata->ring_head, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                tcp_disconnect(stream);
+            return;
+        }
+        pdata->ring_head = (pdata->ring_head + rc) % pdata->ring_size;
+        pdata->ring_len -= rc;
+        pdata->consumed += rc;
+    }
+}
+
 static int stream_impl_open(stream_t *stream)
 {
     struct private_data_t *pdata = stream->pdata;
     int rc, port;
     char *args;
-    char *socket_type, *ip_s, *port_s;
+    char *socket_type, *ip_s, *port_s, *ring_s;
 
-    /* args: tcp:[connect|listen]:<ip>:<port> */
+    /* args: tcp:[connect|listen]:<ip>:<port>[:<buffer kB>] */
     if (stream->args[0] == 0)
         STREAM_RETURN_ERROR("tcp arguments", EINVAL);
 
@@ -108,6 +341,7 @@ static int stream_impl_open(stream_t *stream)
     socket_type = strtok(args, ":");
     ip_s = strtok(NULL, ":");
     port_s = strtok(NULL, ":");
+    ring_s = strtok(NULL, ":");
     if (!socket_type || !ip_s || !port_s) {
         pdata->error = EINVAL;
         pdata->error_op = "arguments parsing";
@@ -122,6 +356,8 @@ static int stream_impl_open(stream_t *stream)
 
     if (strcmp(socket_type, "connect") == 0) {
         rc = stream_impl_open_connect(stream);
+        if (rc == STREAM_ERROR_NONE && stream->direction == STREAM_OUTPUT)
+            rc = tcp_ring_init(stream, ring_s);
     } else if (strcmp(socket_type, "listen") == 0) {
         rc = stream_impl_open_listen(stream);
     } else {
@@ -142,8 +378,30 @@ static int stream_impl_close(stream_t *stream)
 {
     struct private_data_t *pdata = stream->pdata;
 
+    if (pdata->ring) {
+        struct timespec start, now;
+
+        /* give peer a chance to get the tail of capture */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (pdata->state == TCP_CONNECTED && pdata->ring_len) {
+            struct pollfd pfd = { pdata->fd, POLLOUT, 0 };
+            long ms;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ms = TCP_DRAIN_MS - (now.tv_sec - start.tv_sec) * 1000
+                              - (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (ms <= 0 || poll(&pfd, 1, ms) <= 0)
+                break;
+            tcp_ring_send(stream);
+        }
+        pdata->lost += (pdata->ring_len + stream->sample_size - 1) / stream->sample_size;
+        free(pdata->ring);
+        pdata->ring = NULL;
+    }
+
     if (pdata->fd >= 0)
         close(pdata->fd);
+    pdata->fd = -1;
 
     return STREAM_ERROR_NONE;
 }
@@ -158,7 +416,7 @@ static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned s
 {
     struct private_data_t *pdata = stream->pdata;
     int rv, offset = 0;
-    int requested_length = 2 * sample_count;
+    int requested_length = stream->sample_size * sample_count;
 
     if (stream->direction == STREAM_OUTPUT)
         STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
@@ -175,7 +433,7 @@ static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned s
     } while (offset < requested_length);
 
     if (rv == 0)
-        return offset / 2;
+        return offset / stream->sample_size;
     if (offset != requested_length)
         return STREAM_ERROR;
 
@@ -186,11 +444,23 @@ static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_co
 {
     struct private_data_t *pdata = stream->pdata;
     int rc, offset = 0;
-    int requested_length = 2 * sample_count;
+    int requested_length = stream->sample_size * sample_count;
 
     if (stream->direction == STREAM_INPUT)
         STREAM_RETURN_ERROR("writing to stream", ENOTSUP);
 
+    /* connect mode: never blocks and never fails because of peer */
+    if (pdata->ring) {
+        if (pdata->state != TCP_CONNECTED) {
+            pdata->buffered += sample_count;
+            tcp_reconnect(stream);
+        }
+        tcp_ring_push(stream, samples, (size_t)sample_count * stream->sample_size);
+        if (pdata->state == TCP_CONNECTED)
+            tcp_ring_send(stream);
+        return sample_count;
+    }
+
     do {
         rc = write(pdata->fd, &((char*)samples)[offset], requested_length - offset);
         if (rc > 0) {
@@ -208,6 +478,19 @@ static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_co
     return sample_count;
 }
 
+static int stream_impl_submit_write(stream_t *stream, void* samples, unsigned sample_count, void *tag)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    /* listen mode blocks on peer, worker thread writes it */
+    if (!pdata->ring)
+        return STREAM_ERROR_OP_NOT_SUPP;
+
+    /* samples are copied to ring, so write is complete */
+    stream_complete(stream, tag, stream_impl_write(stream, samples, sample_count));
+    return STREAM_ERROR_NONE;
+}
+
 static int stream_impl_get_errno(stream_t *stream)
 {
     struct private_data_t *pdata = stream->pdata;
@@ -226,6 +509,19 @@ static const char* stream_impl_get_error_op(stream_t *stream)
     return pdata->error_op;
 }
 
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (!pdata->ring)
+        STREAM_RETURN_ERROR("stream status", ENOTSUP);
+
+    snprintf(buf, len, "%s, disconnects %lu, buffered while disconnected %llu samples, lost %llu samples"
+            , pdata->state == TCP_CONNECTED ? "connected" : "disconnected"
+            , pdata->disconnects, pdata->buffered, pdata->lost);
+    return STREAM_ERROR_NONE;
+}
+
 static int stream_impl_count(stream_t* stream)
 {
     struct private_data_t *pdata = stream->pdata;
@@ -234,12 +530,17 @@ static int stream_impl_count(stream_t* stream)
 
 int stream_impl_tcp_new(stream_t *stream)
 {
-    stream->pdata = calloc(1, sizeof(struct private_data_t));
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+
+    pdata->fd = -1;
+    stream->pdata = pdata;
     stream->open         = stream_impl_open;
     stream->close        = stream_impl_close;
     stream->free         = stream_impl_free;
     stream->read         = stream_impl_read;
     stream->write        = stream_impl_write;
+    stream->submit_write = stream_impl_submit_write;
+    stream->status       = stream_impl_status;
     stream->get_errno    = stream_impl_get_errno;
     stream->strerror     = stream_impl_strerror;
     stream->get_error_op = stream_impl_get_error_op;
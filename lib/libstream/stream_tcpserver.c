@@ -0,0 +1,463 @@
+//*************************************************************************
+// Non-blocking TCP server sink serving any number of clients             *
+//*************************************************************************
+
+/* Listener thread accepts clients as soon as they connect and passes them
+ * to the writer, which starts sending them samples from its next write. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include <stream.h>
+
+#define TCPSERVER_BFR_SIZE   (4 * 1024 * 1024)
+// Time to send buffered data to clients on close.
+#define TCPSERVER_DRAIN_MS   500
+
+struct client_t
+{
+    int fd;
+    // Not yet sent data: bfr[off .. len).
+    char *bfr;
+    size_t off;
+    size_t len;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    // listening socket
+    int fd;
+    // Per client buffer size in bytes.
+    size_t bfr_size;
+
+    struct client_t *clients;
+    unsigned nclients;
+    // Clients dropped because they were too slow or failed.
+    unsigned long dropped;
+
+    // Listener thread, stopped by wake_fd.
+    pthread_t listener;
+    int listener_started;
+    int wake_fd;
+    // Accepted by listener and not yet taken by writer, under lock.
+    pthread_mutex_t lock;
+    int *pending;
+    unsigned npending;
+    unsigned long accepted;
+};
+
+static void tcpserver_drop(struct private_data_t *pdata, unsigned i)
+{
+    close(pdata->clients[i].fd);
+    free(pdata->clients[i].bfr);
+    pdata->clients[i] = pdata->clients[--pdata->nclients];
+}
+
+/* take all clients waiting in backlog */
+static void* tcpserver_listener(void *arg)
+{
+    struct private_data_t *pdata = arg;
+    struct pollfd pfd[2] = { { pdata->fd, POLLIN, 0 }, { pdata->wake_fd, POLLIN, 0 } };
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+            break;
+        if (pfd[1].revents)
+            break;
+        if (!pfd[0].revents)
+            continue;
+
+        for (;;) {
+            int fd, opt = 1, *p;
+
+            fd = accept4(pdata->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                break;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+            pthread_mutex_lock(&pdata->lock);
+            p = realloc(pdata->pending, (pdata->npending + 1) * sizeof(*p));
+            if (p) {
+                pdata->pending = p;
+                pdata->pending[pdata->npending++] = fd;
+                pdata->accepted++;
+            }
+            pthread_mutex_unlock(&pdata->lock);
+            if (!p)
+                close(fd);
+        }
+    }
+    return NULL;
+}
+
+/* move clients accepted by listener to the list of writer */
+static void tcpserver_take_pending(struct private_data_t *pdata)
+{
+    struct client_t *c;
+    unsigned i;
+
+    pthread_mutex_lock(&pdata->lock);
+    if (pdata->npending) {
+        c = realloc(pdata->clients, (pdata->nclients + pdata->npending) * sizeof(*c));
+        if (c) {
+            pdata->clients = c;
+            for (i = 0; i < pdata->npending; i++) {
+                c = &pdata->clients[pdata->nclients++];
+                memset(c, 0, sizeof(*c));
+                c->fd = pdata->pending[i];
+            }
+        } else {
+            for (i = 0; i < pdata->npending; i++)
+                close(pdata->pending[i]);
+        }
+        pdata->npending = 0;
+    }
+    pthread_mutex_unlock(&pdata->lock);
+}
+
+/* send as much as socket takes. Return -1 if client must be dropped */
+static int tcpserver_send(int fd, const char **data, size_t *len)
+{
+    while (*len > 0) {
+        ssize_t rc = send(fd, *data, *len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        *data += rc;
+        *len  -= rc;
+    }
+    return 0;
+}
+
+static int tcpserver_flush(struct client_t *c)
+{
+    const char *data = c->bfr + c->off;
+    size_t len = c->len - c->off;
+
+    if (tcpserver_send(c->fd, &data, &len) < 0)
+        return -1;
+    c->off = c->len - len;
+    if (c->off == c->len)
+        c->off = c->len = 0;
+    return 0;
+}
+
+/* queue data which socket did not take. Return -1 if client is too slow */
+static int tcpserver_queue(struct private_data_t *pdata, struct client_t *c, const char *data, size_t len)
+{
+    if (len == 0)
+        return 0;
+
+    if (c->len - c->off + len > pdata->bfr_size)
+        return -1;
+
+    if (!c->bfr) {
+        c->bfr = malloc(pdata->bfr_size);
+        if (!c->bfr)
+            return -1;
+    }
+    if (c->len + len > pdata->bfr_size) {
+        memmove(c->bfr, c->bfr + c->off, c->len - c->off);
+        c->len -= c->off;
+        c->off  = 0;
+    }
+    memcpy(c->bfr + c->len, data, len);
+    c->len += len;
+    return 0;
+}
+
+/* <ip>:<port>[:<buffer kB>], IPv6 address in brackets: [::1]:5000 */
+static int tcpserver_parse_args(char *args, char **ip_s, char **port_s, char **size_s)
+{
+    char *p;
+
+    if (args[0] == '[') {
+        *ip_s = args + 1;
+        p = strchr(args, ']');
+        if (!p || p[1] != ':')
+            return -1;
+        *p = 0;
+        p += 2;
+    } else {
+        *ip_s = args;
+        p = strchr(args, ':');
+        if (!p)
+            return -1;
+        *p++ = 0;
+    }
+    *port_s = p;
+    *size_s = strchr(p, ':');
+    if (*size_s)
+        *(*size_s)++ = 0;
+
+    return **ip_s && **port_s ? 0 : -1;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct addrinfo hints, *res, *rp;
+    char *args, *ip_s, *port_s, *size_s;
+    int opt, rc;
+
+    /* args: tcpserver:<ip>:<port>[:<buffer kB>], <ip> may be [<IPv6 address>] */
+    if (stream->direction != STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("opening stream", ENOTSUP);
+
+    args = strdup(stream->args);
+    if (tcpserver_parse_args(args, &ip_s, &port_s, &size_s) < 0) {
+        free(args);
+        STREAM_RETURN_ERROR("arguments parsing", EINVAL);
+    }
+
+    pdata->bfr_size = TCPSERVER_BFR_SIZE;
+    if (size_s) {
+        char *endptr;
+
+        errno = 0;
+        pdata->bfr_size = strtoul(size_s, &endptr, 10) * 1024;
+        if (errno || *endptr || pdata->bfr_size == 0) {
+            free(args);
+            STREAM_RETURN_ERROR("client buffer size", EINVAL);
+        }
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    rc = getaddrinfo(ip_s, port_s, &hints, &res);
+    free(args);
+    if (rc != 0)
+        STREAM_RETURN_ERROR("address parsing", EINVAL);
+
+    pdata->fd = -1;
+    for (rp = res; rp != NULL; rp = rp->ai_next) {
+        pdata->fd = socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, rp->ai_protocol);
+        if (pdata->fd < 0) {
+            STREAM_SET_ERROR("socket creation", errno);
+            continue;
+        }
+
+        opt = 1;
+        setsockopt(pdata->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (bind(pdata->fd, rp->ai_addr, rp->ai_addrlen) == 0 && listen(pdata->fd, 16) == 0)
+            break;
+
+        STREAM_SET_ERROR("binding socket", errno);
+        close(pdata->fd);
+        pdata->fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (pdata->fd < 0)
+        return STREAM_ERROR;
+
+    pdata->nclients = pdata->npending = 0;
+    pdata->accepted = pdata->dropped = 0;
+
+    pdata->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (pdata->wake_fd < 0) {
+        STREAM_SET_ERROR("starting listener", errno);
+        goto stream_impl_open_error;
+    }
+    pthread_mutex_init(&pdata->lock, NULL);
+    /* pthread_create() returns error code, errno is not set */
+    rc = pthread_create(&pdata->listener, NULL, tcpserver_listener, pdata);
+    if (rc != 0) {
+        STREAM_SET_ERROR("starting listener", rc);
+        pthread_mutex_destroy(&pdata->lock);
+        close(pdata->wake_fd);
+        goto stream_impl_open_error;
+    }
+    pdata->listener_started = 1;
+    return STREAM_ERROR_NONE;
+
+stream_impl_open_error:
+    close(pdata->fd);
+    pdata->fd = -1;
+    return STREAM_ERROR;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct timespec start, now;
+    unsigned i;
+
+    if (pdata->fd < 0)
+        return STREAM_ERROR_NONE;
+    if (pdata->listener_started) {
+        eventfd_write(pdata->wake_fd, 1);
+        pthread_join(pdata->listener, NULL);
+        pdata->listener_started = 0;
+        close(pdata->wake_fd);
+        tcpserver_take_pending(pdata);
+        pthread_mutex_destroy(&pdata->lock);
+        free(pdata->pending);
+        pdata->pending = NULL;
+    }
+    close(pdata->fd);
+    pdata->fd = -1;
+
+    /* give clients a chance to get the tail of capture */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        struct pollfd pfd[pdata->nclients ? pdata->nclients : 1];
+        unsigned n = 0;
+        long ms;
+
+        for (i = 0; i < pdata->nclients; i++) {
+            if (pdata->clients[i].len == pdata->clients[i].off)
+                continue;
+            pfd[n].fd = pdata->clients[i].fd;
+            pfd[n].events = POLLOUT;
+            n++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = TCPSERVER_DRAIN_MS - (now.tv_sec - start.tv_sec) * 1000
+                                - (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (n == 0 || ms <= 0 || poll(pfd, n, ms) <= 0)
+            break;
+
+        for (i = 0; i < pdata->nclients; i++) {
+            if (pdata->clients[i].len != pdata->clients[i].off && tcpserver_flush(&pdata->clients[i]) < 0)
+                pdata->clients[i].off = pdata->clients[i].len;
+        }
+    }
+
+    while (pdata->nclients)
+        tcpserver_drop(pdata, 0);
+    free(pdata->clients);
+    pdata->clients = NULL;
+
+    return STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t length = (size_t)sample_count * stream->sample_size;
+    unsigned i;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing to stream", ENOTSUP);
+
+    tcpserver_take_pending(pdata);
+
+    /* capture never waits for clients: slow or broken one is dropped */
+    for (i = 0; i < pdata->nclients; ) {
+        struct client_t *c = &pdata->clients[i];
+        const char *data = samples;
+        size_t len = length;
+        int rc = 0;
+
+        if (c->len != c->off)
+            rc = tcpserver_flush(c);
+        if (rc == 0 && c->len == c->off)
+            rc = tcpserver_send(c->fd, &data, &len);
+        if (rc == 0)
+            rc = tcpserver_queue(pdata, c, data, len);
+
+        if (rc < 0) {
+            tcpserver_drop(pdata, i);
+            pdata->dropped++;
+        } else
+            i++;
+    }
+
+    return sample_count;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    unsigned long accepted = pdata->accepted;
+    unsigned nclients = pdata->nclients;
+
+    /* clients accepted meanwhile are counted already */
+    if (pdata->listener_started) {
+        pthread_mutex_lock(&pdata->lock);
+        accepted = pdata->accepted;
+        nclients += pdata->npending;
+        pthread_mutex_unlock(&pdata->lock);
+    }
+    snprintf(buf, len, "clients %u, accepted %lu, dropped %lu"
+            , nclients, accepted, pdata->dropped);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    STREAM_RETURN_ERROR("stream count", ENOTSUP);
+}
+
+int stream_impl_tcpserver_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+
+    pdata->fd = -1;
+    stream->pdata = pdata;
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "TCPSERVER", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
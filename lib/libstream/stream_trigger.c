@@ -0,0 +1,412 @@
+//*************************************************************************
+// Energy trigger: pass only loud parts of signal to other stream         *
+//*************************************************************************
+
+/* args: trigger:[<dB>][,<pre>[,<post>[,<window>[,<segments>]]]]:<driver>:<args>
+ *
+ * Output only. Mean power of every <window> (default 256 samples) is
+ * compared with running noise floor, made of quiet windows: it follows
+ * power down fast and up with time constant of 2 s. Window <dB> (default
+ * 10) above floor starts segment, which ends after <post> (default 1 s)
+ * of quiet windows and begins <pre> (default 0.5 s) before the window.
+ * Lengths are in samples or in seconds with 's' suffix. Only segments
+ * are written to inner stream.
+ *
+ * Segment start is marked as event "trigger" with absolute sample index
+ * in inner stream. With <segments> file every segment is written there
+ * as line "<first sample> <samples> <offset in inner stream> <host time>",
+ * so positions in original stream can be rebuilt from raw output too. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include <stream.h>
+#include <stream_dsp.h>
+
+#define TRIGGER_DB            10.
+#define TRIGGER_PRE           0.5
+#define TRIGGER_POST          1.
+#define TRIGGER_WINDOW        256
+// Time constant of rising noise floor, s. Falling one is 10 times shorter.
+#define TRIGGER_FLOOR_TAU     2.
+#define TRIGGER_LEN_MAX       (60 * 1000000.)
+
+// Length in samples or in seconds.
+struct trigger_len_t
+{
+    double value;
+    int seconds;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    stream_t *inner;
+    double db;
+    struct trigger_len_t pre_len;
+    struct trigger_len_t post_len;
+    struct trigger_len_t window_len;
+    char segments_name[256];
+    FILE *segments;
+
+    unsigned pre;
+    unsigned post;
+    unsigned window;
+    double ratio;
+    double rise;
+    double fall;
+
+    // History of pre + window samples by absolute index.
+    int16_t *ring;
+    unsigned ring_len;
+    // Samples taken, absolute index of the next one.
+    unsigned long long total;
+    // Energy and length of current window.
+    uint64_t energy;
+    unsigned fill;
+    // Power of quiet windows, LSB^2.
+    double floor;
+    double power;
+
+    int active;
+    unsigned long long seg_start;
+    unsigned long long seg_offset;
+    struct timeval seg_time;
+    // Quiet samples of active segment.
+    unsigned long quiet;
+    // Samples passed to inner stream, end of last segment.
+    unsigned long long passed;
+    unsigned long long seg_end;
+    unsigned long nsegments;
+};
+
+static int trigger_parse_len(const char *s, struct trigger_len_t *len)
+{
+    char *end;
+
+    len->value = strtod(s, &end);
+    len->seconds = *end == 's';
+    if (len->seconds)
+        end++;
+    if (end == s || *end || len->value < 0 || len->value > TRIGGER_LEN_MAX)
+        return -1;
+    return 0;
+}
+
+static int trigger_parse(struct private_data_t *pdata, char *args, char **inner)
+{
+    char *colon = strchr(args, ':');
+    char *p = args, *tok, *end;
+    int n, rc = 0;
+
+    if (!colon || !colon[1])
+        return -1;
+    *colon = 0;
+    *inner = colon + 1;
+
+    pdata->db = TRIGGER_DB;
+    pdata->pre_len.value = TRIGGER_PRE;
+    pdata->pre_len.seconds = 1;
+    pdata->post_len.value = TRIGGER_POST;
+    pdata->post_len.seconds = 1;
+    pdata->window_len.value = TRIGGER_WINDOW;
+    pdata->window_len.seconds = 0;
+
+    for (n = 0; rc == 0 && (tok = strsep(&p, ",")) != NULL; n++) {
+        /* empty is default */
+        if (!*tok)
+            continue;
+        if (n == 0) {
+            pdata->db = strtod(tok, &end);
+            if (end == tok || *end || pdata->db <= 0)
+                rc = -1;
+        } else if (n == 1) {
+            rc = trigger_parse_len(tok, &pdata->pre_len);
+        } else if (n == 2) {
+            rc = trigger_parse_len(tok, &pdata->post_len);
+        } else if (n == 3) {
+            rc = trigger_parse_len(tok, &pdata->window_len);
+        } else if (n == 4) {
+            snprintf(pdata->segments_name, sizeof(pdata->segments_name), "%s", tok);
+        } else {
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+static unsigned trigger_samples(const struct trigger_len_t *len, unsigned fs)
+{
+    return (unsigned)(len->seconds ? len->value * fs + 0.5 : len->value);
+}
+
+/* Pass samples [from, to) of history to inner stream */
+static int trigger_pass(stream_t *stream, unsigned long long from, unsigned long long to)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    while (from < to) {
+        unsigned pos = from % pdata->ring_len;
+        unsigned n = pdata->ring_len - pos;
+        int rc;
+
+        if (n > to - from)
+            n = to - from;
+        rc = stream_write(pdata->inner, pdata->ring + pos, n);
+        if (rc < 0) {
+            STREAM_SET_INNER_ERROR("writing inner stream");
+            return rc;
+        }
+        from += n;
+        pdata->passed += n;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static void trigger_segment_start(stream_t *stream, unsigned long long start)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char value[32];
+
+    pdata->active = 1;
+    pdata->quiet = 0;
+    pdata->seg_start = start;
+    pdata->seg_offset = pdata->passed;
+    gettimeofday(&pdata->seg_time, NULL);
+    snprintf(value, sizeof(value), "%llu", start);
+    stream_mark(pdata->inner, "trigger", value);
+}
+
+static void trigger_segment_end(stream_t *stream, unsigned long long end)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    pdata->active = 0;
+    pdata->seg_end = end;
+    pdata->nsegments++;
+    if (!pdata->segments)
+        return;
+    fprintf(pdata->segments, "%llu %llu %llu %ld.%06ld\n", pdata->seg_start, end - pdata->seg_start
+            , pdata->seg_offset, (long)pdata->seg_time.tv_sec, (long)pdata->seg_time.tv_usec);
+    fflush(pdata->segments);
+}
+
+/* Window [total - window, total) is complete */
+static int trigger_window(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned long long end = pdata->total, begin = end - pdata->window;
+    int loud;
+
+    pdata->power = (double)pdata->energy / pdata->window;
+    pdata->energy = 0;
+    pdata->fill = 0;
+    if (pdata->floor == 0)
+        pdata->floor = pdata->power > 1. ? pdata->power : 1.;
+    loud = pdata->power > pdata->floor * pdata->ratio;
+
+    if (!pdata->active) {
+        if (!loud) {
+            pdata->floor += (pdata->power - pdata->floor) * (pdata->power < pdata->floor ? pdata->fall : pdata->rise);
+            /* digital silence would make every sample loud */
+            if (pdata->floor < 1.)
+                pdata->floor = 1.;
+            return STREAM_ERROR_NONE;
+        }
+        /* pre-roll, but not samples of previous segment */
+        begin = begin > pdata->pre ? begin - pdata->pre : 0;
+        if (begin < pdata->seg_end)
+            begin = pdata->seg_end;
+        trigger_segment_start(stream, begin);
+    } else if (loud) {
+        pdata->quiet = 0;
+    } else {
+        pdata->quiet += pdata->window;
+    }
+
+    if (trigger_pass(stream, begin, end) < 0)
+        return STREAM_ERROR;
+    if (pdata->quiet >= pdata->post && pdata->quiet > 0)
+        trigger_segment_end(stream, end);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    double windows;
+
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t))
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
+
+    pdata->pre = trigger_samples(&pdata->pre_len, stream->fs);
+    pdata->post = trigger_samples(&pdata->post_len, stream->fs);
+    pdata->window = trigger_samples(&pdata->window_len, stream->fs);
+    if (pdata->window == 0)
+        STREAM_RETURN_ERROR("window length", EINVAL);
+    pdata->ratio = pow(10., pdata->db / 10.);
+    windows = TRIGGER_FLOOR_TAU * stream->fs / pdata->window;
+    pdata->rise = windows > 1. ? 1. / windows : 1.;
+    pdata->fall = windows > 10. ? 10. / windows : 1.;
+
+    pdata->ring_len = pdata->pre + pdata->window;
+    pdata->ring = malloc(pdata->ring_len * sizeof(int16_t));
+    if (!pdata->ring)
+        STREAM_RETURN_ERROR("allocating memory", ENOMEM);
+    pdata->total = 0;
+    pdata->energy = 0;
+    pdata->fill = 0;
+    pdata->floor = 0;
+    pdata->power = 0;
+    pdata->active = 0;
+    pdata->passed = 0;
+    pdata->seg_end = 0;
+    pdata->nsegments = 0;
+
+    if (pdata->segments_name[0]) {
+        pdata->segments = fopen(pdata->segments_name, "w");
+        if (!pdata->segments)
+            STREAM_RETURN_ERROR("opening segments file", errno);
+        fprintf(pdata->segments, "# first_sample samples offset host_time, fs %u, %g dB over floor\n"
+                , stream->fs, pdata->db);
+    }
+
+    stream_set_fs(pdata->inner, stream->fs);
+    stream_set_nsamples(pdata->inner, stream->nsamples);
+    if (stream_open(pdata->inner)) {
+        STREAM_SET_INNER_ERROR("opening inner stream");
+        return STREAM_ERROR;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static void trigger_release(struct private_data_t *pdata)
+{
+    free(pdata->ring);
+    pdata->ring = NULL;
+    if (pdata->segments)
+        fclose(pdata->segments);
+    pdata->segments = NULL;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+
+    /* segment in progress ends with the stream, partial window too */
+    if (pdata->ring && pdata->active) {
+        rc = trigger_pass(stream, pdata->total - pdata->fill, pdata->total);
+        trigger_segment_end(stream, pdata->total);
+    }
+    trigger_release(pdata);
+    if (stream_close(pdata->inner) < 0 && rc == STREAM_ERROR_NONE) {
+        STREAM_SET_INNER_ERROR("closing inner stream");
+        rc = STREAM_ERROR;
+    }
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    trigger_release(pdata);
+    stream_free(pdata->inner);
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    const int16_t *src = samples;
+    unsigned i = 0;
+
+    while (i < sample_count) {
+        unsigned pos = pdata->total % pdata->ring_len;
+        unsigned n = pdata->window - pdata->fill;
+
+        if (n > sample_count - i)
+            n = sample_count - i;
+        if (n > pdata->ring_len - pos)
+            n = pdata->ring_len - pos;
+        memcpy(pdata->ring + pos, src + i, n * sizeof(int16_t));
+        pdata->energy += dsp_energy_s16(src + i, n);
+        pdata->fill += n;
+        pdata->total += n;
+        i += n;
+        if (pdata->fill == pdata->window && trigger_window(stream) < 0)
+            return STREAM_ERROR;
+    }
+    return sample_count;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    snprintf(buf, len, "%s, %lu segments, %llu of %llu samples passed, floor %.1f dBFS"
+            , pdata->active ? "triggered" : "quiet", pdata->nsegments + pdata->active
+            , pdata->passed, pdata->total
+            , pdata->floor > 0 ? 10 * log10(pdata->floor / (32768. * 32768.)) : -INFINITY);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+int stream_impl_trigger_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+    char *args = strdup(stream->args);
+    char *inner;
+
+    if (trigger_parse(pdata, args, &inner) < 0
+            || (pdata->inner = stream_new(stream->direction, inner)) == NULL) {
+        free(args);
+        free(pdata);
+        return STREAM_ERROR;
+    }
+    free(args);
+
+    stream->pdata = pdata;
+    stream_stage_init(stream, pdata->inner);
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->write        = stream_impl_write;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    strncpy(stream->name, "TRIGGER", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
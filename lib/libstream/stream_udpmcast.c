@@ -0,0 +1,395 @@
+//*************************************************************************
+// UDP multicast driver: one stream for any number of hosts on LAN        *
+//*************************************************************************
+
+/* args: udpmcast:<group>:<port>[:<ttl>[:<interface address>]]
+ *
+ * Every datagram is a header followed by up to 1400 bytes of samples:
+ *     0  "SDMU"
+ *     4  u32 sequence number of datagram
+ *     8  u64 index of first sample in stream
+ *    16  u32 sampling frequency
+ *    20  u16 number of samples, a sample is one value of every channel
+ *    22  u16 sample format: 0 s16le, 1 s16be, 2 f32, 3 ulaw
+ *    24  u16 number of interleaved channels
+ *    26  u16 reserved, 0
+ * Header fields are little endian, f32 samples are in host byte order.
+ * Receivers skip datagrams of other format or channels than their own.
+ *
+ * Input mode joins the group and fills lost datagrams with zeros, so
+ * sample positions are kept. contrib/udpmcast-rx.py is a receiver
+ * for hosts without sdmsh. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <stream.h>
+
+#define UDPMCAST_HDR_SIZE    28
+// 28 + 1400 bytes fit into 1500 bytes MTU with IP and UDP headers.
+#define UDPMCAST_PAYLOAD     1400
+#define UDPMCAST_BATCH       64
+// Larger jump of sample index means sender restart, stream is resynchronised
+// without filling.
+#define UDPMCAST_MAX_FILL    (1024 * 1024)
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    int fd;
+    struct sockaddr_in group;
+    uint32_t seq;
+    // Index of next sample.
+    uint64_t sample;
+
+    // Output: headers of one batch.
+    uint8_t hdr[UDPMCAST_BATCH][UDPMCAST_HDR_SIZE];
+    struct mmsghdr msgs[UDPMCAST_BATCH];
+    struct iovec iov[UDPMCAST_BATCH][2];
+
+    // Input: last received datagram.
+    uint8_t pkt[UDPMCAST_HDR_SIZE + UDPMCAST_PAYLOAD];
+    unsigned pkt_len;
+    unsigned pkt_pos;
+    // Samples of zeros to return before current datagram.
+    uint64_t fill;
+    int synced;
+
+    unsigned long long packets;
+    unsigned long long lost_packets;
+    unsigned long long lost_samples;
+};
+
+static inline void wr16(uint8_t *p, uint16_t v) { v = htole16(v); memcpy(p, &v, 2); }
+static inline void wr32(uint8_t *p, uint32_t v) { v = htole32(v); memcpy(p, &v, 4); }
+static inline void wr64(uint8_t *p, uint64_t v) { v = htole64(v); memcpy(p, &v, 8); }
+static inline uint16_t rd16(const uint8_t *p) { uint16_t v; memcpy(&v, p, 2); return le16toh(v); }
+static inline uint32_t rd32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return le32toh(v); }
+static inline uint64_t rd64(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return le64toh(v); }
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char *args, *group_s, *port_s, *ttl_s, *if_s;
+    struct in_addr ifaddr;
+    int opt;
+
+    /* one sample of all channels must fit into datagram */
+    if (stream->sample_size > UDPMCAST_PAYLOAD || stream->channels > UINT16_MAX)
+        STREAM_RETURN_ERROR("checking number of channels", EINVAL);
+
+    args = strdup(stream->args);
+    group_s = strtok(args, ":");
+    port_s  = strtok(NULL, ":");
+    ttl_s   = strtok(NULL, ":");
+    if_s    = strtok(NULL, ":");
+
+    memset(&pdata->group, 0, sizeof(pdata->group));
+    pdata->group.sin_family = AF_INET;
+    ifaddr.s_addr = htonl(INADDR_ANY);
+    if (!group_s || !port_s || inet_pton(AF_INET, group_s, &pdata->group.sin_addr) != 1
+            || !IN_MULTICAST(ntohl(pdata->group.sin_addr.s_addr))
+            || (if_s && inet_pton(AF_INET, if_s, &ifaddr) != 1)) {
+        free(args);
+        STREAM_RETURN_ERROR("arguments parsing", EINVAL);
+    }
+    pdata->group.sin_port = htons(atoi(port_s));
+    opt = ttl_s ? atoi(ttl_s) : 1;
+    free(args);
+
+    pdata->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (pdata->fd < 0)
+        STREAM_RETURN_ERROR("socket creation", errno);
+
+    pdata->seq = 0;
+    pdata->sample = 0;
+    pdata->packets = pdata->lost_packets = pdata->lost_samples = 0;
+
+    if (stream->direction == STREAM_OUTPUT) {
+        unsigned char ttl = opt, loop = 1;
+
+        if (setsockopt(pdata->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0
+                || setsockopt(pdata->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0
+                || (if_s && setsockopt(pdata->fd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) < 0)) {
+            STREAM_SET_ERROR("setting socket parameters", errno);
+            goto stream_impl_open_error;
+        }
+        if (connect(pdata->fd, (struct sockaddr *)&pdata->group, sizeof(pdata->group)) < 0) {
+            STREAM_SET_ERROR("connecting socket", errno);
+            goto stream_impl_open_error;
+        }
+    } else {
+        struct sockaddr_in addr = pdata->group;
+        struct ip_mreq mreq;
+
+        opt = 1;
+        setsockopt(pdata->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        /* bigger buffer rides out scheduling delays of reader */
+        opt = 4 * 1024 * 1024;
+        setsockopt(pdata->fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+
+        if (bind(pdata->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            STREAM_SET_ERROR("binding socket", errno);
+            goto stream_impl_open_error;
+        }
+        mreq.imr_multiaddr = pdata->group.sin_addr;
+        mreq.imr_interface = ifaddr;
+        if (setsockopt(pdata->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            STREAM_SET_ERROR("joining multicast group", errno);
+            goto stream_impl_open_error;
+        }
+        pdata->pkt_len = pdata->pkt_pos = 0;
+        pdata->fill = 0;
+        pdata->synced = 0;
+    }
+
+    return STREAM_ERROR_NONE;
+
+stream_impl_open_error:
+    close(pdata->fd);
+    pdata->fd = -1;
+    return STREAM_ERROR;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (pdata->fd >= 0)
+        close(pdata->fd);
+    pdata->fd = -1;
+
+    return STREAM_ERROR_NONE;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+/* receive next datagram and check it against expected sequence */
+static int udpmcast_recv(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    for (;;) {
+        ssize_t rc = recv(pdata->fd, pdata->pkt, sizeof(pdata->pkt), 0);
+        uint64_t first;
+        uint32_t seq;
+        unsigned n;
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            STREAM_RETURN_ERROR("receiving datagram", errno);
+        }
+        if (rc < UDPMCAST_HDR_SIZE || memcmp(pdata->pkt, "SDMU", 4))
+            continue;
+        n = rd16(pdata->pkt + 20);
+        if ((size_t)rc != UDPMCAST_HDR_SIZE + (size_t)n * stream->sample_size
+                || rd16(pdata->pkt + 22) != stream->format
+                || rd16(pdata->pkt + 24) != stream->channels)
+            continue;
+
+        seq   = rd32(pdata->pkt + 4);
+        first = rd64(pdata->pkt + 8);
+        stream->fs = rd32(pdata->pkt + 16);
+
+        /* sender restarted: index went far back */
+        if (pdata->synced && first + UDPMCAST_MAX_FILL < pdata->sample)
+            pdata->synced = 0;
+        if (pdata->synced && first < pdata->sample)
+            continue; /* duplicate or reordered */
+
+        if (pdata->synced && first > pdata->sample) {
+            uint64_t gap = first - pdata->sample;
+
+            pdata->lost_packets += (uint32_t)(seq - pdata->seq);
+            pdata->lost_samples += gap;
+            if (gap <= UDPMCAST_MAX_FILL)
+                pdata->fill = gap;
+            else
+                pdata->sample = first;
+        }
+        if (!pdata->synced)
+            pdata->sample = first;
+
+        pdata->synced  = 1;
+        pdata->seq     = seq + 1;
+        pdata->pkt_len = n;
+        pdata->pkt_pos = 0;
+        pdata->packets++;
+        return STREAM_ERROR_NONE;
+    }
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned n = 0;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
+
+    if (pdata->fill == 0 && pdata->pkt_pos == pdata->pkt_len) {
+        int rc = udpmcast_recv((stream_t *)stream);
+
+        if (rc < 0)
+            return rc;
+    }
+
+    /* lost datagrams: keep positions of following samples */
+    if (pdata->fill) {
+        n = pdata->fill < sample_count ? pdata->fill : sample_count;
+        memset(samples, 0, (size_t)n * stream->sample_size);
+        pdata->fill   -= n;
+        pdata->sample += n;
+        return n;
+    }
+
+    n = pdata->pkt_len - pdata->pkt_pos;
+    if (n > sample_count)
+        n = sample_count;
+    memcpy(samples, pdata->pkt + UDPMCAST_HDR_SIZE + pdata->pkt_pos * stream->sample_size
+           , (size_t)n * stream->sample_size);
+    pdata->pkt_pos += n;
+    pdata->sample  += n;
+
+    return n;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char *src = samples;
+    unsigned left = sample_count;
+    unsigned per_packet = UDPMCAST_PAYLOAD / stream->sample_size;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing to stream", ENOTSUP);
+
+    while (left > 0) {
+        unsigned i, nmsg = 0;
+        int rc;
+
+        /* samples are not copied: second iovec points to caller buffer */
+        for (; left > 0 && nmsg < UDPMCAST_BATCH; nmsg++) {
+            unsigned n = left < per_packet ? left : per_packet;
+            uint8_t *h = pdata->hdr[nmsg];
+
+            memcpy(h, "SDMU", 4);
+            wr32(h + 4,  pdata->seq++);
+            wr64(h + 8,  pdata->sample);
+            wr32(h + 16, stream->fs);
+            wr16(h + 20, n);
+            wr16(h + 22, stream->format);
+            wr16(h + 24, stream->channels);
+            wr16(h + 26, 0);
+
+            pdata->iov[nmsg][0].iov_base = h;
+            pdata->iov[nmsg][0].iov_len  = UDPMCAST_HDR_SIZE;
+            pdata->iov[nmsg][1].iov_base = src;
+            pdata->iov[nmsg][1].iov_len  = (size_t)n * stream->sample_size;
+            memset(&pdata->msgs[nmsg], 0, sizeof(pdata->msgs[nmsg]));
+            pdata->msgs[nmsg].msg_hdr.msg_iov    = pdata->iov[nmsg];
+            pdata->msgs[nmsg].msg_hdr.msg_iovlen = 2;
+
+            src  += (size_t)n * stream->sample_size;
+            left -= n;
+            pdata->sample += n;
+        }
+
+        i = 0;
+        while (i < nmsg) {
+            rc = sendmmsg(pdata->fd, pdata->msgs + i, nmsg - i, 0);
+            if (rc < 0) {
+                if (errno == EINTR)
+                    continue;
+                /* nobody listens or network is down: datagrams are lost,
+                 * capture goes on */
+                if (errno == ECONNREFUSED || errno == ENOBUFS || errno == ENETUNREACH
+                        || errno == EHOSTUNREACH || errno == EAGAIN) {
+                    pdata->lost_packets += nmsg - i;
+                    break;
+                }
+                STREAM_RETURN_ERROR("sending datagrams", errno);
+            }
+            /* only sent datagrams, failed ones are in lost_packets */
+            pdata->packets += rc;
+            i += rc;
+        }
+    }
+
+    return sample_count;
+}
+
+static int stream_impl_status(stream_t *stream, char *buf, size_t len)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->direction == STREAM_OUTPUT)
+        snprintf(buf, len, "datagrams %llu, not sent %llu", pdata->packets, pdata->lost_packets);
+    else
+        snprintf(buf, len, "datagrams %llu, lost %llu datagrams, %llu samples"
+                , pdata->packets, pdata->lost_packets, pdata->lost_samples);
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    STREAM_RETURN_ERROR("stream count", ENOTSUP);
+}
+
+int stream_impl_udpmcast_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+
+    pdata->fd = -1;
+    stream->pdata = pdata;
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->status       = stream_impl_status;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "UDPMCAST", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -0,0 +1,608 @@
+//*************************************************************************
+// Unix domain socket driver with optional memfd segment handoff          *
+//*************************************************************************
+
+/* args: unix:<connect|listen>:<path>[:stream|:seqpacket|:memfd[:<samples>]]
+ *
+ * stream:    SOCK_STREAM, int16_t per value, like tcp:
+ * seqpacket: SOCK_SEQPACKET, every message is a block of int16_t values
+ * memfd:     SOCK_SEQPACKET, samples are collected in a sealed memfd of
+ *            <samples> samples, and the descriptor is passed by SCM_RIGHTS.
+ *            Message payload is struct unix_segment_t, consumer mmap()s
+ *            the descriptor, no sample goes through the socket. Segment
+ *            not sealed against shrink and write, or smaller than its
+ *            samples, is refused.
+ *
+ * Path starting with '@' is in abstract namespace. */
+
+// ISO C headers.
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <stream.h>
+
+#define UNIX_MSG_SAMPLES     32768
+#define UNIX_MEMFD_SAMPLES   (1024 * 1024)
+
+enum {
+    UNIX_MODE_STREAM,
+    UNIX_MODE_SEQPACKET,
+    UNIX_MODE_MEMFD
+};
+
+/* memfd mode message payload, native byte order */
+struct unix_segment_t
+{
+    // Index of first sample of segment in capture.
+    uint64_t first;
+    // Number of samples in segment.
+    uint32_t nsamples;
+    // Sampling frequency.
+    uint32_t fs;
+};
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    // socket handle.
+    int fd;
+    int mode;
+    struct sockaddr_un saun;
+    socklen_t saun_len;
+    // Listening socket path to remove on close.
+    char *bound_path;
+
+    // seqpacket input: rest of last message.
+    char *bfr;
+    size_t bfr_len;
+    size_t bfr_pos;
+
+    // memfd segment being filled or read.
+    int seg_fd;
+    char *seg;
+    unsigned long seg_size;
+    // Mapped length in bytes.
+    size_t seg_map;
+    unsigned long seg_len;
+    unsigned long seg_pos;
+    uint64_t seg_first;
+};
+
+static int unix_parse_path(struct private_data_t *pdata, const char *path)
+{
+    size_t len = strlen(path);
+
+    if (len == 0 || len >= sizeof(pdata->saun.sun_path))
+        return -1;
+
+    memset(&pdata->saun, 0, sizeof(pdata->saun));
+    pdata->saun.sun_family = AF_UNIX;
+    memcpy(pdata->saun.sun_path, path, len);
+    if (path[0] == '@')
+        pdata->saun.sun_path[0] = 0;
+    pdata->saun_len = offsetof(struct sockaddr_un, sun_path) + len + (path[0] != '@');
+
+    return 0;
+}
+
+static int stream_impl_open_connect(stream_t *stream, int type)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if ((pdata->fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) < 0)
+        STREAM_RETURN_ERROR("socket creation", errno);
+
+    if (connect(pdata->fd, (struct sockaddr *)&pdata->saun, pdata->saun_len) == -1) {
+        STREAM_SET_ERROR("connecting socket", errno);
+        close(pdata->fd);
+        pdata->fd = -1;
+        return STREAM_ERROR;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_open_listen(stream_t *stream, int type)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int wait_conn_fd;
+
+    if ((wait_conn_fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) < 0)
+        STREAM_RETURN_ERROR("socket creation", errno);
+
+    /* stale socket of previous run */
+    if (pdata->saun.sun_path[0])
+        unlink(pdata->saun.sun_path);
+
+    if (bind(wait_conn_fd, (struct sockaddr *)&pdata->saun, pdata->saun_len) < 0) {
+        STREAM_SET_ERROR("binding socket", errno);
+        goto stream_impl_listen_error;
+    }
+    if (pdata->saun.sun_path[0])
+        pdata->bound_path = strdup(pdata->saun.sun_path);
+
+    if (listen(wait_conn_fd, 1) == -1) {
+        STREAM_SET_ERROR("listening socket", errno);
+        goto stream_impl_listen_error;
+    }
+
+    pdata->fd = accept4(wait_conn_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (pdata->fd < 0) {
+        STREAM_SET_ERROR("accepting socket connection", errno);
+        goto stream_impl_listen_error;
+    }
+    close(wait_conn_fd);
+    return STREAM_ERROR_NONE;
+
+stream_impl_listen_error:
+    close(wait_conn_fd);
+    return STREAM_ERROR;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char *args, *socket_type, *path, *mode, *size_s;
+    int rc;
+
+    /* args: unix:<connect|listen>:<path>[:stream|:seqpacket|:memfd[:<samples>]] */
+    args = strdup(stream->args);
+    socket_type = strtok(args, ":");
+    path = strtok(NULL, ":");
+    mode = strtok(NULL, ":");
+    size_s = strtok(NULL, ":");
+    if (!socket_type || !path || unix_parse_path(pdata, path) < 0) {
+        free(args);
+        STREAM_RETURN_ERROR("arguments parsing", EINVAL);
+    }
+
+    pdata->seg_size = UNIX_MEMFD_SAMPLES;
+    rc = 0;
+    if (!mode || !strcmp(mode, "stream")) {
+        pdata->mode = UNIX_MODE_STREAM;
+    } else if (!strcmp(mode, "seqpacket")) {
+        pdata->mode = UNIX_MODE_SEQPACKET;
+    } else if (!strcmp(mode, "memfd")) {
+        pdata->mode = UNIX_MODE_MEMFD;
+        if (size_s) {
+            char *endptr;
+
+            errno = 0;
+            pdata->seg_size = strtoul(size_s, &endptr, 10);
+            if (errno || *endptr || pdata->seg_size == 0 || pdata->seg_size > UINT32_MAX)
+                rc = -1;
+        }
+    } else {
+        rc = -1;
+    }
+    if (rc < 0 || (size_s && pdata->mode != UNIX_MODE_MEMFD)) {
+        free(args);
+        STREAM_RETURN_ERROR("socket mode", EINVAL);
+    }
+
+    rc = pdata->mode == UNIX_MODE_STREAM ? SOCK_STREAM : SOCK_SEQPACKET;
+    if (strcmp(socket_type, "connect") == 0) {
+        rc = stream_impl_open_connect(stream, rc);
+    } else if (strcmp(socket_type, "listen") == 0) {
+        rc = stream_impl_open_listen(stream, rc);
+    } else {
+        STREAM_SET_ERROR("connection type", EINVAL);
+        rc = STREAM_ERROR;
+    }
+    free(args);
+
+    pdata->bfr_len = pdata->bfr_pos = 0;
+    pdata->seg_len = pdata->seg_pos = 0;
+    pdata->seg_first = 0;
+
+    return rc;
+}
+
+static void unix_segment_unmap(struct private_data_t *pdata)
+{
+    if (pdata->seg)
+        munmap(pdata->seg, pdata->seg_map);
+    if (pdata->seg_fd >= 0)
+        close(pdata->seg_fd);
+    pdata->seg = NULL;
+    pdata->seg_fd = -1;
+}
+
+static int unix_segment_new(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t size = pdata->seg_size * stream->sample_size;
+
+    pdata->seg_fd = memfd_create("sdm-segment", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (pdata->seg_fd < 0)
+        STREAM_RETURN_ERROR("creating memfd", errno);
+
+    if (ftruncate(pdata->seg_fd, size) < 0) {
+        STREAM_SET_ERROR("creating memfd", errno);
+        unix_segment_unmap(pdata);
+        return STREAM_ERROR;
+    }
+
+    pdata->seg_map = size;
+    pdata->seg = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, pdata->seg_fd, 0);
+    if (pdata->seg == MAP_FAILED) {
+        pdata->seg = NULL;
+        STREAM_SET_ERROR("mapping memfd", errno);
+        unix_segment_unmap(pdata);
+        return STREAM_ERROR;
+    }
+    pdata->seg_len = 0;
+
+    return STREAM_ERROR_NONE;
+}
+
+/* seal filled segment and pass descriptor to peer */
+static int unix_segment_send(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct unix_segment_t hdr;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int rc;
+
+    munmap(pdata->seg, pdata->seg_map);
+    pdata->seg = NULL;
+
+    /* peer gets exactly the samples and cannot change them */
+    if (ftruncate(pdata->seg_fd, pdata->seg_len * stream->sample_size) < 0
+            || fcntl(pdata->seg_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW
+                     | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        STREAM_SET_ERROR("sealing memfd", errno);
+        unix_segment_unmap(pdata);
+        return STREAM_ERROR;
+    }
+
+    hdr.first    = pdata->seg_first;
+    hdr.nsamples = pdata->seg_len;
+    hdr.fs       = stream->fs;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pdata->seg_fd, sizeof(int));
+
+    do {
+        rc = sendmsg(pdata->fd, &msg, MSG_NOSIGNAL);
+    } while (rc < 0 && errno == EINTR);
+
+    pdata->seg_first += pdata->seg_len;
+    unix_segment_unmap(pdata);
+
+    if (rc < 0)
+        STREAM_RETURN_ERROR("sending memfd", errno);
+
+    return STREAM_ERROR_NONE;
+}
+
+/* receive next segment descriptor and map it */
+static int unix_segment_recv(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct unix_segment_t hdr;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &hdr, sizeof(hdr) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct stat st;
+    int rc, seals;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    do {
+        rc = recvmsg(pdata->fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc == 0)
+        return STREAM_ERROR_EOS;
+    if (rc < 0)
+        STREAM_RETURN_ERROR("receiving memfd", errno);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        STREAM_RETURN_ERROR("receiving memfd", EPROTO);
+    memcpy(&pdata->seg_fd, CMSG_DATA(cmsg), sizeof(int));
+    if (rc != sizeof(hdr) || (msg.msg_flags & MSG_CTRUNC)) {
+        STREAM_SET_ERROR("receiving memfd", EPROTO);
+        goto unix_segment_recv_error;
+    }
+
+    /* peer must not shrink or rewrite segment while it is mapped here:
+     * access beyond its end would raise SIGBUS, not an error */
+    seals = fcntl(pdata->seg_fd, F_GET_SEALS);
+    if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) != (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+        STREAM_SET_ERROR("checking memfd seals", seals < 0 ? errno : EPERM);
+        goto unix_segment_recv_error;
+    }
+    if (fstat(pdata->seg_fd, &st) < 0) {
+        STREAM_SET_ERROR("checking memfd size", errno);
+        goto unix_segment_recv_error;
+    }
+    if ((uint64_t)st.st_size < (uint64_t)hdr.nsamples * stream->sample_size) {
+        STREAM_SET_ERROR("checking memfd size", EPROTO);
+        goto unix_segment_recv_error;
+    }
+
+    pdata->seg_size = hdr.nsamples;
+    pdata->seg_len  = hdr.nsamples;
+    pdata->seg_pos  = 0;
+    if (hdr.nsamples == 0)
+        return STREAM_ERROR_NONE;
+
+    pdata->seg_map = (size_t)pdata->seg_size * stream->sample_size;
+    pdata->seg = mmap(NULL, pdata->seg_map, PROT_READ, MAP_SHARED, pdata->seg_fd, 0);
+    if (pdata->seg == MAP_FAILED) {
+        pdata->seg = NULL;
+        STREAM_SET_ERROR("mapping memfd", errno);
+        goto unix_segment_recv_error;
+    }
+    return STREAM_ERROR_NONE;
+
+unix_segment_recv_error:
+    unix_segment_unmap(pdata);
+    return STREAM_ERROR;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+
+    /* last, not full segment */
+    if (pdata->mode == UNIX_MODE_MEMFD && stream->direction == STREAM_OUTPUT
+            && pdata->seg && pdata->seg_len)
+        rc = unix_segment_send(stream);
+    unix_segment_unmap(pdata);
+
+    if (pdata->fd >= 0)
+        close(pdata->fd);
+    pdata->fd = -1;
+
+    if (pdata->bound_path) {
+        unlink(pdata->bound_path);
+        free(pdata->bound_path);
+        pdata->bound_path = NULL;
+    }
+
+    free(pdata->bfr);
+    pdata->bfr = NULL;
+
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int unix_read_stream(stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t requested_length = (size_t)sample_count * stream->sample_size;
+    size_t offset = 0;
+    ssize_t rv;
+
+    do {
+        rv = read(pdata->fd, &((char*)samples)[offset], requested_length - offset);
+        if (rv > 0) {
+            offset += rv;
+        } else if (rv == 0) {
+            break;
+        } else {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+            STREAM_RETURN_ERROR("reading from stream", errno);
+        }
+    } while (offset < requested_length);
+
+    if (offset == 0)
+        return STREAM_ERROR_EOS;
+    return offset / stream->sample_size;
+}
+
+static int unix_read_seqpacket(stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t n;
+
+    if (pdata->bfr_pos == pdata->bfr_len) {
+        ssize_t rv;
+
+        if (!pdata->bfr)
+            pdata->bfr = malloc(UNIX_MSG_SAMPLES * stream->sample_size);
+        do {
+            rv = recv(pdata->fd, pdata->bfr, UNIX_MSG_SAMPLES * stream->sample_size, 0);
+        } while (rv < 0 && errno == EINTR);
+        if (rv == 0)
+            return STREAM_ERROR_EOS;
+        if (rv < 0)
+            STREAM_RETURN_ERROR("reading from stream", errno);
+        pdata->bfr_len = rv;
+        pdata->bfr_pos = 0;
+    }
+
+    n = pdata->bfr_len - pdata->bfr_pos;
+    if (n > (size_t)sample_count * stream->sample_size)
+        n = (size_t)sample_count * stream->sample_size;
+    memcpy(samples, pdata->bfr + pdata->bfr_pos, n);
+    pdata->bfr_pos += n;
+
+    return n / stream->sample_size;
+}
+
+static int unix_read_memfd(stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned long n;
+
+    while (pdata->seg_pos == pdata->seg_len) {
+        int rc;
+
+        unix_segment_unmap(pdata);
+        rc = unix_segment_recv(stream);
+        if (rc < 0)
+            return rc;
+    }
+
+    n = pdata->seg_len - pdata->seg_pos;
+    if (n > sample_count)
+        n = sample_count;
+    memcpy(samples, pdata->seg + pdata->seg_pos * stream->sample_size, n * stream->sample_size);
+    pdata->seg_pos += n;
+
+    return n;
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading from stream", ENOTSUP);
+
+    switch (pdata->mode) {
+        case UNIX_MODE_SEQPACKET: return unix_read_seqpacket((stream_t *)stream, samples, sample_count);
+        case UNIX_MODE_MEMFD:     return unix_read_memfd((stream_t *)stream, samples, sample_count);
+        default:                  return unix_read_stream((stream_t *)stream, samples, sample_count);
+    }
+}
+
+static int unix_write_memfd(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    char *src = samples;
+    unsigned left = sample_count;
+
+    while (left > 0) {
+        unsigned long n;
+
+        if (!pdata->seg && unix_segment_new(stream) < 0)
+            return STREAM_ERROR;
+
+        n = pdata->seg_size - pdata->seg_len;
+        if (n > left)
+            n = left;
+        memcpy(pdata->seg + pdata->seg_len * stream->sample_size, src, n * stream->sample_size);
+        pdata->seg_len += n;
+        src  += n * stream->sample_size;
+        left -= n;
+
+        if (pdata->seg_len == pdata->seg_size && unix_segment_send(stream) < 0)
+            return STREAM_ERROR;
+    }
+
+    return sample_count;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    size_t requested_length = (size_t)sample_count * stream->sample_size;
+    size_t offset = 0, chunk = requested_length;
+    ssize_t rc;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing to stream", ENOTSUP);
+
+    if (pdata->mode == UNIX_MODE_MEMFD)
+        return unix_write_memfd(stream, samples, sample_count);
+
+    /* message boundaries of seqpacket socket are kept, so limit their size */
+    if (pdata->mode == UNIX_MODE_SEQPACKET)
+        chunk = UNIX_MSG_SAMPLES * stream->sample_size;
+
+    while (offset < requested_length) {
+        size_t len = requested_length - offset;
+
+        if (len > chunk)
+            len = chunk;
+        rc = send(pdata->fd, &((char*)samples)[offset], len, MSG_NOSIGNAL);
+        if (rc > 0) {
+            offset += rc;
+        } else {
+            if (rc < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (rc < 0 && errno == EPIPE)
+                return STREAM_ERROR_EOS;
+            STREAM_RETURN_ERROR("writing to stream", errno);
+        }
+    }
+
+    return sample_count;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    STREAM_RETURN_ERROR("stream count", ENOTSUP);
+}
+
+int stream_impl_unix_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+
+    pdata->fd = -1;
+    pdata->seg_fd = -1;
+    stream->pdata = pdata;
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "UNIX", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
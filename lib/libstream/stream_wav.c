@@ -0,0 +1,392 @@
+//*************************************************************************
+// RIFF WAVE file driver                                                  *
+//*************************************************************************
+
+// ISO C headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stream.h>
+
+#define WAVE_FORMAT_PCM        0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+#define WAV_HEADER_SIZE 44
+
+struct private_data_t
+{
+    // Code of last error.
+    int error;
+    // Last error operation.
+    const char* error_op;
+
+    // Input: whole file mapped.
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    const uint8_t *data;
+    unsigned format;
+    unsigned channels;
+    unsigned bits;
+    unsigned block_align;
+    unsigned fs;
+    unsigned long frames;
+    unsigned long pos;
+
+    // Output.
+    FILE *fp;
+    unsigned long written;
+};
+
+static inline uint16_t rd16(const uint8_t *p) { uint16_t v; memcpy(&v, p, 2); return le16toh(v); }
+static inline uint32_t rd32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return le32toh(v); }
+
+/* Parse RIFF chunks. Chunk "fmt " must be before "data" */
+static int wav_parse(struct private_data_t *pdata)
+{
+    const uint8_t *p = pdata->map, *end = pdata->map + pdata->map_size;
+    int have_fmt = 0;
+
+    if (pdata->map_size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+        STREAM_RETURN_ERROR("not a RIFF WAVE file", EINVAL);
+    p += 12;
+
+    while (end - p >= 8) {
+        uint32_t size = rd32(p + 4);
+        const uint8_t *body = p + 8;
+
+        if (!memcmp(p, "fmt ", 4)) {
+            if (size < 16 || (size_t)(end - body) < size)
+                STREAM_RETURN_ERROR("wrong fmt chunk", EINVAL);
+            pdata->format      = rd16(body);
+            pdata->channels    = rd16(body + 2);
+            pdata->fs          = rd32(body + 4);
+            pdata->block_align = rd16(body + 12);
+            pdata->bits        = rd16(body + 14);
+            /* sub format GUID starts with format tag */
+            if (pdata->format == WAVE_FORMAT_EXTENSIBLE && size >= 40)
+                pdata->format = rd16(body + 24);
+            have_fmt = 1;
+        } else if (!memcmp(p, "data", 4)) {
+            if (!have_fmt)
+                STREAM_RETURN_ERROR("data chunk before fmt chunk", EINVAL);
+            /* streaming writers leave size 0 or 0xffffffff, take rest of file */
+            if (size == 0 || size > (size_t)(end - body))
+                size = end - body;
+            pdata->data = body;
+            pdata->frames = pdata->block_align ? size / pdata->block_align : 0;
+            break;
+        }
+        /* size of corrupted chunk may point past the file */
+        if ((uint64_t)size + (size & 1) > (size_t)(end - body))
+            break;
+        p = body + size + (size & 1);
+    }
+
+    if (!pdata->data)
+        STREAM_RETURN_ERROR("no data chunk", EINVAL);
+
+    if (pdata->channels == 0
+            || !((pdata->format == WAVE_FORMAT_PCM && pdata->bits == 16)
+              || (pdata->format == WAVE_FORMAT_IEEE_FLOAT && pdata->bits == 32))
+            || pdata->block_align != pdata->channels * pdata->bits / 8)
+        STREAM_RETURN_ERROR("unsupported sample format", ENOTSUP);
+
+    return STREAM_ERROR_NONE;
+}
+
+static void wav_unmap(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (pdata->map)
+        munmap(pdata->map, pdata->map_size);
+    if (pdata->fd >= 0)
+        close(pdata->fd);
+    pdata->map = NULL;
+    pdata->data = NULL;
+    pdata->fd = -1;
+}
+
+static int wav_map(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    struct stat st;
+
+    pdata->fd = open(stream->args, O_RDONLY);
+    if (pdata->fd < 0)
+        STREAM_RETURN_ERROR("opening file", errno);
+
+    if (fstat(pdata->fd, &st) < 0) {
+        STREAM_SET_ERROR("reading file", errno);
+        wav_unmap(stream);
+        return STREAM_ERROR;
+    }
+
+    pdata->map_size = st.st_size;
+    pdata->map = mmap(NULL, pdata->map_size, PROT_READ, MAP_PRIVATE, pdata->fd, 0);
+    if (pdata->map == MAP_FAILED) {
+        pdata->map = NULL;
+        STREAM_SET_ERROR("mapping file", errno);
+        wav_unmap(stream);
+        return STREAM_ERROR;
+    }
+    madvise(pdata->map, pdata->map_size, MADV_SEQUENTIAL);
+
+    if (wav_parse(pdata) < 0) {
+        wav_unmap(stream);
+        return STREAM_ERROR;
+    }
+    return STREAM_ERROR_NONE;
+}
+
+static int wav_write_header(struct private_data_t *pdata, unsigned fs, unsigned channels, unsigned long frames)
+{
+    uint8_t h[WAV_HEADER_SIZE];
+    uint32_t data_size = frames * 2 * channels;
+    uint32_t v32;
+    uint16_t v16;
+
+    memcpy(h, "RIFF", 4);
+    v32 = htole32(data_size + WAV_HEADER_SIZE - 8); memcpy(h + 4, &v32, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    v32 = htole32(16);               memcpy(h + 16, &v32, 4);
+    v16 = htole16(WAVE_FORMAT_PCM);  memcpy(h + 20, &v16, 2);
+    v16 = htole16(channels);         memcpy(h + 22, &v16, 2);
+    v32 = htole32(fs);               memcpy(h + 24, &v32, 4);
+    v32 = htole32(fs * 2 * channels); memcpy(h + 28, &v32, 4);
+    v16 = htole16(2 * channels);     memcpy(h + 32, &v16, 2);
+    v16 = htole16(16);               memcpy(h + 34, &v16, 2);
+    memcpy(h + 36, "data", 4);
+    v32 = htole32(data_size);        memcpy(h + 40, &v32, 4);
+
+    if (fseek(pdata->fp, 0, SEEK_SET) < 0 || fwrite(h, sizeof(h), 1, pdata->fp) != 1)
+        return -1;
+    return 0;
+}
+
+static int stream_impl_open(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->format != STREAM_FORMAT_S16LE || stream->sample_size != sizeof(int16_t) * stream->channels)
+        STREAM_RETURN_ERROR("sample format", ENOTSUP);
+
+    if (stream->direction == STREAM_OUTPUT) {
+        pdata->fp = fopen(stream->args, "w");
+        if (!pdata->fp)
+            STREAM_RETURN_ERROR("opening file", errno);
+        pdata->written = 0;
+        /* sizes are patched on close */
+        if (wav_write_header(pdata, stream->fs, stream->channels, 0) < 0)
+            STREAM_RETURN_ERROR("writing file", errno);
+        return STREAM_ERROR_NONE;
+    }
+
+    if (wav_map(stream) < 0)
+        return STREAM_ERROR;
+    if (stream->channels > pdata->channels) {
+        wav_unmap(stream);
+        STREAM_RETURN_ERROR("channels in file", ENOTSUP);
+    }
+
+    stream->fs = pdata->fs;
+    pdata->pos = 0;
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_close(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc = STREAM_ERROR_NONE;
+
+    if (stream->direction == STREAM_INPUT) {
+        wav_unmap(stream);
+        return STREAM_ERROR_NONE;
+    }
+
+    if (!pdata->fp)
+        return STREAM_ERROR_NONE;
+
+    /* WAV data size is 32 bit */
+    if (pdata->written > (UINT32_MAX - WAV_HEADER_SIZE) / stream->sample_size)
+        pdata->written = (UINT32_MAX - WAV_HEADER_SIZE) / stream->sample_size;
+
+    if (wav_write_header(pdata, stream->fs, stream->channels, pdata->written) < 0) {
+        STREAM_SET_ERROR("writing file", errno);
+        rc = STREAM_ERROR;
+    }
+    if (fclose(pdata->fp) != 0 && rc == STREAM_ERROR_NONE) {
+        STREAM_SET_ERROR("closing file", errno);
+        rc = STREAM_ERROR;
+    }
+    pdata->fp = NULL;
+
+    return rc;
+}
+
+static void stream_impl_free(stream_t *stream)
+{
+    free(stream->pdata);
+    stream->pdata = NULL;
+}
+
+static int stream_impl_read(const stream_t *stream, int16_t* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    const uint8_t *src;
+    unsigned long n, i;
+    unsigned c, nch = stream->channels;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("reading file", ENOTSUP);
+
+    if (pdata->pos >= pdata->frames)
+        return STREAM_ERROR_EOS;
+
+    n = pdata->frames - pdata->pos;
+    if (n > sample_count)
+        n = sample_count;
+    src = pdata->data + pdata->pos * pdata->block_align;
+
+    /* multichannel file: first stream->channels channels are taken */
+    if (pdata->format == WAVE_FORMAT_PCM) {
+        if (pdata->channels == nch && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+            memcpy(samples, src, n * pdata->block_align);
+        } else {
+            for (i = 0; i < n; i++)
+                for (c = 0; c < nch; c++)
+                    samples[i * nch + c] = (int16_t)rd16(src + i * pdata->block_align + 2 * c);
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            for (c = 0; c < nch; c++) {
+                uint32_t u = rd32(src + i * pdata->block_align + 4 * c);
+                float f;
+
+                memcpy(&f, &u, 4);
+                f *= SHRT_MAX;
+                /* conversion of NaN or out of range value is undefined */
+                samples[i * nch + c] = f != f ? 0 : f >= SHRT_MAX ? SHRT_MAX : f <= SHRT_MIN ? SHRT_MIN : (int16_t)f;
+            }
+        }
+    }
+
+    pdata->pos += n;
+    return n;
+}
+
+static int stream_impl_write(stream_t *stream, void* samples, unsigned sample_count)
+{
+    struct private_data_t *pdata = stream->pdata;
+    unsigned rc;
+
+    if (stream->direction == STREAM_INPUT)
+        STREAM_RETURN_ERROR("writing file", ENOTSUP);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    rc = fwrite(samples, stream->sample_size, sample_count, pdata->fp);
+#else
+    for (rc = 0; rc < sample_count; rc++) {
+        unsigned c;
+
+        for (c = 0; c < stream->channels; c++) {
+            uint16_t v = htole16(((uint16_t *)samples)[rc * stream->channels + c]);
+            if (fwrite(&v, 2, 1, pdata->fp) != 1)
+                break;
+        }
+        if (c != stream->channels)
+            break;
+    }
+#endif
+    if (rc != sample_count)
+        STREAM_RETURN_ERROR("writing file", errno);
+
+    pdata->written += rc;
+    return rc;
+}
+
+static int stream_impl_seek(stream_t *stream, unsigned long offset)
+{
+    struct private_data_t *pdata = stream->pdata;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("seeking file", ENOTSUP);
+
+    if (offset > pdata->frames)
+        STREAM_RETURN_ERROR("seeking file", EINVAL);
+
+    pdata->pos = offset;
+    return STREAM_ERROR_NONE;
+}
+
+static int stream_impl_get_errno(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error;
+}
+
+static const char* stream_impl_strerror(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return strerror(pdata->error);
+}
+
+static const char* stream_impl_get_error_op(stream_t *stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    return pdata->error_op;
+}
+
+static int stream_impl_count(stream_t* stream)
+{
+    struct private_data_t *pdata = stream->pdata;
+    int rc;
+
+    if (stream->direction == STREAM_OUTPUT)
+        STREAM_RETURN_ERROR("counting samples in file", ENOTSUP);
+
+    if (pdata->map)
+        return pdata->frames;
+
+    /* exact number of samples from header, without reading data.
+     * Rate is known as well, stages before open may need it */
+    rc = wav_map(stream);
+    if (rc == STREAM_ERROR_NONE) {
+        stream->fs = pdata->fs;
+        rc = pdata->frames;
+    }
+    wav_unmap(stream);
+
+    return rc;
+}
+
+int stream_impl_wav_new(stream_t *stream)
+{
+    struct private_data_t *pdata = calloc(1, sizeof(struct private_data_t));
+
+    pdata->fd = -1;
+    stream->pdata = pdata;
+    stream->open         = stream_impl_open;
+    stream->close        = stream_impl_close;
+    stream->free         = stream_impl_free;
+    stream->read         = stream_impl_read;
+    stream->write        = stream_impl_write;
+    stream->seek         = stream_impl_seek;
+    stream->get_errno    = stream_impl_get_errno;
+    stream->strerror     = stream_impl_strerror;
+    stream->get_error_op = stream_impl_get_error_op;
+    stream->count        = stream_impl_count;
+    strncpy(stream->name, "WAV", sizeof (stream->name));
+
+    return STREAM_ERROR_NONE;
+}
@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <getopt.h>
 #include <libgen.h> /* basename() */
+#include <time.h>
 
 #include <compat/readline6.h>
 #include <readline/readline.h>
@@ -22,7 +23,8 @@
 
 #define SDM_PORT    4200
 
-#define SDMSH_UPDATE_RX_STATE_SAMPLES 0x1ffff
+/* refresh of rx prompt with samples and levels */
+#define SDMSH_UPDATE_RX_STATE_MS 250
 
 enum {
     FLAG_SHOW_HELP     = 0x01,
@@ -119,10 +121,20 @@ char *short_hostname(char *host) {
     return host;
 }
 
+static long sdmsh_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 void sdmsh_update_promt_state(sdm_session_t *ss, char *host)
 {
     static int old_state = -1;
-    static unsigned long data_len = 0;
+    static int data_len = 0;
+    static long updated_ms = 0;
+    long now_ms = sdmsh_now_ms();
 
     if(old_state == -1) {
         old_state = ss->state;
@@ -130,12 +142,19 @@ void sdmsh_update_promt_state(sdm_session_t *ss, char *host)
     }
 
     if (old_state == ss->state &&
-      !(ss->state == SDM_STATE_RX && ss->data_len - data_len >= SDMSH_UPDATE_RX_STATE_SAMPLES))
+      !(ss->state == SDM_STATE_RX && ss->data_len != data_len
+          && now_ms - updated_ms >= SDMSH_UPDATE_RX_STATE_MS))
         return;
 
     if (ss->state == SDM_STATE_RX) {
-        rl_message("%s:rx[%d]> ", short_hostname(host), ss->data_len / 2);
+        /* window being filled till first one is complete */
+        const dsp_levels_t *lv = ss->level.count ? &ss->level : &ss->level_window;
+        char level[128];
+
+        sdm_levels_str(lv, level, sizeof(level));
+        rl_message("%s:rx[%d] %s> ", short_hostname(host), ss->data_len / 2, level);
         data_len = ss->data_len;
+        updated_ms = now_ms;
     } else if (ss->state == SDM_STATE_WAIT_SYNCIN) {
         rl_message("%s:wait syncin> ", short_hostname(host));
     } else {
@@ -146,6 +165,36 @@ void sdmsh_update_promt_state(sdm_session_t *ss, char *host)
     old_state = ss->state;
 }
 
+/* Add descriptors signalling completed writes of sinks, return max fd */
+static int sdmsh_sinks_fd_set(sdm_session_t *ss, fd_set *rfds, int maxfd)
+{
+    unsigned int i;
+
+    for (i = 0; i < ss->streams.count; i++) {
+        int fd = stream_get_event_fd(ss->streams.streams[i]);
+
+        if (fd < 0)
+            continue;
+        FD_SET(fd, rfds);
+        if (fd > maxfd)
+            maxfd = fd;
+    }
+    return maxfd;
+}
+
+static int sdmsh_sinks_fd_isset(sdm_session_t *ss, fd_set *rfds)
+{
+    unsigned int i;
+
+    for (i = 0; i < ss->streams.count; i++) {
+        int fd = stream_get_event_fd(ss->streams.streams[i]);
+
+        if (fd >= 0 && FD_ISSET(fd, rfds))
+            return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     char *progname, *host;
@@ -306,6 +355,9 @@ int main(int argc, char *argv[])
             maxfd = (sdm_session->sockfd > fileno(shell_config.input)) ? sdm_session->sockfd : fileno(shell_config.input);
         }
         sdmsh_update_promt_state(sdm_session, host);
+        /* sinks write in background, wake up on their completions too */
+        if (sdm_session->state == SDM_STATE_RX)
+            maxfd = sdmsh_sinks_fd_set(sdm_session, &rfds, maxfd);
 
         rc = select(maxfd + 1, &rfds, NULL, NULL, &tv);
 
@@ -350,6 +402,11 @@ int main(int argc, char *argv[])
             }
         }
 
+        if (sdm_session->state == SDM_STATE_RX && sdmsh_sinks_fd_isset(sdm_session, &rfds)) {
+            if (sdm_reap_samples(sdm_session) < 0)
+                sdm_send(sdm_session, SDM_CMD_STOP);
+        }
+
         if (FD_ISSET(sdm_session->sockfd, &rfds)) {
             int state = sdm_session->state;
             int len_orig;
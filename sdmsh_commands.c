@@ -27,6 +27,7 @@ int sdmsh_cmd_rx_janus   (struct shell_config *sc, char *argv[], int argc);
 int sdmsh_cmd_usbl_config(struct shell_config *sc, char *argv[], int argc);
 int sdmsh_cmd_usbl_rx    (struct shell_config *sc, char *argv[], int argc);
 int sdmsh_cmd_systime    (struct shell_config *sc, char *argv[], int argc);
+int sdmsh_cmd_level      (struct shell_config *sc, char *argv[], int argc);
 int sdmsh_cmd_waitsyncin (struct shell_config *sc, char *argv[], int argc);
 int sdmsh_cmd_usleep     (struct shell_config *sc, char *argv[], int argc);
 int sdmsh_cmd_source     (struct shell_config *sc, char *argv[], int argc);
@@ -41,8 +42,14 @@ struct commands_t commands[] = {
    , {"tx",          sdmsh_cmd_tx,          SCF_USE_DRIVER, "tx [<number of samples>] [<driver>:]<parameter>", "Send signal."}
    , {"rx",          sdmsh_cmd_rx,          SCF_USE_DRIVER, "rx <number of samples> [<driver>:]<params> [[<driver>:]<params>]", "Receive signal [0 is inf]."}
    , {"rx_janus",    sdmsh_cmd_rx_janus,    SCF_USE_DRIVER, "rx_janus <number of samples> [<driver>:]<params> [[<driver>:]<params>]", "Receive signal [0 is inf]."}
-   , {"usbl_rx",     sdmsh_cmd_usbl_rx,     SCF_USE_DRIVER, "usbl_rx <channel> <number of samples> [<driver>:]<params>", "Receive signal from USBL channel."}
+   , {"usbl_rx",     sdmsh_cmd_usbl_rx,     SCF_USE_DRIVER, "usbl_rx <channel|all> <number of samples> [<driver>:]<params>", "Receive signal from USBL channel."
+          "\n        With 'all' channels 0..4 are received one after another and written in one pass:"
+          "\n        to <driver>/5ch:<params> as frames, to planar files with \"%d\" in <params>"
+          "\n        or one after another to sink of one channel"}
    , {"systime",     sdmsh_cmd_systime,     SCF_NONE,       "systime", "Request systime."}
+   , {"level",       sdmsh_cmd_level,       SCF_NONE,       "level", "Levels of received samples: since start of last rx and of last window."
+          "\n        Peak and rms in dBFS, dc as fraction of full scale, samples at full scale."
+          "\n        Levels of last window are shown in prompt while receiving"}
    , {"waitsyncin",  sdmsh_cmd_waitsyncin,  SCF_NONE,       "waitsyncin", "Wait SYNCIN message."}
    , {"usleep",      sdmsh_cmd_usleep,      SCF_NO_HISTORY, "usleep <usec>", "Delay in usec."}
    , {"source",      sdmsh_cmd_source,      SCF_NONE,       "source <source-file>", "Run commands from file."}
@@ -56,9 +63,72 @@ struct driver_t drivers[] = {
     {"ascii:", SCF_DRIVER_FILENAME, "ascii:<filename> or file extension \".dat\" or \".txt\""
         , "This is default driver File format: float (-1.0 .. 1.0) or short integer (-32768 .. 32767) as text line, one value per line."
           "\n        Empty lines and '#' or '//' comments is allowed." }
-  , {"raw:",   SCF_DRIVER_FILENAME, "raw:<filename> or file extension \".raw\", \".bin\", \".dmp\" or \".fifo\"", "Binary format: int16_t per value" }
-  , {"tcp:",   SCF_DRIVER_NET,      "tcp:<connect|listen>:<ip>:<port>", "Opens TCP socket to send or receive data, int16_t per value" }
+  , {"raw:",   SCF_DRIVER_FILENAME, "raw:<filename> or file extension \".raw\", \".bin\", \".dmp\" or \".fifo\"", "Binary format: int16_t per value."
+          "\n        Sample format of raw, ascii, tcp, udpmcast and other byte streams is selected by"
+          "\n        <driver>/<s16le|s16be|f32|ulaw>:<params>, for ex. tcp/ulaw:connect:10.0.0.2:5000."
+          "\n        Extensions \".f32\" and \".ul\" select raw/f32 and raw/ulaw."
+          "\n        <driver>/<N>ch:<params> is stream of N interleaved channels, with \"%d\" in <params>"
+          "\n        file per channel. Empty driver name is taken by extension, for ex. /5ch:usbl-%d.raw" }
+  , {"tcp:",   SCF_DRIVER_NET,      "tcp:<connect|listen>:<ip>:<port>[:<buffer kB>]", "Opens TCP socket to send or receive data, int16_t per value."
+          "\n        Output in connect mode is buffered (default 8192 kB) and reconnects when peer restarts" }
+  , {"tcpserver:", SCF_DRIVER_NET,  "tcpserver:<ip>:<port>[:<buffer kB>]", "Output only. TCP server for any number of clients connecting at any time,"
+          "\n        every one gets samples from the moment it connected. Client which cannot take data"
+          "\n        fast enough to keep its buffer (default 4096 kB) is dropped. IPv6 address in brackets: [::1]" }
+  , {"udpmcast:", SCF_DRIVER_NET,   "udpmcast:<group>:<port>[:<ttl>[:<interface ip>]]", "UDP multicast, one stream for any number of hosts. Datagrams carry sequence"
+          "\n        number, sample index, format and channels, receiver fills lost datagrams with zeros."
+          "\n        Default ttl 1."
+          "\n        See contrib/udpmcast-rx.py for receiver without sdmsh" }
+  , {"unix:",  SCF_DRIVER_NET,      "unix:<connect|listen>:<path>[:stream|:seqpacket|:memfd[:<samples>]]"
+          , "Unix domain socket, '@' starts abstract name. memfd: samples are passed in sealed memfd"
+          "\n        segments by SCM_RIGHTS, default 1M samples per segment" }
   , {"popen:", SCF_DRIVER_SH_LINE,  "popen:\"command-line\"", "Call external program to send or receive data, int16_t per value" }
+  , {"exec:",  SCF_DRIVER_SH_LINE,  "exec:\"program [arguments]\"", "Run program without shell to send or receive data through its stdin/stdout, int16_t per value."
+          "\n        Arguments are split on blanks, quotes and '\\' are handled. Large pipe, written by vmsplice()" }
+  , {"direct:", SCF_DRIVER_FILENAME, "direct:<filename>", "Binary format: int16_t per value. Output only. File is preallocated for <number of samples>"
+          "\n        and written with O_DIRECT, bypassing the page cache" }
+  , {"rotate:", SCF_DRIVER_FILENAME, "rotate:<samples>[s]:[<driver>:]<filename>", "Output only. Start new file every <samples> samples or seconds with 's' suffix."
+          "\n        Segments are named <filename>-0000.<ext>, or by printf-like %u in <filename>."
+          "\n        Segment start sample and host time are written to <filename>.manifest" }
+  , {"filter:", SCF_DRIVER_FILENAME, "filter:<stage>[,<stage>...]:<driver>:<params>", "Filter samples in front of other stream. Stages, 'k' suffix for kHz:"
+          "\n        dc[(<cutoff>)], gain(<dB>), lp(<f>[,<taps>]), hp(<f>[,<taps>]), bp(<f1>,<f2>[,<taps>]),"
+          "\n        notch(<f>[,<Q>]). For ex. filter:dc,bp(7k,17k),gain(6):raw:out.raw" }
+  , {"resample:", SCF_DRIVER_FILENAME, "resample:<L>/<M>|<fs>[,<taps>]:<driver>:<params>", "Polyphase resampling by L/M or to <fs> in front of other stream,"
+          "\n        default 64 taps per phase. Input: for ex. tx resample:62500:wav:signal-48k.wav."
+          "\n        Output: for ex. decimated preview rx 0 resample:1/4:raw:preview.raw" }
+  , {"ddc:",   SCF_DRIVER_FILENAME, "ddc:<center>,<decimation>[,ci16|cf32][,<threads>]:<driver>:<params>", "Output only. Mix down to complex baseband at <center> Hz,"
+          "\n        CIC and FIR decimation by even <decimation>. Usable bandwidth about 0.78 * fs / <decimation>."
+          "\n        Inner stream gets interleaved I/Q int16 (ci16) or float (cf32). For ex. rx 0 ddc:26k,2:raw:bb.raw" }
+  , {"detect:", SCF_DRIVER_FILENAME, "detect:[<reference>][,<threshold>[,<events>[,<doppler>[,<hypotheses>[,<threads>]]]]][:<driver>:<params>]"
+          , "Output only. Matched filter: normalised correlation"
+          "\n        with <reference> (default of last ref command) by FFT, detection above <threshold> (default 0.5)"
+          "\n        is marked as event \"detect\" in <driver>, written to <events> file or printed."
+          "\n        With <doppler> m/s reference is scaled for speeds -<doppler>..<doppler> in parallel"
+          "\n        and the best one is reported. Empty field is default."
+          "\n        For ex. rx 0 detect:ref.dat,0.4:sdc:capture.sdc, rx 0 detect:-,,,5,,2" }
+  , {"trigger:", SCF_DRIVER_FILENAME, "trigger:[<dB>][,<pre>[,<post>[,<window>[,<segments>]]]]:<driver>:<params>"
+          , "Output only. Pass to <driver> only segments with window power <dB> (default 10)"
+          "\n        above noise floor, with <pre> (default 0.5s) and <post> (default 1s) roll, 's' suffix for seconds."
+          "\n        Segment start is marked as event \"trigger\" with sample index, <segments> file lists"
+          "\n        first sample, length and offset of every one. For ex. rx 0 trigger:,,,,cap.seg:raw:cap.raw" }
+  , {"history:", SCF_DRIVER_FILENAME, "history:<length>[,<events>]:<driver>:<params>", "Output only. Keep last <length> samples, 's' suffix for seconds,"
+          "\n        in memory and write them to <params> with -0000, -0001... before extension on every event,"
+          "\n        listed in <file name>.manifest. <events> separated by '+', default syncin+janus, '*' is any."
+          "\n        For ex. rx 0 raw:cap.raw history:5s:raw:before-syncin.raw" }
+  , {"spectrum:", SCF_DRIVER_FILENAME, "spectrum:[<fft>][,<interval>[,<bins>]]:<driver>:<params>", "Output only. Power spectra of <fft> (default 1024) samples"
+          "\n        with Hann window and half overlap averaged over <interval> (default 1s, 's' suffix for seconds)."
+          "\n        Frame of <bins> (default <fft>/2) int16_t levels in 0.01 dBFS from DC up is written"
+          "\n        to <driver> per interval. For ex. rx 0 spectrum:2048,1s,256:tcp:connect:10.0.0.2:5000" }
+  , {"planar:", SCF_DRIVER_FILENAME, "planar:<N>:<driver>:<params>", "Stream per channel, \"%d\" in <params> is channel number."
+          "\n        Made by <driver>/<N>ch:<params> with \"%d\" in <params>" }
+  , {"lpc:",   SCF_DRIVER_FILENAME, "lpc:<filename> or file extension \".sdz\"", "Lossless compressed int16_t samples: per block fixed prediction and Rice coding."
+          "\n        Blocks are compressed in parallel and indexed for seeking" }
+  , {"wav:",   SCF_DRIVER_FILENAME, "wav:<filename> or file extension \".wav\"", "RIFF WAVE file. Input: PCM16 or float32, first channel of multichannel file"
+          "\n        or first N channels with wav/<N>ch:. Output: PCM16, mono or N channels" }
+  , {"sdc:",   SCF_DRIVER_FILENAME, "sdc:<filename> or file extension \".sdc\"", "Indexed capture container. Header keeps sample rate, start time"
+          "\n        and modem settings, trailing index keeps chunk times and events like syncin" }
+  , {"shm:",   SCF_DRIVER_NET,      "shm:<name>[:<samples>]", "POSIX shared memory ring /dev/shm/<name> for local readers, default 1M samples."
+          "\n        Readers attach with stream_shm_reader_open() or shm_reader.py without copying data."
+          "\n        Ring of running capture with the same name is not replaced" }
   , {NULL, 0, NULL, NULL }
 };
 
@@ -163,6 +233,8 @@ int sdmsh_cmd_ref(struct shell_config *sc, char *argv[], int argc)
 
         /* DUMP2LOG(ERR_LOG, (char *)data, len*2); */
         rc = sdm_send(ss, SDM_CMD_REF, data, (unsigned)len);
+        if (rc >= 0)
+            snprintf(ss->meta_reference, sizeof(ss->meta_reference), "%s", argv[1]);
     }
 
     stream_close(stream);
@@ -290,6 +362,9 @@ int sdmsh_cmd_rx_helper(struct shell_config *sc, char *argv[], int argc, int cod
         if (!stream)
             break;
 
+        stream_set_nsamples(stream, nsamples);
+        sdm_set_stream_meta(ss, stream);
+
         if (stream_open(stream)) {
             if (stream_get_errno(stream) == EINTR)
                 logger(WARN_LOG, "rx: opening %s was interrupted\n", args_sink[i]);
@@ -323,12 +398,15 @@ int sdmsh_cmd_rx_janus(struct shell_config *sc, char *argv[], int argc)
 int sdmsh_cmd_usbl_rx(struct shell_config *sc, char *argv[], int argc)
 {
     uint8_t channel = 0;
-    int16_t samples = 0;
+    uint16_t samples = 0;
     sdm_session_t *ss = sc->cookie;
     stream_t* stream;
+    int all;
 
     ARGS_RANGE(argc == 4);
-    SDM_CHECK_STR_ARG_LONG("usbl_rx: channel", argv[1], channel, arg >= 0 && arg <= 4);
+    all = !strcmp(argv[1], "all");
+    if (!all)
+        SDM_CHECK_STR_ARG_LONG("usbl_rx: channel", argv[1], channel, arg >= 0 && arg <= 4);
     SDM_CHECK_STR_ARG_LONG("usbl_rx: number of samples", argv[2], samples, arg >= 1024 && arg <= 51200 && (arg % 1024) == 0);
 
     streams_clean(&ss->streams);
@@ -336,6 +414,12 @@ int sdmsh_cmd_usbl_rx(struct shell_config *sc, char *argv[], int argc)
     if (!stream)
         return -1;
 
+    if (all && stream_get_channels(stream) == 1)
+        stream_set_nsamples(stream, SDM_USBL_CHANNELS * samples);
+    else
+        stream_set_nsamples(stream, samples);
+    sdm_set_stream_meta(ss, stream);
+
     if (stream_open(stream)) {
         if (stream_get_errno(stream) == EINTR)
             logger(WARN_LOG, "rx: opening %s was interrupted\n", argv[1]);
@@ -343,6 +427,8 @@ int sdmsh_cmd_usbl_rx(struct shell_config *sc, char *argv[], int argc)
             logger(ERR_LOG, "usbl_rx: error %s\n", stream_strerror(stream));
         return -1;
     }
+    if (all)
+        return sdm_usbl_rx_all(ss, samples);
     sdm_send(ss, SDM_CMD_USBL_RX, (unsigned)channel, (unsigned)samples);
     
     return 0;
@@ -359,6 +445,22 @@ int sdmsh_cmd_systime(struct shell_config *sc, char *argv[], int argc)
     return 0;
 }
 
+int sdmsh_cmd_level(struct shell_config *sc, char *argv[], int argc)
+{
+    sdm_session_t *ss = sc->cookie;
+    const dsp_levels_t *last = ss->level.count ? &ss->level : &ss->level_window;
+    char buf[128];
+
+    (void)argv;
+    ARGS_RANGE(argc == 1);
+    sdm_levels_str(&ss->level_total, buf, sizeof(buf));
+    logger(INFO_LOG, "total: %llu samples, %s\n", ss->level_total.count, buf);
+    sdm_levels_str(last, buf, sizeof(buf));
+    logger(INFO_LOG, "last:  %llu samples, %s\n", last->count, buf);
+
+    return 0;
+}
+
 int sdmsh_cmd_waitsyncin(struct shell_config *sc, char *argv[], int argc)
 {
     sdm_session_t *ss = sc->cookie;